@@ -0,0 +1,106 @@
+#include "src/net/loadgen.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --host HOST      server to connect to (default: 127.0.0.1)\n"
+		"  --port PORT      server port (default: 32768)\n"
+		"  --bots N         number of bots to connect (default: 100)\n"
+		"  --players N      player slots to spread the bots over (default: 8)\n"
+		"  --join-rate R    new connections per second (default: 50)\n"
+		"  --cmd-rate R     commands per second for each bot (default: 2)\n"
+		"  --cam-rate R     camera updates per second for each bot (default: 1)\n"
+		"  --gamespeed X    speed the host sets once the game runs, 0.5 to 3 (default: 1)\n"
+		"  --duration S     seconds to play once the game is running (default: 30)\n"
+		"  --seed N         seed for the bot commands (default: 1)\n"
+		"  --no-start       do not let the first bot start the game\n"
+		"  --no-compress    do not ask the server to compress packets\n"
+		"  --serve          run a server in this process as well\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	aoe::LoadGenConfig cfg;
+	bool serve = false;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (!strcmp(arg, "--serve")) {
+			serve = true;
+		} else if (!strcmp(arg, "--no-start")) {
+			cfg.start = false;
+		} else if (!strcmp(arg, "--no-compress")) {
+			cfg.compress = false;
+		} else if (!val) {
+			usage(argv[0]);
+			return 1;
+		} else if (!strcmp(arg, "--host")) {
+			cfg.host = argv[++i];
+		} else if (!strcmp(arg, "--port")) {
+			cfg.port = (uint16_t)atoi(argv[++i]);
+		} else if (!strcmp(arg, "--bots")) {
+			cfg.bots = (unsigned)atoi(argv[++i]);
+		} else if (!strcmp(arg, "--players")) {
+			cfg.players = (unsigned)atoi(argv[++i]);
+		} else if (!strcmp(arg, "--join-rate")) {
+			cfg.join_rate = atof(argv[++i]);
+		} else if (!strcmp(arg, "--cmd-rate")) {
+			cfg.cmd_rate = atof(argv[++i]);
+		} else if (!strcmp(arg, "--cam-rate")) {
+			cfg.cam_rate = atof(argv[++i]);
+		} else if (!strcmp(arg, "--gamespeed")) {
+			cfg.gamespeed = atof(argv[++i]);
+		} else if (!strcmp(arg, "--duration")) {
+			cfg.duration = atof(argv[++i]);
+		} else if (!strcmp(arg, "--seed")) {
+			cfg.seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	try {
+		aoe::Net net;
+		std::unique_ptr<aoe::Server> server;
+		std::thread t;
+
+		if (serve) {
+			server.reset(new aoe::Server);
+			t = std::thread([&server](uint16_t port) {
+				server->mainloop(port, 1, true);
+			}, cfg.port);
+
+			// give the server some time to start listening
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+
+		aoe::LoadGen gen(cfg);
+		unsigned failed = gen.run();
+
+		printf("%s", gen.report().c_str());
+
+		if (server) {
+			server->close();
+			t.join();
+		}
+
+		return failed ? 2 : 0;
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "loadgen: %s\n", e.what());
+	}
+	return 1;
+}
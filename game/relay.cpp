@@ -0,0 +1,52 @@
+#include "src/server.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <stdexcept>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --host HOST      game server to watch (default: 127.0.0.1)\n"
+		"  --port PORT      game server port (default: 32768)\n"
+		"  --listen PORT    port for observers (default: 32769)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	uint16_t port = 32768, listen = 32769;
+
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (!val) {
+			usage(argv[0]);
+			return 1;
+		} else if (!strcmp(arg, "--host")) {
+			host = argv[++i];
+		} else if (!strcmp(arg, "--port")) {
+			port = (uint16_t)atoi(argv[++i]);
+		} else if (!strcmp(arg, "--listen")) {
+			listen = (uint16_t)atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	try {
+		aoe::Net net;
+		aoe::SpectatorRelay relay;
+
+		return relay.mainloop(host, port, listen);
+	} catch (const std::runtime_error &e) {
+		fprintf(stderr, "relay: %s\n", e.what());
+	}
+	return 1;
+}
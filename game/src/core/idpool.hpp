@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <unordered_map>
 #include <deque>
@@ -20,15 +21,15 @@ typedef std::pair<RefCounter, RefCounter> IdPoolRef;
 
 static constexpr const IdPoolRef invalid_ref{ 0, 0 };
 
+/**
+ * Iterates in order of ref, so all machines that do the same operations visit
+ * values in the same order. Lockstep peers tick entities in pool order and
+ * the outcome depends on it, e.g. which unit strikes first. Hash maps iterate
+ * in an order that depends on the standard library and on the history of
+ * rehashes, and sorting at every loop would cost a copy and a sort per tick.
+ */
 template<typename T> class IdPool final {
-	struct RefHash {
-		template<class T1, class T2> std::size_t operator()(const std::pair<T1, T2> &p) const {
-			size_t h = std::hash<T1>{}(p.first);
-			hash_combine(h, p.second);
-			return h;
-		}
-	};
-	std::unordered_map<IdPoolRef, T, RefHash> values;
+	std::map<IdPoolRef, T> values;
 	std::deque<RefCounter> next;
 	RefCounter mod;
 public:
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+ * Small deterministic random number generator. Unlike rand() and the standard
+ * distributions, the sequence only depends on the seed, so every machine that
+ * runs the same simulation with the same seed draws the same numbers.
+ */
+
+#include <cstdint>
+
+class Rng final {
+	uint64_t state;
+public:
+	Rng(uint64_t seed=0) noexcept : state(0) { this->seed(seed); }
+
+	void seed(uint64_t seed) noexcept {
+		// splitmix64 to make sure small seeds still give a good initial state
+		uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		state = (z ^ (z >> 31)) | 1;
+	}
+
+	/** xorshift64* */
+	uint32_t next() noexcept {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return (uint32_t)((state * 0x2545f4914f6cdd1dull) >> 32);
+	}
+
+	/** Number in [0,n). Returns 0 if n is 0. */
+	unsigned below(unsigned n) noexcept {
+		return n ? (unsigned)(((uint64_t)next() * n) >> 32) : 0;
+	}
+
+	/** Number in [lo,hi). */
+	double real(double lo, double hi) noexcept {
+		return lo + (hi - lo) * (next() / 4294967296.0);
+	}
+};
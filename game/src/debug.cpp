@@ -14,6 +14,45 @@ static ImU8 read_incoming(const ImU8 *ptr, size_t off) {
 	return data.at(off);
 }
 
+static void show_net_rate(Frame &f, const char *str_id, const NetRate &r) {
+	f.fmt("in: %.0f pkg/s %.1f KiB/s", r.total_packets(NetDir::in), r.total_bytes(NetDir::in) / 1024);
+	f.fmt("out: %.0f pkg/s %.1f KiB/s", r.total_packets(NetDir::out), r.total_bytes(NetDir::out) / 1024);
+	f.fmt("calls: %.0f recv/s %.0f send/s, queued: %llu bytes", r.recv_calls, r.send_calls, (unsigned long long)r.queued);
+
+	const NetStatsSnapshot &s = r.totals();
+
+	if (r.queued || s.coalesced)
+		f.fmt("lanes: %llu control, %llu command, %llu state, %llu bulk, %llu coalesced",
+			(unsigned long long)r.lane_queued[0], (unsigned long long)r.lane_queued[1], (unsigned long long)r.lane_queued[2], (unsigned long long)r.lane_queued[3],
+			(unsigned long long)s.coalesced);
+
+	if (s.deflate_in)
+		f.fmt("deflate: %llu to %llu bytes (%.1f%%) in %.1fms", (unsigned long long)s.deflate_in, (unsigned long long)s.deflate_out, 100.0 * s.deflate_out / s.deflate_in, s.deflate_us / 1000.0);
+
+	if (s.inflate_out)
+		f.fmt("inflate: %llu to %llu bytes (%.1f%%) in %.1fms", (unsigned long long)s.inflate_in, (unsigned long long)s.inflate_out, 100.0 * s.inflate_in / s.inflate_out, s.inflate_us / 1000.0);
+
+	Table t;
+
+	if (!t.begin(str_id, 5))
+		return;
+
+	t.row(-1, { "Type", "In pkg/s", "In B/s", "Out pkg/s", "Out B/s" });
+
+	for (unsigned i = 0; i < NetStats::types; ++i) {
+		if (!r.packets[0][i] && !r.packets[1][i])
+			continue;
+
+		Row row(5, i);
+
+		row.str(net_pkg_type_name(i));
+		row.fmt("%.1f", r.packets[0][i]);
+		row.fmt("%.0f", r.bytes[0][i]);
+		row.fmt("%.1f", r.packets[1][i]);
+		row.fmt("%.0f", r.bytes[1][i]);
+	}
+}
+
 void Debug::show_texture_map() {
 	ZoneScoped;
 
@@ -27,8 +66,13 @@ void Debug::show_texture_map() {
 
 	Engine &e = *eng;
 	Assets &a = *e.assets.get();
-	ImTextureID tex = (ImTextureID)1;
-	ImGui::Image(tex, ImVec2(a.ts_ui.w, a.ts_ui.h));
+
+	for (unsigned i = 0; i < a.ts_ui.pages.size() && i < e.textures.size(); ++i) {
+		const gfx::Tileset::Page &pg = a.ts_ui.pages[i];
+
+		f.fmt("page %u: %dx%d", i, pg.w, pg.h);
+		ImGui::Image((ImTextureID)(uintptr_t)e.textures[i], ImVec2(pg.w, pg.h));
+	}
 }
 
 void Debug::show(bool &open) {
@@ -114,6 +158,27 @@ void Debug::show(bool &open) {
 			f.fmt("port: %u", s.port);
 			f.fmt("protocol: %u", s.protocol);
 
+			srv_rate.update(s.s.snapshot());
+			show_net_rate(f, "ServerNet", srv_rate);
+
+			bool log = s.has_stats_log();
+
+			if (f.chkbox("Record network stats to netstats.csv", log)) {
+				try {
+					if (log)
+						s.set_stats_log("netstats.csv");
+					else
+						s.close_stats_log();
+				} catch (std::runtime_error &ex) {
+					e.push_error(ex.what());
+				}
+			}
+
+			uint32_t rate = (uint32_t)s.w.snapshot_rate.load();
+
+			if (f.scalar("Snapshot rate (Hz)", rate, 1, (uint32_t)World::snapshot_rate_min, (uint32_t)World::snapshot_rate_max))
+				s.set_snapshot_rate(rate);
+
 			f.fmt("connected peers: %llu", (unsigned long long)s.peers.size());
 
 			size_t i = 0;
@@ -164,7 +229,7 @@ void Debug::show(bool &open) {
 
 						auto it = ss.send_pending.find(sock);
 						if (it != ss.send_pending.end())
-							out = it->second.size();
+							out = it->second.bytes;
 
 						f.fmt("pending data: %zu", out);
 					}
@@ -175,6 +240,12 @@ void Debug::show(bool &open) {
 
 					f.fmt("ref (%u,%u)", ref.first, ref.second);
 
+					NetStatsSnapshot snap(s.s.snapshot(p));
+
+					f.fmt("queued: %llu bytes (%llu state, %llu bulk), coalesced: %llu", (unsigned long long)snap.queued,
+						(unsigned long long)snap.lane_queued[(unsigned)SendLane::state], (unsigned long long)snap.lane_queued[(unsigned)SendLane::bulk],
+						(unsigned long long)snap.coalesced);
+
 					unsigned flags = ci.flags;
 					bool ready = !!(flags & (unsigned)ClientInfoFlags::ready);
 
@@ -205,6 +276,9 @@ void Debug::show(bool &open) {
 
 			f.fmt("ref: (%u,%u)", c.me.first, c.me.second);
 
+			cl_rate.update(c.stats.snapshot());
+			show_net_rate(f, "ClientNet", cl_rate);
+
 			f.fmt("connected peers: %llu", (unsigned long long)c.peers.size());
 
 			size_t i = 0;
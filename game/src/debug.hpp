@@ -8,6 +8,7 @@
 #include <tracy/Tracy.hpp>
 
 #include "engine/gfx.hpp"
+#include "net/stats.hpp"
 #include <vector>
 
 namespace aoe {
@@ -15,6 +16,7 @@ namespace aoe {
 class Debug final {
 	MemoryEditor mem_edit;
 	bool show_tm;
+	NetRate srv_rate, cl_rate;
 
 	void show_texture_map();
 public:
@@ -75,10 +75,10 @@ Engine::Engine()
 	, debug()
 	, cfg(*this, "config"), sdl(nullptr), is_fullscreen(false), m_gl(nullptr), assets(), assets_good(false)
 	, show_chat(false), m_show_achievements(false), show_timeline(false), show_diplomacy(false)
-	, vbo(0), vsync_mode(0), vsync_idx(0)
+	, vbo(0), bkg_page(0), vsync_mode(0), vsync_idx(0)
 	, cam_x(0), cam_y(0), keyctl(), gv(), tw(0), th(0), cv()
 	, player_tbl_y(0), ui(), fnt()
-	, texture1(0), tex1(nullptr)
+	, textures(), tex_players(), tex_palette(0)
 {
 	ZoneScoped;
 	std::lock_guard<std::mutex> lk(m_eng);
@@ -214,6 +214,9 @@ void Engine::verify_game_data(const std::string &path) {
 		return;
 	}
 
+	// decoding graphics fans out over the thread pool, so give it a thread for every core
+	reserve_threads((int)std::max(1u, std::thread::hardware_concurrency()));
+
 	std::thread t([this](const char *func, std::string path) {
 		ZoneScoped;
 		using namespace io;
@@ -231,24 +234,29 @@ void Engine::verify_game_data(const std::string &path) {
 }
 
 void Engine::start_singleplayer_game() {
-	std::thread t([this](const char *func) {
-		ZoneScoped;
-		using namespace io;
+	// the server runs in this process, so there is no need to go through a socket
+	start_server(0, true, true);
+}
 
-		try {
-			UI_TaskInfo info(ui_async("Starting single player game", "Initializing player settings", 1));
+void Engine::start_singleplayer_now() {
+	ZoneScoped;
 
-			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(2s);
+	// the server only accepts settings from the host, so wait till it has seen us
+	ClientView cv;
+	auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
 
-			info.next();
-		} catch (std::exception &e) {
-			fprintf(stderr, "%s: cannot start single player game: %s\n", func, e.what());
-			push_error(std::string("Failed to start game: ") + e.what());
-		}
-	}, __func__);
+	for (cv.try_read(*client); cv.me == invalid_ref; cv.try_read(*client)) {
+		if (std::chrono::steady_clock::now() > end)
+			throw std::runtime_error("server has not accepted us");
 
-	t.detach();
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	client->send_scn_vars(sp_scn);
+	client->send_players_resize(sp_player_count);
+	client->claim_player(1);
+	client->send_ready(true);
+	client->send_start_game();
 }
 
 void Engine::display() {
@@ -389,6 +397,13 @@ void Engine::start_client_now(const char *host, uint16_t port) {
 	client->start(host, port);
 }
 
+void Engine::start_client_now(std::shared_ptr<LocalChannel> ch) {
+	ZoneScoped;
+
+	client.reset(new Client());
+	client->start(ch);
+}
+
 void Engine::start_client(const char *host, uint16_t port) {
 	ZoneScoped;
 
@@ -399,7 +414,11 @@ void Engine::start_client(const char *host, uint16_t port) {
 		try {
 			UI_TaskInfo info(ui_async("Starting client", "Creating network area", 2));
 
+			// take our seat again if we have been dropped from a game on the same server
+			uint64_t token = client ? client->resume_token(host, port) : 0;
+
 			client.reset(new Client());
+			client->resume(token);
 
 			info.next("Connecting to host");
 
@@ -435,21 +454,21 @@ void Engine::stop_server() {
 	t.detach();
 }
 
-void Engine::start_server(uint16_t port) {
+void Engine::start_server(uint16_t port, bool local, bool singleplayer) {
 	ZoneScoped;
 
-	std::thread t1([this](const char *func, uint16_t port) {
+	std::thread t1([this](const char *func, uint16_t port, bool local, bool singleplayer) {
 		ZoneScoped;
 
 		try {
-			UI_TaskInfo info(ui_async("Starting server", "Creating network area", 2));
+			UI_TaskInfo info(ui_async("Starting server", "Creating network area", singleplayer ? 3 : 2));
 
 			// ensures that tsk_start_server is always in a reliable state
 			class TskGuard final {
 			public:
-				bool good;
+				bool good, lobby;
 
-				TskGuard(UI_TaskInfo &info) : good(false) {
+				TskGuard(UI_TaskInfo &info, bool lobby) : good(false), lobby(lobby) {
 					lock lk(m_eng);
 					if (eng)
 						eng->stop_server_now(info.get_ref());
@@ -464,10 +483,10 @@ void Engine::start_server(uint16_t port) {
 
 					if (!good)
 						eng->stop_server();
-					else
+					else if (lobby)
 						eng->trigger_server_started();
 				}
-			} guard(info);
+			} guard(info, !singleplayer);
 
 			{
 				lock lk(m);
@@ -476,20 +495,41 @@ void Engine::start_server(uint16_t port) {
 				server.reset(new Server);
 			}
 
-			std::thread t2([this](uint16_t port) {
-				server->mainloop(port, 1);
-			}, port);
-			t2.detach();
+			if (local) {
+				auto ch = std::make_shared<LocalChannel>();
 
-			info.next("Connecting to host");
+				std::thread t2([this, ch]() {
+					server->mainloop(ch, 1);
+				});
+				t2.detach();
+
+				info.next("Connecting to host");
+
+				start_client_now(ch);
 
-			start_client_now("127.0.0.1", port);
+				if (singleplayer) {
+					info.next("Starting game");
+					start_singleplayer_now();
+				}
+			} else {
+				std::thread t2([this](uint16_t port) {
+					server->mainloop(port, 1);
+				}, port);
+				t2.detach();
+
+				info.next("Connecting to host");
+
+				start_client_now("127.0.0.1", port);
+			}
 
 			guard.good = true;
 		} catch (std::exception &e) {
 			fprintf(stderr, "%s: cannot start server: %s\n", func, e.what());
+
+			if (singleplayer)
+				push_error(std::string("Failed to start game: ") + e.what());
 		}
-	}, __func__, port);
+	}, __func__, port, local, singleplayer);
 	t1.detach();
 }
 
@@ -533,6 +573,7 @@ void Engine::set_background(io::DrsId id) {
 	Assets &a = *assets.get();
 
 	const gfx::ImageRef &r = a.at(id);
+	bkg_page = r.page;
 	//printf("(%.2f,%.2f), (%.2f,%.2f)\n", r.s0, r.t0, r.s1, r.t1);
 
 	bkg_vertices[0].s = r.s1;
@@ -593,8 +634,32 @@ void Engine::set_game_data() {
 	Assets &a = *assets.get();
 	game_dir = a.path;
 
-	GLuint tex = 1;
-	a.ts_ui.write(tex);
+	{
+		ZoneScopedN("upload pages");
+		size_t n = textures.size();
+
+		if (n < a.ts_ui.pages.size()) {
+			textures.resize(a.ts_ui.pages.size());
+			tex_players.resize(a.ts_ui.pages.size());
+
+			glGenTextures((GLsizei)(textures.size() - n), &textures[n]);
+			glGenTextures((GLsizei)(tex_players.size() - n), &tex_players[n]);
+		}
+
+		for (unsigned i = 0; i < a.ts_ui.pages.size(); ++i)
+			a.ts_ui.write(i, textures[i], tex_players[i]);
+	}
+
+	{
+		ZoneScopedN("player colors");
+		std::vector<uint8_t> data;
+
+		for (const SDL_Color &c : a.player_cols)
+			data.insert(data.end(), { c.r, c.g, c.b, 255 });
+
+		glBindTexture(GL_TEXTURE_2D, tex_palette);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gfx::player_ramp, MAX_PLAYERS, 0, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
+	}
 
 	GLCHK;
 	set_background(io::DrsId::bkg_main_menu);
@@ -982,9 +1047,16 @@ int Engine::mainloop() {
 		prog.setVertexArray("aColor"   , 3, GL_FLOAT, sizeof(BkgVertex), offsetof(BkgVertex, r));
 		prog.setVertexArray("aTexCoord", 2, GL_FLOAT, sizeof(BkgVertex), offsetof(BkgVertex, s));
 
-		glGenTextures(1, &texture1);
-		tex1 = (ImTextureID)texture1;
-		GL::bind2d(texture1, GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
+		// the first page is created now, so the background can always be drawn. set_game_data adds any other pages
+		textures.resize(1);
+		tex_players.resize(1);
+
+		glGenTextures(1, &textures[0]);
+		GL::bind2d(textures[0], GL_REPEAT, GL_REPEAT, GL_LINEAR, GL_LINEAR);
+
+		glGenTextures(1, &tex_players[0]);
+		glGenTextures(1, &tex_palette);
+		GL::bind2d(tex_palette, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST);
 
 		GLCHK;
 
@@ -992,6 +1064,8 @@ int Engine::mainloop() {
 		verify_game_data(cfg.game_dir);
 
 		eventloop(sdl, prog, vao);
+
+		ui.gl_free();
 	}
 
 	// Cleanup
@@ -1067,7 +1141,7 @@ void Engine::eventloop(SDL &sdl, gfx::GLprogram &prog, GLuint vao) {
 
 		if (menu_state != MenuState::multiplayer_game) {
 			// bind textures on corresponding texture units
-			GL::bind2d(0, texture1);
+			GL::bind2d(0, textures.at(bkg_page));
 
 			prog.use();
 			prog.setUniform("texture1", 0);
@@ -1080,6 +1154,9 @@ void Engine::eventloop(SDL &sdl, gfx::GLprogram &prog, GLuint vao) {
 
 		display();
 
+		// the world goes straight to OpenGL, so it ends up below everything imgui draws
+		ui.draw_world(io.DisplaySize.x, io.DisplaySize.y);
+
 		// Rendering
 		ImGui::Render();
 		GL::viewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
@@ -142,6 +142,7 @@ private:
 	bool show_diplomacy;
 
 	GLuint vbo;
+	unsigned bkg_page;
 	int vsync_mode, vsync_idx;
 
 	float cam_x, cam_y;
@@ -160,9 +161,11 @@ private:
 	friend Config;
 	friend EngineView;
 	friend ui::UICache;
+	friend Assets;
 public:
-	GLuint texture1;
-	ImTextureID tex1;
+	std::vector<GLuint> textures; // one for every Tileset page
+	std::vector<GLuint> tex_players; // player color planes of textures
+	GLuint tex_palette; // player colors for tex_players
 
 	Engine();
 	~Engine();
@@ -170,6 +173,8 @@ public:
 	int mainloop();
 
 	gfx::GL &gl();
+	/** Texture that contains \a r, so imgui can draw it. */
+	ImTextureID tex(const gfx::ImageRef &r) const { return (ImTextureID)(uintptr_t)textures.at(r.page); }
 	Assets &gamedata() { return *assets.get(); }
 private:
 	static constexpr float frame_height = 0.9f, player_height = 0.55f, frame_margin = 0.075f;
@@ -215,14 +220,18 @@ private:
 	void show_general_settings();
 	void show_menubar();
 
-	void start_server(uint16_t port);
+	/** Start server and connect to it. If \a local, no TCP port is bound and only we can join. If \a singleplayer, skip the lobby and start right away. */
+	void start_server(uint16_t port, bool local=false, bool singleplayer=false);
 	void stop_server();
 	void stop_server_now(IdPoolRef ref=invalid_ref);
 
 	void start_singleplayer_game();
+	/** Set up the single player game on the server we have just connected to and start it. */
+	void start_singleplayer_now();
 
 	void start_client(const char *host, uint16_t port);
 	void start_client_now(const char *host, uint16_t port);
+	void start_client_now(std::shared_ptr<LocalChannel> ch);
 
 	void reserve_threads(int n);
 
@@ -0,0 +1,440 @@
+#include "asset_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <tracy/Tracy.hpp>
+
+namespace aoe {
+
+MappedFile::MappedFile(const std::string &path)
+#if _WIN32
+	: file(INVALID_HANDLE_VALUE), mapping(NULL)
+#else
+	: fd(-1)
+#endif
+	, ptr(nullptr), len(0)
+{
+	ZoneScoped;
+#if _WIN32
+	HANDLE f = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE)
+		throw std::runtime_error(std::string("cannot open ") + path);
+
+	LARGE_INTEGER sz;
+	if (!GetFileSizeEx(f, &sz)) {
+		CloseHandle(f);
+		throw std::runtime_error(std::string("cannot stat ") + path);
+	}
+
+	file = f;
+	len = (size_t)sz.QuadPart;
+
+	// empty files cannot be mapped
+	if (!len)
+		return;
+
+	HANDLE m = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	void *p = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+	if (!p) {
+		if (m)
+			CloseHandle(m);
+		CloseHandle(f);
+		throw std::runtime_error(std::string("cannot map ") + path);
+	}
+
+	mapping = m;
+	ptr = (const uint8_t*)p;
+#else
+	if ((fd = open(path.c_str(), O_RDONLY)) == -1)
+		throw std::runtime_error(std::string("cannot open ") + path);
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		::close(fd);
+		throw std::runtime_error(std::string("cannot stat ") + path);
+	}
+
+	len = (size_t)st.st_size;
+
+	// empty files cannot be mapped
+	if (!len)
+		return;
+
+	void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		::close(fd);
+		throw std::runtime_error(std::string("cannot map ") + path);
+	}
+
+	ptr = (const uint8_t*)p;
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if _WIN32
+	if (ptr)
+		UnmapViewOfFile(ptr);
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	if (ptr)
+		munmap((void*)ptr, len);
+	::close(fd);
+#endif
+}
+
+// all tables are stored in native byte order. a machine with a different one will just not recognize the magic
+
+struct cache_hdr final {
+	uint32_t magic, version;
+	uint64_t key;
+	uint64_t size; // whole file, so truncated files are noticed
+	uint32_t pages, imgs, masks, ids, gifs, refs, bkgs, cols;
+};
+
+struct cache_page final {
+	int32_t w, h;
+	uint64_t pixels, players; // file offsets. players is zero if the page has no player color plane
+};
+
+struct cache_img final {
+	uint32_t id, mod;
+	int32_t x, y, w, h;
+	int32_t hotspot_x, hotspot_y;
+	float s0, t0, s1, t1;
+	uint32_t page, mask, mask_count, pad;
+};
+
+struct cache_mask final {
+	int32_t first, second;
+};
+
+struct cache_id final {
+	uint32_t drs, id, mod;
+};
+
+struct cache_gif final {
+	uint32_t drs, first, count, dynamic;
+};
+
+struct cache_ref final {
+	uint32_t id, mod;
+};
+
+struct cache_bkg final {
+	uint32_t drs;
+	SDL_Color border[6];
+};
+
+static_assert(sizeof(SDL_Color) == 4, "SDL_Color must be packed");
+static_assert(sizeof(cache_img) == 64, "cache_img must not have padding");
+
+/** Pages are aligned to this many bytes, so they can be handed to the driver as is. */
+static constexpr uint64_t page_align = 64;
+
+static uint64_t align(uint64_t pos, uint64_t n) noexcept {
+	return (pos + n - 1) / n * n;
+}
+
+/** Reserve space for \a count items of \a size bytes at \a pos and return where they start. */
+static uint64_t table(uint64_t &pos, size_t count, size_t size) noexcept {
+	uint64_t start = align(pos, 8);
+	pos = start + (uint64_t)count * size;
+	return start;
+}
+
+// FNV-1a, but a word at a time. we only need to notice changed files, so this is good enough and a lot faster
+static constexpr uint64_t fnv_basis = 14695981039346656037ull, fnv_prime = 1099511628211ull;
+
+static uint64_t mix(uint64_t h, uint64_t v) noexcept {
+	h = (h ^ v) * fnv_prime;
+	return h ^ (h >> 29);
+}
+
+static uint64_t mix(uint64_t h, const uint8_t *p, size_t n) noexcept {
+	for (; n >= 8; p += 8, n -= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof v);
+		h = mix(h, v);
+	}
+
+	for (; n; ++p, --n)
+		h = mix(h, *p);
+
+	return h;
+}
+
+AssetCache::AssetCache(gfx::Tileset &ts, std::map<io::DrsId, IdPoolRef> &ids, std::map<io::DrsId, ImageSet> &gifs, std::map<io::DrsId, BackgroundColors> &bkg_cols, std::vector<SDL_Color> &player_cols)
+	: ts(ts), ids(ids), gifs(gifs), bkg_cols(bkg_cols), player_cols(player_cols) {}
+
+uint64_t AssetCache::key(const std::vector<std::string> &files, uint64_t salt) {
+	ZoneScoped;
+	uint64_t h = mix(mix(fnv_basis, version), salt);
+
+	for (const std::string &path : files) {
+		MappedFile f(path);
+
+		h = mix(h, f.size());
+		h = mix(h, f.data(), f.size());
+	}
+
+	return h;
+}
+
+bool AssetCache::load(const std::string &path, uint64_t key) {
+	ZoneScoped;
+	std::shared_ptr<MappedFile> f;
+
+	try {
+		f.reset(new MappedFile(path));
+	} catch (std::runtime_error&) {
+		return false;
+	}
+
+	const uint8_t *data = f->data();
+	uint64_t size = f->size();
+
+	if (size < sizeof(cache_hdr))
+		return false;
+
+	cache_hdr hdr;
+	memcpy(&hdr, data, sizeof hdr);
+
+	if (hdr.magic != magic || hdr.version != version || hdr.key != key || hdr.size != size)
+		return false;
+
+	uint64_t pos = sizeof hdr;
+
+	const cache_page *pages = (const cache_page*)(data + table(pos, hdr.pages, sizeof(cache_page)));
+	const cache_img  *imgs  = (const cache_img *)(data + table(pos, hdr.imgs , sizeof(cache_img )));
+	const cache_mask *masks = (const cache_mask*)(data + table(pos, hdr.masks, sizeof(cache_mask)));
+	const cache_id   *idrs  = (const cache_id  *)(data + table(pos, hdr.ids  , sizeof(cache_id  )));
+	const cache_gif  *grs   = (const cache_gif *)(data + table(pos, hdr.gifs , sizeof(cache_gif )));
+	const cache_ref  *refs  = (const cache_ref *)(data + table(pos, hdr.refs , sizeof(cache_ref )));
+	const cache_bkg  *bkgs  = (const cache_bkg *)(data + table(pos, hdr.bkgs , sizeof(cache_bkg )));
+	const SDL_Color  *cols  = (const SDL_Color *)(data + table(pos, hdr.cols , sizeof(SDL_Color )));
+
+	if (pos > size || !hdr.pages)
+		return false;
+
+	// images are remapped with a fixed number of colors per player
+	if (hdr.cols != MAX_PLAYERS * gfx::player_ramp)
+		return false;
+
+	gfx::Tileset ts;
+
+	for (uint32_t i = 0; i < hdr.pages; ++i) {
+		const cache_page &p = pages[i];
+
+		if (p.w < 1 || p.h < 1 || p.w > UINT16_MAX || p.h > UINT16_MAX)
+			return false;
+
+		uint64_t n = (uint64_t)p.w * p.h;
+
+		if (p.pixels % page_align || p.pixels > size || size - p.pixels < 4 * n)
+			return false;
+
+		if (p.players && (p.players > size || size - p.players < n))
+			return false;
+
+		gfx::Tileset::Page &pg = ts.pages.emplace_back();
+
+		pg.w = p.w;
+		pg.h = p.h;
+		// SDL does not write to it, it just does not know about const
+		pg.surf.reset(SDL_CreateRGBSurfaceWithFormatFrom((void*)(data + p.pixels), p.w, p.h, 32, 4 * p.w, SDL_PIXELFORMAT_RGBA32));
+		pg.backing = f;
+
+		if (!pg.surf)
+			return false;
+
+		if (p.players)
+			pg.players.assign(data + p.players, data + p.players + n);
+	}
+
+	for (uint32_t i = 0; i < hdr.imgs; ++i) {
+		const cache_img &r = imgs[i];
+
+		if (r.page >= hdr.pages || r.mask > hdr.masks || hdr.masks - r.mask < r.mask_count)
+			return false;
+
+		std::vector<std::pair<int, int>> mask;
+		for (uint32_t j = 0; j < r.mask_count; ++j)
+			mask.emplace_back(masks[r.mask + j].first, masks[r.mask + j].second);
+
+		gfx::ImageRef ref(IdPoolRef(r.id, r.mod), SDL_Rect{ r.x, r.y, r.w, r.h }, nullptr, mask, r.hotspot_x, r.hotspot_y, r.s0, r.t0, r.s1, r.t1);
+		ref.page = r.page;
+
+		if (!ts.imgs.emplace(std::move(ref)).second)
+			return false;
+	}
+
+	std::map<io::DrsId, IdPoolRef> ids;
+	for (uint32_t i = 0; i < hdr.ids; ++i)
+		ids[(io::DrsId)idrs[i].drs] = IdPoolRef(idrs[i].id, idrs[i].mod);
+
+	std::map<io::DrsId, ImageSet> gifs;
+	for (uint32_t i = 0; i < hdr.gifs; ++i) {
+		const cache_gif &g = grs[i];
+
+		if (g.first > hdr.refs || hdr.refs - g.first < g.count)
+			return false;
+
+		ImageSet &set = gifs[(io::DrsId)g.drs];
+		set.dynamic = g.dynamic != 0;
+
+		for (uint32_t j = 0; j < g.count; ++j)
+			set.imgs.emplace_back(refs[g.first + j].id, refs[g.first + j].mod);
+	}
+
+	std::map<io::DrsId, BackgroundColors> bkg_cols;
+	for (uint32_t i = 0; i < hdr.bkgs; ++i)
+		memcpy(bkg_cols[(io::DrsId)bkgs[i].drs].border, bkgs[i].border, sizeof(bkgs[i].border));
+
+	// everything checks out
+	this->ts = std::move(ts);
+	this->ids = std::move(ids);
+	this->gifs = std::move(gifs);
+	this->bkg_cols = std::move(bkg_cols);
+	player_cols.assign(cols, cols + hdr.cols);
+
+	return true;
+}
+
+bool AssetCache::save(const std::string &path, uint64_t key) const {
+	ZoneScoped;
+
+	std::vector<cache_page> pages;
+	std::vector<cache_img> imgs;
+	std::vector<cache_mask> masks;
+	std::vector<cache_id> idrs;
+	std::vector<cache_gif> grs;
+	std::vector<cache_ref> refs;
+	std::vector<cache_bkg> bkgs;
+
+	for (const gfx::ImageRef &r : ts.imgs) {
+		imgs.push_back(cache_img{ r.ref.first, r.ref.second, r.bnds.x, r.bnds.y, r.bnds.w, r.bnds.h, r.hotspot_x, r.hotspot_y, r.s0, r.t0, r.s1, r.t1, r.page, (uint32_t)masks.size(), (uint32_t)r.mask.size(), 0 });
+
+		for (const std::pair<int, int> &m : r.mask)
+			masks.push_back(cache_mask{ m.first, m.second });
+	}
+
+	for (auto &kv : ids)
+		idrs.push_back(cache_id{ (uint32_t)kv.first, kv.second.first, kv.second.second });
+
+	for (auto &kv : gifs) {
+		grs.push_back(cache_gif{ (uint32_t)kv.first, (uint32_t)refs.size(), (uint32_t)kv.second.imgs.size(), kv.second.dynamic });
+
+		for (IdPoolRef r : kv.second.imgs)
+			refs.push_back(cache_ref{ r.first, r.second });
+	}
+
+	for (auto &kv : bkg_cols) {
+		cache_bkg b{ (uint32_t)kv.first };
+		memcpy(b.border, kv.second.border, sizeof(b.border));
+		bkgs.push_back(b);
+	}
+
+	cache_hdr hdr{ magic, version, key, 0, (uint32_t)ts.pages.size(), (uint32_t)imgs.size(), (uint32_t)masks.size(), (uint32_t)idrs.size(), (uint32_t)grs.size(), (uint32_t)refs.size(), (uint32_t)bkgs.size(), (uint32_t)player_cols.size() };
+
+	uint64_t pos = sizeof hdr;
+	uint64_t offsets[] = {
+		table(pos, ts.pages.size(), sizeof(cache_page)),
+		table(pos, imgs.size(), sizeof(cache_img)),
+		table(pos, masks.size(), sizeof(cache_mask)),
+		table(pos, idrs.size(), sizeof(cache_id)),
+		table(pos, grs.size(), sizeof(cache_gif)),
+		table(pos, refs.size(), sizeof(cache_ref)),
+		table(pos, bkgs.size(), sizeof(cache_bkg)),
+		table(pos, player_cols.size(), sizeof(SDL_Color)),
+	};
+
+	for (const gfx::Tileset::Page &pg : ts.pages) {
+		// the surfaces are gone once the pages have been uploaded
+		if (!pg.surf)
+			return false;
+
+		cache_page p{ pg.w, pg.h, 0, 0 };
+		uint64_t n = (uint64_t)pg.w * pg.h;
+
+		p.pixels = pos = align(pos, page_align);
+		pos += 4 * n;
+
+		if (!pg.players.empty()) {
+			p.players = pos = align(pos, page_align);
+			pos += n;
+		}
+
+		pages.push_back(p);
+	}
+
+	hdr.size = pos;
+
+	// write to a temporary file first, so a crash or a second instance never leaves a broken cache behind
+	std::string tmp(path + ".tmp");
+
+	try {
+		std::ofstream out(tmp, std::ios_base::binary | std::ios_base::trunc);
+		out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+
+		uint64_t at = 0;
+		static const char zeros[page_align] = { 0 };
+
+		auto put = [&](uint64_t off, const void *src, size_t n) {
+			for (; at < off; at += std::min<uint64_t>(off - at, page_align))
+				out.write(zeros, (std::streamsize)std::min<uint64_t>(off - at, page_align));
+
+			out.write((const char*)src, (std::streamsize)n);
+			at += n;
+		};
+
+		put(0, &hdr, sizeof hdr);
+		put(offsets[0], pages.data(), pages.size() * sizeof(cache_page));
+		put(offsets[1], imgs.data(), imgs.size() * sizeof(cache_img));
+		put(offsets[2], masks.data(), masks.size() * sizeof(cache_mask));
+		put(offsets[3], idrs.data(), idrs.size() * sizeof(cache_id));
+		put(offsets[4], grs.data(), grs.size() * sizeof(cache_gif));
+		put(offsets[5], refs.data(), refs.size() * sizeof(cache_ref));
+		put(offsets[6], bkgs.data(), bkgs.size() * sizeof(cache_bkg));
+		put(offsets[7], player_cols.data(), player_cols.size() * sizeof(SDL_Color));
+
+		for (size_t i = 0; i < pages.size(); ++i) {
+			const gfx::Tileset::Page &pg = ts.pages[i];
+			const SDL_Surface *surf = pg.surf.get();
+
+			for (int y = 0; y < pg.h; ++y)
+				put(y ? at : pages[i].pixels, (const uint8_t*)surf->pixels + (size_t)y * surf->pitch, 4 * (size_t)pg.w);
+
+			if (pages[i].players)
+				put(pages[i].players, pg.players.data(), pg.players.size());
+		}
+
+		out.close();
+	} catch (std::exception&) {
+		remove(tmp.c_str());
+		return false;
+	}
+
+	// rename does not replace existing files on windows
+	remove(path.c_str());
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "assets.hpp"
+
+namespace aoe {
+
+/** Read only memory mapping of a whole file. */
+class MappedFile final {
+#if _WIN32
+	void *file, *mapping;
+#else
+	int fd;
+#endif
+	const uint8_t *ptr;
+	size_t len;
+public:
+	/** Map \a path. Throws if the file cannot be opened or mapped. */
+	explicit MappedFile(const std::string &path);
+	MappedFile(const MappedFile&) = delete;
+	~MappedFile();
+
+	const uint8_t *data() const noexcept { return ptr; }
+	size_t size() const noexcept { return len; }
+};
+
+/**
+ * Baked graphics on disk, so we do not have to decode and pack all SLPs on
+ * every launch. The file is a small header with tables for all image refs,
+ * masks, ids and animations, followed by the raw atlas pages. Pages are
+ * aligned, so loading just maps the file and points the tileset surfaces at
+ * the mapped pixels, which go straight to OpenGL.
+ *
+ * The cache is only an optimization: any file that does not look exactly
+ * right is ignored and gets overwritten by the next cold start.
+ */
+class AssetCache final {
+	gfx::Tileset &ts;
+	std::map<io::DrsId, IdPoolRef> &ids;
+	std::map<io::DrsId, ImageSet> &gifs;
+	std::map<io::DrsId, BackgroundColors> &bkg_cols;
+	std::vector<SDL_Color> &player_cols;
+public:
+	static constexpr uint32_t magic = 0x0ac8e5a7;
+	/** Bump this when anything changes how images are decoded or packed. */
+	static constexpr uint32_t version = 1;
+
+	AssetCache(gfx::Tileset &ts, std::map<io::DrsId, IdPoolRef> &ids, std::map<io::DrsId, ImageSet> &gifs, std::map<io::DrsId, BackgroundColors> &bkg_cols, std::vector<SDL_Color> &player_cols);
+
+	/** Hash contents of \a files and \a salt. Throws if any file cannot be read. */
+	static uint64_t key(const std::vector<std::string> &files, uint64_t salt);
+
+	/** Restore everything from \a path if it has been baked with \a key. Leaves everything alone and returns false otherwise. */
+	bool load(const std::string &path, uint64_t key);
+	/** Bake everything to \a path. Must be called before the tileset has been written. Returns false if the cache could not be written. */
+	bool save(const std::string &path, uint64_t key) const;
+};
+
+}
@@ -1,4 +1,5 @@
 #include "assets.hpp"
+#include "asset_cache.hpp"
 
 #include "../engine.hpp"
 
@@ -6,6 +7,9 @@
 #include "../legacy/strings.hpp"
 
 #include <algorithm>
+#include <exception>
+#include <future>
+#include <mutex>
 
 namespace aoe {
 
@@ -60,40 +64,206 @@ IdPoolRef ImageSet::try_at(unsigned color, unsigned index) const {
 	return imgs[((color % MAX_PLAYERS) * image_count + index % image_count) % imgs.size()];
 }
 
-void Animation::load(io::DRS &drs, const SDL_Palette *pal, io::DrsId id) {
-	Slp slp(drs.open_slp((DrsId)id));
+Image &Animation::subimage(unsigned index, unsigned player) {
+	return dynamic ? images[(player % MAX_PLAYERS) * image_count + index % image_count] : images[index % image_count];
+}
 
-	images.reset(new Image[all_count = image_count = slp.frames.size()]);
-	dynamic = false;
+/** SDL palettes are reference counted without any locking, so every decode task needs its own copy. */
+static std::unique_ptr<SDL_Palette, decltype(&SDL_FreePalette)> copy_pal(const SDL_Palette *pal) {
+	std::unique_ptr<SDL_Palette, decltype(&SDL_FreePalette)> copy(SDL_AllocPalette(pal->ncolors), SDL_FreePalette);
 
-	for (unsigned i = 0; i < image_count; ++i) {
-		if (images[i].load(pal, slp, i, 0, id)) {
-			dynamic = true;
-			break;
-		}
+	if (!copy.get() || SDL_SetPaletteColors(copy.get(), pal->colors, 0, pal->ncolors))
+		throw std::runtime_error(std::string("Could not copy palette: ") + SDL_GetError());
+
+	return copy;
+}
+
+/**
+ * Decodes animations and images on the engine thread pool. Every SLP is parsed
+ * by its own task and every frame is decoded by its own task, so a cold start
+ * scales with the number of cores. Tasks are only pushed and waited for by the
+ * thread that runs the batch, so pool threads never wait on each other.
+ */
+class GfxBatch final {
+	struct Item final {
+		DRS *drs;
+		DrsId id;
+		Animation *anim; // either anim or img is set
+		Image *img;
+		bool remap, dynamic;
+		Slp slp;
+	};
+
+	struct Task final {
+		size_t item;
+		std::future<bool> f;
+	};
+
+	ctpl::thread_pool &tp;
+	UI_TaskInfo &info;
+	unsigned total;
+	const SDL_Palette *pal;
+	std::map<DRS*, std::mutex> drs_locks; // every DRS reads from a single file
+	std::vector<Item> items;
+	std::vector<Task> tasks;
+public:
+	GfxBatch(ctpl::thread_pool &tp, UI_TaskInfo &info, unsigned total, const SDL_Palette *pal)
+		: tp(tp), info(info), total(total), pal(pal), drs_locks(), items(), tasks() {}
+
+	/**
+	 * Decode all images of \a id. If \a remap is set, player colors are recolored when drawing
+	 * instead, so all players share the same images and the animation is never dynamic.
+	 */
+	void add(DRS &drs, Animation &a, DrsId id, bool remap=false) {
+		drs_locks[&drs];
+		items.push_back(Item{ &drs, id, &a, nullptr, remap, false, Slp() });
 	}
 
-	if (!dynamic)
-		return;
+	/** Decode the first image of \a id. */
+	void add(DRS &drs, Image &img, DrsId id) {
+		drs_locks[&drs];
+		items.push_back(Item{ &drs, id, nullptr, &img, false, false, Slp() });
+	}
 
-	// restart parsing as we need one for every player
-	images.reset(new Image[all_count = image_count * MAX_PLAYERS]);
+	void run();
+private:
+	void grow(size_t n);
+	void decode(size_t item, unsigned index, unsigned player);
+	void wait();
+};
 
-	for (unsigned p = 0; p < MAX_PLAYERS; ++p)
-		for (unsigned i = 0; i < image_count; ++i)
-			images[p * image_count + i].load(pal, slp, i, p, id);
+void GfxBatch::grow(size_t n) {
+	total += (unsigned)n;
+	info.set_total(total);
 }
 
-Image &Animation::subimage(unsigned index, unsigned player) {
-	return dynamic ? images[(player % MAX_PLAYERS) * image_count + index % image_count] : images[index % image_count];
+void GfxBatch::decode(size_t item, unsigned index, unsigned player) {
+	tasks.push_back(Task{ item, tp.push([this, item, index, player](int) {
+		ZoneScopedN("decode");
+		Item &it = items[item];
+		auto copy = copy_pal(pal);
+
+		if (!it.anim) {
+			it.img->load(copy.get(), it.slp, index, player, it.id);
+			return false;
+		}
+
+		Animation &a = *it.anim;
+		bool dynamic = a.images[player * a.image_count + index].load(copy.get(), it.slp, index, player, it.id, it.remap);
+		return !it.remap && dynamic;
+	}) });
+}
+
+/** Wait for all tasks, even if some fail, because they all refer to our items. Rethrows the first failure. */
+void GfxBatch::wait() {
+	ZoneScoped;
+	std::exception_ptr err;
+
+	for (Task &t : tasks) {
+		try {
+			if (t.f.get())
+				items[t.item].dynamic = true;
+
+			info.next();
+		} catch (...) {
+			if (!err)
+				err = std::current_exception();
+		}
+	}
+
+	tasks.clear();
+
+	if (err)
+		std::rethrow_exception(err);
+}
+
+void GfxBatch::run() {
+	ZoneScoped;
+
+	grow(items.size());
+
+	for (size_t i = 0; i < items.size(); ++i)
+		tasks.push_back(Task{ i, tp.push([this, i](int) {
+			ZoneScopedN("parse");
+			Item &it = items[i];
+			std::lock_guard<std::mutex> lk(drs_locks.at(it.drs));
+
+			it.slp = it.drs->open_slp(it.id);
+			return false;
+		}) });
+
+	wait();
+
+	// decode all frames for the first player, which also tells us which animations are dynamic
+	size_t frames = 0;
+
+	for (Item &it : items) {
+		if (!it.anim) {
+			++frames;
+			continue;
+		}
+
+		Animation &a = *it.anim;
+		a.images.reset(new Image[a.all_count = a.image_count = (unsigned)it.slp.frames.size()]);
+		a.dynamic = false;
+		frames += a.image_count;
+	}
+
+	grow(frames);
+
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (!items[i].anim) {
+			decode(i, 0, 0);
+			continue;
+		}
+
+		for (unsigned f = 0; f < items[i].anim->image_count; ++f)
+			decode(i, f, 0);
+	}
+
+	wait();
+
+	// dynamic animations need a copy for every other player as well
+	frames = 0;
+
+	for (Item &it : items) {
+		if (!it.dynamic)
+			continue;
+
+		Animation &a = *it.anim;
+		std::unique_ptr<Image[]> first(std::move(a.images));
+
+		a.images.reset(new Image[a.all_count = a.image_count * MAX_PLAYERS]);
+		a.dynamic = true;
+
+		for (unsigned f = 0; f < a.image_count; ++f)
+			a.images[f] = std::move(first[f]);
+
+		frames += a.all_count - a.image_count;
+	}
+
+	grow(frames);
+
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (!items[i].dynamic)
+			continue;
+
+		for (unsigned p = 1; p < MAX_PLAYERS; ++p)
+			for (unsigned f = 0; f < items[i].anim->image_count; ++f)
+				decode(i, f, p);
+	}
+
+	wait();
+
+	items.clear();
 }
 
 Assets::Assets(Engine &eng, const std::string &path)
-	: drs_gifs(), path(path), drs_ids(), bkg_cols(), ts_ui(), gif_cursors()
+	: drs_gifs(), path(path), drs_ids(), bkg_cols(), ts_ui(), gif_cursors(), player_cols()
 {
 	ZoneScoped;
 	// TODO use engine view to prevent crash when closed while ctor is still running
-	UI_TaskInfo info(eng.ui_async("Verifying game data", "Loading interface data", 7));
+	UI_TaskInfo info(eng.ui_async("Verifying game data", "Loading interface data", load_steps));
 
 	eng.sfx.reset();
 
@@ -102,10 +272,39 @@ Assets::Assets(Engine &eng, const std::string &path)
 	load_audio(eng, info);
 }
 
+/** Where baked graphics are stored between launches, see AssetCache. */
+static const char *cache_path = "assets.cache";
+
 void Assets::load_gfx(Engine &eng, UI_TaskInfo &info) {
 	ZoneScoped;
 
 	DRS drs_ui(path + "/data/Interfac.drs");
+	// the page size changes how everything is packed, so it is part of the key as well
+	GLint size = std::min(5120, eng.gl().max_texture_size);
+
+	AssetCache cache(ts_ui, drs_ids, drs_gifs, bkg_cols, player_cols);
+	uint64_t key = AssetCache::key({ path + "/data/Interfac.drs", path + "/data/Border.drs", path + "/data/Terrain.drs", path + "/data/graphics.drs" }, size);
+
+	if (cache.load(cache_path, key)) {
+		info.next("Loading cached graphics");
+		load_cursors();
+	} else {
+		bake_gfx(eng, info, drs_ui, size);
+
+		if (!cache.save(cache_path, key))
+			fprintf(stderr, "%s: could not save asset cache\n", __func__);
+	}
+
+#define sfx(id) eng.sfx.load_sfx(SfxId:: id, drs_ui.open_wav(DrsId:: sfx_ ## id))
+	eng.sfx.load_sfx(SfxId::sfx_chat, drs_ui.open_wav(DrsId::sfx_chat));
+	sfx(player_resign);
+	sfx(gameover_victory);
+	sfx(gameover_defeat);
+#undef sfx
+}
+
+void Assets::bake_gfx(Engine &eng, UI_TaskInfo &info, DRS &drs_ui, int size) {
+	ZoneScoped;
 
 	Background bkg_main, bkg_singleplayer, bkg_multiplayer, bkg_editor_menu, bkg_victory, bkg_defeat, bkg_mission, bkg_achievements;
 	gfx::ImagePacker p;
@@ -136,46 +335,45 @@ void Assets::load_gfx(Engine &eng, UI_TaskInfo &info) {
 	Animation gif_moveto, gif_explode1, gif_explode2;
 	Image img_dialog0, img_dialog_editor;
 	auto pal = drs_ui.open_pal(DrsId::pal_default);
-	{
-		ZoneScopedN("Loading user interface");
-
-		gif_menu_btn_small0.load(drs_ui, pal.get(), DrsId::gif_menu_btn_small0);
-		gif_menu_btn_medium0.load(drs_ui, pal.get(), DrsId::gif_menu_btn_medium0);
-		gif_menubar0.load(drs_ui, pal.get(), DrsId::gif_menubar0);
-		auto slp = drs_ui.open_slp(DrsId::img_dialog0);
-		img_dialog0.load(pal.get(), slp, 0, 0, DrsId::img_dialog0);
-		gif_cursors.load(drs_ui, pal.get(), DrsId::gif_cursors);
-		slp = drs_ui.open_slp(DrsId::img_editor);
-		img_dialog_editor.load(pal.get(), slp, 0, 0, DrsId::img_editor);
-
-#define load_gif(id) id.load(drs_ui, pal.get(), DrsId::id)
-		load_gif(gif_building_icons);
-		load_gif(gif_task_icons);
-		load_gif(gif_unit_icons);
-		load_gif(gif_hpbar);
-		load_gif(gif_moveto);
+
+	player_cols.resize(MAX_PLAYERS * player_ramp);
+
+	for (unsigned p = 0; p < MAX_PLAYERS; ++p)
+		for (unsigned c = 0; c < player_ramp; ++c)
+			player_cols[p * player_ramp + c] = pal->colors[player_color(p, c) % pal->ncolors];
+
+	DRS drs_border(path + "/data/Border.drs");
+	DRS drs_terrain(path + "/data/Terrain.drs");
+	DRS drs_graphics(path + "/data/graphics.drs"); // NOTE official installer uses lowercase g in graphics
+
+	GfxBatch batch(eng.tp, info, load_steps, pal.get());
+
+	batch.add(drs_ui, gif_menu_btn_small0, DrsId::gif_menu_btn_small0);
+	batch.add(drs_ui, gif_menu_btn_medium0, DrsId::gif_menu_btn_medium0);
+	batch.add(drs_ui, gif_menubar0, DrsId::gif_menubar0);
+	batch.add(drs_ui, img_dialog0, DrsId::img_dialog0);
+	batch.add(drs_ui, gif_cursors, DrsId::gif_cursors);
+	batch.add(drs_ui, img_dialog_editor, DrsId::img_editor);
+
+#define load_gif(id) batch.add(drs_ui, id, DrsId::id)
+	load_gif(gif_building_icons);
+	load_gif(gif_task_icons);
+	load_gif(gif_unit_icons);
+	load_gif(gif_hpbar);
+	load_gif(gif_moveto);
 #undef load_gif
-	}
 
 	Animation trn_water_desert, trn_desert_overlay, trn_water_overlay;
 	Animation trn_desert, trn_grass, trn_water, trn_deepwater;
-	info.next("Loading terrain data");
-	{
-		ZoneScopedN("Loading terrain data");
-
-		DRS drs_border(path + "/data/Border.drs");
 
-		trn_water_desert.load(drs_border, pal.get(), DrsId::trn_water_desert);
-		trn_desert_overlay.load(drs_border, pal.get(), DrsId::trn_desert_overlay);
-		trn_water_overlay.load(drs_border, pal.get(), DrsId::trn_water_overlay);
+	batch.add(drs_border, trn_water_desert, DrsId::trn_water_desert);
+	batch.add(drs_border, trn_desert_overlay, DrsId::trn_desert_overlay);
+	batch.add(drs_border, trn_water_overlay, DrsId::trn_water_overlay);
 
-		DRS drs_terrain(path + "/data/Terrain.drs");
-
-		trn_desert.load(drs_terrain, pal.get(), DrsId::trn_desert);
-		trn_grass.load(drs_terrain, pal.get(), DrsId::trn_grass);
-		trn_water.load(drs_terrain, pal.get(), DrsId::trn_water);
-		trn_deepwater.load(drs_terrain, pal.get(), DrsId::trn_deepwater);
-	}
+	batch.add(drs_terrain, trn_desert, DrsId::trn_desert);
+	batch.add(drs_terrain, trn_grass, DrsId::trn_grass);
+	batch.add(drs_terrain, trn_water, DrsId::trn_water);
+	batch.add(drs_terrain, trn_deepwater, DrsId::trn_deepwater);
 
 	Animation bld_town_center, bld_town_center_player, bld_barracks, bld_barracks_player;
 	Animation gif_bld_fire1, gif_bld_fire2, gif_bld_fire3;
@@ -192,97 +390,91 @@ void Assets::load_gfx(Engine &eng, UI_TaskInfo &info) {
 	Animation gif_gold, gif_stone;
 	Image img_bld_debris;
 
-	info.next("Loading game entities data");
-	{
-		ZoneScopedN("Loading game entities data");
-
-		DRS drs_graphics(path + "/data/graphics.drs"); // NOTE official installer uses lowercase g in graphics
-
-		bld_town_center.load(drs_graphics, pal.get(), DrsId::bld_town_center);
-		bld_town_center_player.load(drs_graphics, pal.get(), DrsId::bld_town_center_player);
-
-		bld_barracks.load(drs_graphics, pal.get(), DrsId::bld_barracks);
-
-#define load_gif(id) id.load(drs_graphics, pal.get(), DrsId::id)
-		load_gif(gif_bld_fire1);
-		load_gif(gif_bld_fire2);
-		load_gif(gif_bld_fire3);
-
-		// TODO shadow images are incorrectly parsed as dynamic, unknown command FE
-		load_gif(gif_bird1);
-		//load_gif(gif_bird1_shadow);
-		load_gif(gif_bird1_glide);
-		//load_gif(gif_bird1_glide_shadow);
-
-		load_gif(gif_bird2);
-		//load_gif(gif_bird2_shadow);
-		load_gif(gif_bird2_glide);
-		//load_gif(gif_bird2_glide_shadow);
-
-		load_gif(gif_villager_stand);
-		load_gif(gif_villager_move);
-		load_gif(gif_villager_attack);
-		load_gif(gif_villager_die1);
-		load_gif(gif_villager_die2);
-		load_gif(gif_villager_decay);
-
-		load_gif(gif_worker_wood_stand);
-		load_gif(gif_worker_wood_move);
-		load_gif(gif_worker_wood_attack1);
-		load_gif(gif_worker_wood_attack2);
-		load_gif(gif_worker_wood_die);
-		load_gif(gif_worker_wood_decay);
-
-		load_gif(gif_worker_miner_stand);
-		load_gif(gif_worker_miner_move);
-		load_gif(gif_worker_miner_attack);
-		load_gif(gif_worker_miner_die);
-		load_gif(gif_worker_miner_decay);
-
-		load_gif(gif_worker_berries_attack);
-
-		load_gif(gif_melee1_stand);
-		load_gif(gif_melee1_move);
-		load_gif(gif_melee1_attack);
-		load_gif(gif_melee1_die);
-		load_gif(gif_melee1_decay);
-
-		load_gif(gif_priest_stand);
-		load_gif(gif_priest_move);
-		load_gif(gif_priest_attack);
-		load_gif(gif_priest_die);
-		load_gif(gif_priest_decay);
-
-		load_gif(gif_explode1);
-		load_gif(gif_explode2);
-
-#define load_ent(id) img_##id.load(pal.get(), drs_graphics.open_slp(DrsId::ent_##id), 0, 0, DrsId::ent_##id)
-		load_ent(berries);
-#undef load_ent
-
-		load_gif(gif_gold);
-		load_gif(gif_stone);
-
-#define load_img(id) img_ ##id.load(pal.get(), drs_graphics.open_slp(DrsId::ent_ ##id), 0, 0, DrsId::ent_ ##id)
-
-		load_img(desert_tree1);
-		load_img(desert_tree2);
-		load_img(desert_tree3);
-		load_img(desert_tree4);
-
-		load_img(grass_tree1);
-		load_img(grass_tree2);
-		load_img(grass_tree3);
-		load_img(grass_tree4);
-
-		img_bld_debris.load(pal.get(), drs_graphics.open_slp(DrsId::bld_debris), 0, 0, DrsId::bld_debris);
+	// player colors are resolved by the sprite shader, so these only have to be decoded once
+	batch.add(drs_graphics, bld_town_center, DrsId::bld_town_center, true);
+	batch.add(drs_graphics, bld_town_center_player, DrsId::bld_town_center_player, true);
+
+	batch.add(drs_graphics, bld_barracks, DrsId::bld_barracks, true);
+
+#define load_gif(id) batch.add(drs_graphics, id, DrsId::id, true)
+	load_gif(gif_bld_fire1);
+	load_gif(gif_bld_fire2);
+	load_gif(gif_bld_fire3);
+
+	// TODO shadow images are incorrectly parsed as dynamic, unknown command FE
+	load_gif(gif_bird1);
+	//load_gif(gif_bird1_shadow);
+	load_gif(gif_bird1_glide);
+	//load_gif(gif_bird1_glide_shadow);
+
+	load_gif(gif_bird2);
+	//load_gif(gif_bird2_shadow);
+	load_gif(gif_bird2_glide);
+	//load_gif(gif_bird2_glide_shadow);
+
+	load_gif(gif_villager_stand);
+	load_gif(gif_villager_move);
+	load_gif(gif_villager_attack);
+	load_gif(gif_villager_die1);
+	load_gif(gif_villager_die2);
+	load_gif(gif_villager_decay);
+
+	load_gif(gif_worker_wood_stand);
+	load_gif(gif_worker_wood_move);
+	load_gif(gif_worker_wood_attack1);
+	load_gif(gif_worker_wood_attack2);
+	load_gif(gif_worker_wood_die);
+	load_gif(gif_worker_wood_decay);
+
+	load_gif(gif_worker_miner_stand);
+	load_gif(gif_worker_miner_move);
+	load_gif(gif_worker_miner_attack);
+	load_gif(gif_worker_miner_die);
+	load_gif(gif_worker_miner_decay);
+
+	load_gif(gif_worker_berries_attack);
+
+	load_gif(gif_melee1_stand);
+	load_gif(gif_melee1_move);
+	load_gif(gif_melee1_attack);
+	load_gif(gif_melee1_die);
+	load_gif(gif_melee1_decay);
+
+	load_gif(gif_priest_stand);
+	load_gif(gif_priest_move);
+	load_gif(gif_priest_attack);
+	load_gif(gif_priest_die);
+	load_gif(gif_priest_decay);
+
+	load_gif(gif_explode1);
+	load_gif(gif_explode2);
+
+	load_gif(gif_gold);
+	load_gif(gif_stone);
 #undef load_gif
-#define load_img(id) img_ ##id.load(pal.get(), drs_graphics.open_slp(DrsId::ent_ ##id), 0, 0, DrsId::ent_##id)
-		load_img(dead_tree1);
-		load_img(dead_tree2);
-		load_img(decay_tree);
+
+#define load_img(id) batch.add(drs_graphics, img_ ##id, DrsId::ent_ ##id)
+	load_img(berries);
+
+	load_img(desert_tree1);
+	load_img(desert_tree2);
+	load_img(desert_tree3);
+	load_img(desert_tree4);
+
+	load_img(grass_tree1);
+	load_img(grass_tree2);
+	load_img(grass_tree3);
+	load_img(grass_tree4);
+
+	load_img(dead_tree1);
+	load_img(dead_tree2);
+	load_img(decay_tree);
 #undef load_img
-	}
+
+	batch.add(drs_graphics, img_bld_debris, DrsId::bld_debris);
+
+	info.next("Decoding graphics");
+	batch.run();
 
 	info.next("Packing graphics");
 	{
@@ -385,26 +577,49 @@ void Assets::load_gfx(Engine &eng, UI_TaskInfo &info) {
 #undef gif
 
 		// pack images
-		GLint size = std::min(5120, eng.gl().max_texture_size);
 		ts_ui = p.collect(size, size);
 	}
+}
 
-#define sfx(id) eng.sfx.load_sfx(SfxId:: id, drs_ui.open_wav(DrsId:: sfx_ ## id))
-	eng.sfx.load_sfx(SfxId::sfx_chat, drs_ui.open_wav(DrsId::sfx_chat));
-	sfx(player_resign);
-	sfx(gameover_victory);
-	sfx(gameover_defeat);
-#undef sfx
+void Assets::load_cursors() {
+	ZoneScoped;
+
+	// cursors need their own surfaces, so cut them out of the atlas before it is uploaded
+	const ImageSet &set = anim_at(DrsId::gif_cursors);
+
+	gif_cursors.images.reset(new Image[gif_cursors.all_count = gif_cursors.image_count = set.imgs.size()]);
+	gif_cursors.dynamic = set.dynamic;
+
+	for (unsigned i = 0; i < gif_cursors.all_count; ++i) {
+		const ImageRef &r = at(set.imgs[i]);
+		const SDL_Surface *page = ts_ui.pages.at(r.page).surf.get();
+		Image &img = gif_cursors.images[i];
+
+		img.surface.reset(SDL_CreateRGBSurfaceWithFormat(0, r.bnds.w, r.bnds.h, 32, SDL_PIXELFORMAT_RGBA32));
+		if (!img.surface)
+			throw std::runtime_error("cannot create cursor");
+
+		for (int y = 0; y < r.bnds.h; ++y)
+			memcpy((uint8_t*)img.surface->pixels + y * img.surface->pitch, (const uint8_t*)page->pixels + (r.bnds.y + y) * page->pitch + 4 * r.bnds.x, 4 * r.bnds.w);
+
+		img.hotspot_x = r.hotspot_x;
+		img.hotspot_y = r.hotspot_y;
+	}
 }
 
 void Assets::add_gifs(gfx::ImagePacker &p, Animation &a, DrsId id) {
 	ImageSet gifs;
 
+	// keep the whole animation on one page
+	p.group();
+
 	for (unsigned i = 0; i < a.all_count; ++i) {
 		Image &img = a.images[i];
-		gifs.imgs.emplace_back(p.add_img(img.hotspot_x, img.hotspot_y, img.surface.get(), img.mask));
+		gifs.imgs.emplace_back(p.add_img(img.hotspot_x, img.hotspot_y, img.surface.get(), img.mask, img.players));
 	}
 
+	p.group();
+
 	gifs.dynamic = a.dynamic;
 	drs_gifs[id] = gifs;
 }
@@ -34,12 +34,10 @@ class Animation final {
 public:
 	std::unique_ptr<gfx::Image[]> images;
 	unsigned image_count, all_count;
-	bool dynamic;
+	bool dynamic; // every player has its own copy of the images
 
 	Animation() : images(), image_count(0), all_count(0), dynamic(false) {}
 
-	void load(io::DRS&, const SDL_Palette*, io::DrsId);
-
 	gfx::Image &subimage(unsigned index, unsigned player);
 };
 
@@ -53,6 +51,8 @@ public:
 	std::map<io::DrsId, BackgroundColors> bkg_cols;
 	gfx::Tileset ts_ui;
 	Animation gif_cursors;
+	/** Player colors for remapped images, gfx::player_ramp colors per player. */
+	std::vector<SDL_Color> player_cols;
 
 	Assets(Engine &e, const std::string &path);
 
@@ -60,7 +60,14 @@ public:
 	const gfx::ImageRef &at(IdPoolRef) const;
 	const ImageSet &anim_at(io::DrsId) const;
 private:
+	/** Progress steps besides decoding graphics, which adds a step for every task it runs. */
+	static constexpr unsigned load_steps = 7;
+
 	void load_gfx(Engine&, UI_TaskInfo&);
+	/** Decode and pack all graphics. */
+	void bake_gfx(Engine&, UI_TaskInfo&, io::DRS &drs_ui, int size);
+	/** Restore gif_cursors from the atlas. */
+	void load_cursors();
 	void load_audio(Engine&, UI_TaskInfo&);
 	void load_str(Engine&, UI_TaskInfo&);
 
@@ -0,0 +1,65 @@
+#include "depth_sort.hpp"
+
+#include <cstring>
+
+#include <stdexcept>
+
+#include <tracy/Tracy.hpp>
+
+namespace aoe {
+
+namespace gfx {
+
+/** Map float to unsigned int such that the integers compare in the same order. */
+static uint32_t depth_key(float z) noexcept {
+	uint32_t v;
+	memcpy(&v, &z, sizeof v);
+
+	// negative numbers sort in reverse, so flip them completely
+	return v & 0x80000000u ? ~v : v | 0x80000000u;
+}
+
+void DepthSort::add(unsigned layer, float z) {
+	if (keys.size() >= max_size)
+		throw std::length_error("depth sort: too many items");
+
+	keys.emplace_back((uint64_t)(layer & 0xff) << 56 | (uint64_t)depth_key(z) << 24 | keys.size());
+}
+
+void DepthSort::sort() {
+	ZoneScoped;
+
+	size_t n = keys.size();
+	if (n < 2)
+		return;
+
+	tmp.resize(n);
+
+	// least significant digit first, skipping the index bits. every pass is stable, so equal keys stay in insertion order
+	for (unsigned shift = 24; shift < 64; shift += 8) {
+		size_t count[256] = { 0 };
+
+		for (uint64_t k : keys)
+			++count[(k >> shift) & 0xff];
+
+		// nothing to do if everything ends up in the same bucket
+		if (count[(keys[0] >> shift) & 0xff] == n)
+			continue;
+
+		size_t sum = 0;
+		for (size_t &c : count) {
+			size_t v = c;
+			c = sum;
+			sum += v;
+		}
+
+		for (uint64_t k : keys)
+			tmp[count[(k >> shift) & 0xff]++] = k;
+
+		keys.swap(tmp);
+	}
+}
+
+}
+
+}
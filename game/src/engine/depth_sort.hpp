@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+namespace aoe {
+
+namespace gfx {
+
+/**
+ * Stable radix sort of draw order on layer first and depth second. Only the
+ * positions are sorted, so callers keep their own array of things to draw and
+ * look them up by index afterwards. Buffers are kept between frames, so it
+ * does not allocate once it has seen the biggest frame.
+ */
+class DepthSort final {
+	std::vector<uint64_t> keys, tmp; // layer (8 bits) | depth (32 bits) | index (24 bits)
+public:
+	static constexpr size_t max_size = 1 << 24;
+
+	DepthSort() : keys(), tmp() {}
+
+	void clear() noexcept { keys.clear(); }
+	/** Add next index. Lower layers come first, regardless of depth. Throws if there are too many items. */
+	void add(unsigned layer, float z);
+
+	void sort();
+
+	size_t size() const noexcept { return keys.size(); }
+	/** Index of the item that has to be drawn at position \a pos. */
+	uint32_t operator[](size_t pos) const noexcept { return (uint32_t)(keys[pos] & (max_size - 1)); }
+};
+
+}
+
+}
@@ -153,6 +153,28 @@ void GLprogram::link() {
 	throw std::runtime_error(std::string("Program compile error: " + buf));
 }
 
+static GLuint compile(GLuint shader, const char *src, const char *what) {
+	if (GL::compileShader(shader, src) == GL_TRUE)
+		return shader;
+
+	std::string buf(GL::getShaderInfoLog(shader));
+	glDeleteShader(shader);
+	throw std::runtime_error(std::string(what) + " shader compile error: " + buf);
+}
+
+void GLprogram::build(const char *vs_src, const char *fs_src) {
+	GLuint vs = compile(GL::createVertexShader(), vs_src, "vertex"), fs;
+
+	try {
+		fs = compile(GL::createFragmentShader(), fs_src, "fragment");
+	} catch (std::runtime_error&) {
+		glDeleteShader(vs);
+		throw;
+	}
+
+	link(vs, fs);
+}
+
 void GLprogram::link(GLuint vs, GLuint fs) {
 	*this += vs;
 	*this += fs;
@@ -163,46 +185,68 @@ void GLprogram::link(GLuint vs, GLuint fs) {
 	*this -= vs;
 }
 
-void GLprogram::setUniform(const char *name, GLint v) {
+GLint GLprogram::uniform(const char *name) {
 	auto it = uniforms.find(name);
-	GLint id = -1;
 
-	if (it != uniforms.end()) {
-		id = it->second;
-	} else {
-		id = glGetUniformLocation(this->id, name);
+	if (it != uniforms.end())
+		return it->second;
 
-		if (id == -1)
-			return;
+	GLint id = glGetUniformLocation(this->id, name);
 
+	if (id != -1)
 		uniforms.emplace(name, id);
-	}
 
-	glUniform1i(id, v);
+	return id;
+}
+
+void GLprogram::setUniform(const char *name, GLint v) {
+	GLint id = uniform(name);
+
+	if (id != -1)
+		glUniform1i(id, v);
+}
+
+void GLprogram::setUniform(const char *name, GLfloat x, GLfloat y) {
+	GLint id = uniform(name);
+
+	if (id != -1)
+		glUniform2f(id, x, y);
 }
 
 void GLprogram::setVertexArray(const char *name, GLint size, GLenum type, GLsizei stride, unsigned offset) {
 	setVertexArray(name, size, type, GL_FALSE, stride, offset);
 }
 
-void GLprogram::setVertexArray(const char *name, GLint size, GLenum type, GLboolean normalized, GLsizei stride, unsigned offset) {
+GLint GLprogram::attribute(const char *name) {
 	auto it = attributes.find(name);
-	GLint id = -1;
 
-	if (it != attributes.end()) {
-		id = it->second;
-	} else {
-		id = glGetAttribLocation(this->id, name);
+	if (it != attributes.end())
+		return it->second;
 
-		if (id == -1)
-			return;
+	GLint id = glGetAttribLocation(this->id, name);
 
+	if (id != -1)
 		attributes.emplace(name, id);
-	}
+
+	return id;
+}
+
+void GLprogram::setVertexArray(const char *name, GLint size, GLenum type, GLboolean normalized, GLsizei stride, unsigned offset) {
+	GLint id = attribute(name);
+
+	if (id == -1)
+		return;
 
 	glVertexAttribPointer(id, size, type, normalized, stride, (void*)(0 + offset));
 	glEnableVertexAttribArray(id);
 }
 
+void GLprogram::setVertexDivisor(const char *name, GLuint divisor) {
+	GLint id = attribute(name);
+
+	if (id != -1)
+		glVertexAttribDivisor(id, divisor);
+}
+
 }
 }
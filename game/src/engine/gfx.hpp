@@ -21,17 +21,29 @@ typedef std::unique_ptr<SDL_Surface, decltype(&SDL_FreeSurface)> Surface;
 
 void glchk(const char *file, const char *func, int lno);
 
+/** Number of colors in a player color ramp. */
+static constexpr unsigned player_ramp = 16;
+
+/** Palette index of color \a c in the color ramp of \a player. Gaia uses the last ramp. */
+static constexpr unsigned player_color(unsigned player, unsigned c) noexcept {
+	return (player ? player : 10) * 0x10 + c;
+}
+
 class Image final {
 public:
 	Surface surface;
 	int hotspot_x, hotspot_y;
 	std::vector<std::pair<int,int>> mask;
+	/** One byte per pixel: 0 for normal pixels and 1 + color for player colored ones. Empty unless asked for and the image has player colors. */
+	std::vector<uint8_t> players;
 
-	Image() : surface(nullptr, SDL_FreeSurface), hotspot_x(0), hotspot_y(0), mask() {}
+	Image() : surface(nullptr, SDL_FreeSurface), hotspot_x(0), hotspot_y(0), mask(), players() {}
 	Image(const Image&) = delete;
 	Image(Image&&) = default;
+	Image &operator=(Image&&) = default;
 
-	bool load(const SDL_Palette *pal, const io::Slp &slp, unsigned index, unsigned player, io::DrsId id);
+	/** Decode image. If \a remap is set, player colored pixels are also marked in players, so they can be recolored when drawing. */
+	bool load(const SDL_Palette *pal, const io::Slp &slp, unsigned index, unsigned player, io::DrsId id, bool remap=false);
 };
 
 class ImageRef final {
@@ -40,6 +52,7 @@ public:
 	SDL_Rect bnds;
 	int hotspot_x, hotspot_y;
 	GLfloat s0, t0, s1, t1;
+	unsigned page; // Tileset page that contains this image
 	SDL_Surface *surf; // NOTE is always NULL if retrieved from Tileset
 	std::vector<std::pair<int, int>> mask; // NOTE is empty if mask is rectangular
 
@@ -53,28 +66,52 @@ public:
 	}
 };
 
-/** Big texture that contains all references images. */
+/** Big textures that contain all references images. */
 class Tileset final {
 public:
+	/** One texture worth of images. */
+	struct Page final {
+		/** Raw surface where images are blitted to. Note that after write, this will become undefined! */
+		Surface surf;
+		/** Player color plane of surf, see Image::players. Empty if no image on this page has one. Cleared by write as well. */
+		std::vector<uint8_t> players;
+		/** Keeps the pixels of surf alive if surf does not own them. Released by write. */
+		std::shared_ptr<const void> backing;
+		int w, h;
+
+		Page() : surf(nullptr, SDL_FreeSurface), players(), backing(), w(0), h(0) {}
+	};
+
 	std::set<ImageRef> imgs;
-	/** Raw surface where images are blitted to. Note that after write(GLuint), this will become undefined! */
-	Surface surf;
-	int w, h;
+	std::vector<Page> pages;
 
 	Tileset();
 
-	void write(GLuint tex);
+	/** Upload \a page to \a tex and its player color plane to \a tex_players. */
+	void write(unsigned page, GLuint tex, GLuint tex_players);
 };
 
-/** Helper to pack images onto a single big texture image. */
+/**
+ * Helper to pack images onto big texture images. Images that do not fit on
+ * one texture spill over to the next page. Images in the same group are kept
+ * on the same page, so drawing an animation never has to switch textures.
+ */
 class ImagePacker final {
 	IdPool<ImageRef> images;
+	std::map<IdPoolRef, const std::vector<uint8_t>*> players;
+	std::vector<std::vector<IdPoolRef>> groups;
 public:
 	ImagePacker();
 
 	IdPoolRef add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf);
 	IdPoolRef add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf, const std::vector<std::pair<int,int>> &mask);
+	/** Add image with player color plane. \a players must stay alive until collect is done. */
+	IdPoolRef add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf, const std::vector<std::pair<int,int>> &mask, const std::vector<uint8_t> &players);
+
+	/** Put all images that are added from now on in a new group. Groups that are too big for a single page are split up. */
+	void group();
 
+	/** Pack all images on pages of at most \a w by \a h pixels. */
 	Tileset collect(int w, int h);
 };
 
@@ -155,14 +192,22 @@ public:
 
 	void link();
 	void link(GLuint vs, GLuint fs);
+	/** Compile shaders from source and link them. Throws if anything fails. */
+	void build(const char *vs_src, const char *fs_src);
 
 	void use();
 
 	// NOTE const char* must be compile time constant
 	void setUniform(const char *s, GLint v);
+	void setUniform(const char *s, GLfloat x, GLfloat y);
 
 	void setVertexArray(const char *s, GLint size, GLenum type, GLsizei stride, unsigned offset);
 	void setVertexArray(const char *s, GLint size, GLenum type, GLboolean normalized, GLsizei stride, unsigned offset);
+	/** Advance attribute once every \a divisor instances instead of once every vertex. Zero restores the default. */
+	void setVertexDivisor(const char *s, GLuint divisor);
+private:
+	GLint uniform(const char *s);
+	GLint attribute(const char *s);
 };
 
 }
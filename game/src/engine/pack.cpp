@@ -16,13 +16,13 @@ ImageRef::ImageRef(IdPoolRef ref, const SDL_Rect &bnds, SDL_Surface *surf, const
 
 ImageRef::ImageRef(IdPoolRef ref, const SDL_Rect &bnds, SDL_Surface *surf, int hotspot_x, int hotspot_y, GLfloat s0, GLfloat t0, GLfloat s1, GLfloat t1)
 	: ref(ref), bnds(bnds)
-	, hotspot_x(hotspot_x), hotspot_y(hotspot_y), mask(), s0(s0), t0(t0), s1(s1), t1(t1), surf(surf) {}
+	, hotspot_x(hotspot_x), hotspot_y(hotspot_y), mask(), s0(s0), t0(t0), s1(s1), t1(t1), page(0), surf(surf) {}
 
 ImageRef::ImageRef(IdPoolRef ref, const SDL_Rect &bnds, SDL_Surface *surf, const std::vector<std::pair<int, int>> &mask, int hotspot_x, int hotspot_y, GLfloat s0, GLfloat t0, GLfloat s1, GLfloat t1)
 	: ref(ref), bnds(bnds)
-	, hotspot_x(hotspot_x), hotspot_y(hotspot_y), mask(mask), s0(s0), t0(t0), s1(s1), t1(t1), surf(surf) {}
+	, hotspot_x(hotspot_x), hotspot_y(hotspot_y), mask(mask), s0(s0), t0(t0), s1(s1), t1(t1), page(0), surf(surf) {}
 
-ImagePacker::ImagePacker() : images() {}
+ImagePacker::ImagePacker() : images(), players(), groups(1) {}
 
 IdPoolRef ImagePacker::add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf) {
 	std::vector<std::pair<int, int>> m;
@@ -42,9 +42,31 @@ IdPoolRef ImagePacker::add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf,
 	if (!ins.second)
 		throw std::runtime_error("cannot add image");
 
+	groups.back().emplace_back(ins.first->first);
 	return ins.first->first;
 }
 
+IdPoolRef ImagePacker::add_img(int hotspot_x, int hotspot_y, SDL_Surface *surf, const std::vector<std::pair<int,int>> &mask, const std::vector<uint8_t> &players) {
+	IdPoolRef ref = add_img(hotspot_x, hotspot_y, surf, mask);
+
+	if (!players.empty()) {
+		if (players.size() != (size_t)surf->w * surf->h)
+			throw std::runtime_error("player color plane does not match image size");
+
+		this->players.emplace(ref, &players);
+	}
+
+	return ref;
+}
+
+void ImagePacker::group() {
+	if (!groups.back().empty())
+		groups.emplace_back();
+}
+
+/** Give up on a page after this many groups did not fit anymore. */
+static constexpr unsigned max_misses = 8;
+
 Tileset ImagePacker::collect(int w, int h) {
 	ZoneScoped;
 
@@ -57,44 +79,100 @@ Tileset ImagePacker::collect(int w, int h) {
 	if (w > max_size || h > max_size)
 		throw std::runtime_error("target texture too big");
 
-	stbrp_context ctx{ 0 };
-
 	std::vector<IdPoolRef> id_to_ref; // keep track of refs
-	std::vector<stbrp_rect> rects;
-
-	rects.reserve(w);
+	std::vector<stbrp_rect> rects; // packed rects, indexed by id
+	std::vector<unsigned> id_to_page;
+	std::vector<std::vector<stbrp_rect>> pending;
 
 	// add all rects to be packed
-	for (auto kv : images) {
-		ImageRef &ref = kv.second;
-		stbrp_rect rect{ id_to_ref.size(), ref.surf->w, ref.surf->h, 0, 0, 0 };
-		rects.push_back(rect);
-		id_to_ref.emplace_back(kv.first);
+	for (const std::vector<IdPoolRef> &g : groups) {
+		if (g.empty())
+			continue;
+
+		std::vector<stbrp_rect> &grp = pending.emplace_back();
+
+		for (IdPoolRef r : g) {
+			const ImageRef &ref = images.at(r);
+			grp.push_back(stbrp_rect{ (int)id_to_ref.size(), ref.surf->w, ref.surf->h, 0, 0, 0 });
+			id_to_ref.emplace_back(r);
+		}
 	}
 
+	rects.resize(id_to_ref.size());
+	id_to_page.resize(id_to_ref.size());
+
+	Tileset ts;
+
 	{
 		ZoneScopedN("pack");
 		std::vector<stbrp_node> nodes(w);
-		stbrp_init_target(&ctx, w, h, nodes.data(), nodes.size());
 
-		stbrp_setup_heuristic(&ctx, STBRP_HEURISTIC_Skyline_BF_sortHeight);
-		stbrp_setup_allow_out_of_mem(&ctx, 0);
+		while (!pending.empty()) {
+			unsigned page = (unsigned)ts.pages.size();
+			std::vector<std::vector<stbrp_rect>> placed, left;
+			unsigned misses = 0;
+			stbrp_context ctx{ 0 };
 
-		// do pack magic
-		if (!stbrp_pack_rects(&ctx, rects.data(), rects.size()))
-			throw std::runtime_error("cannot fit images in texture");
-	}
+			auto reset = [&]() {
+				stbrp_init_target(&ctx, w, h, nodes.data(), nodes.size());
 
-	Tileset ts;
+				stbrp_setup_heuristic(&ctx, STBRP_HEURISTIC_Skyline_BF_sortHeight);
+				stbrp_setup_allow_out_of_mem(&ctx, 0);
+			};
 
-	{
-		ZoneScopedN("resize");
-		w = h = 0;
+			reset();
+
+			for (std::vector<stbrp_rect> &g : pending) {
+				if (misses >= max_misses) {
+					left.emplace_back(std::move(g));
+					continue;
+				}
+
+				// do pack magic
+				if (stbrp_pack_rects(&ctx, g.data(), g.size())) {
+					placed.emplace_back(std::move(g));
+					continue;
+				}
+
+				if (placed.empty()) {
+					// too big for an empty page: keep what fits and put the rest on the next page
+					std::vector<stbrp_rect> fit, rest;
+
+					for (const stbrp_rect &r : g)
+						(r.was_packed ? fit : rest).push_back(r);
+
+					if (fit.empty())
+						throw std::runtime_error("cannot fit images in texture");
+
+					placed.emplace_back(std::move(fit));
+					left.emplace_back(std::move(rest));
+					misses = max_misses;
+					continue;
+				}
+
+				// try again on the next page, but undo the part that did fit.
+				// packing is deterministic, so replaying what we have placed restores the free space exactly
+				left.emplace_back(std::move(g));
+				++misses;
+
+				reset();
+				for (std::vector<stbrp_rect> &p : placed)
+					stbrp_pack_rects(&ctx, p.data(), p.size());
+			}
 
-		// adjust w and h to ensure all images are inclosed in a minimal rectangle
-		for (stbrp_rect &r : rects) {
-			w = std::max<unsigned>(w, r.x + r.w);
-			h = std::max<unsigned>(h, r.y + r.h);
+			Tileset::Page &pg = ts.pages.emplace_back();
+
+			for (const std::vector<stbrp_rect> &p : placed)
+				for (const stbrp_rect &r : p) {
+					rects[r.id] = r;
+					id_to_page[r.id] = page;
+
+					// adjust w and h to ensure all images are inclosed in a minimal rectangle
+					pg.w = std::max(pg.w, r.x + r.w);
+					pg.h = std::max(pg.h, r.y + r.h);
+				}
+
+			pending = std::move(left);
 		}
 	}
 
@@ -103,34 +181,38 @@ Tileset ImagePacker::collect(int w, int h) {
 		// traverse result to restore refs
 		for (size_t i = 0; i < rects.size(); ++i) {
 			stbrp_rect &r = rects[i];
+			const Tileset::Page &pg = ts.pages[id_to_page[i]];
 
 			// compute texture coordinates
-			GLfloat s0 = (GLfloat)r.x / w, t0 = (GLfloat)r.y / h;
-			GLfloat s1 = (GLfloat)(r.x + r.w) / w, t1 = (GLfloat)(r.y + r.h) / h;
+			GLfloat s0 = (GLfloat)r.x / pg.w, t0 = (GLfloat)r.y / pg.h;
+			GLfloat s1 = (GLfloat)(r.x + r.w) / pg.w, t1 = (GLfloat)(r.y + r.h) / pg.h;
 
 			const ImageRef &ref = images.at(id_to_ref[i]);
 
-			ts.imgs.emplace(id_to_ref[i], SDL_Rect{ r.x, r.y, r.w, r.h }, nullptr, ref.mask, ref.hotspot_x, ref.hotspot_y, s0, t0, s1, t1);
+			ImageRef dst(id_to_ref[i], SDL_Rect{ r.x, r.y, r.w, r.h }, nullptr, ref.mask, ref.hotspot_x, ref.hotspot_y, s0, t0, s1, t1);
+			dst.page = id_to_page[i];
+			ts.imgs.emplace(std::move(dst));
 		}
 	}
 
 	{
 		ZoneScopedN("copy");
-		ts.surf.reset(SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32));
+		for (Tileset::Page &pg : ts.pages)
+			pg.surf.reset(SDL_CreateRGBSurfaceWithFormat(0, pg.w, pg.h, 32, SDL_PIXELFORMAT_RGBA32));
 
 		std::unique_ptr<SDL_Surface, decltype(&SDL_FreeSurface)> tmp(nullptr, SDL_FreeSurface);
 
 		// traverse again to copy data to big surface
 		for (const ImageRef &r : ts.imgs) {
-			SDL_Surface *surf = images.at(r.ref).surf;
+			SDL_Surface *surf = images.at(r.ref).surf, *dst = ts.pages[r.page].surf.get();
 			tmp.reset(SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, 0));
 			if (!tmp)
 				throw std::runtime_error("cannot convert image");
 
-			uint32_t *pixels1 = (uint32_t*)ts.surf->pixels;
+			uint32_t *pixels1 = (uint32_t*)dst->pixels;
 			const uint32_t *pixels0 = (const uint32_t*)tmp->pixels;
 
-			int p1 = ts.surf->pitch >> 2, p0 = tmp->pitch >> 2;
+			int p1 = dst->pitch >> 2, p0 = tmp->pitch >> 2;
 
 			// copy data
 			for (int y0 = 0, y1 = r.bnds.y, h = tmp->h; y0 < h; ++y0, ++y1)
@@ -138,6 +220,22 @@ Tileset ImagePacker::collect(int w, int h) {
 		}
 	}
 
+	if (!players.empty()) {
+		ZoneScopedN("copy players");
+
+		for (auto kv : players) {
+			const ImageRef &r = *ts.imgs.find(ImageRef(kv.first, SDL_Rect{ 0, 0, 0, 0 }, nullptr, 0, 0));
+			Tileset::Page &pg = ts.pages[r.page];
+			const uint8_t *src = kv.second->data();
+
+			if (pg.players.empty())
+				pg.players.assign((size_t)pg.w * pg.h, 0);
+
+			for (int y = 0; y < r.bnds.h; ++y)
+				memcpy(&pg.players[(size_t)(r.bnds.y + y) * pg.w + r.bnds.x], &src[(size_t)y * r.bnds.w], r.bnds.w);
+		}
+	}
+
 	return ts;
 }
 
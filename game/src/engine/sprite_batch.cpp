@@ -0,0 +1,115 @@
+#include "sprite_batch.hpp"
+
+#include <cstddef>
+
+#include <tracy/Tracy.hpp>
+
+namespace aoe {
+
+namespace gfx {
+
+SpriteBatch::SpriteBatch() : prog(), vao(), quad(), ring(), ring_pos(0), sprites(), sorted(), order() {
+	ZoneScoped;
+
+	prog.build(
+#include "../shaders/sprite.vs"
+		,
+#include "../shaders/sprite.fs"
+	);
+
+	// triangle strip
+	static const GLfloat corners[] = {
+		0, 0,
+		1, 0,
+		0, 1,
+		1, 1,
+	};
+
+	vao.bind();
+	quad.setData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	prog.setVertexArray("aCorner", 2, GL_FLOAT, 2 * sizeof(GLfloat), 0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLCHK;
+}
+
+void SpriteBatch::add(unsigned layer, float z, const Sprite &s) {
+	order.add(layer, z);
+	sprites.emplace_back(s);
+}
+
+void SpriteBatch::draw(const std::vector<GLuint> &tex, const std::vector<GLuint> &tex_players, GLuint tex_palette, float width, float height) {
+	ZoneScoped;
+
+	if (sprites.empty())
+		return;
+
+	if (width > 0 && height > 0) {
+		order.sort();
+
+		sorted.resize(sprites.size());
+		for (size_t i = 0; i < sorted.size(); ++i)
+			sorted[i] = sprites[order[i]];
+
+		GLbuffer &vbo = ring[ring_pos];
+		ring_pos = (ring_pos + 1) % ring_size;
+
+		GL::viewport(0, 0, (int)width, (int)height);
+		GL::bind2d(2, tex_palette);
+		glActiveTexture(GL_TEXTURE0);
+
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		prog.use();
+		prog.setUniform("texture1", 0);
+		prog.setUniform("players", 1);
+		prog.setUniform("palette", 2);
+		prog.setUniform("scale", 2.0f / width, 2.0f / height);
+
+		vao.bind();
+
+		// stream into a fresh store, so the driver does not have to wait for the previous frame
+		vbo.setData(GL_ARRAY_BUFFER, sorted.size() * sizeof(Sprite), sorted.data(), GL_STREAM_DRAW);
+
+		prog.setVertexDivisor("aRect"   , 1);
+		prog.setVertexDivisor("aTexRect", 1);
+		prog.setVertexDivisor("aFlags"  , 1);
+
+		// depth order wins, so only consecutive sprites on the same page can be drawn together
+		for (size_t first = 0, n = sorted.size(); first < n;) {
+			unsigned page = sorted[first].page;
+			size_t last = first + 1;
+
+			while (last < n && sorted[last].page == page)
+				++last;
+
+			GL::bind2d(0, tex.at(page));
+			GL::bind2d(1, tex_players.at(page));
+			glActiveTexture(GL_TEXTURE0);
+
+			unsigned offset = (unsigned)(first * sizeof(Sprite));
+
+			prog.setVertexArray("aRect"   , 4, GL_FLOAT, sizeof(Sprite), offset + offsetof(Sprite, x));
+			prog.setVertexArray("aTexRect", 4, GL_FLOAT, sizeof(Sprite), offset + offsetof(Sprite, s0));
+			prog.setVertexArray("aFlags"  , 2, GL_UNSIGNED_BYTE, sizeof(Sprite), offset + offsetof(Sprite, player));
+
+			glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, (GLsizei)(last - first));
+			first = last;
+		}
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glDisable(GL_BLEND);
+
+		GLCHK;
+	}
+
+	sprites.clear();
+	order.clear();
+}
+
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "gfx.hpp"
+#include "depth_sort.hpp"
+
+namespace aoe {
+
+namespace gfx {
+
+/**
+ * Collects all sprites of a frame and draws them with one instanced draw call
+ * for every run of sprites on the same Tileset page. Every sprite is one
+ * instance of a unit quad, so the vertex shader does the positioning and
+ * mirroring. Instance data is streamed into a small ring of buffers, so we
+ * never write to a buffer the GPU may still be reading from.
+ */
+class SpriteBatch final {
+public:
+	/** Instance data. Positions are in screen pixels. */
+	struct Sprite final {
+		GLfloat x, y, w, h;
+		GLfloat s0, t0, s1, t1;
+		GLubyte player, xflip, page, pad;
+	};
+
+	static constexpr unsigned ring_size = 3;
+private:
+	GLprogram prog;
+	GLvertexArray vao;
+	GLbuffer quad;
+	std::array<GLbuffer, ring_size> ring;
+	unsigned ring_pos;
+	std::vector<Sprite> sprites, sorted;
+	DepthSort order;
+public:
+	/** Create the shaders and buffers. Only call this when an OpenGL context is active. */
+	SpriteBatch();
+
+	/** Add sprite at depth \a z. Lower layers are always drawn first. */
+	void add(unsigned layer, float z, const Sprite &s);
+
+	size_t size() const noexcept { return sprites.size(); }
+
+	/**
+	 * Draw and forget everything that has been added since the last time.
+	 * \a tex contains all pages and \a tex_players and \a tex_palette are used to recolor player colored pixels, see Tileset::Page::players.
+	 */
+	void draw(const std::vector<GLuint> &tex, const std::vector<GLuint> &tex_players, GLuint tex_palette, float width, float height);
+};
+
+}
+
+}
@@ -0,0 +1,229 @@
+#include "terrain_mesh.hpp"
+
+#include <cfloat>
+#include <cstddef>
+
+#include <algorithm>
+
+#include <tracy/Tracy.hpp>
+
+namespace aoe {
+
+namespace gfx {
+
+// a tile has at most one base image and four overlays
+static constexpr unsigned max_quads = TerrainMesh::chunk_size * TerrainMesh::chunk_size * 5;
+
+static_assert(max_quads * 4 <= UINT16_MAX, "chunk too big for 16 bit indices");
+
+TerrainMesh::TerrainMesh()
+	: prog(), vao(), ebo(), chunks(), vertices()
+	, w(0), h(0), cw(0), ch(0), tw(0), th(0), left(0), top(0), shown(false)
+{
+	ZoneScoped;
+
+	prog.build(
+#include "../shaders/terrain.vs"
+		,
+#include "../shaders/terrain.fs"
+	);
+
+	std::vector<GLushort> indices;
+	indices.reserve(max_quads * 6);
+
+	for (unsigned i = 0; i < max_quads; ++i) {
+		GLushort v = (GLushort)(4 * i);
+
+		indices.insert(indices.end(), { v, (GLushort)(v + 1), (GLushort)(v + 2), v, (GLushort)(v + 2), (GLushort)(v + 3) });
+	}
+
+	// the element buffer binding is part of the vertex array state
+	vao.bind();
+	ebo.setData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+
+	GLCHK;
+}
+
+void TerrainMesh::resize(unsigned w, unsigned h) {
+	this->w = w;
+	this->h = h;
+
+	cw = (w + chunk_size - 1) / chunk_size;
+	ch = (h + chunk_size - 1) / chunk_size;
+
+	chunks.clear();
+	chunks.resize(cw * ch);
+}
+
+void TerrainMesh::invalidate() noexcept {
+	for (Chunk &c : chunks)
+		c.dirty = true;
+}
+
+void TerrainMesh::invalidate(unsigned x, unsigned y, unsigned w, unsigned h) noexcept {
+	if (!w || !h || x >= this->w || y >= this->h)
+		return;
+
+	unsigned cx0 = x / chunk_size, cx1 = std::min(x + w - 1, this->w - 1) / chunk_size;
+	unsigned cy0 = y / chunk_size, cy1 = std::min(y + h - 1, this->h - 1) / chunk_size;
+
+	for (unsigned cy = cy0; cy <= cy1; ++cy)
+		for (unsigned cx = cx0; cx <= cx1; ++cx)
+			chunks[cy * cw + cx].dirty = true;
+}
+
+void TerrainMesh::update(Terrain &t, int tw, int th, const TileImage &img) {
+	ZoneScoped;
+
+	if (t.w != w || t.h != h)
+		resize(t.w, t.h);
+
+	if (tw != this->tw || th != this->th) {
+		this->tw = tw;
+		this->th = th;
+		invalidate();
+	}
+
+	for (unsigned cy = 0; cy < ch; ++cy)
+		for (unsigned cx = 0; cx < cw; ++cx) {
+			Chunk &c = chunks[cy * cw + cx];
+
+			if (c.dirty)
+				build(c, cx, cy, t, img);
+		}
+}
+
+void TerrainMesh::quad(Chunk &c, const ImageRef &img, float x, float y, GLubyte col) {
+	float x0 = x - img.hotspot_x, y0 = y - img.hotspot_y;
+	float x1 = x0 + img.bnds.w, y1 = y0 + img.bnds.h;
+
+	GLsizei first = (GLsizei)(vertices.size() / 4 * 6);
+
+	if (c.runs.empty() || c.runs.back().page != img.page)
+		c.runs.push_back(Run{ img.page, first, 0 });
+
+	c.runs.back().count += 6;
+
+	vertices.push_back(Vertex{ x0, y0, img.s0, img.t0, col, col, col, 255 });
+	vertices.push_back(Vertex{ x1, y0, img.s1, img.t0, col, col, col, 255 });
+	vertices.push_back(Vertex{ x1, y1, img.s1, img.t1, col, col, col, 255 });
+	vertices.push_back(Vertex{ x0, y1, img.s0, img.t1, col, col, col, 255 });
+
+	c.x0 = std::min(c.x0, x0);
+	c.y0 = std::min(c.y0, y0);
+	c.x1 = std::max(c.x1, x1);
+	c.y1 = std::max(c.y1, y1);
+}
+
+void TerrainMesh::build(Chunk &c, unsigned cx, unsigned cy, Terrain &t, const TileImage &img) {
+	ZoneScoped;
+
+	vertices.clear();
+	c.runs.clear();
+	c.x0 = c.y0 = FLT_MAX;
+	c.x1 = c.y1 = -FLT_MAX;
+
+	unsigned x0 = cx * chunk_size, x1 = std::min(x0 + chunk_size, w);
+	unsigned y0 = cy * chunk_size, y1 = std::min(y0 + chunk_size, h);
+
+	// same order and placement as Engine::tilepos, so it looks exactly like the old imgui terrain
+	int hw = tw / 2, hh = th / 2;
+
+	for (unsigned y = y0; y < y1; ++y) {
+		for (unsigned x = x0; x < x1; ++x) {
+			uint16_t id = t.tile_at(x, y);
+			int z = t.h_at(x, y);
+			// unexplored tiles are black
+			GLubyte col = id ? 255 : 0;
+
+			float px = (float)(hw * (int)(x + y));
+			float py = (float)(hh * (int)x - hh * (int)y - hh * z);
+
+			if (!Terrain::tile_hasoverlay(id)) {
+				quad(c, img(id), px, py, col);
+				continue;
+			}
+
+			TileType base = Terrain::tile_base(id);
+			unsigned meta = Terrain::tile_img(id);
+			unsigned bits = meta >> (12 - 3);
+			unsigned sub = meta & ~0x1e00;
+
+			quad(c, img(Terrain::tile_id(base, sub)), px, py, col);
+
+			TileType type = Terrain::tile_type(id);
+
+			for (unsigned i = 0; i < 4; ++i)
+				if (bits & (1 << i))
+					quad(c, img(Terrain::tile_id(type, i)), px, py, col);
+		}
+	}
+
+	c.dirty = false;
+
+	if (!c.vbo)
+		c.vbo.reset(new GLbuffer());
+
+	c.vbo->setData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	GLCHK;
+}
+
+void TerrainMesh::show(float left, float top) noexcept {
+	this->left = left;
+	this->top = top;
+	shown = true;
+}
+
+void TerrainMesh::draw(const std::vector<GLuint> &tex, float width, float height) {
+	ZoneScoped;
+
+	if (!shown)
+		return;
+
+	shown = false;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	GL::viewport(0, 0, (int)width, (int)height);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	prog.use();
+	prog.setUniform("texture1", 0);
+	prog.setUniform("offset", left, top);
+	prog.setUniform("scale", 2.0f / width, 2.0f / height);
+
+	vao.bind();
+
+	// draw in the same order as they are built, so overlapping tile edges look the same every frame
+	for (const Chunk &c : chunks) {
+		if (c.runs.empty() || c.x1 + left < 0 || c.x0 + left >= width || c.y1 + top < 0 || c.y0 + top >= height)
+			continue;
+
+		glBindBuffer(GL_ARRAY_BUFFER, *c.vbo);
+
+		prog.setVertexArray("aPos"     , 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, x));
+		prog.setVertexArray("aTexCoord", 2, GL_FLOAT, sizeof(Vertex), offsetof(Vertex, s));
+		prog.setVertexArray("aColor"   , 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), offsetof(Vertex, r));
+
+		for (const Run &r : c.runs) {
+			GL::bind2d(0, tex.at(r.page));
+			glDrawElements(GL_TRIANGLES, r.count, GL_UNSIGNED_SHORT, (void*)(r.first * sizeof(GLushort)));
+		}
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisable(GL_BLEND);
+
+	GLCHK;
+}
+
+}
+
+}
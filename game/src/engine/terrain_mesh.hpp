@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "gfx.hpp"
+
+#include "../world/terrain.hpp"
+
+namespace aoe {
+
+namespace gfx {
+
+/**
+ * Terrain that lives on the GPU. The map is cut into square chunks and each
+ * chunk gets its own vertex buffer with a quad for every tile image. Chunks
+ * are only rebuilt when tiles in them change, so drawing the terrain is just
+ * one draw call per chunk that is on screen (or a few more if its tiles are
+ * spread over several Tileset pages). Vertices are in map pixels and
+ * the camera is passed as a uniform, so scrolling does not touch them either.
+ */
+class TerrainMesh final {
+public:
+	typedef std::function<const ImageRef&(uint8_t)> TileImage;
+
+	static constexpr unsigned chunk_size = 16;
+private:
+	struct Vertex final {
+		GLfloat x, y;
+		GLfloat s, t;
+		GLubyte r, g, b, a;
+	};
+
+	/** Consecutive quads that use the same Tileset page. */
+	struct Run final {
+		unsigned page;
+		GLsizei first, count; // in indices
+	};
+
+	struct Chunk final {
+		std::unique_ptr<GLbuffer> vbo; // created on first build
+		std::vector<Run> runs;
+		float x0, y0, x1, y1; // bounds in map pixels
+		bool dirty;
+
+		Chunk() : vbo(), runs(), x0(0), y0(0), x1(0), y1(0), dirty(true) {}
+	};
+
+	GLprogram prog;
+	GLvertexArray vao;
+	GLbuffer ebo; // same quad indices for all chunks
+	std::vector<Chunk> chunks;
+	std::vector<Vertex> vertices; // scratch space for building chunks
+	unsigned w, h, cw, ch; // map and chunk grid size
+	int tw, th;
+	float left, top;
+	bool shown;
+public:
+	/** Create the shaders and buffers. Only call this when an OpenGL context is active. */
+	TerrainMesh();
+
+	/** Throw all chunks away. Call this when the map size changes. */
+	void resize(unsigned w, unsigned h);
+	/** Rebuild everything, e.g. because the tile images have moved. */
+	void invalidate() noexcept;
+	/** Rebuild all chunks that touch these tiles. */
+	void invalidate(unsigned x, unsigned y, unsigned w, unsigned h) noexcept;
+
+	/** Rebuild dirty chunks. \a tw and \a th are the tile size in pixels. */
+	void update(Terrain &t, int tw, int th, const TileImage &img);
+
+	/** Draw the terrain during this frame with the camera at \a left, \a top. */
+	void show(float left, float top) noexcept;
+	/** Draw all visible chunks if show has been called since the last time. \a tex contains all Tileset pages. */
+	void draw(const std::vector<GLuint> &tex, float width, float height);
+private:
+	void build(Chunk &c, unsigned cx, unsigned cy, Terrain &t, const TileImage &img);
+	void quad(Chunk &c, const ImageRef &img, float x, float y, GLubyte col);
+};
+
+}
+
+}
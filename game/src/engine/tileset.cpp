@@ -7,14 +7,14 @@
 namespace aoe {
 namespace gfx {
 
-Tileset::Tileset() : imgs(), surf(nullptr, SDL_FreeSurface), w(0), h(0) {}
+Tileset::Tileset() : imgs(), pages() {}
 
-void Tileset::write(GLuint tex) {
+void Tileset::write(unsigned page, GLuint tex, GLuint tex_players) {
 	ZoneScoped;
-	assert(surf.get());
-
-	w = surf->w;
-	h = surf->h;
+	Page &pg = pages.at(page);
+	SDL_Surface *surf = pg.surf.get();
+	std::vector<uint8_t> &players = pg.players;
+	assert(surf);
 
 	{
 		ZoneScopedN("prepare");
@@ -28,29 +28,38 @@ void Tileset::write(GLuint tex) {
 
 	GLenum mode = GL_RGBA;
 
-	//surf->w = std::min(4096 * 2, surf->w);
-
-	std::vector<uint32_t> data;
-	{
-		ZoneScopedN("resize");
-		data.resize(surf->w * surf->h);
-	}
 	{
-		ZoneScopedN("copy");
-		uint32_t *pixels = (uint32_t*)surf->pixels;
-		size_t pos = 0;
-
-		for (int y = 0, h = surf->h, p = surf->pitch >> 2; y < h; ++y) {
-			memcpy(&data[pos], &pixels[y * p], 4 * surf->w);
-			pos += surf->w;
-		}
+		ZoneScopedN("flush");
+		// upload straight from the surface, skipping any row padding
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, surf->pitch >> 2);
+		glTexImage2D(GL_TEXTURE_2D, 0, mode, surf->w, surf->h, 0, mode, GL_UNSIGNED_BYTE, surf->pixels);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 	}
 	{
-		ZoneScopedN("flush");
-		glTexImage2D(GL_TEXTURE_2D, 0, mode, surf->w, surf->h, 0, mode, GL_UNSIGNED_BYTE, data.data());
+		ZoneScopedN("flush players");
+		// these are color indices, so they must never be interpolated
+		glBindTexture(GL_TEXTURE_2D, tex_players);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		static const uint8_t none = 0;
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+		if (players.empty())
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, 1, 1, 0, GL_RED, GL_UNSIGNED_BYTE, &none);
+		else
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, pg.w, pg.h, 0, GL_RED, GL_UNSIGNED_BYTE, players.data());
+
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	}
 
-	surf.reset();
+	pg.surf.reset();
+	pg.backing.reset();
+	players.clear();
+	players.shrink_to_fit();
 }
 
 }
@@ -9,26 +9,35 @@
 namespace aoe {
 
 enum class GameMod {
-	terrain   = 1 << 0,
-	entities  = 1 << 1,
-	players   = 1 << 2,
-	particles = 1 << 3,
+	all     = 1 << 0, // journal has been dropped, so GameView has to copy everything
+	players = 1 << 2,
 };
 
 Game::Game()
-	: m(), t(), players(), entities(), entities_spawned(), entities_killed()
-	, particles(), particles_spawned()
-	, modflags((unsigned)-1), ticks(0), team_won(0), running(false) {}
+	: m(), t(), players(), entities(), particles(), journal(), reader(nullptr), spare_terrain()
+	, modflags((unsigned)-1), ticks(0), sfx(), team_won(0), running(false) {}
+
+/** Append change to journal. Game::m must be locked. */
+template<class... Args> void Game::record(GameChangeType type, Args&&... data) {
+	if (modflags & (unsigned)GameMod::all)
+		return;
+
+	if (journal.size() >= journal_max) {
+		journal.clear();
+		modflags |= (unsigned)GameMod::all;
+		return;
+	}
+
+	journal.emplace_back(type, std::forward<Args>(data)...);
+}
 
 void Game::resize(const ScenarioSettings &scn) {
 	std::lock_guard<std::mutex> lk(m);
 	// nuke entities
 	entities.clear();
-	entities_spawned.clear();
-	entities_killed.clear();
-
 	particles.clear();
-	particles_spawned.clear();
+	journal.clear();
+	sfx.reset(ticks);
 
 	t.resize(scn.width, scn.height, scn.seed, scn.players.size(), scn.wrap, scn.type);
 	modflags |= (unsigned)-1;
@@ -72,48 +81,89 @@ PlayerView Game::pv(unsigned idx) {
 
 void Game::imgtick(unsigned n) {
 	ZoneScoped;
-	for (const Entity &e : entities) {
-		Entity &ent = const_cast<Entity&>(e);
-		if (!ent.imgtick(n)) {
-			std::optional<SfxId> sfx(ent.sfxtick());
-			if (sfx.has_value()) {
-				EngineView ev;
-				ev.play_sfx(sfx.value());
-			}
-		}
+	// animations are computed when drawn, so only entities that make some noise have to be checked
+	for (const TimerWheel::Timer &tm : sfx.advance(ticks)) {
+		Entity *ent = entities.try_get(tm.ref);
+		if (!ent || ent->anim_start != tm.token)
+			continue;
+
+		std::optional<SfxId> id(ent->sfxtick());
+		if (!id.has_value())
+			continue;
+
+		EngineView ev;
+		ev.play_sfx(id.value());
+
+		std::optional<uint64_t> next(ent->anim_event(ticks));
+		if (next)
+			sfx.schedule(next.value(), ent->ref, ent->anim_start);
 	}
 
-	modflags |= (unsigned)GameMod::entities;
-
-	bool changed = !particles.empty();
-
 	for (auto it = particles.begin(); it != particles.end();) {
-		Particle &part = const_cast<Particle&>(*it);
-
-		if (!part.imgtick(n))
+		if (it->done(ticks))
 			it = particles.erase(it);
 		else
 			++it;
 	}
 
-	if (changed)
-		modflags |= (unsigned)GameMod::particles;
+	// GameView animates its own copy
+	record(GameChangeType::tick, n);
+}
+
+/** Play animation of \a ent from tick \a start. Game::m must be locked. */
+void Game::start_anim(Entity &ent, uint64_t start) {
+	ent.start_anim(start);
+
+	if (start != ticks || !ent.sfxtick().has_value())
+		return;
+
+	std::optional<uint64_t> t(ent.anim_event(ticks));
+	if (t)
+		sfx.schedule(t.value(), ent.ref, ent.anim_start);
 }
 
 void Game::terrain_create() {
+	std::lock_guard<std::mutex> lk(m);
+
 	t.generate();
+	journal.clear();
+	modflags |= (unsigned)GameMod::all;
 }
 
 void Game::terrain_set(const std::vector<uint16_t> &tiles, const std::vector<uint8_t> &hmap, unsigned x, unsigned y, unsigned w, unsigned h) {
 	std::lock_guard<std::mutex> lk(m);
 
 	t.set(tiles, hmap, x, y, w, h);
-	modflags |= (unsigned)GameMod::terrain;
+	record(GameChangeType::terrain, TerrainPatch(tiles, hmap, x, y, w, h));
+}
+
+void Game::terrain_set(NetTerrainMod &tm) {
+	std::lock_guard<std::mutex> lk(m);
+
+	t.set(tm.tiles, tm.hmap, tm.x, tm.y, tm.w, tm.h);
+
+	TerrainPatch tp(tm.x, tm.y, tm.w, tm.h);
+	tp.tiles.swap(tm.tiles);
+	tp.hmap.swap(tm.hmap);
+
+	if (!spare_terrain.empty()) {
+		tm.tiles.swap(spare_terrain.back().tiles);
+		tm.hmap.swap(spare_terrain.back().hmap);
+		spare_terrain.pop_back();
+	}
+
+	record(GameChangeType::terrain, std::move(tp));
 }
 
 void Game::entities_set(std::set<Entity> &&ent) {
 	lock lk(m);
-	entities = ent;
+	entities.clear();
+
+	for (const Entity &e : ent)
+		start_anim(entities.emplace(e), ticks);
+
+	journal.clear();
+	modflags |= (unsigned)GameMod::all;
 }
 
 void Game::set_players(const std::vector<PlayerSetting> &lst) {
@@ -160,24 +210,29 @@ void Game::player_died(unsigned pos) {
 void Game::entity_add(const EntityView &ev) {
 	std::lock_guard<std::mutex> lk(m);
 
-	entities.emplace(ev);
-	modflags |= (unsigned)GameMod::entities;
+	Entity &ent = entities.emplace(Entity(ev));
+	start_anim(ent, ticks);
+
+	record(GameChangeType::entity_add, ent);
 }
 
 void Game::entity_spawn(const EntityView &ev) {
 	std::lock_guard<std::mutex> lk(m);
 
-	entities.emplace(ev);
-	entities_spawned.emplace(ev.ref);
-	modflags |= (unsigned)GameMod::entities;
+	Entity &ent = entities.emplace(Entity(ev));
+	start_anim(ent, ticks);
+
+	record(GameChangeType::entity_spawn, ent);
 }
 
 void Game::particle_spawn(const Particle &p) {
 	std::lock_guard<std::mutex> lk(m);
 
-	particles.emplace(p);
-	particles_spawned.emplace(p.ref);
-	modflags |= (unsigned)GameMod::particles;
+	Particle part(p);
+	part.start = ticks;
+
+	particles.emplace(part);
+	record(GameChangeType::particle_spawn, part);
 }
 
 void Game::entity_update(const EntityView &ev) {
@@ -185,19 +240,15 @@ void Game::entity_update(const EntityView &ev) {
 	std::lock_guard<std::mutex> lk(m);
 
 	bool statechange = false;
-	auto it = entities.find(v);
-	if (it != entities.end()) {
-		// TODO subimage is always zero. prob forgot to update it somewhere on the server side or forgot to send it to the clients.
-		// only update subimage if it's state has been changed
+	uint64_t start = ticks;
+	Entity *it = entities.try_get(v.ref);
+	if (it) {
+		// only restart the animation if it's state has been changed
 		// e.g. when a unit goes from alive to dying, we need to reset the animation sequence
-		if (it->state == ev.state) {
-			v.subimage = it->subimage;
-			v.xflip = it->xflip;
-		} else {
+		if (it->state == ev.state)
+			start = it->anim_start;
+		else
 			statechange = true;
-		}
-
-		entities.erase(it);
 	}
 
 	switch (ev.state) {
@@ -207,102 +258,300 @@ void Game::entity_update(const EntityView &ev) {
 		/* FALLTHROUGH */
 	case EntityState::dying:
 		if (statechange)
-			entities_killed.emplace_back(v);
+			record(GameChangeType::entity_died, v);
 		break;
 	}
 
-	auto p = entities.emplace(v);
-	// if the entity's state changed, its subimage is zero, which is usually wrong. force recomputing fixes that
-	const_cast<Entity&>(*p.first).imgtick(0);
+	// overwrite in place, so updates do not allocate
+	Entity &ent = it ? (*it = Entity(v)) : entities.put(Entity(v));
+	start_anim(ent, start);
 
-	modflags |= (unsigned)GameMod::entities;
+	record(GameChangeType::entity_update, ent);
 }
 
 bool Game::entity_kill(IdPoolRef ref) {
 	std::lock_guard<std::mutex> lk(m);
 
-	auto it = entities.find(ref);
-	if (it == entities.end())
+	if (!entities.erase(ref))
 		return false;
 
-	//entities_killed.emplace_back(*it);
-	entities.erase(it);
+	record(GameChangeType::entity_kill, ref);
+
+	return true;
+}
+
+void EntityTrack::add(const Sample &s) noexcept {
+	if (count == capacity) {
+		for (unsigned i = 1; i < capacity; ++i)
+			samples[i - 1] = samples[i];
+
+		--count;
+	}
+
+	samples[count++] = s;
+}
+
+bool EntityTrack::at(time_point t, float speed, std::chrono::steady_clock::duration max_ahead, float &x, float &y) const noexcept {
+	assert(count);
+
+	if (t <= samples[0].time) {
+		x = samples[0].x;
+		y = samples[0].y;
+		return true;
+	}
 
-	modflags |= (unsigned)GameMod::entities;
+	for (unsigned i = 1; i < count; ++i) {
+		const Sample &a = samples[i - 1], &b = samples[i];
+
+		if (t >= b.time)
+			continue;
+
+		float f = std::chrono::duration<float>(t - a.time).count() / std::chrono::duration<float>(b.time - a.time).count();
+
+		x = a.x + (b.x - a.x) * f;
+		y = a.y + (b.y - a.y) * f;
+		return true;
+	}
+
+	const Sample &last = samples[count - 1];
+
+	x = last.x;
+	y = last.y;
+
+	if (last.state != EntityState::moving && last.state != EntityState::attack_follow)
+		return false;
+
+	// update is late: keep going in the same direction
+	float dt = std::chrono::duration<float>(std::min(t - last.time, max_ahead)).count();
+
+	x += speed * dt * cos(last.angle);
+	y += speed * dt * sin(last.angle);
 
 	return true;
 }
 
 GameView::GameView()
-	: t(), entities(), entities_spawned(), entities_killed()
-	, particles(), particles_spawned()
-	, players(), players_died() {}
+	: src(nullptr), changes(), spare_terrain(), tracks()
+	, last_tick(), snapshot_period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / DEFAULT_TICKS_PER_SECOND)))
+	, rate_start(), rate_ticks(0), t(), entities(), entities_spawned(), entities_killed()
+	, particles()
+	, players(), players_died(), ticks(0), logic_gamespeed(1.0), hmax(0), terrain_dirty(), terrain_reset(true) {}
 
-bool GameView::try_read(Game &g, bool reset) {
+bool GameView::try_read(Game &g) {
+	ZoneScoped;
 	std::unique_lock lk(g.m, std::defer_lock);
 
 	if (!lk.try_lock())
 		return false;
 
-	if (g.modflags & (unsigned)GameMod::terrain)
-		t = g.t;
-
-	// TODO only copy what has changed
 	players_died.clear();
 
-	std::vector<bool> players_alive;
-	size_t size = players.size();
+	// the journal has been emptied by whoever has read it last
+	bool full = src != &g || g.reader != this || (g.modflags & (unsigned)GameMod::all);
 
-	for (PlayerView &pv : players)
-		players_alive.emplace_back(pv.alive);
+	if (full) {
+		copy(g);
+	} else {
+		// the journal keeps its capacity, so this does not allocate once the buffers have grown big enough
+		changes.swap(g.journal);
+	}
 
-	players = g.players;
+	if (full || (g.modflags & (unsigned)GameMod::players)) {
+		size_t size = std::min(players.size(), g.players.size());
 
-	for (unsigned i = 0; i < std::min(size, g.players.size()); ++i) {
-		if (players_alive[i] != g.players[i].alive)
-			players_died.emplace_back(i);
+		for (unsigned i = 0; i < size; ++i)
+			if (players[i].alive != g.players[i].alive)
+				players_died.emplace_back(i);
 
-		players[i].alive = g.players[i].alive;
-		players[i].military = g.players[i].military;
-		players[i].score = g.players[i].score;
-		players[i].res = g.players[i].res;
+		players = g.players;
 	}
-	// end todo
 
-	if (g.modflags & (unsigned)GameMod::entities) {
-		entities = g.entities;
-		entities_spawned = g.entities_spawned;
-		entities_killed = g.entities_killed;
+	// patches are only handed back to the game that they came from
+	for (TerrainPatch &tp : spare_terrain)
+		if (src == &g && g.spare_terrain.size() < Game::terrain_spares)
+			g.spare_terrain.emplace_back(std::move(tp));
+
+	spare_terrain.clear();
 
-		if (reset) {
-			g.entities_spawned.clear();
-			g.entities_killed.clear();
+	g.modflags = 0;
+	lk.unlock();
+
+	for (GameChange &c : changes)
+		apply(c);
+
+	changes.clear();
+
+	if (!tracks.empty())
+		interpolate(g.running ? logic_gamespeed : 0);
+
+	return true;
+}
+
+/** Take everything from \a g. Game::m must be locked. */
+void GameView::copy(Game &g) {
+	ZoneScoped;
+
+	src = &g;
+	g.reader = this;
+	t = g.t;
+	entities = g.entities;
+	particles = g.particles;
+	ticks = g.ticks;
+	tracks.clear();
+	last_tick = GameChange::time_point();
+
+	hmax = 0;
+	for (unsigned y = 0; y < t.h; ++y)
+		for (unsigned x = 0; x < t.w; ++x)
+			hmax = std::max<unsigned>(hmax, t.h_at(x, y));
+
+	terrain_dirty.clear();
+	terrain_reset = true;
+
+	changes.clear();
+	g.journal.clear();
+}
+
+void GameView::apply(GameChange &c) {
+	switch (c.type) {
+	case GameChangeType::entity_add:
+	case GameChangeType::entity_spawn: {
+		const Entity &ent = std::get<Entity>(c.data);
+
+		entities.emplace(ent);
+
+		if (c.type == GameChangeType::entity_spawn)
+			entities_spawned.emplace(ent.ref);
+		break;
+	}
+	case GameChangeType::entity_update: {
+		const Entity &ent = std::get<Entity>(c.data);
+		Entity *old = entities.try_get(ent.ref);
+
+		if (!old) {
+			entities.emplace(ent);
+			break;
 		}
+
+		track(*old, ent, c.time);
+		*old = ent;
+		break;
 	}
+	case GameChangeType::entity_kill: {
+		IdPoolRef ref = std::get<IdPoolRef>(c.data);
 
-	if (g.modflags & (unsigned)GameMod::particles) {
-		particles = g.particles;
-		particles_spawned = g.particles_spawned;
+		entities.erase(ref);
+		tracks.erase(ref);
+		break;
+	}
+	case GameChangeType::entity_died:
+		entities_killed.emplace_back(std::get<EntityView>(c.data));
+		break;
+	case GameChangeType::particle_spawn: {
+		const Particle &p = std::get<Particle>(c.data);
 
-		if (reset)
-			g.particles_spawned.clear();
+		particles.emplace(p);
+		break;
 	}
+	case GameChangeType::terrain: {
+		TerrainPatch &tp = std::get<TerrainPatch>(c.data);
 
-	if (reset)
-		g.modflags = 0;
+		t.set(tp.tiles, tp.hmap, tp.x, tp.y, tp.w, tp.h);
 
-	return true;
+		for (uint8_t h : tp.hmap)
+			hmax = std::max<unsigned>(hmax, h);
+
+		if (!terrain_reset)
+			terrain_dirty.push_back(TileArea{ tp.x, tp.y, tp.w, tp.h });
+
+		if (spare_terrain.size() < Game::terrain_spares)
+			spare_terrain.emplace_back(std::move(tp));
+		break;
+	}
+	case GameChangeType::tick: {
+		unsigned n = std::get<unsigned>(c.data);
+		ticks += n;
+
+		if (last_tick == GameChange::time_point() || c.time - last_tick > max_extrapolate) {
+			// just started or unpaused: the gap says nothing about the gamespeed
+			rate_start = c.time;
+			rate_ticks = 0;
+		} else {
+			// positions only change when ticks pass and those come with the next snapshot, so this is how long an update stays current
+			snapshot_period = std::clamp<std::chrono::steady_clock::duration>(c.time - last_tick, std::chrono::milliseconds(1000 / EntityTrack::max_rate), EntityTrack::delay);
+			rate_ticks += n;
+
+			if (c.time - rate_start >= gamespeed_window) {
+				double hz = rate_ticks / std::chrono::duration<double>(c.time - rate_start).count();
+
+				logic_gamespeed = std::clamp(hz / DEFAULT_TICKS_PER_SECOND, World::gamespeed_min, World::gamespeed_max);
+				rate_start = c.time;
+				rate_ticks = 0;
+			}
+		}
+
+		last_tick = c.time;
+
+		// entities are animated when they are drawn
+		for (auto it = particles.begin(); it != particles.end();) {
+			if (it->done(ticks))
+				it = particles.erase(it);
+			else
+				++it;
+		}
+		break;
+	}
+	}
+}
+
+/** Remember position of \a now at \a t for interpolation. */
+void GameView::track(const Entity &old, const Entity &now, GameChange::time_point t) {
+	auto it = tracks.find(now.ref);
+
+	if (it == tracks.end()) {
+		// most entities never move, so only track them once they do
+		if (old.x == now.x && old.y == now.y)
+			return;
+
+		// the old position was valid until the previous snapshot
+		it = tracks.try_emplace(now.ref).first;
+		it->second.add(EntityTrack::Sample{ t - snapshot_period, old.x, old.y, old.angle, old.state });
+	}
+
+	it->second.add(EntityTrack::Sample{ t, now.x, now.y, now.angle, now.state });
+}
+
+/** Move all tracked entities to where they should be drawn right now. \a gamespeed is zero while paused, so nothing runs away. */
+void GameView::interpolate(double gamespeed) {
+	ZoneScoped;
+
+	auto t = std::chrono::steady_clock::now() - interp_delay;
+	float speed = (float)(Entity::move_speed * DEFAULT_TICKS_PER_SECOND * gamespeed);
+
+	for (auto it = tracks.begin(); it != tracks.end();) {
+		Entity *ent = entities.try_get(it->first);
+		float x, y;
+
+		bool more = it->second.at(t, speed, max_extrapolate, x, y);
+
+		if (ent) {
+			ent->x = x;
+			ent->y = y;
+		}
+
+		if (more)
+			++it;
+		else
+			it = tracks.erase(it);
+	}
 }
 
 Entity *GameView::try_get(IdPoolRef ref) noexcept {
-	auto it = entities.find(ref);
-	return it == entities.end() ? nullptr : (Entity*)&*it;
+	return entities.try_get(ref);
 }
 
 Entity &GameView::get(IdPoolRef ref) {
-	auto it = entities.find(ref);
-	assert(it != entities.end());
-	return (Entity&)*it;
+	return entities.at(ref);
 }
 
 }
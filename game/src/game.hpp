@@ -3,6 +3,7 @@
 #include <cstdint>
 
 #include <atomic>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <optional>
@@ -10,6 +11,7 @@
 
 #include <mutex>
 #include <set>
+#include <variant>
 
 #include "world/terrain.hpp"
 
@@ -21,6 +23,8 @@
 
 #include "world/game/game_settings.hpp"
 #include "world/entity.hpp"
+#include "world/entity_store.hpp"
+#include "world/timer_wheel.hpp"
 
 namespace aoe {
 
@@ -108,28 +112,114 @@ public:
 
 class GameView;
 struct NetPlayerScore;
+class NetTerrainMod;
+
+/** Most recent positions of an entity as received from the server. */
+class EntityTrack final {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	struct Sample final {
+		time_point time;
+		float x, y, angle;
+		EntityState state;
+	};
+
+	/** Entities are drawn this far in the past, so there is usually a newer update to interpolate to. */
+	static constexpr std::chrono::milliseconds delay{100};
+	/** Highest rate at which the server sends state updates. See World::snapshot_rate */
+	static constexpr unsigned max_rate = 60;
+	/** Lowest rate at which the next update still arrives within \a delay, so entities do not freeze and jump. */
+	static constexpr unsigned min_rate = (unsigned)(1000 / delay.count());
+	/** Enough samples to cover \a delay at \a max_rate, plus the ones right before and after it. */
+	static constexpr unsigned capacity = (unsigned)((delay.count() * max_rate + 999) / 1000) + 2;
+
+	Sample samples[capacity]; // oldest first
+	unsigned count;
+
+	EntityTrack() : samples(), count(0) {}
+
+	void add(const Sample&) noexcept;
+
+	/**
+	 * Compute position at \a t by interpolating between the samples around it.
+	 * If \a t is past the last sample and the entity is moving, extrapolate
+	 * along its angle at \a speed tiles per second for at most \a max_ahead.
+	 * Returns false if the entity has stopped and the track is no longer needed.
+	 */
+	bool at(time_point t, float speed, std::chrono::steady_clock::duration max_ahead, float &x, float &y) const noexcept;
+};
+
+enum class GameChangeType {
+	entity_add,
+	entity_spawn,
+	entity_update,
+	entity_kill,
+	entity_died, // entity has started dying, so the ui can play a sound
+	particle_spawn,
+	terrain,
+	tick,
+};
+
+class TerrainPatch final {
+public:
+	std::vector<tile_t> tiles;
+	std::vector<uint8_t> hmap;
+	unsigned x, y, w, h;
+
+	TerrainPatch(const std::vector<tile_t> &tiles, const std::vector<uint8_t> &hmap, unsigned x, unsigned y, unsigned w, unsigned h)
+		: tiles(tiles), hmap(hmap), x(x), y(y), w(w), h(h) {}
+	TerrainPatch(unsigned x, unsigned y, unsigned w, unsigned h) : tiles(), hmap(), x(x), y(y), w(w), h(h) {}
+};
+
+/** Area of tiles that has changed. */
+struct TileArea final {
+	unsigned x, y, w, h;
+};
+
+/** Single state change of a Game that has not been applied to its GameView yet. */
+class GameChange final {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+
+	GameChangeType type;
+	time_point time; // when it has been received, so GameView can interpolate movement
+	std::variant<unsigned, IdPoolRef, Entity, EntityView, Particle, TerrainPatch> data;
+
+	template<class... Args> GameChange(GameChangeType type, Args&&... data) : type(type), time(std::chrono::steady_clock::now()), data(std::forward<Args>(data)...) {}
+};
 
 /**
  * Client side game state. Some vars are duplicated from World,
  * but may be slightly altered as the client has little control over their internal state.
+ *
+ * Everything that changes is also appended to a journal, which GameView swaps
+ * with its own and replays, so reading does not have to copy the whole world.
  */
 class Game final {
 	std::mutex m;
 	Terrain t;
 	std::vector<PlayerView> players;
 	// no IdPool as we have no control over IdPoolRefs: the server does
-	std::set<Entity> entities;
-	std::set<IdPoolRef> entities_spawned;
-	std::vector<EntityView> entities_killed;
+	EntityStore entities;
 	// no IdPool as we have no control over IdPoolRefs: the server does
 	std::set<Particle> particles;
-	std::set<IdPoolRef> particles_spawned;
-	unsigned modflags, ticks;
+	std::vector<GameChange> journal; // changes since the last GameView::try_read of reader
+	const GameView *reader; // the only view that gets the journal, any other view has to copy everything
+	std::vector<TerrainPatch> spare_terrain; // buffers of patches that GameView has applied
+	unsigned modflags;
+	uint64_t ticks;
+	TimerWheel sfx; // attack sounds
 	unsigned team_won;
 	friend GameView;
 public:
 	std::atomic<bool> running;
 
+	/** Drop the journal if nobody reads it and let the next GameView copy everything instead. */
+	static constexpr size_t journal_max = 64 * 1024;
+	/** Terrain patch buffers to keep around for reuse. */
+	static constexpr size_t terrain_spares = 4;
+
 	Game();
 
 	void tick(unsigned n);
@@ -137,6 +227,12 @@ public:
 	void resize(const ScenarioSettings &scn);
 	void terrain_create();
 	void terrain_set(const std::vector<uint16_t> &tiles, const std::vector<uint8_t> &hmap, unsigned x, unsigned y, unsigned w, unsigned h);
+	/**
+	 * Same as above, but the buffers of \a tm are moved into the journal. \a tm
+	 * gets the buffers of an applied patch back, so the next terrain packet can
+	 * be decoded into it without allocating.
+	 */
+	void terrain_set(NetTerrainMod &tm);
 
 	void set_players(const std::vector<PlayerSetting>&);
 	void set_player_score(unsigned idx, const NetPlayerScore&);
@@ -160,25 +256,56 @@ public:
 	PlayerView pv(unsigned);
 private:
 	void imgtick(unsigned n);
+	void start_anim(Entity&, uint64_t start);
+	template<class... Args> void record(GameChangeType type, Args&&... data);
 };
 
 class GameView final {
+	const Game *src; // game that the journal belongs to
+	std::vector<GameChange> changes; // swapped with the journal of src
+	std::vector<TerrainPatch> spare_terrain; // applied patches that go back to src
+	std::map<IdPoolRef, EntityTrack> tracks;
+	GameChange::time_point last_tick; // when the previous tick change has been received
+	std::chrono::steady_clock::duration snapshot_period; // time between state updates as seen by the client
+	GameChange::time_point rate_start; // ticks are counted from here to estimate logic_gamespeed
+	unsigned rate_ticks;
 public:
 	Terrain t;
-	std::set<Entity> entities;
+	EntityStore entities;
 	std::set<IdPoolRef> entities_spawned;
 	std::vector<EntityView> entities_killed;
 	std::set<Particle> particles;
-	std::set<IdPoolRef> particles_spawned;
 	std::vector<PlayerView> players;
 	std::vector<unsigned> players_died;
+	uint64_t ticks; // use this to compute the image to show for entities and particles
+	double logic_gamespeed; // as measured from the ticks that arrive, since the server does not send it
+	unsigned hmax; // tiles are never raised higher than this, so culling knows how far to look
+	/** Tiles that have changed since the terrain renderer has last looked. It clears these once it is up to date. */
+	std::vector<TileArea> terrain_dirty;
+	bool terrain_reset; // all tiles may have changed, so terrain_dirty is meaningless
+
+	static constexpr std::chrono::milliseconds interp_delay = EntityTrack::delay;
+	/** Stop extrapolating if updates are this late. */
+	static constexpr std::chrono::milliseconds max_extrapolate{250};
+	/** Time over which ticks are counted to estimate the gamespeed. */
+	static constexpr std::chrono::milliseconds gamespeed_window{500};
 
 	GameView();
 
-	bool try_read(Game&, bool reset=true);
+	/**
+	 * Apply everything that has changed in \a g since the last call. Returns false if \a g is busy.
+	 * Changes are taken from the journal of \a g, so only the last view that has read \a g gets them.
+	 * Any other view copies everything instead and takes over the journal.
+	 */
+	bool try_read(Game&);
 
 	Entity *try_get(IdPoolRef) noexcept;
 	Entity &get(IdPoolRef);
+private:
+	void copy(Game&);
+	void apply(GameChange&);
+	void track(const Entity &old, const Entity &now, GameChange::time_point t);
+	void interpolate(double gamespeed);
 };
 
 }
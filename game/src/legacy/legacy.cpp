@@ -9,6 +9,7 @@
 
 #include <except.hpp>
 #include <minmax.hpp>
+#include <rng.hpp>
 
 #include <tracy/Tracy.hpp>
 
@@ -29,17 +30,12 @@ static unsigned cmd_or_next(const std::vector<uint8_t> &data, uint32_t &cmdpos,
 	return v ? v : data.at(++cmdpos);
 }
 
-bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigned player, io::DrsId id) {
+bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigned player, io::DrsId id, bool remap) {
 	ZoneScoped;
 	const SlpFrame &frame = slp.frames.at(index);
 
 	assert(player < MAX_PLAYERS);
 
-	if (!player)
-		player = 9;
-	else
-		--player;
-
 	hotspot_x = frame.hotspot_x;
 	hotspot_y = frame.hotspot_y;
 
@@ -60,8 +56,13 @@ bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigne
 	const std::vector<uint8_t> &cmd = frame.cmd;
 	unsigned maxerr = 5;
 	bool bail_out = false, dynamic = false, rectangular = true;
+	Rng garbage; // same garbage every time, so decoding the same frame gives the same surface
 
 	mask.clear();
+	players.clear();
+
+	if (remap)
+		players.resize((size_t)frame.w * frame.h);
 
 	for (int y = 0, h = frame.h; y < h; ++y) {
 		const SlpFrameRowEdge &e = frame.frameEdges.at(y);
@@ -82,7 +83,7 @@ bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigne
 
 		// fill row with garbage so any funny bytes will be visible immediately
 		for (int x = e.left_space, w = x + line_size, p = surface->pitch; x < w; ++x)
-			pixels[y * p + x] = rand();
+			pixels[y * p + x] = (unsigned char)garbage.next();
 
 		for (int i = e.left_space, x = i, w = x + line_size, p = surface->pitch; i <= w; ++i, ++cmdpos) {
 			unsigned char bc = cmd.at(cmdpos);
@@ -97,8 +98,12 @@ bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigne
 			case 0x0a:
 				count = cmd_or_next(cmd, cmdpos, 4);
 
-				for (++cmdpos; count; --count)
-					pixels[y * p + x++] = cmd.at(cmdpos) + 0x10 * (player + 1);
+				for (++cmdpos; count; --count) {
+					if (remap)
+						players[y * frame.w + x] = (cmd.at(cmdpos) & (player_ramp - 1)) + 1;
+
+					pixels[y * p + x++] = player_color(player, cmd.at(cmdpos));
+				}
 
 				dynamic = true;
 				break;
@@ -114,8 +119,12 @@ bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigne
 			case 0x06:
 				count = cmd_or_next(cmd, cmdpos, 4);
 
-				for (; count; --count)
-					pixels[y * p + x++] = cmd.at(++cmdpos) + 0x10 * (player + 1);
+				for (; count; --count) {
+					if (remap)
+						players[y * frame.w + x] = (cmd.at(cmdpos + 1) & (player_ramp - 1)) + 1;
+
+					pixels[y * p + x++] = player_color(player, cmd.at(++cmdpos));
+				}
 
 				dynamic = true;
 				break;
@@ -191,6 +200,9 @@ bool Image::load(const SDL_Palette *pal, const Slp &slp, unsigned index, unsigne
 	if (rectangular)
 		mask.clear();
 
+	if (!dynamic)
+		players.clear();
+
 	if (SDL_SetColorKey(surface.get(), SDL_TRUE, 0))
 		fprintf(stderr, "Could not set transparency: %s\n", SDL_GetError());
 
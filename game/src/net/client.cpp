@@ -4,96 +4,35 @@
 
 namespace aoe {
 
-Client::Client() : s(), port(0), m_connected(false), starting(false), m(), peers(), me(invalid_ref), scn(), g(), modflags(-1), playerindex(0), team_me(0), victory(false), gameover(false) {}
+Client::Client() : s(), ls(), t(&s), port(0), m_connected(false), starting(false), m(), peers(), me(invalid_ref), scn(), g(), modflags(-1), playerindex(0), team_me(0), victory(false), gameover(false), rx(), stats(), deflate(false), sim(), token(0), spectator(false), terrain() {}
 
 Client::~Client() {
 	stop();
 }
 
 void Client::mainloop() {
-	send_protocol(1);
+	send_protocol(1, (uint16_t)NetProtocolFlags::compress);
+
+	if (token) {
+		NetPkg pkg;
+		pkg.set_resume(token);
+		send(pkg);
+	} else if (spectator) {
+		NetPkg pkg;
+		pkg.set_spectate();
+		send(pkg);
+	}
 
 	try {
 		starting = false;
+		// reuse pkg such that its buffers only grow and do not have to be reallocated for every packet
+		NetPkg pkg;
 
 		while (m_connected) {
-			NetPkg pkg = recv();
-
-			switch (pkg.type()) {
-				case NetPkgType::set_protocol:
-					printf("prot=%u\n", pkg.protocol_version());
-					break;
-				case NetPkgType::chat_text: {
-					auto p = pkg.chat_text();
-					add_chat_text(p.first, p.second);
-					break;
-				}
-				case NetPkgType::start_game: {
-					if (starting) {
-						start_game();
-					} else {
-						starting = true;
-						add_chat_text(invalid_ref, "game starting now");
-					}
-					break;
-				}
-				case NetPkgType::gameover: {
-					std::lock_guard<std::mutex> lk(m);
-					g.gameover(pkg.get_gameover());
-
-					auto maybe_pv = g.try_pv(playerindex);
-					if (maybe_pv.has_value()) {
-						unsigned me_team = maybe_pv.value().init.team;
-						victory = me_team == g.winning_team();
-					} else {
-						fprintf(stderr, "%s: unable to determine winning team: playerindex=%u\n", __func__, playerindex);
-						victory = false;
-					}
-					gameover = true;
-
-					EngineView ev;
-
-					if (victory)
-						ev.play_sfx(SfxId::gameover_victory);
-					else
-						ev.play_sfx(SfxId::gameover_defeat);
-
-					break;
-				}
-				case NetPkgType::set_scn_vars:
-					set_scn_vars(pkg.get_scn_vars());
-					break;
-				case NetPkgType::set_username:
-					set_username(pkg.username());
-					break;
-				case NetPkgType::playermod:
-					playermod(pkg.get_player_control());
-					break;
-				case NetPkgType::peermod:
-					peermod(pkg.get_peer_control());
-					break;
-				case NetPkgType::terrainmod:
-					terrainmod(pkg.get_terrain_mod());
-					break;
-				case NetPkgType::entity_mod:
-					entitymod(pkg.get_entity_mod());
-					break;
-				case NetPkgType::gameticks:
-					gameticks(pkg.get_gameticks());
-					break;
-				case NetPkgType::gamespeed_control:
-					gamespeed_control(pkg.get_gamespeed());
-					break;
-				case NetPkgType::particle_mod:
-					particlemod(pkg);
-					break;
-				case NetPkgType::resmod:
-					resource_ctl(pkg);
-					break;
-				default:
-					printf("%s: unknown type %u\n", __func__, (unsigned)pkg.type());
-					break;
-			}
+			recv_fill();
+
+			while (m_connected && try_recv(pkg))
+				dispatch(pkg);
 		}
 	} catch (std::runtime_error &e) {
 		if (m_connected)
@@ -109,11 +48,125 @@ void Client::mainloop() {
 	}
 }
 
+void Client::dispatch(NetPkg &pkg) {
+	switch (pkg.type()) {
+		case NetPkgType::set_protocol:
+			printf("prot=%u\n", pkg.protocol_version());
+			deflate = !!(pkg.protocol_flags() & (uint16_t)NetProtocolFlags::compress);
+			break;
+		case NetPkgType::chat_text: {
+			auto p = pkg.chat_text();
+			add_chat_text(p.first, p.second);
+			break;
+		}
+		case NetPkgType::start_game: {
+			if (starting) {
+				start_game();
+			} else {
+				starting = true;
+				add_chat_text(invalid_ref, "game starting now");
+			}
+			break;
+		}
+		case NetPkgType::gameover: {
+			std::lock_guard<std::mutex> lk(m);
+			g.gameover(pkg.get_gameover());
+
+			auto maybe_pv = g.try_pv(playerindex);
+			if (maybe_pv.has_value()) {
+				unsigned me_team = maybe_pv.value().init.team;
+				victory = me_team == g.winning_team();
+			} else {
+				fprintf(stderr, "%s: unable to determine winning team: playerindex=%u\n", __func__, playerindex);
+				victory = false;
+			}
+			gameover = true;
+
+			EngineView ev;
+
+			if (victory)
+				ev.play_sfx(SfxId::gameover_victory);
+			else
+				ev.play_sfx(SfxId::gameover_defeat);
+
+			break;
+		}
+		case NetPkgType::set_scn_vars:
+			set_scn_vars(pkg.get_scn_vars());
+			break;
+		case NetPkgType::set_username:
+			set_username(pkg.username());
+			break;
+		case NetPkgType::playermod:
+			playermod(pkg.get_player_control());
+			break;
+		case NetPkgType::peermod:
+			peermod(pkg.get_peer_control());
+			break;
+		case NetPkgType::terrainmod:
+			terrainmod(pkg);
+			break;
+		case NetPkgType::entity_mod:
+			entitymod(pkg);
+			break;
+		case NetPkgType::gameticks:
+			gameticks(pkg.get_gameticks());
+			break;
+		case NetPkgType::gamespeed_control:
+			gamespeed_control(pkg.get_gamespeed());
+			break;
+		case NetPkgType::particle_mod:
+			particlemod(pkg);
+			break;
+		case NetPkgType::resmod:
+			resource_ctl(pkg);
+			break;
+		case NetPkgType::turn:
+			lockstep_turn(pkg.get_turn());
+			break;
+		case NetPkgType::resume:
+			token = pkg.get_resume();
+			break;
+		case NetPkgType::spectate:
+			add_chat_text(invalid_ref, "spectating");
+			break;
+		default:
+			printf("%s: unknown type %u\n", __func__, (unsigned)pkg.type());
+			break;
+	}
+}
+
 void Client::gameticks(unsigned n) {
 	ZoneScoped;
 	g.tick(n);
 }
 
+void Client::start_lockstep() {
+	ZoneScoped;
+
+	// state changes end up here just like they would have been received from the server
+	sim.reset(new World());
+	sim->start_lockstep(scn, playerindex, [this](NetPkg &pkg) { dispatch(pkg); });
+}
+
+void Client::lockstep_turn(const NetTurn &t) {
+	ZoneScoped;
+
+	if (!sim) {
+		fprintf(stderr, "%s: not in lockstep mode\n", __func__);
+		return;
+	}
+
+	bool more = sim->step(t);
+	gameticks(t.ticks);
+
+	if (more && t.turn % checksum_interval == 0) {
+		NetPkg pkg;
+		pkg.set_checksum(t.turn, sim->checksum());
+		send(pkg);
+	}
+}
+
 void Client::gamespeed_control(const NetGamespeedControl &ctl) {
 	ZoneScoped;
 	NetGamespeedType type = ctl.type;
@@ -213,6 +266,16 @@ void Client::playermod(const NetPlayerControl &ctl) {
 			g.set_player_score(p.playerid, p);
 			break;
 		}
+		case NetPlayerControlType::set_ai: {
+			auto p = std::get<std::pair<uint16_t, uint16_t>>(ctl.data);
+
+			unsigned pos = p.first;
+
+			if (pos < scn.players.size())
+				scn.players[pos].ai = !!p.second;
+
+			break;
+		}
 		default:
 			fprintf(stderr, "%s: unknown type: %u\n", __func__, (unsigned)ctl.type);
 			break;
@@ -222,10 +285,14 @@ void Client::playermod(const NetPlayerControl &ctl) {
 }
 
 void Client::start_game() {
-	std::lock_guard<std::mutex> lk(m_eng);
-
 	g.set_players(scn.players);
 
+	// lockstep peers create the world themselves instead of receiving it from the server
+	if (scn.lockstep)
+		start_lockstep();
+
+	std::lock_guard<std::mutex> lk(m_eng);
+
 	puts("start game");
 	if (eng)
 		eng->trigger_async_flags(EngineAsyncTask::multiplayer_started);
@@ -237,9 +304,9 @@ void Client::entity_kill(IdPoolRef ref) {
 	send(pkg);
 }
 
-void Client::send_protocol(uint16_t version) {
+void Client::send_protocol(uint16_t version, uint16_t flags) {
 	NetPkg pkg;
-	pkg.set_protocol(version);
+	pkg.set_protocol(version, flags);
 	send(pkg);
 }
 
@@ -302,6 +369,38 @@ void Client::entity_infer(IdPoolRef r1, IdPoolRef r2) {
 	send(pkg);
 }
 
+void Client::entity_move(const std::vector<IdPoolRef> &refs, float x, float y) {
+	entity_group(refs, EntityTask(invalid_ref, x, y));
+}
+
+void Client::entity_infer(const std::vector<IdPoolRef> &refs, IdPoolRef target) {
+	entity_group(refs, EntityTask(EntityTaskType::infer, invalid_ref, target));
+}
+
+void Client::entity_group(const std::vector<IdPoolRef> &refs, const EntityTask &task) {
+	ZoneScoped;
+
+	// a single entity fits in a smaller packet
+	if (refs.size() == 1) {
+		if (task.type == EntityTaskType::move)
+			entity_move(refs[0], task.x, task.y);
+		else
+			entity_infer(refs[0], task.ref2);
+		return;
+	}
+
+	NetPkg pkg;
+	NetEntityGroup g(task);
+
+	for (size_t i = 0; i < refs.size(); i += NetEntityGroup::max_refs) {
+		size_t n = std::min(refs.size() - i, NetEntityGroup::max_refs);
+		g.refs.assign(refs.begin() + i, refs.begin() + i + n);
+
+		pkg.set_entity_group(g);
+		send(pkg);
+	}
+}
+
 void Client::send_scn_vars(const ScenarioSettings &scn) {
 	NetPkg pkg;
 	pkg.set_scn_vars(scn);
@@ -311,23 +410,50 @@ void Client::send_scn_vars(const ScenarioSettings &scn) {
 void Client::stop() {
 	lock lk(m);
 	m_connected = false;
-	s.close();
+	t->close();
 }
 
 void Client::start(const char *host, uint16_t port, bool run) {
 	lock lk(m);
 	s.open();
+	t = &s;
 	m_connected = false;
+	rx.reset();
+	sim.reset();
 
 	s.connect(host, port);
 	m_connected = true;
 
+	this->host = host;
+	this->port = port;
+
 	if (run) {
 		std::thread t(&Client::mainloop, std::ref(*this));
 		t.detach();
 	}
 }
 
+void Client::start(std::shared_ptr<LocalChannel> ch, bool run) {
+	lock lk(m);
+	ls.open(ch);
+	t = &ls;
+	m_connected = true;
+	rx.reset();
+	sim.reset();
+
+	if (run) {
+		std::thread t(&Client::mainloop, std::ref(*this));
+		t.detach();
+	}
+}
+
+uint64_t Client::resume_token(const std::string &host, uint16_t port) const {
+	if (t != &s || gameover || this->host != host || this->port != port)
+		return 0;
+
+	return token;
+}
+
 void Client::add_chat_text(IdPoolRef ref, const std::string &s) {
 	lock lk(m_eng);
 
@@ -365,6 +491,7 @@ void Client::set_scn_vars(const ScenarioSettings &scn) {
 	this->scn.cheating = scn.cheating;
 	this->scn.square = scn.square;
 	this->scn.wrap = scn.wrap;
+	this->scn.lockstep = scn.lockstep;
 
 	// scn.restricted is not copied for obvious reasons
 
@@ -372,6 +499,7 @@ void Client::set_scn_vars(const ScenarioSettings &scn) {
 	this->scn.height = scn.height;
 	this->scn.popcap = scn.popcap;
 	this->scn.age = scn.age;
+	this->scn.seed = scn.seed;
 	this->scn.villagers = scn.villagers;
 
 	this->scn.res = scn.res;
@@ -452,10 +580,11 @@ void Client::peermod(const NetPeerControl &ctl) {
 	}
 }
 
-void Client::terrainmod(const NetTerrainMod &tm) {
+void Client::terrainmod(NetPkg &pkg) {
 	lock lk(m);
+	pkg.get_terrain_mod(terrain);
 	modflags |= (unsigned)ClientModFlags::terrain;
-	g.terrain_set(tm.tiles, tm.hmap, tm.x, tm.y, tm.w, tm.h);
+	g.terrain_set(terrain);
 }
 
 }
@@ -6,24 +6,27 @@
 
 namespace aoe {
 
-void Client::entitymod(const NetEntityMod &em) {
+void Client::entitymod(NetPkg &pkg) {
+	EntityView ev;
+	NetEntityControlType type = pkg.get_entity_mod(ev);
+
 	std::lock_guard<std::mutex> lk(m);
 
-	switch (em.type) {
+	switch (type) {
 	case NetEntityControlType::add:
-		g.entity_add(std::get<EntityView>(em.data));
+		g.entity_add(ev);
 		break;
 	case NetEntityControlType::kill:
-		g.entity_kill(std::get<IdPoolRef>(em.data));
+		g.entity_kill(ev.ref);
 		break;
 	case NetEntityControlType::update:
-		g.entity_update(std::get<EntityView>(em.data));
+		g.entity_update(ev);
 		break;
 	case NetEntityControlType::spawn:
-		g.entity_spawn(std::get<EntityView>(em.data));
+		g.entity_spawn(ev);
 		break;
 	default:
-		fprintf(stderr, "%s: unknown type: %u\n", __func__, (unsigned)em.type);
+		fprintf(stderr, "%s: unknown type: %u\n", __func__, (unsigned)type);
 		break;
 	}
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 #include <idpool.hpp>
@@ -8,6 +9,8 @@ namespace aoe {
 
 enum class ClientInfoFlags {
 	ready = 1 << 0,
+	resuming = 1 << 1, // joined a running game and has to prove who it is first
+	spectator = 1 << 2, // only receives the delayed stream, see Server::spectate
 };
 
 class ClientInfo final {
@@ -15,9 +18,20 @@ public:
 	std::string username;
 	unsigned flags;
 	IdPoolRef ref;
+	uint64_t token; // secret to resume the game with if dropped. 0 if none
+	unsigned player; // player setting controlled in the running game. only valid if token is set
 
-	ClientInfo() : username(), flags(0), ref(invalid_ref) {}
-	ClientInfo(IdPoolRef ref, const std::string &username) : username(username), flags(0), ref(ref) {}
+	ClientInfo() : username(), flags(0), ref(invalid_ref), token(0), player(0) {}
+	ClientInfo(IdPoolRef ref, const std::string &username) : username(username), flags(0), ref(ref), token(0), player(0) {}
+};
+
+/** Seat of a peer that has dropped out of a running game and may come back. */
+class ClientSeat final {
+public:
+	std::string username;
+	unsigned player;
+
+	ClientSeat(const std::string &username, unsigned player) : username(username), player(player) {}
 };
 
 }
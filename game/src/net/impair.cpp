@@ -0,0 +1,221 @@
+#include "impair.hpp"
+#include "../server.hpp"
+
+#include <cstdio>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace aoe {
+
+ImpairModel::ImpairModel(const ImpairConfig &cfg)
+	: cfg(cfg), rng(cfg.seed), jitter(0.0, cfg.jitter_us ? (double)cfg.jitter_us : 1.0), stall(0.0, 1.0), link_free(0), last_due(0) {}
+
+uint64_t ImpairModel::schedule(uint64_t now, size_t size) {
+	// always draw the same amount of numbers to keep the sequence independent of the outcome
+	double j = jitter(rng), s = stall(rng);
+
+	uint64_t start = std::max(now, link_free);
+
+	if (s < cfg.stall_chance)
+		start += cfg.stall_us;
+
+	uint64_t tx = cfg.bandwidth ? size * 1000000ull / cfg.bandwidth : 0;
+	link_free = start + tx;
+
+	double delay = cfg.latency_us;
+	if (cfg.jitter_us)
+		delay = std::max(0.0, delay + j);
+
+	// packets cannot overtake each other in a stream
+	uint64_t due = std::max(link_free + (uint64_t)delay, last_due);
+	last_due = due;
+
+	return due;
+}
+
+LatencyHistogram::LatencyHistogram() : count(), total(0), sum(0), min(UINT64_MAX), max(0) {}
+
+void LatencyHistogram::add(uint64_t us) noexcept {
+	unsigned idx = 0;
+
+	for (uint64_t v = us; v > 1 && idx < buckets - 1; v >>= 1)
+		++idx;
+
+	++count[idx];
+	++total;
+	sum += us;
+	min = std::min(min, us);
+	max = std::max(max, us);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &h) noexcept {
+	for (unsigned i = 0; i < buckets; ++i)
+		count[i] += h.count[i];
+
+	total += h.total;
+	sum += h.sum;
+	min = std::min(min, h.min);
+	max = std::max(max, h.max);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const noexcept {
+	if (!total)
+		return 0;
+
+	uint64_t need = (uint64_t)(p * total), seen = 0;
+
+	for (unsigned i = 0; i < buckets; ++i) {
+		seen += count[i];
+
+		if (seen > need || seen == total)
+			return std::min<uint64_t>(max, (2ull << i) - 1);
+	}
+
+	return max;
+}
+
+ImpairProxy::Link::Link(std::shared_ptr<LocalChannel> src, LocalSide src_side, std::shared_ptr<LocalChannel> dst, LocalSide dst_side, const ImpairConfig &cfg)
+	: src(src), dst(dst), src_side(src_side), dst_side(dst_side), model(cfg), in(), out(), stats() {}
+
+/** Forward all data that is due at \a now. Returns false if either end has closed the connection. */
+bool ImpairProxy::Link::step(uint64_t now) {
+	if (dst->closed()) {
+		src->close();
+		return false;
+	}
+
+	bool closed = src->closed();
+	uint8_t buf[4096];
+	size_t n;
+
+	while ((n = src->read(src_side, buf, sizeof buf)) > 0)
+		in.insert(in.end(), buf, buf + n);
+
+	// split stream into packets. header is type and payload size in network byte order
+	size_t pos = 0;
+
+	while (in.size() - pos >= 4) {
+		// compressed or not, it is still the same kind of packet
+		uint16_t type = (in[pos] << 8 | in[pos + 1]) & ~NetPkgHdr::compressed;
+		size_t size = 4 + (in[pos + 2] << 8 | in[pos + 3]);
+
+		if (in.size() - pos < size)
+			break;
+
+		out.push_back(Pending{ now, model.schedule(now, size), type, std::vector<uint8_t>(in.begin() + pos, in.begin() + pos + size), 0 });
+		pos += size;
+	}
+
+	in.erase(in.begin(), in.begin() + pos);
+
+	while (!out.empty() && out.front().due <= now) {
+		Pending &p = out.front();
+
+		p.pos += dst->write(dst_side, p.data.data() + p.pos, p.data.size() - p.pos);
+		if (p.pos < p.data.size())
+			break; // receiver is lagging behind
+
+		stats[p.type].add(now - p.sent);
+		out.pop_front();
+	}
+
+	if (closed && out.empty()) {
+		dst->close();
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t ImpairProxy::Link::next_due() const noexcept {
+	return out.empty() ? UINT64_MAX : out.front().due;
+}
+
+ImpairProxy::ImpairProxy(std::shared_ptr<LocalChannel> client, std::shared_ptr<LocalChannel> server, const ImpairConfig &up, const ImpairConfig &down)
+	: up(client, LocalSide::server, server, LocalSide::client, up)
+	, down(server, LocalSide::client, client, LocalSide::server, down)
+	, running(false), t(), m_stats(), start_time(std::chrono::steady_clock::now())
+{
+	if (!client || !server)
+		throw std::runtime_error("impair: no channel");
+}
+
+ImpairProxy::~ImpairProxy() {
+	stop();
+}
+
+uint64_t ImpairProxy::now() const {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void ImpairProxy::start() {
+	if (running.exchange(true))
+		return;
+
+	t = std::thread(&ImpairProxy::mainloop, this);
+}
+
+void ImpairProxy::stop() {
+	running = false;
+
+	if (t.joinable())
+		t.join();
+}
+
+void ImpairProxy::mainloop() {
+	// NOTE we have to poll as we cannot wait for two channels at once. keep the interval small compared to typical latencies
+	static constexpr uint64_t poll_us = 250;
+
+	while (running) {
+		uint64_t time = now();
+		bool alive;
+
+		{
+			std::lock_guard<std::mutex> lk(m_stats);
+			// NOTE use & to always step both links
+			alive = up.step(time) & down.step(time);
+		}
+
+		if (!alive)
+			break;
+
+		uint64_t next = std::min(up.next_due(), down.next_due());
+		time = now();
+
+		if (next > time)
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min(next - time, poll_us)));
+	}
+
+	up.src->close();
+	down.src->close();
+	running = false;
+}
+
+std::map<uint16_t, LatencyHistogram> ImpairProxy::histograms(bool upstream) const {
+	std::lock_guard<std::mutex> lk(m_stats);
+	return upstream ? up.stats : down.stats;
+}
+
+std::string ImpairProxy::report() const {
+	std::string s("dir  type    count   min(us)   p50(us)   p99(us)   max(us)\n");
+	char buf[128];
+
+	for (int i = 0; i < 2; ++i) {
+		auto stats = histograms(i == 0);
+
+		for (auto kv : stats) {
+			const LatencyHistogram &h = kv.second;
+
+			snprintf(buf, sizeof buf, "%-4s %4u %8llu %9llu %9llu %9llu %9llu\n", i == 0 ? "up" : "down", (unsigned)kv.first,
+				(unsigned long long)h.total, (unsigned long long)h.min, (unsigned long long)h.percentile(0.5),
+				(unsigned long long)h.percentile(0.99), (unsigned long long)h.max);
+
+			s += buf;
+		}
+	}
+
+	return s;
+}
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+/*
+ * Network impairment simulator for tests and benchmarks. An ImpairProxy sits
+ * between two LocalChannels and delays every packet according to an
+ * ImpairModel, which makes it possible to see how the protocol behaves on bad
+ * links without leaving the process.
+ *
+ * Since the game runs over a reliable stream, packets are never dropped or
+ * reordered: a packet that would overtake an earlier one is held back, just
+ * like head-of-line blocking in TCP.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "local.hpp"
+
+namespace aoe {
+
+class ImpairConfig final {
+public:
+	uint32_t seed;
+	unsigned latency_us; // one way delay
+	unsigned jitter_us; // standard deviation of normal distributed extra delay
+	uint64_t bandwidth; // bytes per second. 0 is unlimited
+	double stall_chance; // chance for each packet that the link stalls
+	unsigned stall_us; // how long a stall lasts
+
+	ImpairConfig() : seed(0), latency_us(0), jitter_us(0), bandwidth(0), stall_chance(0), stall_us(0) {}
+};
+
+/** Deterministic link model: the same seed and packet sizes always result in the same schedule. */
+class ImpairModel final {
+	ImpairConfig cfg;
+	std::mt19937 rng;
+	std::normal_distribution<double> jitter;
+	std::uniform_real_distribution<double> stall;
+	uint64_t link_free; // time when link has sent everything queued so far
+	uint64_t last_due;
+public:
+	ImpairModel(const ImpairConfig &cfg);
+
+	/** Compute when a packet of \a size bytes that is sent at \a now arrives. All times are in microseconds. */
+	uint64_t schedule(uint64_t now, size_t size);
+};
+
+/** Log2 histogram for latencies in microseconds. */
+class LatencyHistogram final {
+public:
+	static constexpr unsigned buckets = 32;
+
+	uint64_t count[buckets];
+	uint64_t total, sum, min, max;
+
+	LatencyHistogram();
+
+	void add(uint64_t us) noexcept;
+	void merge(const LatencyHistogram &h) noexcept;
+	/** Approximate percentile \a p in the range [0,1]. Returns upper bound of matching bucket. */
+	uint64_t percentile(double p) const noexcept;
+};
+
+/**
+ * Forward traffic between a client channel and a server channel on a
+ * background thread. The client connects with LocalSocket to \a client and
+ * the server serves \a server as if it was a direct connection.
+ */
+class ImpairProxy final {
+	class Link final {
+	public:
+		struct Pending final {
+			uint64_t sent, due;
+			uint16_t type;
+			std::vector<uint8_t> data;
+			size_t pos;
+		};
+
+		std::shared_ptr<LocalChannel> src, dst;
+		LocalSide src_side, dst_side;
+		ImpairModel model;
+		std::vector<uint8_t> in;
+		std::deque<Pending> out;
+		std::map<uint16_t, LatencyHistogram> stats;
+
+		Link(std::shared_ptr<LocalChannel> src, LocalSide src_side, std::shared_ptr<LocalChannel> dst, LocalSide dst_side, const ImpairConfig &cfg);
+
+		bool step(uint64_t now);
+		uint64_t next_due() const noexcept;
+	};
+
+	Link up, down; // client to server and server to client
+	std::atomic<bool> running;
+	std::thread t;
+	mutable std::mutex m_stats;
+	std::chrono::steady_clock::time_point start_time;
+
+	void mainloop();
+	uint64_t now() const;
+public:
+	ImpairProxy(std::shared_ptr<LocalChannel> client, std::shared_ptr<LocalChannel> server, const ImpairConfig &up, const ImpairConfig &down);
+	ImpairProxy(std::shared_ptr<LocalChannel> client, std::shared_ptr<LocalChannel> server, const ImpairConfig &cfg) : ImpairProxy(client, server, cfg, cfg) {}
+	~ImpairProxy();
+
+	void start();
+	/** Stop forwarding, close both channels and wait till the proxy thread has finished. */
+	void stop();
+
+	/** Latency for each packet type from client to server (\a upstream) or server to client. Compressed packets are counted with their uncompressed type. */
+	std::map<uint16_t, LatencyHistogram> histograms(bool upstream) const;
+	/** Human readable summary of all latency histograms. */
+	std::string report() const;
+};
+
+}
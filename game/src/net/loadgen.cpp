@@ -0,0 +1,436 @@
+#include "loadgen.hpp"
+
+#include "../legacy/legacy.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace aoe {
+
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point since, std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now()) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - since).count();
+}
+
+/** Pick a random element from \a s, which must not be empty. */
+static IdPoolRef pick(Rng &rng, const std::set<IdPoolRef> &s) {
+	return *std::next(s.begin(), rng.below((unsigned)s.size()));
+}
+
+Bot::Bot(unsigned idx, const LoadGenConfig &cfg)
+	: s(), t(), m(), m_send(), idx(idx), player(1 + idx % std::max(1u, cfg.players)), players(std::max(1u, cfg.players))
+	, name("bot" + std::to_string(idx)), host(idx == 0 && cfg.start), compress(cfg.compress)
+	, me(invalid_ref), starts(0), width(0), height(0), units(), buildings(), enemies(), pending()
+	, t_connect(), t_ticks(), ticks(0), gamespeed(std::clamp(cfg.gamespeed, World::gamespeed_min, World::gamespeed_max)), rx(), cmd_budget(0), cam_budget(0)
+	, state(BotState::connecting), join_us(0), rtt(), lag(), commands(0), stats() {}
+
+Bot::~Bot() {
+	stop();
+}
+
+void Bot::start(const LoadGenConfig &cfg) {
+	s.open();
+	t_connect = std::chrono::steady_clock::now();
+	s.connect(cfg.host.c_str(), cfg.port);
+
+	NetPkg pkg;
+	pkg.set_protocol(1, compress ? (uint16_t)NetProtocolFlags::compress : 0);
+	send(pkg);
+
+	t = std::thread(&Bot::mainloop, this);
+}
+
+void Bot::stop() {
+	if (state != BotState::failed)
+		state = BotState::done;
+
+	if (t.joinable()) {
+		s.shutdown();
+		t.join();
+	}
+
+	s.close();
+}
+
+void Bot::send(NetPkg &pkg) {
+	std::vector<uint8_t> v;
+	pkg.write(v);
+
+	lock lk(m_send);
+	s.send_fully(v.data(), (int)v.size());
+}
+
+void Bot::send_start_game() {
+	NetPkg pkg;
+	pkg.set_start_game();
+	send(pkg);
+}
+
+void Bot::mainloop() {
+	NetPkg pkg;
+
+	try {
+		while (state != BotState::done && state != BotState::failed) {
+			rx.fill(s, stats);
+
+			while (rx.try_recv(pkg, stats))
+				dispatch(pkg);
+		}
+	} catch (std::runtime_error &e) {
+		if (state != BotState::done) {
+			fprintf(stderr, "%s: %s: %s\n", __func__, name.c_str(), e.what());
+			state = BotState::failed;
+		}
+	}
+}
+
+void Bot::dispatch(NetPkg &pkg) {
+	switch (pkg.type()) {
+	case NetPkgType::peermod: {
+		NetPeerControl ctl(pkg.get_peer_control());
+
+		if (ctl.type != NetPeerControlType::set_peer_ref)
+			break;
+
+		me = ctl.ref;
+
+		NetPkg out;
+		out.set_username(name);
+		send(out);
+
+		if (host) {
+			out.set_player_resize(players + 1);
+			send(out);
+		}
+		break;
+	}
+	case NetPkgType::playermod: {
+		NetPlayerControl ctl(pkg.get_player_control());
+
+		// claim our slot as soon as it exists
+		if (ctl.type == NetPlayerControlType::resize && player < std::get<uint16_t>(ctl.data)) {
+			NetPkg out;
+			out.claim_player_setting(player);
+			send(out);
+
+			if (host) {
+				for (unsigned i = 1; i <= players; ++i) {
+					out.set_player_name(i, "bots " + std::to_string(i));
+					send(out);
+				}
+			}
+		}
+		break;
+	}
+	case NetPkgType::set_username: {
+		std::string got(pkg.username());
+
+		// the server adds a suffix if the name is already taken
+		if (state != BotState::connecting || got.compare(0, name.size(), name))
+			break;
+
+		join_us = elapsed_us(t_connect);
+		state = BotState::joined;
+
+		NetPkg out;
+		out.set_ready(true);
+		send(out);
+		break;
+	}
+	case NetPkgType::set_scn_vars: {
+		ScenarioSettings scn(pkg.get_scn_vars());
+
+		lock lk(m);
+		width = scn.width;
+		height = scn.height;
+		break;
+	}
+	case NetPkgType::start_game:
+		if (++starts == 2 && state == BotState::joined) {
+			state = BotState::playing;
+
+			if (host)
+				send_gamespeed();
+		}
+		break;
+	case NetPkgType::entity_mod:
+		entitymod(pkg.get_entity_mod());
+		break;
+	case NetPkgType::gameticks:
+		gameticks(pkg.get_gameticks());
+		break;
+	case NetPkgType::gameover:
+		state = BotState::done;
+		break;
+	default:
+		break;
+	}
+}
+
+void Bot::entitymod(const NetEntityMod &em) {
+	lock lk(m);
+
+	switch (em.type) {
+	case NetEntityControlType::add:
+	case NetEntityControlType::spawn:
+	case NetEntityControlType::update: {
+		const EntityView &ev = std::get<EntityView>(em.data);
+
+		if (em.type == NetEntityControlType::update) {
+			auto it = pending.find(ev.ref);
+			if (it != pending.end()) {
+				rtt.add(elapsed_us(it->second));
+				pending.erase(it);
+			}
+		}
+
+		if (ev.state == EntityState::dying || ev.state == EntityState::decaying) {
+			units.erase(ev.ref);
+			buildings.erase(ev.ref);
+			enemies.erase(ev.ref);
+		} else if (ev.playerid == player) {
+			if (is_building(ev.type))
+				buildings.emplace(ev.ref);
+			else
+				units.emplace(ev.ref);
+		} else if (!is_resource(ev.type) && ev.playerid) {
+			enemies.emplace(ev.ref);
+		}
+		break;
+	}
+	case NetEntityControlType::kill: {
+		IdPoolRef ref = std::get<IdPoolRef>(em.data);
+
+		units.erase(ref);
+		buildings.erase(ref);
+		enemies.erase(ref);
+		pending.erase(ref);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/** Compare received game ticks to wall clock time to see how far the server is lagging behind. */
+void Bot::gameticks(unsigned n) {
+	auto now = std::chrono::steady_clock::now();
+
+	if (t_ticks == std::chrono::steady_clock::time_point()) {
+		t_ticks = now;
+		return;
+	}
+
+	ticks += n;
+
+	double hz = DEFAULT_TICKS_PER_SECOND * gamespeed;
+	double expected = elapsed_us(t_ticks, now) * 1e-6 * hz;
+	double behind = std::max(0.0, expected - ticks);
+
+	lag.add((uint64_t)(behind * 1e6 / hz));
+}
+
+/** Move the server from its default gamespeed to ours. The server only changes it one step at a time. */
+void Bot::send_gamespeed() {
+	int steps = (int)std::lround((gamespeed - 1.0) / World::gamespeed_step);
+	NetPkg pkg;
+
+	pkg.set_gamespeed(steps < 0 ? NetGamespeedType::decrease : NetGamespeedType::increase);
+
+	for (int i = 0; i < std::abs(steps); ++i)
+		send(pkg);
+}
+
+void Bot::step(Rng &rng, const LoadGenConfig &cfg, double dt) {
+	if (state != BotState::playing)
+		return;
+
+	cmd_budget += cfg.cmd_rate * dt;
+	cam_budget += cfg.cam_rate * dt;
+
+	NetPkg pkg;
+
+	for (; cam_budget >= 1; cam_budget -= 1) {
+		{
+			lock lk(m);
+			pkg.cam_set((float)rng.below(width), (float)rng.below(height), 20, 20);
+		}
+
+		send(pkg);
+	}
+
+	for (; cmd_budget >= 1; cmd_budget -= 1) {
+		{
+			lock lk(m);
+			unsigned what = rng.below(10);
+
+			if (what == 0 && !buildings.empty()) {
+				pkg.entity_train(pick(rng, buildings), EntityType::villager);
+			} else if (units.empty()) {
+				continue;
+			} else {
+				IdPoolRef ref(pick(rng, units));
+
+				if (what < 4 && !enemies.empty())
+					pkg.entity_task(ref, pick(rng, enemies));
+				else
+					pkg.entity_move(ref, (float)rng.below(width), (float)rng.below(height));
+
+				pending[ref] = std::chrono::steady_clock::now();
+			}
+		}
+
+		send(pkg);
+		++commands;
+	}
+}
+
+LoadGen::LoadGen(const LoadGenConfig &cfg) : cfg(cfg), bots(), rng(cfg.seed) {
+	if (!cfg.bots)
+		throw std::runtime_error("loadgen: no bots");
+
+	if (cfg.join_rate <= 0)
+		throw std::runtime_error("loadgen: join rate must be positive");
+}
+
+void LoadGen::join() {
+	auto interval = std::chrono::duration<double>(1.0 / cfg.join_rate);
+
+	for (unsigned i = 0; i < cfg.bots; ++i) {
+		bots.emplace_back(new Bot(i, cfg));
+
+		try {
+			bots.back()->start(cfg);
+		} catch (std::runtime_error &e) {
+			fprintf(stderr, "%s: bot%u: %s\n", __func__, i, e.what());
+			bots.back()->state = BotState::failed;
+		}
+
+		std::this_thread::sleep_for(interval);
+	}
+}
+
+/** Wait till all bots that are still alive have reached at least state \a s. */
+bool LoadGen::wait(BotState s, double timeout) {
+	auto end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+
+	do {
+		bool all = true;
+
+		for (auto &b : bots)
+			if (b->state < s)
+				all = false;
+
+		if (all)
+			return true;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	} while (std::chrono::steady_clock::now() < end);
+
+	return false;
+}
+
+void LoadGen::drive(double seconds) {
+	auto start = std::chrono::steady_clock::now(), last = start;
+
+	while (std::chrono::duration<double>(last - start).count() < seconds) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		auto now = std::chrono::steady_clock::now();
+		double dt = std::chrono::duration<double>(now - last).count();
+		last = now;
+
+		bool busy = false;
+
+		for (auto &b : bots) {
+			b->step(rng, cfg, dt);
+			busy |= b->state == BotState::playing;
+		}
+
+		if (!busy)
+			break;
+	}
+}
+
+unsigned LoadGen::run() {
+	join();
+
+	if (!wait(BotState::joined, 30))
+		fprintf(stderr, "%s: not all bots have joined\n", __func__);
+
+	if (cfg.start && !bots.empty() && bots[0]->state == BotState::joined) {
+		// the server refuses to start until everyone is ready, so keep asking
+		for (unsigned i = 0; i < 10 && !wait(BotState::playing, 2); ++i)
+			bots[0]->send_start_game();
+	}
+
+	if (!wait(BotState::playing, 60))
+		fprintf(stderr, "%s: not all bots are playing\n", __func__);
+
+	drive(cfg.duration);
+
+	unsigned failed = 0;
+
+	for (auto &b : bots) {
+		b->stop();
+
+		if (b->state == BotState::failed)
+			++failed;
+	}
+
+	return failed;
+}
+
+std::string LoadGen::report() const {
+	LatencyHistogram join, rtt, lag;
+	unsigned joined = 0, failed = 0;
+	uint64_t commands = 0, packets = 0, bytes = 0;
+
+	for (auto &b : bots) {
+		NetStatsSnapshot snap(b->stats.snapshot());
+
+		if (b->join_us) {
+			++joined;
+			join.add(b->join_us);
+		}
+
+		if (b->state == BotState::failed)
+			++failed;
+
+		rtt.merge(b->rtt);
+		lag.merge(b->lag);
+		commands += b->commands;
+		packets += snap.total_packets(NetDir::in);
+		bytes += snap.total_bytes(NetDir::in);
+	}
+
+	char buf[160];
+	snprintf(buf, sizeof buf, "bots: %u, joined: %u, failed: %u\ncommands sent: %llu, packets received: %llu, bytes received: %llu\n",
+		(unsigned)bots.size(), joined, failed, (unsigned long long)commands, (unsigned long long)packets, (unsigned long long)bytes);
+
+	std::string s(buf);
+	s += "metric         count   min(us)   p50(us)   p99(us)   max(us)\n";
+
+	const std::pair<const char*, const LatencyHistogram*> rows[] = {
+		{ "join", &join },
+		{ "command_rtt", &rtt },
+		{ "tick_lag", &lag },
+	};
+
+	for (auto &row : rows) {
+		const LatencyHistogram &h = *row.second;
+
+		snprintf(buf, sizeof buf, "%-11s %8llu %9llu %9llu %9llu %9llu\n", row.first,
+			(unsigned long long)h.total, (unsigned long long)(h.total ? h.min : 0), (unsigned long long)h.percentile(0.5),
+			(unsigned long long)h.percentile(0.99), (unsigned long long)h.max);
+
+		s += buf;
+	}
+
+	return s;
+}
+
+}
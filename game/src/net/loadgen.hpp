@@ -0,0 +1,124 @@
+#pragma once
+
+/*
+ * Headless load generator for server stress tests. A Bot speaks the same
+ * protocol as Client, but it has no Game or Engine attached, so hundreds of
+ * them fit in a single process. Bots join, pick a name, claim a player and get
+ * ready. Once the game runs, they keep sending random commands for their own
+ * units while measuring how long everything takes.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <rng.hpp>
+
+#include "../server.hpp"
+#include "impair.hpp"
+
+namespace aoe {
+
+class LoadGenConfig final {
+public:
+	std::string host;
+	uint16_t port;
+	unsigned bots;
+	unsigned players; // player slots to spread the bots over, excluding gaia
+	double join_rate; // new connections per second
+	double cmd_rate; // commands per second for each bot
+	double cam_rate; // camera updates per second for each bot
+	double gamespeed; // the host asks the server to run at this speed, so tick lag is measured against it
+	double duration; // seconds to keep sending commands once the game is running
+	bool start; // let the first bot start the game once everyone is ready. only works if it is the host
+	bool compress;
+	uint32_t seed;
+
+	LoadGenConfig()
+		: host("127.0.0.1"), port(32768), bots(100), players(8), join_rate(50), cmd_rate(2), cam_rate(1), gamespeed(1)
+		, duration(30), start(true), compress(true), seed(1) {}
+};
+
+enum class BotState {
+	connecting,
+	joined, // username acknowledged and ready
+	playing,
+	done, // game over or stopped
+	failed,
+};
+
+class Bot final {
+	TcpSocket s;
+	std::thread t;
+	std::mutex m, m_send;
+	unsigned idx, player, players;
+	std::string name;
+	bool host, compress;
+	IdPoolRef me;
+	unsigned starts; // the server sends start_game once when starting and once when everything has been sent
+	uint32_t width, height;
+	std::set<IdPoolRef> units, buildings, enemies;
+	std::map<IdPoolRef, std::chrono::steady_clock::time_point> pending; // commands waiting for an entity update
+	std::chrono::steady_clock::time_point t_connect, t_ticks;
+	uint64_t ticks;
+	double gamespeed;
+	PkgReceiver rx; // same receive path as Client
+	double cmd_budget, cam_budget;
+public:
+	std::atomic<BotState> state;
+	// all latencies are in microseconds
+	uint64_t join_us;
+	LatencyHistogram rtt, lag;
+	std::atomic<uint64_t> commands;
+	NetStats stats;
+
+	Bot(unsigned idx, const LoadGenConfig &cfg);
+	~Bot();
+
+	/** Connect and start receiving. Throws if the server cannot be reached. */
+	void start(const LoadGenConfig &cfg);
+	void stop();
+
+	/** Send any commands that are due after \a dt seconds have passed since the last call. */
+	void step(Rng &rng, const LoadGenConfig &cfg, double dt);
+
+	void send_start_game();
+
+	bool is_host() const noexcept { return host; }
+private:
+	void mainloop();
+	void dispatch(NetPkg &pkg);
+	void entitymod(const NetEntityMod &em);
+	void gameticks(unsigned n);
+	void send_gamespeed();
+	void send(NetPkg &pkg);
+};
+
+/** Spawn bots, drive them and summarize what they have measured. */
+class LoadGen final {
+	LoadGenConfig cfg;
+	std::vector<std::unique_ptr<Bot>> bots;
+	Rng rng;
+public:
+	LoadGen(const LoadGenConfig &cfg);
+
+	/** Run the whole test. Returns the number of bots that have failed. */
+	unsigned run();
+
+	std::string report() const;
+private:
+	void join();
+	bool wait(BotState s, double timeout);
+	void drive(double seconds);
+};
+
+}
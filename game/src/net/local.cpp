@@ -0,0 +1,161 @@
+#include "local.hpp"
+
+#include <cstring>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace aoe {
+
+static size_t next_pow2(size_t v) {
+	size_t n = 1;
+
+	while (n < v)
+		n <<= 1;
+
+	return n;
+}
+
+SpscRing::SpscRing(size_t capacity) : buf(next_pow2(std::max<size_t>(capacity, 1))), mask(0), head(0), tail(0) {
+	mask = buf.size() - 1;
+}
+
+size_t SpscRing::write(const void *ptr, size_t len) noexcept {
+	size_t t = tail.load(std::memory_order_relaxed);
+	size_t h = head.load(std::memory_order_acquire);
+	size_t n = std::min(len, buf.size() - (t - h));
+
+	if (!n)
+		return 0;
+
+	// data may wrap around the end of the buffer
+	size_t pos = t & mask, first = std::min(n, buf.size() - pos);
+
+	memcpy(buf.data() + pos, ptr, first);
+	memcpy(buf.data(), (const uint8_t*)ptr + first, n - first);
+
+	tail.store(t + n, std::memory_order_release);
+	return n;
+}
+
+size_t SpscRing::read(void *dst, size_t len) noexcept {
+	size_t h = head.load(std::memory_order_relaxed);
+	size_t t = tail.load(std::memory_order_acquire);
+	size_t n = std::min(len, t - h);
+
+	if (!n)
+		return 0;
+
+	size_t pos = h & mask, first = std::min(n, buf.size() - pos);
+
+	memcpy(dst, buf.data() + pos, first);
+	memcpy((uint8_t*)dst + first, buf.data(), n - first);
+
+	head.store(h + n, std::memory_order_release);
+	return n;
+}
+
+LocalChannel::LocalChannel(size_t capacity) : rings{ SpscRing(capacity), SpscRing(capacity) }, m_closed(false), waiting{ 0, 0 }, m(), cv() {}
+
+size_t LocalChannel::write(LocalSide side, const void *ptr, size_t len) noexcept {
+	size_t n = rings[side == LocalSide::client ? 0 : 1].write(ptr, len);
+
+	if (n)
+		notify(side == LocalSide::client ? LocalSide::server : LocalSide::client);
+
+	return n;
+}
+
+size_t LocalChannel::read(LocalSide side, void *dst, size_t len) noexcept {
+	size_t n = rings[side == LocalSide::client ? 1 : 0].read(dst, len);
+
+	// other side may be waiting for space to become available
+	if (n)
+		notify(side == LocalSide::client ? LocalSide::server : LocalSide::client);
+
+	return n;
+}
+
+void LocalChannel::notify(LocalSide side) {
+	unsigned idx = (unsigned)side;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	// only take the lock if the other side may be sleeping
+	if (!waiting[idx])
+		return;
+
+	std::lock_guard<std::mutex> lk(m);
+	cv[idx].notify_all();
+}
+
+void LocalChannel::close() {
+	m_closed = true;
+
+	std::lock_guard<std::mutex> lk(m);
+	cv[0].notify_all();
+	cv[1].notify_all();
+}
+
+void LocalSocket::open(std::shared_ptr<LocalChannel> ch) {
+	std::lock_guard<std::mutex> lk(m_send);
+
+	if (!ch)
+		throw std::runtime_error("local: open failed: no channel");
+
+	this->ch = ch;
+}
+
+unsigned LocalSocket::send_fully(const void *ptr, int len) {
+	std::lock_guard<std::mutex> lk(m_send);
+	std::shared_ptr<LocalChannel> ch(this->ch);
+
+	if (!ch)
+		throw SocketClosedError("local: send_fully failed: not connected");
+
+	const uint8_t *src = (const uint8_t*)ptr;
+	unsigned calls = 0;
+
+	for (int written = 0; written < len;) {
+		if (ch->closed())
+			throw SocketClosedError("local: send_fully failed: connection closed");
+
+		size_t out = ch->write(LocalSide::client, src + written, len - written);
+		written += (int)out;
+		++calls;
+
+		if (!out)
+			ch->wait(LocalSide::client, [&ch]{ return ch->closed() || ch->space(LocalSide::client); });
+	}
+
+	return calls;
+}
+
+int LocalSocket::recv(void *dst, int len, unsigned tries) {
+	std::shared_ptr<LocalChannel> ch(this->ch);
+
+	if (!ch)
+		throw SocketClosedError("local: recv failed: not connected");
+
+	(void)tries;
+
+	while (1) {
+		// check before reading to make sure we drain all data that has been written before the channel got closed
+		bool closed = ch->closed();
+		size_t in = ch->read(LocalSide::client, dst, len);
+
+		if (in || closed)
+			return (int)in;
+
+		ch->wait(LocalSide::client, [&ch]{ return ch->closed() || ch->available(LocalSide::client); });
+	}
+}
+
+void LocalSocket::close() {
+	std::shared_ptr<LocalChannel> ch(this->ch);
+
+	if (ch)
+		ch->close();
+}
+
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+/*
+ * In-process transport for a client and server running in the same process.
+ * Data is exchanged through lock-free single producer single consumer rings,
+ * so no sockets and no kernel round trips are involved.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "net.hpp"
+
+namespace aoe {
+
+/** Lock-free single producer single consumer byte queue. */
+class SpscRing final {
+	std::vector<uint8_t> buf;
+	size_t mask;
+	// head is only modified by the consumer, tail only by the producer. both only increase and wrap around naturally
+	std::atomic<size_t> head, tail;
+public:
+	/** Create ring that can hold at least \a capacity bytes. */
+	explicit SpscRing(size_t capacity);
+
+	/** Append at most \a len bytes. Returns number of bytes written. Only call from the producer. */
+	size_t write(const void *ptr, size_t len) noexcept;
+	/** Remove at most \a len bytes. Returns number of bytes read. Only call from the consumer. */
+	size_t read(void *dst, size_t len) noexcept;
+
+	size_t size() const noexcept { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+	size_t space() const noexcept { return buf.size() - size(); }
+	size_t capacity() const noexcept { return buf.size(); }
+};
+
+enum class LocalSide {
+	client,
+	server,
+};
+
+/**
+ * Full duplex in-memory connection. Each side writes to its own ring and
+ * reads from the other one. The mutex and condition variables are only used
+ * to put a side to sleep when it has nothing to do.
+ */
+class LocalChannel final {
+	SpscRing rings[2]; // [0] client to server, [1] server to client
+	std::atomic<bool> m_closed;
+	std::atomic<unsigned> waiting[2]; // number of threads sleeping for each side
+	std::mutex m;
+	std::condition_variable cv[2];
+public:
+	static constexpr size_t default_capacity = 256 * 1024;
+
+	explicit LocalChannel(size_t capacity=default_capacity);
+
+	size_t write(LocalSide, const void *ptr, size_t len) noexcept;
+	size_t read(LocalSide, void *dst, size_t len) noexcept;
+
+	/** Number of bytes ready to be read by \a side. */
+	size_t available(LocalSide side) const noexcept { return rings[side == LocalSide::client ? 1 : 0].size(); }
+	/** Number of bytes that can be written by \a side without blocking. */
+	size_t space(LocalSide side) const noexcept { return rings[side == LocalSide::client ? 0 : 1].space(); }
+
+	bool closed() const noexcept { return m_closed; }
+	void close();
+
+	/** Wake up \a side if it is waiting. */
+	void notify(LocalSide side);
+
+	/** Block \a side until \a pred returns true. \a pred must only check atomic state. */
+	template<typename Pred> void wait(LocalSide side, Pred pred) {
+		unsigned idx = (unsigned)side;
+		std::unique_lock<std::mutex> lk(m);
+
+		++waiting[idx];
+		// pairs with the fence in notify: either we see the new state or the other side sees us waiting
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cv[idx].wait(lk, pred);
+		--waiting[idx];
+	}
+};
+
+/** Client end of a LocalChannel. */
+class LocalSocket final : public Transport {
+	std::shared_ptr<LocalChannel> ch;
+	std::mutex m_send; // serialize producers, the ring only supports one
+public:
+	LocalSocket() : ch(), m_send() {}
+
+	void open(std::shared_ptr<LocalChannel> ch);
+
+	unsigned send_fully(const void *ptr, int len) override;
+	int recv(void *dst, int len, unsigned tries=1) override;
+	void close() override;
+};
+
+}
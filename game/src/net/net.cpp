@@ -1,4 +1,5 @@
 #include "net.hpp"
+#include "local.hpp"
 
 #include <cstdio>
 #include <cassert>
@@ -154,6 +155,10 @@ void TcpSocket::close() {
 		s = INVALID_SOCKET;
 }
 
+void TcpSocket::shutdown() {
+	::shutdown((int)s, SD_BOTH);
+}
+
 SOCKET TcpSocket::accept() {
 	return ::accept(s, NULL, NULL);
 }
@@ -371,6 +376,10 @@ void TcpSocket::close() {
 		s = INVALID_SOCKET;
 }
 
+void TcpSocket::shutdown() {
+	::shutdown(s.load(), SHUT_RDWR);
+}
+
 int TcpSocket::accept() {
 	return ::accept(s, NULL, NULL);
 }
@@ -505,19 +514,28 @@ int TcpSocket::try_send(const void *ptr, int len, unsigned tries) noexcept {
 	return written;
 }
 
-void TcpSocket::send_fully(const void *ptr, int len) {
-	int out;
+unsigned TcpSocket::send_fully(const void *ptr, int len) {
+	unsigned calls = 0;
+	int written = 0;
 
-	if ((out = send(ptr, len, 0)) == len)
-		return;
+	// one try at a time, so we know how many calls it has taken
+	while (written < len) {
+		int out = send((const char *)ptr + written, len - written, 1);
+		++calls;
 
-	if (!out)
-		throw SocketClosedError("tcp: send_fully failed: connection closed");
+		if (out <= 0)
+			break;
+
+		written += out;
+	}
+
+	if (written == len)
+		return calls;
 
-	if (out < 0)
-		out = 0;
+	if (!written)
+		throw SocketClosedError("tcp: send_fully failed: connection closed");
 
-	throw std::runtime_error(std::string("tcp: send_fully failed: ") + std::to_string(out) + (out == 1 ? " byte written out of " : " bytes written out of ") + std::to_string(len));
+	throw std::runtime_error(std::string("tcp: send_fully failed: ") + std::to_string(written) + (written == 1 ? " byte written out of " : " bytes written out of ") + std::to_string(len));
 }
 
 int TcpSocket::try_recv(void *dst, int len, unsigned tries) noexcept {
@@ -558,7 +576,120 @@ void TcpSocket::recv_fully(void *ptr, int len) {
 	throw std::runtime_error(std::string("tcp: recv_fully failed: ") + std::to_string(in) + (in == 1 ? " byte read out of " : " bytes read out of ") + std::to_string(len));
 }
 
-ServerSocket::ServerSocket() : s(), h(INVALID_HANDLE_VALUE), port(0), events(), peers(), peer_host(INVALID_SOCKET), peer_ev_lock(), data_lock(), m_pending(), data_in(), data_out(), recvbuf(), sendbuf(), running(false), step(false), poll_us(50u * 1000ull), closing(), send_pending(), id(std::this_thread::get_id()), m_ctl(), ctl(nullptr) {}
+bool SendQueue::empty() const noexcept {
+	for (const auto &l : lanes)
+		if (!l.empty())
+			return false;
+
+	return true;
+}
+
+bool SendQueue::push(SendLane lane, const BulkChunk &data, uint64_t key, bool coalesce) {
+	unsigned idx = (unsigned)lane;
+	std::deque<Item> &l = lanes[idx];
+
+	if (key == barrier) {
+		last_barrier = ++pushed;
+		barriers.emplace_back(pushed);
+		l.emplace_back(Item{ data, barrier, pushed });
+		lane_bytes[idx] += data->size();
+		bytes += data->size();
+		return false;
+	}
+
+	if (lane != SendLane::state || key == no_key) {
+		l.emplace_back(Item{ data, no_key, ++pushed });
+		lane_bytes[idx] += data->size();
+		bytes += data->size();
+		return false;
+	}
+
+	auto it = state_keys.find(key);
+
+	// NOTE replace in place: the old position is still in order with respect to anything else queued for this key
+	if (coalesce && it != state_keys.end()) {
+		Item &old = l[it->second - state_head];
+
+		// the update is newer than the barrier, so it must not move in front of it
+		if (old.seq > last_barrier) {
+			lane_bytes[idx] += data->size() - old.data->size();
+			bytes += data->size() - old.data->size();
+			old.data = data;
+			return true;
+		}
+	}
+
+	state_keys[key] = state_head + l.size();
+	l.emplace_back(Item{ data, key, ++pushed });
+	lane_bytes[idx] += data->size();
+	bytes += data->size();
+	return false;
+}
+
+size_t SendQueue::pop(SendLane lane, std::deque<uint8_t> &out, size_t budget) {
+	unsigned idx = (unsigned)lane;
+	std::deque<Item> &l = lanes[idx];
+	size_t n = 0;
+
+	while (n < budget && !l.empty()) {
+		// the oldest barrier goes before anything newer and after anything older, so the budget does not apply to these
+		if (!barriers.empty() && l.front().seq >= barriers.front()) {
+			n += pop_before(barriers.front() + 1, out);
+			barriers.pop_front();
+			continue;
+		}
+
+		n += take(idx, out);
+	}
+
+	return n;
+}
+
+/** Move everything that has been pushed before \a seq to \a out in the order it has been pushed. */
+size_t SendQueue::pop_before(uint64_t seq, std::deque<uint8_t> &out) {
+	size_t n = 0;
+
+	while (1) {
+		unsigned next = send_lanes;
+
+		for (unsigned i = 0; i < send_lanes; ++i)
+			if (!lanes[i].empty() && lanes[i].front().seq < seq && (next == send_lanes || lanes[i].front().seq < lanes[next].front().seq))
+				next = i;
+
+		if (next == send_lanes)
+			return n;
+
+		n += take(next, out);
+	}
+}
+
+/** Move the first packet of lane \a idx to \a out. */
+size_t SendQueue::take(unsigned idx, std::deque<uint8_t> &out) {
+	std::deque<Item> &l = lanes[idx];
+	Item &item = l.front();
+	const std::vector<uint8_t> &data = *item.data;
+	size_t n = data.size();
+
+	out.insert(out.end(), data.begin(), data.end());
+
+	if (idx == (unsigned)SendLane::state) {
+		if (item.key != no_key) {
+			auto it = state_keys.find(item.key);
+			if (it != state_keys.end() && it->second == state_head)
+				state_keys.erase(it);
+		}
+
+		++state_head;
+	}
+
+	l.pop_front();
+
+	lane_bytes[idx] -= n;
+	bytes -= n;
+	return n;
+}
+
+ServerSocket::ServerSocket() : s(), h(INVALID_HANDLE_VALUE), port(0), events(), peers(), peer_host(INVALID_SOCKET), peer_ev_lock(), data_lock(), m_pending(), data_in(), data_out(), recvbuf(), sendbuf(), running(false), step(false), poll_us(50u * 1000ull), flush_ms(-1), closing(), send_pending(), held(), muted(), watermark(256 * 1024), id(std::this_thread::get_id()), m_local(), local(), local_dirty(false), stats(), m_ctl(), ctl(nullptr) {}
 
 ServerSocket::~ServerSocket() { stop(); }
 
@@ -596,6 +727,11 @@ void ServerSocket::stop() {
 
 	running = false;
 
+	// wake up local mainloop and let host know we are done
+	std::shared_ptr<LocalChannel> ch(local_channel());
+	if (ch)
+		ch->close();
+
 	std::lock_guard<std::mutex> lk2(m_ctl);
 	if (ctl)
 		ctl->stopped();
@@ -685,6 +821,7 @@ void ServerSocket::incoming() {
 
 		auto ins = peers.emplace(std::piecewise_construct, std::forward_as_tuple(infd), std::forward_as_tuple(infd, hbuf, sbuf, is_host));
 		assert(ins.second);
+		ins.first->second.stats = std::make_shared<NetStats>();
 
 		// now just let the controller know a new client has joined
 		bool keep = false;
@@ -730,6 +867,8 @@ bool ServerSocket::recv_step(const Peer &p, SOCKET s) {
 
 	while (1) {
 		int count = ::recv(s, recvbuf.data(), recvbuf.size(), 0);
+		stats.add_recv_call();
+
 		if (count < 0) {
 #if _WIN32
 			int r = WSAGetLastError();
@@ -755,41 +894,47 @@ bool ServerSocket::recv_step(const Peer &p, SOCKET s) {
 			return false; // peer send shutdown request or has closed socket
 		}
 
-		step = true;
-		std::unique_lock<std::mutex> lk(data_lock);
+		if (!process_in(p, s, count))
+			return false;
+	}
+}
 
-		auto ins = data_in.try_emplace(s);
-		auto it = ins.first;
-		for (int i = 0; i < count; ++i)
-			it->second.emplace_back(recvbuf[i]);
+/** Append \a count bytes from recvbuf to the queue of \a s and process all complete packets. Returns false if \a p has to be dropped. */
+bool ServerSocket::process_in(const Peer &p, SOCKET s, int count) {
+	step = true;
+	std::unique_lock<std::mutex> lk(data_lock);
 
-		std::unique_lock<std::mutex> lkctl(m_ctl);
-		int processed = 0;
+	auto ins = data_in.try_emplace(s);
+	auto it = ins.first;
+	for (int i = 0; i < count; ++i)
+		it->second.emplace_back(recvbuf[i]);
 
-		while ((processed = ctl->proper_packet(*this, it->second)) > 0) {
-			bool keep_alive = false;
+	std::unique_lock<std::mutex> lkctl(m_ctl);
+	int processed = 0;
 
-			try {
-				auto outs = data_out.try_emplace(s);
-				auto out = outs.first;
+	while ((processed = ctl->proper_packet(*this, it->second)) > 0) {
+		bool keep_alive = false;
 
-				keep_alive = ctl->process_packet(*this, p, it->second, out->second, processed);
-			} catch (const std::exception &e) {
-				fprintf(stderr, "%s: failed to process for (%s,%s): %s\n", __func__, p.host.c_str(), p.server.c_str(), e.what());
-			}
+		try {
+			auto outs = data_out.try_emplace(s);
+			auto out = outs.first;
 
-			if (!keep_alive)
-				return false;
+			keep_alive = ctl->process_packet(*this, p, it->second, out->second, processed);
+		} catch (const std::exception &e) {
+			fprintf(stderr, "%s: failed to process for (%s,%s): %s\n", __func__, p.host.c_str(), p.server.c_str(), e.what());
 		}
 
-		lkctl.unlock();
+		if (!keep_alive)
+			return false;
+	}
 
-		// remove bytes if asked to do so
-		for (; processed < 0 && !it->second.empty(); ++processed)
-			it->second.pop_front();
+	lkctl.unlock();
 
-		lk.unlock();
-	}
+	// remove bytes if asked to do so
+	for (; processed < 0 && !it->second.empty(); ++processed)
+		it->second.pop_front();
+
+	return true;
 }
 
 bool ServerSocket::send_step(SOCKET s) {
@@ -812,7 +957,27 @@ bool ServerSocket::send_step(SOCKET s) {
 		// s may be closed after this unlock, but this way, we give a brief moment for other threads to kick in
 		lk.unlock();
 
+		if (s == local_sock) {
+			std::shared_ptr<LocalChannel> ch(local_channel());
+			if (!ch)
+				return false;
+
+			count = (int)ch->write(LocalSide::server, sendbuf.data(), out);
+			stats.add_send_call();
+
+			// channel full: retry when the host has read some data
+			if (!count)
+				return !ch->closed();
+
+			step = true;
+			lk.lock();
+			q.erase(q.begin(), q.begin() + count);
+			continue;
+		}
+
 		count = ::send(s, sendbuf.data(), out, 0);
+		stats.add_send_call();
+
 		if (count < 0) {
 #if _WIN32
 			int r = WSAGetLastError();
@@ -870,9 +1035,21 @@ void ServerSocket::reset(ServerSocketController &ctl, unsigned recvbuf, unsigned
 
 	closing.clear();
 	id = std::this_thread::get_id();
+	{
+		std::lock_guard<std::mutex> lkl(m_local);
+		local.reset();
+	}
+	local_dirty = false;
 
-	std::lock_guard<std::mutex> lks(m_pending);
-	send_pending.clear();
+	{
+		std::lock_guard<std::mutex> lks(m_pending);
+		send_pending.clear();
+		held.clear();
+		muted.clear();
+	}
+
+	lk2.unlock();
+	lk.unlock();
 
 	std::lock_guard<std::mutex> lkctl(m_ctl);
 	this->ctl = &ctl;
@@ -893,6 +1070,8 @@ void ServerSocket::reduce_peers() {
 		::close(sock);
 		data_out.erase(sock);
 		send_pending.erase(sock);
+		held.erase(sock);
+		muted.erase(sock);
 	}
 
 	slk.unlock();
@@ -934,30 +1113,41 @@ bool ServerSocket::event_step(int idx) {
 	return true;
 }
 
-void ServerSocket::queue_out(const Peer &p, const void *ptr, int len) {
-	SOCKET sock = p.sock;
+void ServerSocket::queue_out(const Peer &p, const BulkChunk &data, SendLane lane, uint64_t key, bool direct) {
+	//printf("%s: %zu bytes for %s:%s\n", __func__, data->size(), p.host.c_str(), p.server.c_str());
 
-	//printf("%s: %d bytes for %s:%s\n", __func__, len, p.host.c_str(), p.server.c_str());
+	if (!direct) {
+		auto it = held.find(p.sock);
 
-	auto it = send_pending.find(sock);
-	if (it == send_pending.end())
-		it = send_pending.try_emplace(sock).first;
+		if (it != held.end()) {
+			it->second.push(lane, data, key, true);
+			return;
+		}
+	}
 
-	std::deque<uint8_t> &out = it->second;
+	SendQueue &q = send_pending[p.sock];
 
-	const uint8_t *src = (const uint8_t*)ptr;
+	if (q.push(lane, data, key, q.bytes > watermark.load(std::memory_order_relaxed))) {
+		stats.add_coalesced();
 
-	for (int i = 0; i < len; ++i)
-		out.emplace_back(src[i]);
+		if (p.stats)
+			p.stats->add_coalesced();
+	}
 }
 
-void ServerSocket::send(const Peer &p, const void *ptr, int len) {
+void ServerSocket::send(const Peer &p, const void *ptr, int len, SendLane lane, uint64_t key) {
+	const uint8_t *src = (const uint8_t*)ptr;
+	BulkChunk data(std::make_shared<const std::vector<uint8_t>>(src, src + len));
+
 	std::lock_guard<std::mutex> lk(m_pending);
-	queue_out(p, ptr, len);
+	queue_out(p, data, lane, key);
+	wake_local();
 }
 
-void ServerSocket::broadcast(const void *ptr, int len, bool include_host) {
+void ServerSocket::broadcast(const void *ptr, int len, bool include_host, int type, SendLane lane, uint64_t key) {
 	const auto id = this->id.load(std::memory_order_relaxed);
+	const uint8_t *src = (const uint8_t*)ptr;
+	BulkChunk data(std::make_shared<const std::vector<uint8_t>>(src, src + len));
 
 	std::unique_lock<std::mutex> lk(m_pending, std::defer_lock);
 	std::unique_lock<std::mutex> plk(peer_ev_lock, std::defer_lock);
@@ -971,57 +1161,216 @@ void ServerSocket::broadcast(const void *ptr, int len, bool include_host) {
 	for (auto kv : peers) {
 		const auto p = kv.second;
 
-		if (!include_host && peer_host == p.sock)
+		if ((!include_host && peer_host == p.sock) || muted.count(p.sock))
 			continue;
 
-		queue_out(p, ptr, len);
+		if (type >= 0)
+			account(p, NetDir::out, (unsigned)type, len);
+
+		queue_out(p, data, lane, key);
 	}
+
+	wake_local();
 }
 
-void ServerSocket::flush_queue() {
+void ServerSocket::send_bulk(const Peer &p, const std::vector<BulkChunk> &chunks) {
 	std::lock_guard<std::mutex> lk(m_pending);
 
-	if (send_pending.empty())
-		return;
+	for (const BulkChunk &c : chunks)
+		queue_out(p, c, SendLane::bulk, SendQueue::no_key, true);
 
-	for (auto it = send_pending.begin(); it != send_pending.end();) {
-		auto kv = *it;
-		SOCKET sock = kv.first;
-		auto q = kv.second;
+	wake_local();
+}
+
+void ServerSocket::hold(const Peer &p) {
+	std::lock_guard<std::mutex> lk(m_pending);
+	held.try_emplace(p.sock);
+}
+
+bool ServerSocket::release(const Peer &p) {
+	std::lock_guard<std::mutex> lk(data_lock), lk2(m_pending);
+
+	auto it = held.find(p.sock);
+	if (it == held.end())
+		return true;
 
-		// remove if nothing to send anymore
-		if (q.empty()) {
-			it = send_pending.erase(it);
+	auto out = data_out.find(p.sock);
+	if (out != data_out.end() && !out->second.empty())
+		return false;
+
+	auto q = send_pending.find(p.sock);
+	if (q != send_pending.end() && !q->second.empty())
+		return false;
+
+	if (!it->second.empty())
+		send_pending[p.sock] = std::move(it->second);
+
+	held.erase(it);
+	wake_local();
+	return true;
+}
+
+void ServerSocket::mute(const Peer &p) {
+	std::lock_guard<std::mutex> lk(m_pending);
+	muted.emplace(p.sock);
+}
+
+size_t ServerSocket::pending(const Peer &p) {
+	std::lock_guard<std::mutex> lk(data_lock), lk2(m_pending);
+	size_t n = 0;
+
+	auto out = data_out.find(p.sock);
+	if (out != data_out.end())
+		n += out->second.size();
+
+	auto it = send_pending.find(p.sock);
+	if (it != send_pending.end())
+		n += it->second.bytes;
+
+	return n;
+}
+
+void ServerSocket::broadcast_bulk(const std::vector<BulkChunk> &chunks, bool include_host, int type) {
+	const auto id = this->id.load(std::memory_order_relaxed);
+
+	std::unique_lock<std::mutex> lk(m_pending, std::defer_lock);
+	std::unique_lock<std::mutex> plk(peer_ev_lock, std::defer_lock);
+
+	// only lock if not ran from mainloop thread
+	if (std::this_thread::get_id() != id)
+		std::lock(lk, plk);
+	else
+		lk.lock();
+
+	for (auto kv : peers) {
+		const auto p = kv.second;
+
+		if ((!include_host && peer_host == p.sock) || muted.count(p.sock))
 			continue;
+
+		for (const BulkChunk &c : chunks) {
+			if (type >= 0)
+				account(p, NetDir::out, (unsigned)type, c->size());
+
+			queue_out(p, c, SendLane::bulk, SendQueue::no_key);
 		}
+	}
 
-		// try to send any pending data
-		std::unique_lock<std::mutex> lk(data_lock);
+	wake_local();
+}
 
-		auto it2 = data_out.find(sock);
-		std::deque<uint8_t> *q2 = nullptr;
+/** Channel to the in-process host. Returns nullptr if serving over TCP. */
+std::shared_ptr<LocalChannel> ServerSocket::local_channel() {
+	std::lock_guard<std::mutex> lk(m_local);
+	return local;
+}
 
-		if (it2 == data_out.end()) {
-			// no data_out item: use queue from send_pending
-			q2 = &data_out.try_emplace(sock).first->second;
-		} else {
-			// data_out item present
-			q2 = &it2->second;
+/** Let local mainloop know there is pending data to be sent. */
+void ServerSocket::wake_local() {
+	std::shared_ptr<LocalChannel> ch(local_channel());
 
-			// this step is really important: if the out queue from send_step is not empty, there is no way we can guarantee that the api layer has sent a full message. so we have to wait for that queue to become depleted first.
-			if (!q2->empty()) {
-				++it;
-				continue;
-			}
-		}
+	if (!ch)
+		return;
+
+	local_dirty = true;
+	ch->notify(LocalSide::server);
+}
+
+/** Fill in bytes that still have to be sent to \a s, or to all peers if \a s is INVALID_SOCKET. Data already handed to the socket is counted as control. */
+void ServerSocket::queued(SOCKET s, NetStatsSnapshot &snap) {
+	std::lock_guard<std::mutex> lk(data_lock), lk2(m_pending);
+
+	snap.queued = 0;
+
+	for (unsigned i = 0; i < send_lanes; ++i)
+		snap.lane_queued[i] = 0;
 
-		// prepare to send
-		std::swap(*q2, q);
-		it = send_pending.erase(it);
+	for (auto &kv : data_out)
+		if (s == INVALID_SOCKET || kv.first == s)
+			snap.lane_queued[(unsigned)SendLane::control] += kv.second.size();
+
+	for (auto &kv : send_pending)
+		if (s == INVALID_SOCKET || kv.first == s)
+			for (unsigned i = 0; i < send_lanes; ++i)
+				snap.lane_queued[i] += kv.second.lane_bytes[i];
+
+	for (unsigned i = 0; i < send_lanes; ++i)
+		snap.queued += snap.lane_queued[i];
+}
 
+NetStatsSnapshot ServerSocket::snapshot() {
+	NetStatsSnapshot snap(stats.snapshot());
+	queued(INVALID_SOCKET, snap);
+	return snap;
+}
+
+NetStatsSnapshot ServerSocket::snapshot(const Peer &p) {
+	NetStatsSnapshot snap;
+
+	if (p.stats)
+		snap = p.stats->snapshot();
+	else
+		snap.time = std::chrono::steady_clock::now();
+
+	queued(p.sock, snap);
+	return snap;
+}
+
+void ServerSocket::flush_queue() {
+	std::vector<SOCKET> socks;
+
+	{
+		std::lock_guard<std::mutex> lk(m_pending);
+
+		if (send_pending.empty())
+			return;
+
+		for (auto &kv : send_pending)
+			socks.emplace_back(kv.first);
+	}
+
+	for (SOCKET sock : socks)
+		flush(sock);
+}
+
+/** Bytes each lane may move to the out queue per round, from high to low priority. */
+static constexpr size_t lane_budget[send_lanes] = { 8 * 1024, 8 * 1024, 16 * 1024, 16 * 1024 };
+
+/**
+ * Move pending data for \a s to its out queue and send as much as possible.
+ * Each round takes at most the lane budget from every lane, so state updates
+ * and bulk data still make progress while chat and commands go first.
+ */
+void ServerSocket::flush(SOCKET s) {
+	while (1) {
+		std::unique_lock<std::mutex> lk(data_lock), lk2(m_pending);
+
+		std::deque<uint8_t> &q = data_out.try_emplace(s).first->second;
+
+		// this step is really important: if the out queue from send_step is not empty, there is no way we can guarantee that the api layer has sent a full message. so we have to wait for that queue to become depleted first.
+		if (!q.empty())
+			return;
+
+		auto it = send_pending.find(s);
+		if (it == send_pending.end())
+			return;
+
+		SendQueue &sq = it->second;
+
+		for (unsigned i = 0; i < send_lanes; ++i)
+			sq.pop((SendLane)i, q, lane_budget[i]);
+
+		if (sq.empty())
+			send_pending.erase(it);
+
+		if (q.empty())
+			return;
+
+		lk2.unlock();
 		lk.unlock();
 
-		send_step(sock);
+		// stops once the socket is full as q will not be empty then
+		send_step(s);
 	}
 }
 
@@ -1042,7 +1391,7 @@ int ServerSocket::mainloop(uint16_t port, int backlog, ServerSocketController &c
 	s.set_nonblocking();
 	step = false;
 
-	for (int nfds; (nfds = epoll_wait(h, events.data(), events.size(), -1)) >= 0; step = false) {
+	for (int nfds; (nfds = epoll_wait(h, events.data(), events.size(), flush_ms.load(std::memory_order_relaxed))) >= 0; step = false) {
 		for (int i = 0; i < nfds; ++i)
 			if (!event_step(i)) {
 				stop();
@@ -1066,4 +1415,71 @@ int ServerSocket::mainloop(uint16_t port, int backlog, ServerSocketController &c
 	return 1;
 }
 
+int ServerSocket::mainloop(std::shared_ptr<LocalChannel> ch, ServerSocketController &ctl, unsigned recvbuf, unsigned sendbuf) {
+	ZoneScoped;
+
+	if (!ch)
+		throw std::runtime_error("ssock: no local channel");
+
+	reset(ctl, recvbuf, sendbuf);
+
+	auto ins = peers.emplace(std::piecewise_construct, std::forward_as_tuple(local_sock), std::forward_as_tuple(local_sock, "local", "0", true));
+	ins.first->second.stats = std::make_shared<NetStats>();
+	const Peer &p = ins.first->second;
+
+	peer_host = local_sock;
+	{
+		std::lock_guard<std::mutex> lkl(m_local);
+		local = ch;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(m_ctl);
+
+		if (!this->ctl || !this->ctl->incoming(*this, p)) {
+			stop();
+			return 1;
+		}
+	}
+
+	bool backlog = false;
+
+	while (running) {
+		ch->wait(LocalSide::server, [&]{
+			return !running || ch->closed() || local_dirty || ch->available(LocalSide::server) || (backlog && ch->space(LocalSide::server));
+		});
+
+		local_dirty = false;
+		step = false;
+
+		// host has left if channel is closed and everything has been read
+		bool closed = ch->closed();
+		int count;
+
+		while ((count = (int)ch->read(LocalSide::server, this->recvbuf.data(), this->recvbuf.size())) > 0) {
+			stats.add_recv_call();
+
+			if (!process_in(p, local_sock, count)) {
+				closed = true;
+				break;
+			}
+		}
+
+		if (closed || !running)
+			break;
+
+		if (!send_step(local_sock))
+			break;
+
+		flush_queue();
+
+		std::lock_guard<std::mutex> lk(data_lock);
+		auto it = data_out.find(local_sock);
+		backlog = it != data_out.end() && !it->second.empty();
+	}
+
+	stop();
+	return 0;
+}
+
 }
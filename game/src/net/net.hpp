@@ -8,6 +8,9 @@
 #include <deque>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <string>
@@ -33,6 +36,8 @@
 #include "../debug.hpp"
 #include <ctpl_stl.hpp>
 
+#include "stats.hpp"
+
 namespace aoe {
 
 // define these in our namespace to reduce the risk of name clashes
@@ -62,10 +67,23 @@ public:
 };
 
 class ServerSocket;
+class LocalChannel;
+
+/** Reliable and ordered byte stream between a client and a server. */
+class Transport {
+public:
+	virtual ~Transport() {}
+
+	/** Send all \a len bytes. Returns the number of low level writes that it took. */
+	virtual unsigned send_fully(const void *ptr, int len) = 0;
+	/** Receive at most \a len bytes. Blocks until some data is available. Returns 0 if the other end has closed the connection. */
+	virtual int recv(void *dst, int len, unsigned tries=1) = 0;
+	virtual void close() = 0;
+};
 
 void set_nonblocking(SOCKET s, bool nonbl=true);
 
-class TcpSocket final {
+class TcpSocket final : public Transport {
 	std::atomic<int> s;
 	friend ServerSocket;
 public:
@@ -76,7 +94,9 @@ public:
 	~TcpSocket();
 
 	void open(); // manually create socket, closes old one
-	void close();
+	void close() override;
+	/** Stop all pending and future transfers. Unlike close, this also wakes up a thread that is blocked in recv. */
+	void shutdown();
 
 	// server mode functions
 
@@ -105,14 +125,14 @@ public:
 		return out / sizeof *ptr;
 	}
 
-	void send_fully(const void *ptr, int len);
+	unsigned send_fully(const void *ptr, int len) override;
 
-	template<typename T> void send_fully(const T *ptr, int len) {
-		send_fully((void*)ptr, len * sizeof *ptr);
+	template<typename T> unsigned send_fully(const T *ptr, int len) {
+		return send_fully((void*)ptr, len * sizeof *ptr);
 	}
 
 	int try_recv(void *dst, int len, unsigned tries) noexcept;
-	int recv(void *dst, int len, unsigned tries=1);
+	int recv(void *dst, int len, unsigned tries=1) override;
 
 	template<typename T> int recv(T *ptr, int len, unsigned tries=5) {
 		int in = recv((void*)ptr, len * sizeof *ptr, tries);
@@ -147,8 +167,9 @@ public:
 	const SOCKET sock;
 	const std::string host, server;
 	const bool is_host;
+	std::shared_ptr<NetStats> stats; // shared by all copies. only set for peers created by ServerSocket
 
-	Peer(SOCKET sock, const char *host, const char *server, bool is_host) : sock(sock), host(host), server(server), is_host(is_host) {}
+	Peer(SOCKET sock, const char *host, const char *server, bool is_host) : sock(sock), host(host), server(server), is_host(is_host), stats() {}
 
 	friend bool operator<(const Peer &lhs, const Peer &rhs) {
 		return lhs.sock < rhs.sock;
@@ -186,6 +207,51 @@ public:
 	virtual bool process_packet(ServerSocket &s, const Peer &p, std::deque<uint8_t> &in, std::deque<uint8_t> &out, int processed) = 0;
 };
 
+/** Piece of data that has to be sent in one go. Shared, so broadcasts do not need a copy for every peer. */
+typedef std::shared_ptr<const std::vector<uint8_t>> BulkChunk;
+
+/**
+ * Outgoing data for a single peer that has not been handed to the socket yet.
+ * Each lane holds complete packets. State updates with a key can replace an
+ * older update with the same key that is still queued. Packets in different
+ * lanes may overtake each other, except for barriers: everything that has
+ * been queued before a barrier is sent before it and nothing that has been
+ * queued after it is sent before it, whatever its lane.
+ */
+class SendQueue final {
+public:
+	static constexpr uint64_t no_key = UINT64_MAX;
+	static constexpr uint64_t barrier = UINT64_MAX - 1;
+
+	struct Item final {
+		BulkChunk data;
+		uint64_t key;
+		uint64_t seq; // order in which all items have been pushed
+	};
+
+	std::deque<Item> lanes[send_lanes];
+	size_t lane_bytes[send_lanes];
+	size_t bytes;
+
+	SendQueue() : lanes(), lane_bytes(), bytes(0), state_keys(), state_head(0), pushed(0), last_barrier(0), barriers() {}
+
+	bool empty() const noexcept;
+
+	/** Append \a data to \a lane. Returns true if it has replaced an older state update instead. */
+	bool push(SendLane lane, const BulkChunk &data, uint64_t key=no_key, bool coalesce=false);
+	/** Move packets from \a lane to \a out until at least \a budget bytes have been moved. Returns number of bytes moved. */
+	size_t pop(SendLane lane, std::deque<uint8_t> &out, size_t budget);
+private:
+	std::unordered_map<uint64_t, uint64_t> state_keys; // key to sequence number of latest queued state update
+	uint64_t state_head; // sequence number of lanes[state].front()
+	uint64_t pushed; // seq of the last item
+	uint64_t last_barrier; // seq of the last barrier. state updates from before it cannot be replaced
+	std::deque<uint64_t> barriers; // seqs of all queued barriers, oldest first
+
+	size_t pop_before(uint64_t seq, std::deque<uint8_t> &out);
+	size_t take(unsigned lane, std::deque<uint8_t> &out);
+};
+
 // TODO check if properly multi thread-safe: should work for open, stop, close and parts of mainloop
 class ServerSocket final {
 	TcpSocket s;
@@ -200,14 +266,25 @@ class ServerSocket final {
 	std::atomic<bool> running;
 	bool step;
 	std::atomic<unsigned long long> poll_us;
+	std::atomic<int> flush_ms;
 	std::vector<SOCKET> closing;
-	std::map<SOCKET, std::deque<uint8_t>> send_pending;
+	std::map<SOCKET, SendQueue> send_pending;
+	std::map<SOCKET, SendQueue> held; // data for peers that are catching up, see hold
+	std::set<SOCKET> muted; // peers that are skipped by broadcasts, see mute
+	std::atomic<size_t> watermark;
 	std::atomic<std::thread::id> id;
+	std::mutex m_local;
+	std::shared_ptr<LocalChannel> local; // only set when serving an in-process host. use local_channel to read it from other threads
+	std::atomic<bool> local_dirty;
+	NetStats stats; // totals for all peers
 
 	std::mutex m_ctl;
 	ServerSocketController *ctl;
 	friend Debug;
 public:
+	/** Descriptor used for the in-process host. Does not refer to an actual socket. */
+	static constexpr SOCKET local_sock = (SOCKET)(INVALID_SOCKET - 1);
+
 	ServerSocket();
 	~ServerSocket();
 
@@ -239,6 +316,13 @@ public:
 	 */
 	int mainloop(uint16_t port, int backlog, ServerSocketController &ctl, unsigned recvbuf=512, unsigned sendbuf=1024);
 
+	/**
+	 * Same as mainloop above, but serve a single host through the in-process
+	 * channel \a ch instead. No TCP port is bound. Returns when the host has
+	 * closed the channel or the server has been stopped.
+	 */
+	int mainloop(std::shared_ptr<LocalChannel> ch, ServerSocketController &ctl, unsigned recvbuf=512, unsigned sendbuf=1024);
+
 	/**
 	 * Change poll timeout (0 to disable). Note that this is only used on systems
 	 * that don't support edge triggered events for epoll(7), like Windows.
@@ -246,8 +330,63 @@ public:
 	 */
 	void set_poll_timeout(unsigned long long microseconds) { poll_us = microseconds; }
 
-	void send(const Peer &p, const void *ptr, int len);
-	void broadcast(const void *ptr, int len, bool include_host=true);
+	/**
+	 * Wake up at least every \a ms milliseconds to send data that has been
+	 * queued by other threads, even if no peer is sending anything. Use -1 to
+	 * only wake up on network activity, which is the default.
+	 */
+	void set_flush_interval(int ms) { flush_ms = ms; }
+
+	/**
+	 * Queue one complete packet for \a p. Lanes are flushed in order of
+	 * priority, but every lane gets a byte budget per flush so nothing starves.
+	 * If \a key is set and too much data is queued for \a p already, a state
+	 * update with the same key that is still waiting is replaced by this one.
+	 */
+	void send(const Peer &p, const void *ptr, int len, SendLane lane=SendLane::control, uint64_t key=SendQueue::no_key);
+	/** Queue data for all peers. If \a type is not negative, the data is counted as one packet of that type for each peer. */
+	void broadcast(const void *ptr, int len, bool include_host=true, int type=-1, SendLane lane=SendLane::control, uint64_t key=SendQueue::no_key);
+
+	/**
+	 * Queue large data that has been split into \a chunks. Regular sends are
+	 * interleaved between chunks, so big transfers do not hold up small messages.
+	 */
+	void send_bulk(const Peer &p, const std::vector<BulkChunk> &chunks);
+	/** Same as broadcast, but for bulk data. \a type is used for each chunk. */
+	void broadcast_bulk(const std::vector<BulkChunk> &chunks, bool include_host=true, int type=-1);
+
+	/**
+	 * Keep everything for \a p aside except data queued with send_bulk. This
+	 * lets a peer that joins late receive a snapshot before all the changes
+	 * that have been made since. State updates that are kept aside are
+	 * coalesced, so the backlog only grows with the number of changed keys.
+	 */
+	void hold(const Peer &p);
+	/** Queue everything that has been kept aside for \a p once all earlier data has been handed to the socket. Returns false if it has to wait a bit longer. */
+	bool release(const Peer &p);
+	/** Number of bytes queued for \a p that have not been sent yet, excluding anything that is kept aside. */
+	size_t pending(const Peer &p);
+
+	/** Skip \a p in broadcast and broadcast_bulk. Data sent directly to \a p is still delivered. */
+	void mute(const Peer &p);
+
+	/** Number of queued bytes for a single peer after which state updates are coalesced. Defaults to 256KiB. */
+	void set_watermark(size_t bytes) { watermark = bytes; }
+
+	/** Count packet of \a size bytes for \a p and the totals. The controller has to call this as only it knows the packet layout. */
+	void account(const Peer &p, NetDir d, unsigned type, size_t size) noexcept {
+		stats.add(d, type, size);
+
+		if (p.stats)
+			p.stats->add(d, type, size);
+	}
+
+	NetStats &net_stats() noexcept { return stats; }
+
+	/** Counters for all peers. The queued gauge contains everything that has not been sent yet. */
+	NetStatsSnapshot snapshot();
+	/** Counters for just \a p. */
+	NetStatsSnapshot snapshot(const Peer &p);
 private:
 	void reset(ServerSocketController &ctl, unsigned recvbuf, unsigned sendbuf);
 
@@ -258,13 +397,19 @@ private:
 	bool io_step(int idx);
 
 	bool recv_step(const Peer &p, SOCKET s);
+	bool process_in(const Peer &p, SOCKET s, int count);
 	bool send_step(SOCKET s);
 
 	bool event_step(int idx);
 	void reduce_peers();
 	void flush_queue();
+	void flush(SOCKET s);
+
+	void queue_out(const Peer &p, const BulkChunk &data, SendLane lane, uint64_t key, bool direct=false);
+	std::shared_ptr<LocalChannel> local_channel();
+	void wake_local();
 
-	void queue_out(const Peer &p, const void *ptr, int len);
+	void queued(SOCKET s, NetStatsSnapshot &snap);
 };
 
 }
@@ -23,6 +23,12 @@ public:
 	netargs args;
 
 	static constexpr unsigned max_payload = tcp4_max_size - NetPkgHdr::size;
+	/** Smaller payloads are never compressed as it would not be worth the CPU time. */
+	static constexpr unsigned compress_min = 256;
+	/** Payloads larger than max_payload are split in fragments of this size. */
+	static constexpr unsigned fragment_size = 16 * 1024;
+	static constexpr unsigned fragment_hdr = 12; // id, type, total size and offset
+	static constexpr unsigned max_message = 16 * 1024 * 1024;
 
 	friend PkgWriter;
 
@@ -31,8 +37,13 @@ public:
 	/** munch as much data we need and check if valid. throws if invalid or not enough data. */
 	NetPkg(std::deque<uint8_t> &q);
 
-	void set_protocol(uint16_t version);
+	/** Check if \a q starts with a whole packet. */
+	static bool complete(const std::deque<uint8_t> &q);
+
+	void set_protocol(uint16_t version, uint16_t flags=0);
 	uint16_t protocol_version();
+	/** NetProtocolFlags requested by the client or accepted by the server. Zero if the other end does not know about them. */
+	uint16_t protocol_flags();
 
 	void set_chat_text(IdPoolRef, const std::string&);
 	std::pair<IdPoolRef, std::string> chat_text();
@@ -54,6 +65,7 @@ public:
 	void set_player_name(uint16_t, const std::string&);
 	void set_player_died(uint16_t); // server to client
 	void set_player_score(uint16_t, const PlayerAchievements&); // server to client
+	void set_player_ai(uint16_t, bool); // server to client
 	NetPlayerControl get_player_control();
 
 	void set_incoming(IdPoolRef);
@@ -71,6 +83,8 @@ public:
 
 	void set_terrain_mod(const NetTerrainMod&);
 	NetTerrainMod get_terrain_mod();
+	/** Same as get_terrain_mod, but reuse the buffers in \a tm. */
+	void get_terrain_mod(NetTerrainMod &tm);
 
 	// TODO repurpose to playerview?
 	void set_resources(const Resources&);
@@ -83,11 +97,17 @@ public:
 	void set_entity_spawn(const Entity&);
 	void set_entity_spawn(const EntityView&);
 	void set_entity_update(const Entity&);
+	void set_entity_update(const EntityView&);
 	void set_entity_kill(IdPoolRef);
 	void entity_move(IdPoolRef, float x, float y);
 	void entity_task(IdPoolRef, IdPoolRef, EntityTaskType type=EntityTaskType::infer);
 	void entity_train(IdPoolRef, EntityType);
 	NetEntityMod get_entity_mod();
+	/** Same as get_entity_mod, but without allocating anything. Fills in \a ev for add, spawn and update and just its ref for kill. Tasks are not decoded. */
+	NetEntityControlType get_entity_mod(EntityView &ev);
+
+	void set_entity_group(const NetEntityGroup&);
+	NetEntityGroup get_entity_group();
 
 	void particle_spawn(const Particle &p);
 	Particle get_particle();
@@ -98,6 +118,19 @@ public:
 	NetGamespeedControl get_gamespeed();
 	void set_gamespeed(NetGamespeedType type);
 
+	// lockstep mode
+	void set_turn(const NetTurn&); // server to client
+	NetTurn get_turn();
+	void set_checksum(uint32_t turn, uint32_t hash); // client to server
+	NetChecksum get_checksum();
+
+	/** Secret that lets a peer take its seat again after it has been dropped from a running game. Sent both ways. */
+	void set_resume(uint64_t token);
+	uint64_t get_resume();
+
+	/** Client asks to become a spectator. The server sends it back right before the stream starts. */
+	void set_spectate();
+
 	NetPkgType type();
 
 	void ntoh();
@@ -105,10 +138,26 @@ public:
 
 	void write(std::deque<uint8_t> &q);
 	void write(std::vector<uint8_t> &q);
+	/** Like write, but deflate the payload if \a compress is set, the payload is large enough and compression actually makes it smaller. */
+	void write(std::vector<uint8_t> &q, bool compress, NetStats *stats=nullptr);
+
+	/** Restore payload if it has been deflated by the other end. Call this before reading anything from the packet. */
+	void inflate(NetStats *stats=nullptr);
 
 	size_t size() const noexcept {
 		return NetPkgHdr::size + data.size();
 	}
+
+	/** Send queue priority for this packet. */
+	SendLane lane();
+	/** Key for state updates that supersede older ones with the same key, SendQueue::barrier for packets that must not overtake anything sent before them, or SendQueue::no_key. */
+	uint64_t state_key();
+
+	/** Check if payload is too big for a single packet. */
+	bool large() const noexcept { return data.size() > max_payload; }
+
+	/** Split large packet into fragment packets that are ready to be sent. \a id must be unique for all fragmented packets in transit. */
+	std::vector<BulkChunk> fragment(uint16_t id, bool compress, NetStats *stats=nullptr);
 private:
 	void entity_add(const EntityView&, NetEntityControlType);
 	void set_hdr(NetPkgType type);
@@ -1,6 +1,9 @@
 #include "../server.hpp"
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
 #include <stdexcept>
 #include <string>
 
@@ -8,6 +11,10 @@
 #include <arpa/inet.h>
 #endif
 
+// only declarations, the implementation is compiled in legacy/scenario.cpp
+#define MINIZ_HEADER_FILE_ONLY
+#include <miniz.c>
+
 namespace aoe {
 
 void NetPkgHdr::ntoh() {
@@ -50,6 +57,9 @@ void NetPkg::hton() {
 }
 
 void NetPkg::write(std::deque<uint8_t> &q) {
+	if (large())
+		throw std::runtime_error("pkg: payload too big, send as fragments");
+
 	hton();
 
 	static_assert(NetPkgHdr::size == 4);
@@ -70,6 +80,9 @@ void NetPkg::write(std::deque<uint8_t> &q) {
 }
 
 void NetPkg::write(std::vector<uint8_t> &q) {
+	if (large())
+		throw std::runtime_error("pkg: payload too big, send as fragments");
+
 	hton();
 
 	static_assert(NetPkgHdr::size == 4);
@@ -89,6 +102,109 @@ void NetPkg::write(std::vector<uint8_t> &q) {
 		q.emplace_back(this->data[i]);
 }
 
+static uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void NetPkg::write(std::vector<uint8_t> &q, bool compress, NetStats *stats) {
+	if (!compress || data.size() < compress_min) {
+		write(q);
+		return;
+	}
+
+	ZoneScoped;
+	auto start = std::chrono::steady_clock::now();
+
+	// compressed payload: uncompressed size followed by zlib stream
+	uint16_t type = (uint16_t)this->type();
+	size_t pos = q.size();
+	mz_ulong size = mz_compressBound((mz_ulong)data.size());
+
+	q.resize(pos + NetPkgHdr::size + 2 + size);
+	uint8_t *dst = q.data() + pos;
+
+	int status = mz_compress2(dst + NetPkgHdr::size + 2, &size, data.data(), (mz_ulong)data.size(), MZ_BEST_SPEED);
+
+	if (status != MZ_OK || 2 + size >= data.size()) {
+		// not worth it
+		q.resize(pos);
+
+		if (stats)
+			stats->add_deflate(data.size(), data.size(), elapsed_us(start));
+
+		write(q);
+		return;
+	}
+
+	size_t payload = 2 + size;
+	uint16_t ctype = type | NetPkgHdr::compressed;
+
+	dst[0] = ctype >> 8;
+	dst[1] = ctype & 0xff;
+	dst[2] = (uint8_t)(payload >> 8);
+	dst[3] = (uint8_t)(payload & 0xff);
+	dst[4] = (uint8_t)(data.size() >> 8);
+	dst[5] = (uint8_t)(data.size() & 0xff);
+
+	q.resize(pos + NetPkgHdr::size + payload);
+
+	if (stats)
+		stats->add_deflate(data.size(), payload, elapsed_us(start));
+}
+
+void NetPkg::inflate(NetStats *stats) {
+	ntoh();
+
+	if (!(hdr.type & NetPkgHdr::compressed))
+		return;
+
+	ZoneScoped;
+	auto start = std::chrono::steady_clock::now();
+
+	need_payload(2);
+	mz_ulong exp = (mz_ulong)data[0] << 8 | data[1], size = exp;
+
+	if (!size)
+		throw std::runtime_error("inflate: empty payload");
+
+	// reuse buffer to avoid allocating for every packet. the old payload becomes the next scratch buffer
+	thread_local std::vector<uint8_t> buf;
+	buf.resize(size);
+
+	int status = mz_uncompress(buf.data(), &size, data.data() + 2, (mz_ulong)(data.size() - 2));
+	if (status != MZ_OK || size != exp)
+		throw std::runtime_error(std::string("inflate: bad payload: ") + mz_error(status));
+
+	size_t in = data.size();
+	data.swap(buf);
+
+	hdr.type &= ~NetPkgHdr::compressed;
+	hdr.payload = (uint16_t)size;
+
+	if (stats)
+		stats->add_inflate(in, size, elapsed_us(start));
+}
+
+bool NetPkg::complete(const std::deque<uint8_t> &q) {
+	if (q.size() < NetPkgHdr::size)
+		return false;
+
+	union hdr {
+		uint16_t v[2];
+		uint8_t b[4];
+	} data;
+
+	static_assert(sizeof(data) == NetPkgHdr::size);
+
+	for (unsigned i = 0; i < NetPkgHdr::size; ++i)
+		data.b[i] = q[i];
+
+	NetPkgHdr h(data.v[0], data.v[1], false);
+	h.ntoh();
+
+	return q.size() - NetPkgHdr::size >= h.payload;
+}
+
 NetPkg::NetPkg(std::deque<uint8_t> &q) : hdr(0, 0, false), data() {
 	if (q.size() < NetPkgHdr::size)
 		throw std::runtime_error("bad pkg hdr");
@@ -127,15 +243,41 @@ NetPkg::NetPkg(std::deque<uint8_t> &q) : hdr(0, 0, false), data() {
 }
 
 void NetPkg::set_hdr(NetPkgType type) {
-	assert(data.size() <= max_payload);
+	assert(data.size() <= max_message);
 
 	hdr.native_ordering = true;
 	hdr.type = (unsigned)type;
 
-	if (data.size() > NetPkg::max_payload)
+	if (data.size() > NetPkg::max_message)
 		throw std::runtime_error("payload overflow");
 
-	hdr.payload = (uint16_t)data.size();
+	// large packets do not fit in the header and are sent as fragments
+	hdr.payload = large() ? 0 : (uint16_t)data.size();
+}
+
+std::vector<BulkChunk> NetPkg::fragment(uint16_t id, bool compress, NetStats *stats) {
+	ZoneScoped;
+
+	uint16_t type = (uint16_t)this->type();
+	uint32_t total = (uint32_t)data.size();
+	std::vector<BulkChunk> chunks;
+	NetPkg frag;
+
+	for (uint32_t offset = 0; offset < total; offset += fragment_size) {
+		uint32_t n = std::min<uint32_t>(fragment_size, total - offset);
+
+		{
+			PkgWriter out(frag, NetPkgType::fragment);
+			frag.write("2H2I", pkgargs{ id, type, total, offset }, false);
+			frag.data.insert(frag.data.end(), data.begin() + offset, data.begin() + offset + n);
+		}
+
+		auto v = std::make_shared<std::vector<uint8_t>>();
+		frag.write(*v, compress, stats);
+		chunks.emplace_back(v);
+	}
+
+	return chunks;
 }
 
 void NetPkg::set_start_game() {
@@ -143,12 +285,85 @@ void NetPkg::set_start_game() {
 	set_hdr(NetPkgType::start_game);
 }
 
+void NetPkg::set_spectate() {
+	data.clear();
+	set_hdr(NetPkgType::spectate);
+}
+
+const char *net_pkg_type_name(unsigned type) {
+	static const char *names[] = {
+		"set_protocol",
+		"chat_text",
+		"start_game",
+		"set_scn_vars",
+		"set_username",
+		"playermod",
+		"peermod",
+		"terrainmod",
+		"resmod",
+		"entity_mod",
+		"gameover",
+		"cam_set",
+		"gameticks",
+		"particle_mod",
+		"gamespeed_control",
+		"client_info",
+		"fragment",
+		"turn",
+		"checksum",
+		"resume",
+		"spectate",
+		"entity_group",
+	};
+
+	static_assert(sizeof(names) / sizeof(names[0]) == (unsigned)NetPkgType::entity_group + 1, "update names when changing NetPkgType");
+	static_assert((unsigned)NetPkgType::entity_group < NetStats::types - 1, "too many packet types to count separately");
+
+	return type < sizeof(names) / sizeof(names[0]) ? names[type] : "other";
+}
+
 NetPkgType NetPkg::type() {
 	ntoh();
 	return (NetPkgType)hdr.type;
 }
 
+SendLane NetPkg::lane() {
+	switch (type()) {
+	case NetPkgType::cam_set:
+	case NetPkgType::gamespeed_control:
+	case NetPkgType::checksum:
+		return SendLane::command;
+	// everything that refers to entities or players has to stay in order with the state it refers to
+	case NetPkgType::entity_mod:
+	case NetPkgType::particle_mod:
+	case NetPkgType::resmod:
+	case NetPkgType::gameticks:
+	case NetPkgType::turn:
+	case NetPkgType::entity_group:
+	case NetPkgType::playermod:
+	case NetPkgType::peermod:
+		return SendLane::state;
+	case NetPkgType::terrainmod:
+	case NetPkgType::fragment:
+		return SendLane::bulk;
+	default:
+		return SendLane::control;
+	}
+}
+
 void Client::send(NetPkg &pkg) {
+	unsigned type = (unsigned)pkg.type();
+
+	if (deflate && pkg.data.size() >= NetPkg::compress_min) {
+		std::vector<uint8_t> v;
+		pkg.write(v, true, &stats);
+
+		stats.add(NetDir::out, type, v.size());
+		stats.add_send_call(send(v.data(), (int)v.size()));
+		return;
+	}
+
+	stats.add(NetDir::out, type, NetPkgHdr::size + pkg.data.size());
 	pkg.hton();
 
 	// prepare header
@@ -156,32 +371,131 @@ void Client::send(NetPkg &pkg) {
 	v[0] = pkg.hdr.type;
 	v[1] = pkg.hdr.payload;
 
-	send(v, 2);
-	send(pkg.data.data(), (int)pkg.data.size());
+	unsigned calls = send(v, 2);
+	calls += send(pkg.data.data(), (int)pkg.data.size());
+	stats.add_send_call(calls);
 }
 
 NetPkg Client::recv() {
 	NetPkg pkg;
-	unsigned payload;
 
-	// retrieve header
-	uint16_t dw[2];
-	recv(dw, 2);
+	while (!try_recv(pkg))
+		recv_fill();
 
-	// parse header
-	pkg.hdr.type = dw[0];
-	pkg.hdr.payload = dw[1];
+	return pkg;
+}
+
+void PkgReceiver::reset() noexcept {
+	rpos = rend = 0;
+	fragments.clear();
+}
 
-	// reserve payload
-	payload = ntohs(pkg.hdr.payload);
-	pkg.data.resize(payload);
+bool PkgReceiver::try_recv(NetPkg &pkg, NetStats &stats) {
+	while (1) {
+		size_t avail = rend - rpos;
 
-	// retrieve payload
-	recv(pkg.data.data(), payload);
+		if (avail < NetPkgHdr::size)
+			return false;
 
-	pkg.ntoh();
+		// header is in network byte order
+		const uint8_t *ptr = rbuf.data() + rpos;
+		uint16_t type = (uint16_t)ptr[0] << 8 | ptr[1];
+		uint16_t payload = (uint16_t)ptr[2] << 8 | ptr[3];
 
-	return pkg;
+		if (avail < NetPkgHdr::size + payload)
+			return false;
+
+		rpos += NetPkgHdr::size + payload;
+		stats.add(NetDir::in, type & ~NetPkgHdr::compressed, NetPkgHdr::size + payload);
+
+		if (type == (uint16_t)NetPkgType::fragment) {
+			// copy straight from the receive buffer into the reassembly buffer
+			if (add_fragment(ptr + NetPkgHdr::size, payload, pkg))
+				return true;
+
+			continue;
+		}
+
+		// NOTE assign and clear keep the capacity, so no allocations are needed if pkg is reused
+		pkg.hdr = NetPkgHdr(type, payload);
+		pkg.data.assign(ptr + NetPkgHdr::size, ptr + NetPkgHdr::size + payload);
+		pkg.args.clear();
+
+		pkg.inflate(&stats);
+
+		if (pkg.hdr.type != (uint16_t)NetPkgType::fragment)
+			return true;
+
+		// compressed fragment
+		if (add_fragment(pkg.data.data(), pkg.data.size(), pkg))
+			return true;
+	}
+}
+
+/** Copy fragment into its reassembly buffer. Returns true if the packet is complete, in which case it has been moved to \a pkg. */
+bool PkgReceiver::add_fragment(const uint8_t *ptr, size_t size, NetPkg &pkg) {
+	if (size < NetPkg::fragment_hdr)
+		throw std::runtime_error("client: bad fragment");
+
+	uint16_t id = (uint16_t)ptr[0] << 8 | ptr[1];
+	uint16_t type = (uint16_t)ptr[2] << 8 | ptr[3];
+	uint32_t total = (uint32_t)ptr[4] << 24 | (uint32_t)ptr[5] << 16 | (uint32_t)ptr[6] << 8 | ptr[7];
+	uint32_t offset = (uint32_t)ptr[8] << 24 | (uint32_t)ptr[9] << 16 | (uint32_t)ptr[10] << 8 | ptr[11];
+	size_t n = size - NetPkg::fragment_hdr;
+
+	// NetPkg::fragment only cuts at multiples of fragment_size, so fragments can never overlap
+	if (total > NetPkg::max_message || offset >= total || offset % NetPkg::fragment_size || n != std::min<size_t>(NetPkg::fragment_size, total - offset))
+		throw std::runtime_error("client: bad fragment range");
+
+	auto ins = fragments.try_emplace(id);
+	FragmentBuffer &f = ins.first->second;
+
+	if (ins.second) {
+		f.type = type;
+		f.data.resize(total);
+		f.missing = (total + NetPkg::fragment_size - 1) / NetPkg::fragment_size;
+		f.chunks.assign(f.missing, false);
+	} else if (f.type != type || f.data.size() != total) {
+		throw std::runtime_error("client: fragment mismatch");
+	}
+
+	size_t idx = offset / NetPkg::fragment_size;
+
+	if (f.chunks[idx])
+		return false;
+
+	memcpy(f.data.data() + offset, ptr + NetPkg::fragment_hdr, n);
+	f.chunks[idx] = true;
+
+	if (--f.missing)
+		return false;
+
+	pkg.hdr = NetPkgHdr(f.type, total > NetPkg::max_payload ? 0 : (uint16_t)total);
+	pkg.data.swap(f.data);
+	pkg.args.clear();
+
+	fragments.erase(ins.first);
+	return true;
+}
+
+void PkgReceiver::fill(Transport &t, NetStats &stats) {
+	ZoneScoped;
+
+	if (rpos == rend) {
+		rpos = rend = 0;
+	} else if (rbuf.size() - rend < tcp4_max_size) {
+		// not enough room left for the largest packet: move pending data to front
+		memmove(rbuf.data(), rbuf.data() + rpos, rend - rpos);
+		rend -= rpos;
+		rpos = 0;
+	}
+
+	int in = t.recv(rbuf.data() + rend, (int)(rbuf.size() - rend), 1);
+	stats.add_recv_call();
+	if (!in)
+		throw SocketClosedError("client: recv failed: connection closed");
+
+	rend += in;
 }
 
 }
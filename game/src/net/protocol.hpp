@@ -22,6 +22,17 @@ enum class NetPkgType {
 	particle_mod,
 	gamespeed_control,
 	client_info,
+	fragment,
+	turn,
+	checksum,
+	resume,
+	spectate,
+	entity_group,
+};
+
+/** Optional features that both ends agree on during the set_protocol handshake. */
+enum class NetProtocolFlags {
+	compress = 1 << 0,
 };
 
 struct NetPkgHdr final {
@@ -29,6 +40,7 @@ struct NetPkgHdr final {
 	bool native_ordering;
 
 	static constexpr size_t size = 4;
+	static constexpr uint16_t compressed = 1 << 15; // set in type if payload has been deflated
 
 	NetPkgHdr(uint16_t type, uint16_t payload, bool native=true) : type(type), payload(payload), native_ordering(native) {}
 
@@ -56,6 +68,7 @@ enum class NetPlayerControlType {
 	set_civ,
 	set_team,
 	set_score,
+	set_ai,
 };
 
 enum class NetPeerControlType {
@@ -179,6 +192,25 @@ public:
 	NetEntityMod(const EntityTask &t) : type(NetEntityControlType::task), data(t) {}
 };
 
+/** Same task for many entities at once, e.g. a right click with a whole army selected. ref1 of the task is ignored. */
+class NetEntityGroup final {
+public:
+	EntityTask task;
+	std::vector<IdPoolRef> refs;
+
+	/*
+	2 task type
+	2 ref count
+	2*4 ref2
+	4 x
+	4 y
+	*/
+	static constexpr size_t hdrsize = 2 + 2 + refsize + 2*4;
+	static constexpr size_t max_refs = 1024; // split bigger groups over multiple packets
+
+	NetEntityGroup(const EntityTask &task) : task(task), refs() {}
+};
+
 class NetParticleMod final {
 public:
 	Particle data;
@@ -212,4 +244,56 @@ public:
 	NetGamespeedControl(NetGamespeedType t) : type(t) {}
 };
 
+/** Command in a lockstep turn. Every peer applies all commands of a turn in the same order before it runs the ticks of that turn. */
+class NetTurnCommand final {
+public:
+	uint16_t player; // player that issued the command, or any if the command is not restricted to a player
+	std::variant<IdPoolRef, EntityTask> data; // entity to kill or task to perform
+
+	static constexpr uint16_t any = UINT16_MAX;
+	/*
+	2 kind
+	2 player
+	2 task type
+	2*4 ref1
+	2*4 ref2
+	4 x
+	4 y
+	2 info type
+	2 info value
+	*/
+	static constexpr size_t size = 3 * 2 + 2 * refsize + 2 * 4 + 2 * 2;
+
+	NetTurnCommand(uint16_t player, IdPoolRef kill) : player(player), data(kill) {}
+	NetTurnCommand(uint16_t player, const EntityTask &task) : player(player), data(task) {}
+};
+
+class NetTurn final {
+public:
+	uint32_t turn;
+	uint16_t ticks;
+	std::vector<NetTurnCommand> cmds;
+
+	/*
+	4 turn
+	2 ticks
+	2 command count
+	*/
+	static constexpr size_t hdrsize = 4 + 2 + 2;
+	static constexpr size_t max_cmds = 1024; // any further commands are deferred to the next turn
+
+	NetTurn() : turn(0), ticks(0), cmds() {}
+	NetTurn(uint32_t turn, uint16_t ticks) : turn(turn), ticks(ticks), cmds() {}
+};
+
+/** Hash of the simulation state right after running all ticks of \a turn. */
+class NetChecksum final {
+public:
+	uint32_t turn, hash;
+
+	static constexpr size_t size = 2 * sizeof(uint32_t);
+
+	NetChecksum(uint32_t turn, uint32_t hash) : turn(turn), hash(hash) {}
+};
+
 }
@@ -29,7 +29,12 @@ void NetPkg::set_entity_spawn(const EntityView &e) {
 }
 
 void NetPkg::set_entity_update(const Entity &e) {
-	entity_add(EntityView(e), NetEntityControlType::update);
+	EntityView ev(e);
+	set_entity_update(ev);
+}
+
+void NetPkg::set_entity_update(const EntityView &e) {
+	entity_add(e, NetEntityControlType::update);
 }
 
 void NetPkg::entity_add(const EntityView &e, NetEntityControlType type) {
@@ -102,53 +107,146 @@ void NetPkg::entity_train(IdPoolRef src, EntityType type) {
 	}, false);
 }
 
-NetEntityMod NetPkg::get_entity_mod() {
+void NetPkg::set_entity_group(const NetEntityGroup &g) {
+	ZoneScoped;
+
+	if (g.refs.size() > NetEntityGroup::max_refs)
+		throw std::runtime_error("too many entities in group");
+
+	const EntityTask &t = g.task;
+	PkgWriter out(*this, NetPkgType::entity_group);
+
+	write("2H4I", pkgargs{
+		(uint16_t)t.type, g.refs.size(),
+		t.ref2.first, t.ref2.second, t.x, t.y,
+	}, false);
+
+	data.reserve(NetEntityGroup::hdrsize + g.refs.size() * refsize);
+
+	for (IdPoolRef ref : g.refs) {
+		refcheck(ref);
+		write("2I", pkgargs{ ref.first, ref.second });
+	}
+}
+
+NetEntityGroup NetPkg::get_entity_group() {
 	ZoneScoped;
-	unsigned pos = read(NetPkgType::entity_mod, "H");
-	NetEntityControlType type = (NetEntityControlType)u16(0);
+	unsigned pos = read(NetPkgType::entity_group, "2H4I");
+
+	EntityTaskType type = (EntityTaskType)u16(0);
+	unsigned n = u16(1);
+
+	if (n > NetEntityGroup::max_refs || data.size() != NetEntityGroup::hdrsize + n * refsize)
+		throw std::runtime_error("bad entity group packet");
+
+	IdPoolRef ref2(u32(2), u32(3));
+	uint32_t x = u32(4), y = u32(5);
+
+	NetEntityGroup g(EntityTask(invalid_ref, x, y));
 
 	switch (type) {
-	case NetEntityControlType::add:
-	case NetEntityControlType::spawn:
-	case NetEntityControlType::update: {
-		EntityView ev;
+		case EntityTaskType::move:
+			break;
+		case EntityTaskType::infer:
+			g.task = EntityTask(type, invalid_ref, ref2);
+			break;
+		default:
+			// NOTE attack is not handled by World::run_task yet. use infer instead
+			throw std::runtime_error("unsupported entity group task");
+	}
+
+	g.refs.reserve(n);
+
+	for (unsigned i = 0; i < n; ++i) {
 		args.clear();
+		pos += read("2I", args, pos);
+		g.refs.emplace_back(u32(0), u32(1));
+	}
+
+	return g;
+}
+
+uint64_t NetPkg::state_key() {
+	switch (type()) {
+	case NetPkgType::start_game:
+	case NetPkgType::gameover:
+		// peers take these as a sign that all state before them has arrived
+		return SendQueue::barrier;
+	default:
+		break;
+	}
+
+	if (type() != NetPkgType::entity_mod || data.size() < 2 * sizeof(uint16_t) + refsize)
+		return SendQueue::no_key;
+
+	read(NetPkgType::entity_mod, "2H2I");
+
+	// only updates contain the full state and can replace each other
+	if ((NetEntityControlType)u16(0) != NetEntityControlType::update)
+		return SendQueue::no_key;
+
+	return (uint64_t)u32(2) << 32 | u32(3);
+}
+
+NetEntityControlType NetPkg::get_entity_mod(EntityView &ev) {
+	ZoneScoped;
+	chktype(NetPkgType::entity_mod);
+	PkgReader in(*this);
 
-		pos += read("H4IHHHBbbBHH", args, pos);
+	NetEntityControlType type = (NetEntityControlType)in.u16();
 
-		ev.type = (EntityType)u16(0);
-		ev.ref.first = u32(1); ev.ref.second = u32(2);
-		ev.x = u32(3); ev.y = u32(4);
+	switch (type) {
+	case NetEntityControlType::add:
+	case NetEntityControlType::spawn:
+	case NetEntityControlType::update: {
+		ev.type = (EntityType)in.u16();
+		ev.ref = in.ref();
+		ev.x = in.u32(); ev.y = in.u32();
 
-		ev.angle = u16(5) * (2 * M_PI) / UINT16_MAX;
-		ev.playerid = u16(6);
-		ev.subimage = u16(7);
+		ev.angle = in.u16() * (2 * M_PI) / UINT16_MAX;
+		ev.playerid = in.u16();
+		ev.subimage = in.u16();
 
-		ev.state = (EntityState)u8(8);
-		int8_t dx = i8(9), dy = i8(10);
+		ev.state = (EntityState)in.u8();
+		int8_t dx = in.i8(), dy = in.i8();
 
 		if (dx || dy) {
 			ev.x += dx / (float)INT8_MAX;
 			ev.y += dy / (float)INT8_MAX;
 		}
 
-		ev.stats.attack = u8(11);
-		ev.stats.hp     = u16(12);
-		ev.stats.maxhp  = u16(13);
-
-		return NetEntityMod(ev, type);
+		ev.stats.attack = in.u8();
+		ev.stats.hp     = in.u16();
+		ev.stats.maxhp  = in.u16();
+		break;
+	}
+	case NetEntityControlType::kill:
+		ev.ref = in.ref();
+		break;
+	case NetEntityControlType::task:
+		// only sent to the server, which uses get_entity_mod()
+		break;
+	default:
+		throw std::runtime_error("unknown entity control packet");
 	}
-	case NetEntityControlType::kill: {
-		IdPoolRef ref;
-		args.clear();
 
-		pos += read("2I", args, pos);
-		ref.first  = u32(0);
-		ref.second = u32(1);
+	return type;
+}
 
-		return NetEntityMod(ref);
-	}
+NetEntityMod NetPkg::get_entity_mod() {
+	ZoneScoped;
+	EntityView ev;
+	NetEntityControlType type = get_entity_mod(ev);
+
+	switch (type) {
+	case NetEntityControlType::add:
+	case NetEntityControlType::spawn:
+	case NetEntityControlType::update:
+		return NetEntityMod(ev, type);
+	case NetEntityControlType::kill:
+		return NetEntityMod(ev.ref);
 	case NetEntityControlType::task: {
+		unsigned pos = 2;
 		args.clear();
 		pos += read("H", args, pos);
 		EntityTaskType type = (EntityTaskType)u16(0);
@@ -159,7 +257,7 @@ NetEntityMod NetPkg::get_entity_mod() {
 
 				return NetEntityMod(EntityTask(IdPoolRef(u32(1), u32(2)), u32(3), u32(4)));
 			}
-			case EntityTaskType::attack:
+			// NOTE attack is not handled by World::run_task yet. use infer instead
 			case EntityTaskType::infer: {
 				pos += read("4I", args, pos);
 
@@ -182,9 +280,9 @@ NetEntityMod NetPkg::get_entity_mod() {
 
 		throw std::runtime_error("unknown entity task type");
 	}
-	default:
-		throw std::runtime_error("unknown entity control packet");
 	}
+
+	throw std::runtime_error("unknown entity control packet");
 }
 
 
@@ -0,0 +1,96 @@
+#include "../../server.hpp"
+
+#include <cassert>
+#include <except.hpp>
+
+namespace aoe {
+
+enum class NetTurnCommandType {
+	kill,
+	task,
+};
+
+void NetPkg::set_turn(const NetTurn &t) {
+	ZoneScoped;
+
+	if (t.cmds.size() > NetTurn::max_cmds)
+		throw std::runtime_error("too many turn commands");
+
+	PkgWriter out(*this, NetPkgType::turn);
+
+	write("I2H", pkgargs{ t.turn, t.ticks, t.cmds.size() }, false);
+	data.reserve(NetTurn::hdrsize + t.cmds.size() * NetTurnCommand::size);
+
+	for (const NetTurnCommand &c : t.cmds) {
+		if (std::holds_alternative<IdPoolRef>(c.data)) {
+			IdPoolRef ref = std::get<IdPoolRef>(c.data);
+
+			write("3H6I2H", pkgargs({
+				(unsigned)NetTurnCommandType::kill, c.player, 0u,
+				ref.first, ref.second, 0u, 0u, 0u, 0u,
+				0u, 0u,
+			}));
+		} else {
+			const EntityTask &task = std::get<EntityTask>(c.data);
+
+			write("3H6I2H", pkgargs({
+				(unsigned)NetTurnCommandType::task, c.player, (unsigned)task.type,
+				task.ref1.first, task.ref1.second, task.ref2.first, task.ref2.second, task.x, task.y,
+				task.info_type, task.info_value,
+			}));
+		}
+	}
+}
+
+NetTurn NetPkg::get_turn() {
+	ZoneScoped;
+	unsigned pos = read(NetPkgType::turn, "I2H");
+
+	NetTurn t(u32(0), u16(1));
+	unsigned n = u16(2);
+
+	if (n > NetTurn::max_cmds || data.size() != NetTurn::hdrsize + n * NetTurnCommand::size)
+		throw std::runtime_error("bad turn packet");
+
+	t.cmds.reserve(n);
+
+	for (unsigned i = 0; i < n; ++i) {
+		args.clear();
+		pos += read("3H6I2H", args, pos);
+
+		uint16_t player = u16(1);
+
+		switch ((NetTurnCommandType)u16(0)) {
+		case NetTurnCommandType::kill:
+			t.cmds.emplace_back(player, IdPoolRef(u32(3), u32(4)));
+			break;
+		case NetTurnCommandType::task: {
+			EntityTask task((EntityTaskType)u16(2), IdPoolRef(u32(3), u32(4)), IdPoolRef(u32(5), u32(6)));
+
+			task.x = u32(7);
+			task.y = u32(8);
+			task.info_type = u16(9);
+			task.info_value = u16(10);
+
+			t.cmds.emplace_back(player, task);
+			break;
+		}
+		default:
+			throw std::runtime_error("unknown turn command");
+		}
+	}
+
+	return t;
+}
+
+void NetPkg::set_checksum(uint32_t turn, uint32_t hash) {
+	PkgWriter out(*this, NetPkgType::checksum);
+	write("2I", pkgargs{ turn, hash }, false);
+}
+
+NetChecksum NetPkg::get_checksum() {
+	read(NetPkgType::checksum, "2I");
+	return NetChecksum(u32(0), u32(1));
+}
+
+}
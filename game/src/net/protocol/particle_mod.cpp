@@ -26,16 +26,12 @@ Particle NetPkg::get_particle() {
 	if ((NetPkgType)hdr.type != NetPkgType::particle_mod)
 		throw std::runtime_error("not a particle control packet");
 
-	args.clear();
-	unsigned pos = 0;
+	PkgReader in(*this);
 
-	pos += read("2I2H2I2b", args, pos);
-
-	IdPoolRef ref;
-	ref.first = u32(0); ref.second = u32(1);
-	unsigned type = u16(2), subimage = u16(3);
-	float x = u32(4), y = u32(5);
-	int8_t sx = i8(6), sy = i8(7);
+	IdPoolRef ref(in.ref());
+	unsigned type = in.u16(), subimage = in.u16();
+	float x = in.u32(), y = in.u32();
+	int8_t sx = in.i8(), sy = in.i8();
 
 	if (sx || sy) {
 		x += sx / (float)INT8_MAX;
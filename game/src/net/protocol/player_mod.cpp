@@ -68,6 +68,7 @@ NetPlayerControl NetPkg::get_player_control() {
 			return NetPlayerControl(type, u16(1), str(2));
 		case NetPlayerControlType::set_civ:
 		case NetPlayerControlType::set_team:
+		case NetPlayerControlType::set_ai:
 			pos += read("2H", args, pos);
 			return NetPlayerControl(type, u16(1), u16(2));
 		case NetPlayerControlType::set_score: {
@@ -103,6 +104,10 @@ void NetPkg::set_player_team(uint16_t idx, uint16_t team) {
 	playermod2(NetPlayerControlType::set_team, idx, team);
 }
 
+void NetPkg::set_player_ai(uint16_t idx, bool ai) {
+	playermod2(NetPlayerControlType::set_ai, idx, ai);
+}
+
 void NetPkg::set_player_name(uint16_t idx, const std::string &s) {
 	PkgWriter out(*this, NetPkgType::playermod);
 	write("2H40s", pkgargs{
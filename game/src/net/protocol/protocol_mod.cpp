@@ -4,9 +4,9 @@
 
 namespace aoe {
 
-void NetPkg::set_protocol(uint16_t version) {
+void NetPkg::set_protocol(uint16_t version, uint16_t flags) {
 	PkgWriter out(*this, NetPkgType::set_protocol);
-	write("H", pkgargs{ version }, false);
+	write("2H", pkgargs{ version, flags }, false);
 }
 
 uint16_t NetPkg::protocol_version() {
@@ -14,4 +14,15 @@ uint16_t NetPkg::protocol_version() {
 	return u16(0);
 }
 
+uint16_t NetPkg::protocol_flags() {
+	chktype(NetPkgType::set_protocol);
+
+	// older versions only send the version
+	if (data.size() < 4)
+		return 0;
+
+	read(NetPkgType::set_protocol, "2H");
+	return u16(1);
+}
+
 }
@@ -23,14 +23,13 @@ Resources NetPkg::get_resources() {
 	if ((NetPkgType)hdr.type != NetPkgType::resmod)
 		throw std::runtime_error("not a resources control packet");
 
-	args.clear();
-	read("4I", args);
+	PkgReader in(*this);
 	Resources res;
 
-	res.wood  = u32(0);
-	res.food  = u32(1);
-	res.gold  = u32(2);
-	res.stone = u32(3);
+	res.wood  = in.u32();
+	res.food  = in.u32();
+	res.gold  = in.u32();
+	res.stone = in.u32();
 
 	return res;
 }
@@ -0,0 +1,15 @@
+#include "../../server.hpp"
+
+namespace aoe {
+
+void NetPkg::set_resume(uint64_t token) {
+	PkgWriter out(*this, NetPkgType::resume);
+	write("L", pkgargs{ token }, false);
+}
+
+uint64_t NetPkg::get_resume() {
+	read(NetPkgType::resume, "L");
+	return u64(0);
+}
+
+}
@@ -16,6 +16,7 @@ void NetPkg::set_scn_vars(const ScenarioSettings &scn) {
 	if (scn.square          ) flags |= 1 << 4;
 	if (scn.wrap            ) flags |= 1 << 5;
 	if (scn.restricted      ) flags |= 1 << 6;
+	if (scn.lockstep        ) flags |= 1 << 7;
 
 	write("6I4IB", pkgargs({
 		(uint64_t)scn.width, (uint64_t)scn.height, (uint64_t)scn.popcap, (uint64_t)scn.age, (uint64_t)scn.seed, (uint64_t)scn.villagers,
@@ -43,6 +44,7 @@ ScenarioSettings NetPkg::get_scn_vars() {
 	scn.square           = !!(flags & (1 << 4));
 	scn.wrap             = !!(flags & (1 << 5));
 	scn.restricted       = !!(flags & (1 << 6));
+	scn.lockstep         = !!(flags & (1 << 7));
 
 	return scn;
 }
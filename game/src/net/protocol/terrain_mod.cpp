@@ -10,9 +10,9 @@ namespace aoe {
 void NetPkg::set_terrain_mod(const NetTerrainMod &tm) {
 	ZoneScoped;
 	assert(tm.tiles.size() == tm.hmap.size());
-	size_t tsize = tm.w * tm.h * 2;
+	size_t tsize = tm.w * tm.h * 3;
 
-	if (tsize > max_payload - NetTerrainMod::possize)
+	if (tsize > max_message - NetTerrainMod::possize)
 		throw std::runtime_error("terrain mod too big");
 
 	PkgWriter out(*this, NetPkgType::terrainmod);
@@ -27,31 +27,32 @@ void NetPkg::set_terrain_mod(const NetTerrainMod &tm) {
 }
 
 NetTerrainMod NetPkg::get_terrain_mod() {
-	ZoneScoped;
-	unsigned pos = read(NetPkgType::terrainmod, "4H");
 	NetTerrainMod tm;
+	get_terrain_mod(tm);
+	return tm;
+}
 
-	tm.x = u16(0); tm.y = u16(1);
-	tm.w = u16(2); tm.h = u16(3);
+void NetPkg::get_terrain_mod(NetTerrainMod &tm) {
+	ZoneScoped;
+	chktype(NetPkgType::terrainmod);
+	PkgReader in(*this);
+
+	tm.x = in.u16(); tm.y = in.u16();
+	tm.w = in.u16(); tm.h = in.u16();
 
 	size_t size = tm.w * tm.h;
 
-	tm.tiles.clear();
-	tm.hmap.clear();
+	if (in.left() < size * 3)
+		throw std::runtime_error("corrupt data");
 
-	for (size_t i = 0; i < size; ++i) {
-		args.clear();
-		pos += read("H", args, pos);
-		tm.tiles.emplace_back(u16(0));
-	}
+	tm.tiles.resize(size);
+	tm.hmap.resize(size);
 
-	for (size_t i = 0; i < size; ++i) {
-		args.clear();
-		pos += read("B", args, pos);
-		tm.hmap.emplace_back(u8(0));
-	}
+	for (size_t i = 0; i < size; ++i)
+		tm.tiles[i] = in.u16();
 
-	return tm;
+	for (size_t i = 0; i < size; ++i)
+		tm.hmap[i] = in.u8();
 }
 
 }
@@ -2,11 +2,18 @@
 
 #include "../legacy/legacy.hpp"
 
+#include <random>
+
 namespace aoe {
 
 const Peer *Server::try_peer(IdPoolRef ref) {
 	std::lock_guard<std::mutex> lk(m_peers);
-	Peer p(refs.at(ref).sock, "", "", false);
+
+	const SocketRef *sr = refs.try_get(ref);
+	if (!sr)
+		return nullptr;
+
+	Peer p(sr->sock, "", "", false);
 
 	auto it = peers.find(p);
 	if (it == peers.end())
@@ -22,11 +29,24 @@ ClientInfo &Server::get_ci(IdPoolRef ref) {
 
 bool Server::process(const Peer &p, NetPkg &pkg, std::deque<uint8_t> &out) {
 	pkg.ntoh();
+	s.account(p, NetDir::in, pkg.hdr.type & ~NetPkgHdr::compressed, pkg.size());
+	pkg.inflate(&s.net_stats());
+
+	if (!chk_resuming(p, pkg.type()))
+		return false;
+
+	// spectators are read-only
+	if (pkg.type() != NetPkgType::set_protocol && pkg.type() != NetPkgType::spectate && spectating(p))
+		return true;
 
 	// TODO for broadcasts, check packet on bogus data if reusing pkg
 	switch (pkg.type()) {
 		case NetPkgType::set_protocol:
 			return chk_protocol(p, out, pkg);
+		case NetPkgType::resume:
+			return resume(p, pkg.get_resume());
+		case NetPkgType::spectate:
+			return spectate(p);
 		case NetPkgType::chat_text:
 			broadcast(pkg);
 			break;
@@ -49,6 +69,10 @@ bool Server::process(const Peer &p, NetPkg &pkg, std::deque<uint8_t> &out) {
 			auto ent = pkg.get_entity_mod();
 			return process_entity_mod(p, ent, out);
 		}
+		case NetPkgType::entity_group: {
+			auto g = pkg.get_entity_group();
+			return process_entity_group(p, g);
+		}
 		case NetPkgType::cam_set: {
 			auto cam = pkg.get_cam_set();
 			return cam_set(p, cam);
@@ -58,6 +82,9 @@ bool Server::process(const Peer &p, NetPkg &pkg, std::deque<uint8_t> &out) {
 			gamespeed_control(p, spd);
 			break;
 		}
+		case NetPkgType::checksum:
+			w.add_event(peer2ref(p), WorldEventType::checksum, pkg.get_checksum());
+			break;
 		default:
 			fprintf(stderr, "bad type: %u\n", (unsigned)pkg.type());
 			throw "invalid type";
@@ -66,6 +93,170 @@ bool Server::process(const Peer &p, NetPkg &pkg, std::deque<uint8_t> &out) {
 	return true;
 }
 
+/** Check if \a p may send \a type. Peers that join a running game have to resume or spectate before they can do anything else. */
+bool Server::chk_resuming(const Peer &p, NetPkgType type) {
+	if (type == NetPkgType::set_protocol || type == NetPkgType::resume || type == NetPkgType::spectate)
+		return true;
+
+	lock lk(m_peers);
+
+	auto it = peers.find(p);
+	if (it == peers.end() || !(it->second.flags & (unsigned)ClientInfoFlags::resuming))
+		return true;
+
+	fprintf(stderr, "%s: (%s,%s) joined running game without resuming: kick!\n", __func__, p.host.c_str(), p.server.c_str());
+	return false;
+}
+
+/** Give \a p the seat that belongs to \a token back and let the world send it everything that it has missed. */
+bool Server::resume(const Peer &p, uint64_t token) {
+	IdPoolRef ref;
+	ClientSeat seat("", 0);
+
+	{
+		lock lk(m_peers);
+
+		auto it = peers.find(p);
+		if (it == peers.end())
+			return false;
+
+		ClientInfo &ci = it->second;
+
+		// ignore if already playing
+		if (!(ci.flags & (unsigned)ClientInfoFlags::resuming))
+			return true;
+
+		auto st = seats.find(token);
+		if (!token || st == seats.end()) {
+			fprintf(stderr, "%s: (%s,%s) has no seat: kick!\n", __func__, p.host.c_str(), p.server.c_str());
+			return false;
+		}
+
+		seat = st->second;
+		seats.erase(st);
+
+		ci.flags &= ~(unsigned)ClientInfoFlags::resuming;
+		ci.username = seat.username;
+		ci.token = token;
+		ci.player = seat.player;
+		ref = ci.ref;
+	}
+
+	printf("%s: (%s,%s) takes seat %u as \"%s\"\n", __func__, p.host.c_str(), p.server.c_str(), seat.player, seat.username.c_str());
+
+	NetPkg pkg;
+
+	pkg.set_username(seat.username);
+	send(p, pkg);
+
+	pkg.set_ref_username(ref, seat.username);
+	broadcast(pkg);
+
+	pkg.set_claim_player(ref, seat.player);
+	broadcast(pkg);
+
+	pkg.set_chat_text(invalid_ref, seat.username + " rejoined");
+	broadcast(pkg);
+
+	// NOTE add_event must not be called while holding m_peers as the world locks them the other way around
+	// the world claims the seat itself, as it reads the owners all the time while the game is running
+	w.add_event(ref, WorldEventType::peer_resync, EventPeerSeat(seat.player));
+	return true;
+}
+
+/**
+ * Turn \a p into a spectator. It is removed from the lobby and receives the
+ * delayed stream from the start of the game. Spectators that join a running
+ * game start with a snapshot instead. Spectators that ask again receive a new
+ * snapshot in line with the stream, so relays can pass it on to new observers.
+ */
+bool Server::spectate(const Peer &p) {
+	NetPkg pkg;
+	IdPoolRef ref;
+
+	{
+		std::unique_lock<std::mutex> lk(m_peers);
+
+		auto it = peers.find(p);
+		if (it == peers.end())
+			return false;
+
+		ClientInfo &ci = it->second;
+		ref = ci.ref;
+
+		if (ci.flags & (unsigned)ClientInfoFlags::spectator) {
+			if (!m_running)
+				return true;
+
+			lk.unlock();
+
+			// NOTE add_event must not be called while holding m_peers. see Server::resume
+			w.add_event(ref, WorldEventType::peer_spectate, std::nullopt);
+			return true;
+		}
+
+		// players cannot leave their seat to watch the game
+		if (m_running && !(ci.flags & (unsigned)ClientInfoFlags::resuming))
+			return true;
+
+		// spectators of a lockstep game need every turn since the start
+		if (m_running && w.scn.lockstep) {
+			fprintf(stderr, "%s: (%s,%s) cannot join lockstep game: kick!\n", __func__, p.host.c_str(), p.server.c_str());
+			return false;
+		}
+
+		// the stream is shared by all spectators, so they must accept whatever it has been encoded with
+		if (!can_deflate(p)) {
+			fprintf(stderr, "%s: (%s,%s) does not accept compressed packets: kick!\n", __func__, p.host.c_str(), p.server.c_str());
+			return false;
+		}
+
+		ci.flags = (unsigned)ClientInfoFlags::spectator;
+
+		// peers that join a running game have no seat yet
+		if (!m_running)
+			w.scn.remove(ci.ref);
+
+		printf("%s: (%s,%s) is spectating\n", __func__, p.host.c_str(), p.server.c_str());
+
+		pkg.set_dropped(ci.ref);
+		broadcast(pkg, p);
+
+		pkg.set_chat_text(invalid_ref, ci.username + " is spectating");
+		broadcast(pkg, p);
+	}
+
+	{
+		lock lk(m_spectate);
+
+		s.mute(p);
+		// spectators do not send anything that would wake up the network thread
+		s.set_flush_interval(spectate_flush_ms);
+
+		if (!m_running) {
+			// everything from now on is part of the stream
+			pkg.set_spectate();
+			send_resync(p, pkg);
+
+			spectators.emplace(p.sock, Spectator(p));
+			return true;
+		}
+
+		// keep everything from now on until the snapshot is in the stream
+		spectators.emplace(p.sock, Spectator(p, tape.end(), true));
+	}
+
+	w.add_event(ref, WorldEventType::peer_spectate, std::nullopt);
+	return true;
+}
+
+bool Server::spectating(const Peer &p) {
+	lock lk(m_peers);
+
+	auto it = peers.find(p);
+	return it != peers.end() && (it->second.flags & (unsigned)ClientInfoFlags::spectator);
+}
+
 IdPoolRef Server::peer2ref(const Peer &p) {
 	return peers.at(p).ref;
 }
@@ -96,7 +287,7 @@ void Server::start_game(const Peer &p) {
 
 	for (auto kv : peers) {
 		ClientInfo &ci = kv.second;
-		if (!(ci.flags & (unsigned)ClientInfoFlags::ready)) {
+		if (!(ci.flags & ((unsigned)ClientInfoFlags::ready | (unsigned)ClientInfoFlags::spectator))) {
 			ready = false;
 			break;
 		}
@@ -109,6 +300,43 @@ void Server::start_game(const Peer &p) {
 		return;
 	}
 
+	// lockstep peers cannot catch up from a snapshot, as they need the exact simulation state
+	seats.clear();
+
+	if (!w.scn.lockstep) {
+		std::random_device rd;
+
+		for (auto &kv : peers) {
+			ClientInfo &ci = kv.second;
+
+			if (ci.flags & (unsigned)ClientInfoFlags::spectator)
+				continue;
+
+			// peers that do not control anyone have no seat to come back to
+			auto it = w.scn.owners.find(ci.ref);
+			if (it == w.scn.owners.end())
+				continue;
+
+			ci.player = it->second;
+
+			do
+				ci.token = (uint64_t)rd() << 32 | rd();
+			while (!ci.token);
+
+			NetPkg pkg;
+			pkg.set_resume(ci.token);
+			send(kv.first, pkg);
+		}
+	}
+
+	{
+		lock lks(m_spectate);
+		tape.clear();
+
+		for (auto &kv : spectators)
+			kv.second.next = 0;
+	}
+
 	m_running = true;
 
 	std::thread t([this]() {
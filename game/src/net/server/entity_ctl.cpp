@@ -37,4 +37,20 @@ bool Server::process_entity_mod(const Peer &p, NetEntityMod &em, std::deque<uint
 	return false;
 }
 
+bool Server::process_entity_group(const Peer &p, NetEntityGroup &g) {
+	if (!m_running)
+		return false; // desync, kick
+
+	IdPoolRef src = peer2ref(p);
+
+	// reject entity control if peer is invalid
+	if (src == invalid_ref && !p.is_host)
+		return true;
+
+	if (!g.refs.empty())
+		w.add_event(src, WorldEventType::entity_group, g);
+
+	return true;
+}
+
 }
@@ -15,6 +15,8 @@ bool Server::process_playermod(const Peer &p, NetPlayerControl &ctl, std::deque<
 		case NetPlayerControlType::set_player_name:
 		case NetPlayerControlType::set_civ:
 		case NetPlayerControlType::set_team:
+		// the world owns the seats while the game is running. see Server::resume
+		case NetPlayerControlType::set_ref:
 			return true;
 		default:
 			break;
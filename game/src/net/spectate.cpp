@@ -0,0 +1,352 @@
+#include "../server.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <tracy/Tracy.hpp>
+
+namespace aoe {
+
+void SpectatorTape::clear() {
+	pending.clear();
+	frames.clear();
+	first = 0;
+	bytes = 0;
+}
+
+void SpectatorTape::add(const void *ptr, size_t size) {
+	const uint8_t *src = (const uint8_t*)ptr;
+	pending.insert(pending.end(), src, src + size);
+}
+
+void SpectatorTape::add(const std::vector<BulkChunk> &chunks) {
+	for (const BulkChunk &c : chunks)
+		pending.insert(pending.end(), c->begin(), c->end());
+}
+
+void SpectatorTape::cut(time_point now) {
+	if (pending.empty())
+		return;
+
+	bytes += pending.size();
+	frames.emplace_back(now, std::make_shared<const std::vector<uint8_t>>(std::move(pending)), INVALID_SOCKET);
+	pending.clear();
+}
+
+size_t SpectatorTape::add_private(SOCKET owner, const BulkChunk &data, time_point now) {
+	// everything before it has been recorded earlier, so keep it in front
+	cut(now);
+
+	bytes += data->size();
+	frames.emplace_back(now, data, owner);
+
+	return end() - 1;
+}
+
+void SpectatorTape::trim(size_t i) {
+	for (; first < i && !frames.empty(); ++first) {
+		bytes -= frames.front().data->size();
+		frames.pop_front();
+	}
+}
+
+size_t SpectatorTape::ready(time_point now, std::chrono::steady_clock::duration delay) const noexcept {
+	// frames are in chronological order
+	size_t lo = 0, hi = frames.size();
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (now - frames[mid].time >= delay)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return first + lo;
+}
+
+bool SpectatorTape::sends_to(size_t i, SOCKET sock) const {
+	SOCKET owner = frames.at(i - first).owner;
+	return owner == INVALID_SOCKET || owner == sock;
+}
+
+SpectatorRelay::SpectatorRelay() : s(), up(), m(), tape(), observers(), rbuf(2 * tcp4_max_size), rpos(0), rend(0), intro(), capturing(false), starts(0), requested(false), m_active(false) {}
+
+int SpectatorRelay::mainloop(const char *host, uint16_t port, uint16_t listen) {
+	ZoneScoped;
+
+	{
+		std::lock_guard<std::mutex> lk(m);
+		tape.clear();
+		rpos = rend = 0;
+		intro.clear();
+		capturing = false;
+		starts = 0;
+		// the game server sends a snapshot when the game is running already
+		requested = true;
+	}
+
+	up.open();
+	up.connect(host, port);
+	m_active = true;
+
+	NetPkg pkg;
+	std::vector<uint8_t> v;
+
+	pkg.set_protocol(1, (uint16_t)NetProtocolFlags::compress);
+	pkg.write(v);
+
+	pkg.set_spectate();
+	pkg.write(v);
+
+	up.send_fully(v.data(), (int)v.size());
+
+	// observers do not send anything once they are watching
+	s.set_flush_interval(flush_ms);
+
+	std::thread t([this](uint16_t listen) {
+		s.mainloop(listen, 10, *this);
+	}, listen);
+
+	try {
+		upstream();
+	} catch (std::runtime_error &e) {
+		if (m_active)
+			fprintf(stderr, "%s: %s\n", __func__, e.what());
+	}
+
+	up.close();
+
+	// let observers see the end of the game as well
+	while (m_active) {
+		std::vector<Peer> lst;
+		{
+			std::lock_guard<std::mutex> lk(m);
+
+			for (auto &kv : observers)
+				lst.emplace_back(kv.second.peer);
+		}
+
+		size_t left = 0;
+
+		for (const Peer &p : lst)
+			left += s.pending(p);
+
+		if (!left)
+			break;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	m_active = false;
+	s.close();
+	t.join();
+
+	return 0;
+}
+
+void SpectatorRelay::stop() {
+	m_active = false;
+	up.shutdown();
+}
+
+void SpectatorRelay::upstream() {
+	while (m_active) {
+		if (rpos == rend) {
+			rpos = rend = 0;
+		} else if (rbuf.size() - rend < tcp4_max_size) {
+			memmove(rbuf.data(), rbuf.data() + rpos, rend - rpos);
+			rend -= rpos;
+			rpos = 0;
+		}
+
+		int in = up.recv(rbuf.data() + rend, (int)(rbuf.size() - rend), 1);
+		if (in <= 0)
+			throw SocketClosedError("relay: game server has closed the connection");
+
+		rend += in;
+
+		std::lock_guard<std::mutex> lk(m);
+
+		while (rend - rpos >= NetPkgHdr::size) {
+			const uint8_t *ptr = rbuf.data() + rpos;
+			uint16_t payload = (uint16_t)ptr[2] << 8 | ptr[3];
+
+			if (rend - rpos < NetPkgHdr::size + payload)
+				break;
+
+			forward(ptr, NetPkgHdr::size + payload);
+			rpos += NetPkgHdr::size + payload;
+		}
+
+		flush();
+	}
+}
+
+/**
+ * Pass a complete packet from the game server on. Snapshots start with an
+ * acknowledgement and end with the second start_game, and only observers
+ * that are waiting receive them. Everything else is part of the stream.
+ */
+void SpectatorRelay::forward(const uint8_t *ptr, size_t size) {
+	uint16_t type = ((uint16_t)ptr[0] << 8 | ptr[1]) & ~NetPkgHdr::compressed;
+
+	if (type == (uint16_t)NetPkgType::spectate) {
+		puts("relay: snapshot");
+		intro.clear();
+		capturing = true;
+		starts = 0;
+		requested = false;
+	}
+
+	if (!capturing) {
+		// nobody is watching, so it does not have to be recorded
+		for (auto &kv : observers)
+			if (!kv.second.waiting) {
+				tape.add(ptr, size);
+				break;
+			}
+
+		return;
+	}
+
+	intro.insert(intro.end(), ptr, ptr + size);
+
+	if (type != (uint16_t)NetPkgType::start_game || ++starts < 2)
+		return;
+
+	capturing = false;
+
+	BulkChunk c(std::make_shared<const std::vector<uint8_t>>(std::move(intro)));
+	intro.clear();
+
+	// the snapshot is taken right after everything that has been recorded so far
+	tape.cut();
+
+	for (auto &kv : observers) {
+		Spectator &sp = kv.second;
+
+		if (!sp.waiting)
+			continue;
+
+		s.account(sp.peer, NetDir::out, (unsigned)NetPkgType::spectate, c->size());
+		s.send_bulk(sp.peer, { c });
+
+		sp.next = tape.end();
+		sp.waiting = false;
+	}
+}
+
+/** Send all new frames to the observers and drop the frames that everyone has received. */
+void SpectatorRelay::flush() {
+	tape.cut();
+
+	size_t ready = tape.end();
+	std::vector<BulkChunk> chunks;
+
+	// every observer gets the same frames
+	for (auto &kv : observers) {
+		Spectator &sp = kv.second;
+
+		if (sp.waiting)
+			continue;
+
+		chunks.clear();
+
+		for (; sp.next < ready; ++sp.next) {
+			const BulkChunk &c = tape.at(sp.next);
+			s.account(sp.peer, NetDir::out, (unsigned)NetPkgType::spectate, c->size());
+			chunks.emplace_back(c);
+		}
+
+		if (!chunks.empty())
+			s.send_bulk(sp.peer, chunks);
+	}
+
+	// observers that are waiting start after these frames
+	tape.trim(ready);
+}
+
+bool SpectatorRelay::incoming(ServerSocket&, const Peer &p) {
+	printf("%s: (%s,%s) connected\n", __func__, p.host.c_str(), p.server.c_str());
+	return true;
+}
+
+void SpectatorRelay::dropped(ServerSocket&, const Peer &p) {
+	std::lock_guard<std::mutex> lk(m);
+	observers.erase(p.sock);
+}
+
+void SpectatorRelay::stopped() {
+	std::lock_guard<std::mutex> lk(m);
+	observers.clear();
+}
+
+int SpectatorRelay::proper_packet(ServerSocket&, const std::deque<uint8_t> &q) {
+	return NetPkg::complete(q);
+}
+
+bool SpectatorRelay::process_packet(ServerSocket&, const Peer &p, std::deque<uint8_t> &in, std::deque<uint8_t> &out, int) {
+	NetPkg pkg(in);
+	pkg.ntoh();
+	s.account(p, NetDir::in, pkg.hdr.type & ~NetPkgHdr::compressed, pkg.size());
+	pkg.inflate(&s.net_stats());
+
+	switch (pkg.type()) {
+		case NetPkgType::set_protocol: {
+			// the stream may contain compressed packets, so observers must accept them
+			if (!(pkg.protocol_flags() & (uint16_t)NetProtocolFlags::compress)) {
+				fprintf(stderr, "%s: (%s,%s) does not accept compressed packets: kick!\n", __func__, p.host.c_str(), p.server.c_str());
+				return false;
+			}
+
+			pkg.set_protocol(1, (uint16_t)NetProtocolFlags::compress);
+			s.account(p, NetDir::out, (unsigned)pkg.type(), NetPkgHdr::size + pkg.data.size());
+			pkg.write(out);
+			break;
+		}
+		case NetPkgType::spectate:
+			subscribe(p);
+			break;
+		default:
+			// observers are read-only
+			break;
+	}
+
+	return true;
+}
+
+/** Let \a p wait for the next snapshot and keep it posted from then on. */
+void SpectatorRelay::subscribe(const Peer &p) {
+	std::lock_guard<std::mutex> lk(m);
+
+	if (observers.find(p.sock) != observers.end())
+		return;
+
+	observers.emplace(p.sock, Spectator(p, tape.end(), true));
+
+	// a snapshot that is underway is complete, so it can be used as well
+	if (!capturing && !requested)
+		request();
+
+	printf("%s: (%s,%s) is watching\n", __func__, p.host.c_str(), p.server.c_str());
+}
+
+/** Ask the game server for a new snapshot. */
+void SpectatorRelay::request() {
+	NetPkg pkg;
+	std::vector<uint8_t> v;
+
+	pkg.set_spectate();
+	pkg.write(v);
+
+	try {
+		up.send_fully(v.data(), (int)v.size());
+		requested = true;
+	} catch (std::runtime_error &e) {
+		fprintf(stderr, "%s: %s\n", __func__, e.what());
+	}
+}
+
+}
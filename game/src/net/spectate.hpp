@@ -0,0 +1,133 @@
+#pragma once
+
+/*
+ * Spectators get a delayed, read-only copy of everything that is broadcasted
+ * during a game. Packets that are sent to a single peer are private to it.
+ * Everything that is broadcasted in one game loop iteration is recorded as a
+ * single frame. All spectators share the same frames, so the cost of a frame
+ * does not depend on the number of spectators. Frames are only recorded while
+ * someone is watching and they are dropped once every spectator has received
+ * them. Spectators that join a running game start with a snapshot of the
+ * world instead.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "net.hpp"
+
+namespace aoe {
+
+class SpectatorTape final {
+public:
+	typedef std::chrono::steady_clock::time_point time_point;
+private:
+	class Frame final {
+	public:
+		time_point time;
+		BulkChunk data;
+		SOCKET owner; // only spectator that receives this frame. INVALID_SOCKET if everyone does
+
+		Frame(time_point time, const BulkChunk &data, SOCKET owner) : time(time), data(data), owner(owner) {}
+	};
+
+	std::vector<uint8_t> pending; // frame that is being recorded
+	std::deque<Frame> frames;
+	size_t first; // index of the oldest frame that has not been trimmed
+	size_t bytes;
+public:
+	SpectatorTape() : pending(), frames(), first(0), bytes(0) {}
+
+	/** Drop all frames and start counting from zero again. */
+	void clear();
+
+	/** Append complete packets to the current frame. */
+	void add(const void *ptr, size_t size);
+	void add(const std::vector<BulkChunk> &chunks);
+
+	/** Close the current frame. Does nothing if nothing has been recorded since the last call. */
+	void cut(time_point now=std::chrono::steady_clock::now());
+	/** Close the current frame and add \a data as a frame that only \a owner receives. Returns its index. */
+	size_t add_private(SOCKET owner, const BulkChunk &data, time_point now=std::chrono::steady_clock::now());
+
+	/** Drop all frames before index \a i. */
+	void trim(size_t i);
+
+	/** Index after the last frame that is at least \a delay old at \a now. */
+	size_t ready(time_point now, std::chrono::steady_clock::duration delay) const noexcept;
+
+	const BulkChunk &at(size_t i) const { return frames.at(i - first).data; }
+	/** Check if frame \a i is meant for \a sock. */
+	bool sends_to(size_t i, SOCKET sock) const;
+
+	/** Index of the oldest frame. Everything before it has been trimmed. */
+	size_t begin() const noexcept { return first; }
+	/** Index after the newest frame. */
+	size_t end() const noexcept { return first + frames.size(); }
+	/** Total size of all frames. */
+	size_t total() const noexcept { return bytes; }
+};
+
+/** Spectator and next frame it has to receive. */
+class Spectator final {
+public:
+	Peer peer;
+	size_t next;
+	bool waiting; // for a snapshot to start with. frames from next on are kept until it arrives
+
+	Spectator(const Peer &peer, size_t next=0, bool waiting=false) : peer(peer), next(next), waiting(waiting) {}
+};
+
+/**
+ * Relay that subscribes as a single spectator to a game server and passes
+ * the stream on to many observers, so the game server only has to send the
+ * stream once. Observers connect to the relay just like they would to the
+ * game server. Late observers make the relay ask the game server for a new
+ * snapshot, which only they receive before they join the shared stream.
+ */
+class SpectatorRelay final : public ServerSocketController {
+	ServerSocket s;
+	TcpSocket up;
+	std::mutex m;
+	SpectatorTape tape;
+	std::map<SOCKET, Spectator> observers;
+	std::vector<uint8_t> rbuf; // upstream data. pending data is in [rpos, rend)
+	size_t rpos, rend;
+	std::vector<uint8_t> intro; // snapshot that is being received for observers that are waiting
+	bool capturing; // upstream is sending a snapshot
+	unsigned starts; // start_game packets in the current snapshot. the second one ends it
+	bool requested; // a snapshot has been asked for, but has not started yet
+	std::atomic<bool> m_active;
+public:
+	static constexpr int flush_ms = 20;
+
+	SpectatorRelay();
+
+	/** Subscribe to game server on \a host and \a port and serve observers on \a listen. Returns when the game server has closed the connection. */
+	int mainloop(const char *host, uint16_t port, uint16_t listen);
+
+	void stop();
+
+	bool incoming(ServerSocket &s, const Peer &p) override;
+	void dropped(ServerSocket &s, const Peer &p) override;
+	void stopped() override;
+
+	int proper_packet(ServerSocket &s, const std::deque<uint8_t> &q) override;
+	bool process_packet(ServerSocket &s, const Peer &p, std::deque<uint8_t> &in, std::deque<uint8_t> &out, int processed) override;
+private:
+	void upstream();
+	void forward(const uint8_t *ptr, size_t size);
+	void flush();
+	void subscribe(const Peer &p);
+	void request();
+};
+
+}
@@ -0,0 +1,173 @@
+#include "stats.hpp"
+
+#include <stdexcept>
+
+namespace aoe {
+
+NetStatsSnapshot NetStats::snapshot() const noexcept {
+	NetStatsSnapshot s;
+
+	s.time = std::chrono::steady_clock::now();
+
+	for (unsigned d = 0; d < 2; ++d)
+		for (unsigned i = 0; i < types; ++i) {
+			s.packets[d][i] = packets[d][i].load(std::memory_order_relaxed);
+			s.bytes[d][i] = bytes[d][i].load(std::memory_order_relaxed);
+		}
+
+	s.send_calls = send_calls.load(std::memory_order_relaxed);
+	s.recv_calls = recv_calls.load(std::memory_order_relaxed);
+
+	s.deflate_in = deflate_in.load(std::memory_order_relaxed);
+	s.deflate_out = deflate_out.load(std::memory_order_relaxed);
+	s.deflate_us = deflate_us.load(std::memory_order_relaxed);
+	s.inflate_in = inflate_in.load(std::memory_order_relaxed);
+	s.inflate_out = inflate_out.load(std::memory_order_relaxed);
+	s.inflate_us = inflate_us.load(std::memory_order_relaxed);
+	s.coalesced = coalesced.load(std::memory_order_relaxed);
+
+	return s;
+}
+
+uint64_t NetStatsSnapshot::total_packets(NetDir d) const noexcept {
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < NetStats::types; ++i)
+		n += packets[(unsigned)d][i];
+
+	return n;
+}
+
+uint64_t NetStatsSnapshot::total_bytes(NetDir d) const noexcept {
+	uint64_t n = 0;
+
+	for (unsigned i = 0; i < NetStats::types; ++i)
+		n += bytes[(unsigned)d][i];
+
+	return n;
+}
+
+const char *send_lane_name(SendLane lane) {
+	static const char *names[] = { "control", "command", "state", "bulk" };
+	static_assert(sizeof(names) / sizeof(names[0]) == send_lanes);
+
+	unsigned i = (unsigned)lane;
+	return i < send_lanes ? names[i] : "???";
+}
+
+bool NetRate::update(const NetStatsSnapshot &now, double interval) {
+	queued = now.queued;
+
+	for (unsigned i = 0; i < send_lanes; ++i)
+		lane_queued[i] = now.lane_queued[i];
+
+	if (!primed) {
+		last = now;
+		primed = true;
+		return false;
+	}
+
+	double dt = std::chrono::duration<double>(now.time - last.time).count();
+	if (dt < interval || dt <= 0)
+		return false;
+
+	// NOTE counters may have been reset if the server has been restarted
+	auto rate = [dt](uint64_t now, uint64_t old) { return now >= old ? (now - old) / dt : 0.0; };
+
+	for (unsigned d = 0; d < 2; ++d)
+		for (unsigned i = 0; i < NetStats::types; ++i) {
+			packets[d][i] = rate(now.packets[d][i], last.packets[d][i]);
+			bytes[d][i] = rate(now.bytes[d][i], last.bytes[d][i]);
+		}
+
+	send_calls = rate(now.send_calls, last.send_calls);
+	recv_calls = rate(now.recv_calls, last.recv_calls);
+
+	last = now;
+	return true;
+}
+
+double NetRate::total_packets(NetDir d) const noexcept {
+	double n = 0;
+
+	for (unsigned i = 0; i < NetStats::types; ++i)
+		n += packets[(unsigned)d][i];
+
+	return n;
+}
+
+double NetRate::total_bytes(NetDir d) const noexcept {
+	double n = 0;
+
+	for (unsigned i = 0; i < NetStats::types; ++i)
+		n += bytes[(unsigned)d][i];
+
+	return n;
+}
+
+void NetStatsLog::open(const std::string &path, double interval) {
+	close();
+
+	if (interval <= 0)
+		throw std::runtime_error("netstats: interval must be positive");
+
+	out.open(path, std::ios_base::trunc);
+	if (!out.is_open())
+		throw std::runtime_error(std::string("netstats: cannot open ") + path);
+
+	out << "time,peer,dir,type,name,packets,bytes,send_calls,recv_calls,queued";
+
+	for (unsigned i = 0; i < send_lanes; ++i)
+		out << ",queued_" << send_lane_name((SendLane)i);
+
+	out << ",coalesced\n";
+
+	start = next = std::chrono::steady_clock::now();
+	this->interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval));
+}
+
+void NetStatsLog::close() {
+	if (out.is_open())
+		out.close();
+}
+
+bool NetStatsLog::due() {
+	auto now = std::chrono::steady_clock::now();
+
+	if (!out.is_open() || now < next)
+		return false;
+
+	// skip missed deadlines instead of writing a burst of rows
+	do
+		next += interval;
+	while (next <= now);
+
+	return true;
+}
+
+void NetStatsLog::write(const std::string &peer, const NetStatsSnapshot &s) {
+	if (!out.is_open())
+		return;
+
+	double t = std::chrono::duration<double>(s.time - start).count();
+	std::string name(peer);
+
+	// quote peer name as it may contain anything the user has typed
+	for (size_t pos = 0; (pos = name.find('"', pos)) != std::string::npos; pos += 2)
+		name.insert(pos, 1, '"');
+
+	name = "\"" + name + "\"";
+
+	for (unsigned d = 0; d < 2; ++d)
+		for (unsigned i = 0; i < NetStats::types; ++i) {
+			if (!s.packets[d][i])
+				continue;
+
+			out << t << ',' << name << ',' << (d ? "out" : "in") << ',' << i << ',' << net_pkg_type_name(i) << ','
+				<< s.packets[d][i] << ',' << s.bytes[d][i] << ',' << s.send_calls << ',' << s.recv_calls << ',' << s.queued << '\n';
+		}
+
+	out.flush();
+}
+
+}
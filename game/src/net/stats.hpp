@@ -0,0 +1,142 @@
+#pragma once
+
+/*
+ * Network traffic accounting. Counters are lock-free and only use relaxed
+ * atomics, so they can be bumped from any network thread without slowing it
+ * down. Readers take a snapshot and compute rates from consecutive snapshots.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+namespace aoe {
+
+enum class NetDir {
+	in,
+	out,
+};
+
+/** Priority of outgoing data. Lower lanes go first, but each lane gets a share of every flush. */
+enum class SendLane {
+	control, // handshake, lobby, chat
+	command, // camera and speed changes, checksums
+	state, // entity, particle, resource, player and peer updates, game ticks, turns and group orders
+	bulk, // terrain and fragments
+};
+
+static constexpr unsigned send_lanes = 4;
+
+class NetStatsSnapshot;
+
+class NetStats final {
+public:
+	static constexpr unsigned types = 32; // unknown packet types end up in the last slot
+
+	std::atomic<uint64_t> packets[2][types], bytes[2][types];
+	std::atomic<uint64_t> send_calls, recv_calls;
+	// payload bytes before and after compression and time spent in microseconds
+	std::atomic<uint64_t> deflate_in, deflate_out, deflate_us;
+	std::atomic<uint64_t> inflate_in, inflate_out, inflate_us;
+	std::atomic<uint64_t> coalesced; // queued state updates that have been replaced by a newer one
+
+	NetStats() : packets(), bytes(), send_calls(0), recv_calls(0), deflate_in(0), deflate_out(0), deflate_us(0), inflate_in(0), inflate_out(0), inflate_us(0), coalesced(0) {}
+
+	/** Count one packet of \a size bytes including its header. */
+	void add(NetDir d, unsigned type, size_t size) noexcept {
+		unsigned dir = (unsigned)d, idx = type < types - 1 ? type : types - 1;
+
+		packets[dir][idx].fetch_add(1, std::memory_order_relaxed);
+		bytes[dir][idx].fetch_add(size, std::memory_order_relaxed);
+	}
+
+	void add_send_call(uint64_t n=1) noexcept { send_calls.fetch_add(n, std::memory_order_relaxed); }
+	void add_recv_call() noexcept { recv_calls.fetch_add(1, std::memory_order_relaxed); }
+	void add_coalesced() noexcept { coalesced.fetch_add(1, std::memory_order_relaxed); }
+
+	void add_deflate(size_t in, size_t out, uint64_t us) noexcept {
+		deflate_in.fetch_add(in, std::memory_order_relaxed);
+		deflate_out.fetch_add(out, std::memory_order_relaxed);
+		deflate_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	void add_inflate(size_t in, size_t out, uint64_t us) noexcept {
+		inflate_in.fetch_add(in, std::memory_order_relaxed);
+		inflate_out.fetch_add(out, std::memory_order_relaxed);
+		inflate_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	NetStatsSnapshot snapshot() const noexcept;
+};
+
+class NetStatsSnapshot final {
+public:
+	std::chrono::steady_clock::time_point time;
+	uint64_t packets[2][NetStats::types], bytes[2][NetStats::types];
+	uint64_t send_calls, recv_calls;
+	uint64_t deflate_in, deflate_out, deflate_us;
+	uint64_t inflate_in, inflate_out, inflate_us;
+	uint64_t coalesced;
+	// bytes waiting to be sent, in total and per lane. filled in by the owner of the counters
+	uint64_t queued, lane_queued[send_lanes];
+
+	NetStatsSnapshot() : time(), packets(), bytes(), send_calls(0), recv_calls(0), deflate_in(0), deflate_out(0), deflate_us(0), inflate_in(0), inflate_out(0), inflate_us(0), coalesced(0), queued(0), lane_queued() {}
+
+	uint64_t total_packets(NetDir) const noexcept;
+	uint64_t total_bytes(NetDir) const noexcept;
+};
+
+/** Per second rates between two snapshots. */
+class NetRate final {
+	NetStatsSnapshot last;
+	bool primed;
+public:
+	double packets[2][NetStats::types], bytes[2][NetStats::types];
+	double send_calls, recv_calls;
+	uint64_t queued, lane_queued[send_lanes];
+
+	NetRate() : last(), primed(false), packets(), bytes(), send_calls(0), recv_calls(0), queued(0), lane_queued() {}
+
+	/** Recompute rates if at least \a interval seconds have passed since the previous update. Returns true if they have been updated. */
+	bool update(const NetStatsSnapshot &now, double interval=1.0);
+
+	/** Counters at the last update. */
+	const NetStatsSnapshot &totals() const noexcept { return last; }
+
+	double total_packets(NetDir) const noexcept;
+	double total_bytes(NetDir) const noexcept;
+};
+
+/**
+ * Periodically append snapshots to a CSV file, such that the network load of
+ * a whole match can be graphed afterwards. Counters are cumulative, so each
+ * row can be diffed against the previous one with the same peer, dir and type.
+ */
+class NetStatsLog final {
+	std::ofstream out;
+	std::chrono::steady_clock::time_point start, next;
+	std::chrono::steady_clock::duration interval;
+public:
+	NetStatsLog() : out(), start(), next(), interval() {}
+
+	void open(const std::string &path, double interval);
+	void close();
+
+	bool is_open() const noexcept { return out.is_open(); }
+
+	/** Check if the next batch of rows should be written. Advances the deadline if so. */
+	bool due();
+
+	/** Write a row for each packet type in \a s that has been seen at least once. */
+	void write(const std::string &peer, const NetStatsSnapshot &s);
+};
+
+/** Human readable name for NetPkgType \a type. */
+const char *net_pkg_type_name(unsigned type);
+const char *send_lane_name(SendLane lane);
+
+}
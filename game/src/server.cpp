@@ -5,7 +5,7 @@
 
 namespace aoe {
 
-Server::Server() : ServerSocketController(), s(), m_active(false), m_running(false), m_peers(), port(0), protocol(0), peers(), refs(), w(), civs() {}
+Server::Server() : ServerSocketController(), s(), m_active(false), m_running(false), m_peers(), port(0), protocol(0), peers(), refs(), w(), civs(), civnames(), m_stats(), stats_log(), m_deflate(), deflate_peers(), raw_peers(0), fragment_id(0), seats(), m_spectate(), tape(), spectators(), spectate_delay(std::chrono::seconds(5)) {}
 
 Server::~Server() {
 	stop();
@@ -19,13 +19,23 @@ struct pkg {
 bool Server::incoming(ServerSocket &s, const Peer &p) {
 	std::lock_guard<std::mutex> lk(m_peers);
 
-	if (peers.size() > 255 || m_running)
+	if (peers.size() > 255)
 		return false;
 
 	std::string name(p.host + ":" + p.server);
 	auto ins = refs.emplace(p.sock);
 	IdPoolRef ref(ins.first->first);
-	peers[p] = ClientInfo(ref, name);
+	ClientInfo &ci = peers[p] = ClientInfo(ref, name);
+
+	// peers can only join a running game to take the seat they have been dropped from
+	if (m_running)
+		ci.flags |= (unsigned)ClientInfoFlags::resuming;
+
+	{
+		// new peers have not negotiated anything yet
+		lock lk(m_deflate);
+		++raw_peers;
+	}
 
 	NetPkg pkg;
 
@@ -48,7 +58,7 @@ bool Server::incoming(ServerSocket &s, const Peer &p) {
 	for (auto kv : peers) {
 		IdPoolRef r = kv.second.ref;
 
-		if (ref == r)
+		if (ref == r || (kv.second.flags & (unsigned)ClientInfoFlags::spectator))
 			continue;
 
 		// TODO check if username has been set
@@ -61,7 +71,7 @@ bool Server::incoming(ServerSocket &s, const Peer &p) {
 }
 
 void Server::dropped(ServerSocket &s, const Peer &p) {
-	std::lock_guard<std::mutex> lk(m_peers);
+	std::unique_lock<std::mutex> lk(m_peers);
 
 	ClientInfo ci(peers.at(p));
 	std::string name(ci.username);
@@ -69,47 +79,72 @@ void Server::dropped(ServerSocket &s, const Peer &p) {
 	refs.erase(ci.ref);
 	peers.erase(p);
 
+	// keep seat, so the peer can come back later
+	if (m_running && ci.token)
+		seats.emplace(ci.token, ClientSeat(name, ci.player));
+
+	{
+		lock lk(m_deflate);
+
+		if (!deflate_peers.erase(p.sock))
+			--raw_peers;
+	}
+
+	// players have already been told that spectators are gone
+	if (ci.flags & (unsigned)ClientInfoFlags::spectator) {
+		lock lks(m_spectate);
+		spectators.erase(p.sock);
+		return;
+	}
+
 	NetPkg pkg;
 
 	pkg.set_dropped(ci.ref);
 	broadcast(pkg);
 
-	// prevent dangling owners
-	w.scn.remove(ci.ref);
-
 	pkg.set_chat_text(invalid_ref, name + " left");
 	broadcast(pkg);
+
+	// prevent dangling owners
+	if (!m_running) {
+		w.scn.remove(ci.ref);
+		return;
+	}
+
+	// the world reads the owners all the time while the game is running, so let it remove them itself
+	// NOTE add_event must not be called while holding m_peers as the world locks them the other way around
+	lk.unlock();
+	w.add_event(ci.ref, WorldEventType::peer_drop, std::nullopt);
 }
 
 void Server::stopped() {
 	std::lock_guard<std::mutex> lk(m_peers);
 	peers.clear();
+
+	lock lkd(m_deflate);
+	deflate_peers.clear();
+	raw_peers = 0;
 }
 
 int Server::proper_packet(ServerSocket &s, const std::deque<uint8_t> &q) {
-	if (q.size() < NetPkgHdr::size)
-		return 0;
-
-	union hdr {
-		uint16_t v[2];
-		uint8_t b[4];
-	} data;
-
-	static_assert(sizeof(data) == NetPkgHdr::size);
-
-	for (unsigned i = 0; i < NetPkgHdr::size; ++i)
-		data.b[i] = q[i];
-
-	NetPkgHdr h(data.v[0], data.v[1], false);
-	h.ntoh();
-
-	return q.size() - NetPkgHdr::size >= h.payload;
+	return NetPkg::complete(q);
 }
 
 void Server::broadcast(NetPkg &pkg, bool include_host) {
+	if (pkg.large()) {
+		auto chunks(pkg.fragment(fragment_id++, can_deflate_all(), &s.net_stats()));
+		s.broadcast_bulk(chunks, include_host, (int)NetPkgType::fragment);
+		record(chunks);
+		return;
+	}
+
 	std::vector<uint8_t> v;
-	pkg.write(v);
-	s.broadcast(v.data(), (int)v.size(), include_host);
+	int type = (int)pkg.type();
+	SendLane lane = pkg.lane();
+	uint64_t key = pkg.state_key();
+	pkg.write(v, can_deflate_all(), &s.net_stats());
+	s.broadcast(v.data(), (int)v.size(), include_host, type, lane, key);
+	record(v.data(), v.size());
 }
 
 /**
@@ -117,33 +152,171 @@ void Server::broadcast(NetPkg &pkg, bool include_host) {
  */
 void Server::broadcast(NetPkg &pkg, const Peer &exclude)
 {
+	if (pkg.large()) {
+		auto chunks(pkg.fragment(fragment_id++, can_deflate_all(), &s.net_stats()));
+
+		for (auto kv : peers)
+			if (kv.first.sock != exclude.sock && !(kv.second.flags & (unsigned)ClientInfoFlags::spectator))
+				send_bulk(kv.first, chunks);
+
+		record(chunks);
+		return;
+	}
+
 	std::vector<uint8_t> v;
-	pkg.write(v);
+	unsigned type = (unsigned)pkg.type();
+	SendLane lane = pkg.lane();
+	uint64_t key = pkg.state_key();
+	pkg.write(v, can_deflate_all(), &s.net_stats());
 
 	for (auto kv : peers) {
 		const Peer &p = kv.first;
 
-		if (p.sock == exclude.sock)
+		if (p.sock == exclude.sock || (kv.second.flags & (unsigned)ClientInfoFlags::spectator))
 			continue;
 
-
-		s.send(p, v.data(), v.size());
+		s.account(p, NetDir::out, type, v.size());
+		s.send(p, v.data(), v.size(), lane, key);
 	}
+
+	record(v.data(), v.size());
 }
 
 void Server::send(const Peer &p, NetPkg &pkg) {
+	if (pkg.large()) {
+		send_bulk(p, pkg.fragment(fragment_id++, can_deflate(p), &s.net_stats()));
+		return;
+	}
+
+	std::vector<uint8_t> v;
+	unsigned type = (unsigned)pkg.type();
+	SendLane lane = pkg.lane();
+	uint64_t key = pkg.state_key();
+	pkg.write(v, can_deflate(p), &s.net_stats());
+
+	s.account(p, NetDir::out, type, v.size());
+	s.send(p, v.data(), v.size(), lane, key);
+}
+
+void Server::send_resync(const Peer &p, NetPkg &pkg) {
+	if (pkg.large()) {
+		send_bulk(p, pkg.fragment(fragment_id++, can_deflate(p), &s.net_stats()));
+		return;
+	}
+
 	std::vector<uint8_t> v;
-	pkg.write(v);
-	s.send(p, v.data(), v.size());
+	unsigned type = (unsigned)pkg.type();
+	pkg.write(v, can_deflate(p), &s.net_stats());
+
+	s.account(p, NetDir::out, type, v.size());
+	s.send_bulk(p, { std::make_shared<const std::vector<uint8_t>>(std::move(v)) });
+}
+
+void Server::send_bulk(const Peer &p, const std::vector<BulkChunk> &chunks) {
+	for (const BulkChunk &c : chunks)
+		s.account(p, NetDir::out, (unsigned)NetPkgType::fragment, c->size());
+
+	s.send_bulk(p, chunks);
+}
+
+bool Server::can_deflate(const Peer &p) {
+	lock lk(m_deflate);
+	return deflate_peers.find(p.sock) != deflate_peers.end();
+}
+
+/** Check if all peers accept compressed packets, so the same data can be broadcasted to everyone. */
+bool Server::can_deflate_all() {
+	lock lk(m_deflate);
+	return !raw_peers && !deflate_peers.empty();
+}
+
+void Server::record(const void *ptr, size_t size) {
+	if (!m_running)
+		return;
+
+	lock lk(m_spectate);
+
+	// spectators that join later start with a snapshot
+	if (!spectators.empty())
+		tape.add(ptr, size);
+}
+
+void Server::record(const std::vector<BulkChunk> &chunks) {
+	if (!m_running)
+		return;
+
+	lock lk(m_spectate);
+
+	if (!spectators.empty())
+		tape.add(chunks);
+}
+
+void Server::encode_spectate(std::vector<uint8_t> &v, NetPkg &pkg) {
+	// spectators have to accept compressed packets, see Server::spectate
+	if (pkg.large()) {
+		for (const BulkChunk &c : pkg.fragment(fragment_id++, true, &s.net_stats()))
+			v.insert(v.end(), c->begin(), c->end());
+
+		return;
+	}
+
+	pkg.write(v, true, &s.net_stats());
+}
+
+void Server::spectate_snapshot(IdPoolRef ref, std::vector<uint8_t> &&v) {
+	ZoneScoped;
+	SOCKET sock = INVALID_SOCKET;
+
+	if (ref != invalid_ref) {
+		const Peer *p = try_peer(ref);
+
+		// spectator has left in the mean time
+		if (!p)
+			return;
+
+		sock = p->sock;
+	}
+
+	lock lk(m_spectate);
+
+	if (spectators.empty() || v.empty())
+		return;
+
+	size_t i = tape.add_private(sock, std::make_shared<const std::vector<uint8_t>>(std::move(v)));
+
+	for (auto &kv : spectators) {
+		Spectator &sp = kv.second;
+
+		// spectators that are watching already receive it in line with the rest of the stream
+		if (sp.waiting && (sock == INVALID_SOCKET || sock == kv.first)) {
+			sp.next = i;
+			sp.waiting = false;
+		}
+	}
+}
+
+/** Send \a pkg to \a p right after the packet that is currently being processed. */
+void Server::reply(const Peer &p, std::deque<uint8_t> &out, NetPkg &pkg) {
+	s.account(p, NetDir::out, (unsigned)pkg.type(), NetPkgHdr::size + pkg.data.size());
+	pkg.write(out);
 }
 
 bool Server::chk_protocol(const Peer &p, std::deque<uint8_t> &out, NetPkg &in) {
 	uint16_t req = in.protocol_version();
+	uint16_t flags = in.protocol_flags() & (uint16_t)NetProtocolFlags::compress;
 	printf("%s: (%s,%s) requests protocol %u. answer protocol %u\n", __func__, p.host.c_str(), p.server.c_str(), req, protocol);
 
 	NetPkg pkg;
-	pkg.set_protocol(protocol);
-	pkg.write(out);
+	pkg.set_protocol(protocol, flags);
+	reply(p, out, pkg);
+
+	// this reply is still uncompressed, so we can switch now
+	if (flags & (uint16_t)NetProtocolFlags::compress) {
+		lock lk(m_deflate);
+
+		if (deflate_peers.insert(p.sock).second)
+			--raw_peers;
+	}
 
 	return true;
 }
@@ -155,7 +328,7 @@ void Server::change_username(const Peer &p, std::deque<uint8_t> &out, const std:
 	NetPkg pkg;
 	ClientInfo &ci = it->second;
 	pkg.set_username(ci.username = name);
-	pkg.write(out);
+	reply(p, out, pkg);
 
 	pkg.set_ref_username(ci.ref, name);
 	broadcast(pkg, p);
@@ -174,7 +347,7 @@ bool Server::chk_username(const Peer &p, std::deque<uint8_t> &out, const std::st
 	if (m_running) {
 		NetPkg pkg;
 		pkg.set_username(old);
-		pkg.write(out);
+		reply(p, out, pkg);
 
 		return true;
 	}
@@ -187,7 +360,7 @@ bool Server::chk_username(const Peer &p, std::deque<uint8_t> &out, const std::st
 		// : found. ignore and send back old name
 		NetPkg pkg;
 		pkg.set_username(old);
-		pkg.write(out);
+		reply(p, out, pkg);
 
 		return true;
 	}
@@ -232,7 +405,7 @@ bool Server::process_packet(ServerSocket &s, const Peer &p, std::deque<uint8_t>
 	return process(p, pkg, out);
 }
 
-int Server::mainloop(uint16_t port, uint16_t protocol, bool testing) {
+void Server::init(uint16_t port, uint16_t protocol, bool testing) {
 	this->port = port;
 	this->protocol = protocol;
 
@@ -244,11 +417,110 @@ int Server::mainloop(uint16_t port, uint16_t protocol, bool testing) {
 	}
 
 	m_active = true;
+}
+
+int Server::mainloop(uint16_t port, uint16_t protocol, bool testing) {
+	init(port, protocol, testing);
 	int r = s.mainloop(port, 10, *this);
 
 	return r;
 }
 
+int Server::mainloop(std::shared_ptr<LocalChannel> ch, uint16_t protocol, bool testing) {
+	init(0, protocol, testing);
+	int r = s.mainloop(ch, *this);
+
+	return r;
+}
+
+void Server::set_stats_log(const std::string &path, double interval) {
+	lock lk(m_stats);
+	stats_log.open(path, interval);
+}
+
+void Server::close_stats_log() {
+	lock lk(m_stats);
+	stats_log.close();
+}
+
+bool Server::has_stats_log() {
+	lock lk(m_stats);
+	return stats_log.is_open();
+}
+
+void Server::log_stats() {
+	ZoneScoped;
+	lock lk(m_stats);
+
+	if (!stats_log.due())
+		return;
+
+	stats_log.write("all", s.snapshot());
+
+	// NOTE snapshot locks the socket queues, which may be held by the network thread while it waits for m_peers
+	std::vector<std::pair<std::string, Peer>> lst;
+	{
+		lock lkp(m_peers);
+
+		for (auto kv : peers)
+			lst.emplace_back(kv.second.username, kv.first);
+	}
+
+	for (auto &kv : lst)
+		stats_log.write(kv.first, s.snapshot(kv.second));
+}
+
+void Server::set_spectate_delay(double seconds) {
+	lock lk(m_spectate);
+	spectate_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(0.0, seconds)));
+}
+
+void Server::set_snapshot_rate(double hz) {
+	w.snapshot_rate = std::clamp(hz, World::snapshot_rate_min, World::snapshot_rate_max);
+}
+
+bool Server::spectate_step() {
+	ZoneScoped;
+	lock lk(m_spectate);
+
+	auto now = std::chrono::steady_clock::now();
+	tape.cut(now);
+
+	size_t ready = tape.ready(now, spectate_delay), oldest = tape.end();
+	std::vector<BulkChunk> chunks;
+
+	// all spectators share the same frames, so this costs the same no matter how many are watching
+	for (auto &kv : spectators) {
+		Spectator &sp = kv.second;
+
+		if (!sp.waiting && sp.next < ready) {
+			chunks.clear();
+
+			for (; sp.next < ready; ++sp.next) {
+				if (!tape.sends_to(sp.next, kv.first))
+					continue;
+
+				const BulkChunk &c = tape.at(sp.next);
+				s.account(sp.peer, NetDir::out, (unsigned)NetPkgType::spectate, c->size());
+				chunks.emplace_back(c);
+			}
+
+			if (!chunks.empty())
+				s.send_bulk(sp.peer, chunks);
+		}
+
+		oldest = std::min(oldest, sp.next);
+	}
+
+	// nobody needs the frames before the oldest one that has not been sent yet
+	if (spectators.empty())
+		tape.clear();
+	else
+		tape.trim(oldest);
+
+	return !spectators.empty() && ready < tape.end();
+}
+
 void Server::stop() {
 	m_running = m_active = false;
 }
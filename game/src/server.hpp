@@ -13,11 +13,13 @@
 #include <thread>
 #include <variant>
 #include <optional>
+#include <functional>
 
 #include "game.hpp"
 #include "debug.hpp"
 
 #include <idpool.hpp>
+#include <rng.hpp>
 
 #if _WIN32
 #include <wepoll.h>
@@ -25,10 +27,13 @@
 
 #include "net/protocol.hpp"
 #include "net/netpkg.hpp"
+#include "net/local.hpp"
+#include "net/spectate.hpp"
 
 #include "net/clientinfo.hpp"
 
 #include "world/world.hpp"
+#include "world/lockstep.hpp"
 
 namespace aoe {
 
@@ -51,7 +56,7 @@ class WorldEvent final {
 public:
 	IdPoolRef src; /** ref to peer that created this event. invalid_ref if from the server itself. */
 	WorldEventType type;
-	std::variant<std::nullopt_t, IdPoolRef, Entity, EventCameraMove, EntityTask, NetGamespeedControl> data;
+	std::variant<std::nullopt_t, IdPoolRef, Entity, EventCameraMove, EventPeerSeat, EntityTask, NetGamespeedControl, NetChecksum, NetEntityGroup> data;
 
 	template<class... Args> WorldEvent(IdPoolRef src, WorldEventType type, Args&&... data) : src(src), type(type), data(data...) {}
 };
@@ -73,6 +78,18 @@ public:
 
 class Server;
 
+/** Snapshot of the world for a peer that joins a running game. It is sent a bit at a time, so the game keeps running smoothly for everyone else. */
+class WorldResync final {
+public:
+	IdPoolRef ref;
+	std::vector<EntityView> entities; // copied when the snapshot was taken
+	size_t pos; // next entity to send
+	unsigned row; // next terrain row to send
+	bool done; // everything has been queued
+
+	WorldResync(IdPoolRef ref) : ref(ref), entities(), pos(0), row(0), done(false) {}
+};
+
 class World final {
 	std::mutex m, m_events;
 	Terrain t;
@@ -87,16 +104,33 @@ class World final {
 	std::set<unsigned> resources_out;
 	Server *s;
 	bool gameover;
+	Rng rng; // NOTE only use this for the simulation, as lockstep peers must draw the same numbers
+	LockstepRelay relay;
+	std::set<IdPoolRef> desynced; // peers that have reported a different checksum
+	std::function<void(NetPkg&)> sink; // receives state changes when simulating for a lockstep peer
+	unsigned local_player;
+	std::vector<WorldResync> resyncs; // peers that are catching up
+	uint64_t ticks; // game ticks sent to peers so far
+	unsigned ticks_out; // game ticks that have run since the last snapshot
+	uint64_t simticks; // game ticks that have been simulated. drives all animations
+	TimerWheel anims; // entities whose animation does something when it shows the image of impact
 	friend WorldView;
 public:
 	ScenarioSettings scn;
 	std::atomic<double> logic_gamespeed;
+	std::atomic<double> snapshot_rate; // state updates per second, independent of logic_gamespeed
 	std::atomic<bool> running;
 
 	static constexpr double gamespeed_max = 3.0;
 	static constexpr double gamespeed_min = 0.5;
 	static constexpr double gamespeed_step = 0.5;
 
+	static constexpr double snapshot_rate_min = EntityTrack::min_rate; // slower updates would arrive after clients have drawn up to them
+	static constexpr double snapshot_rate_max = EntityTrack::max_rate; // clients keep enough samples for this rate
+
+	static constexpr size_t resync_window = 64 * 1024; // max snapshot bytes waiting to be sent to a single peer
+	static constexpr unsigned resync_rows = 16; // terrain rows per packet in a snapshot
+
 	World();
 
 	void load_scn(const ScenarioSettings &scn);
@@ -105,6 +139,14 @@ public:
 
 	void eventloop(Server &s);
 
+	/** Simulate for a lockstep peer that controls \a player. All state changes are passed to \a out instead of being sent to peers. */
+	void start_lockstep(const ScenarioSettings &scn, unsigned player, std::function<void(NetPkg&)> out);
+	/** Apply all commands and run all ticks of turn \a t. Returns false once the game has ended. */
+	bool step(const NetTurn &t);
+
+	/** Hash of everything that affects the outcome of the simulation. */
+	uint32_t checksum();
+
 	template<class... Args> void add_event(IdPoolRef src, WorldEventType type, Args&&... data) {
 		std::lock_guard<std::mutex> lk(m_events);
 		events_in.emplace_back(src, type, data...);
@@ -113,6 +155,7 @@ public:
 	int non_gaia_players() const noexcept { return this->players.size() - 1; }
 private:
 	void startup();
+	void create_world();
 	void create_terrain();
 	void create_players();
 	void create_entities();
@@ -131,9 +174,12 @@ private:
 
 	void tick();
 	void tick_entities();
+	void start_anim(Entity&);
+	bool anim_event(WorldView&, Entity&);
 	void tick_particles();
 	void tick_players();
 	void pump_events();
+	void push_snapshot();
 	void push_events();
 
 	void push_entities();
@@ -142,11 +188,21 @@ private:
 	void push_resources();
 
 	void cam_move(WorldEvent&);
+	void verify_checksum(WorldEvent&);
+
+	void resync(WorldEvent&);
+	void push_resyncs();
+	bool resync_step(const Peer &p, WorldResync &r);
+	void spectate(WorldEvent&);
+	void push_setup(const std::function<void(NetPkg&)> &out);
+	void push_players(const std::function<void(NetPkg&)> &out);
 
 	void gamespeed_control(WorldEvent&);
 	void push_gamespeed_control(WorldEvent&);
 
 	void send_gameticks(unsigned);
+	void send_turn(unsigned);
+	void apply(const NetTurn&);
 
 	bool single_team() const noexcept;
 
@@ -154,10 +210,15 @@ private:
 
 	void entity_kill(WorldEvent &ev);
 	void entity_task(WorldEvent &ev);
+	void entity_group(WorldEvent &ev);
+	void entity_kill(IdPoolRef, std::optional<unsigned> player);
+	void entity_task(const EntityTask&, std::optional<unsigned> player);
+	void entity_group(const NetEntityGroup&, std::optional<unsigned> player);
+	bool run_task(const EntityTask&, std::optional<unsigned> player);
 
 	void nuke_ref(IdPoolRef);
 
-	bool controls_player(IdPoolRef src, unsigned pid);
+	bool src2player(IdPoolRef src, std::optional<unsigned> &player);
 
 	void save_scores();
 	void send_scores();
@@ -165,6 +226,7 @@ private:
 	void send_resources();
 
 	void send_player(unsigned i, NetPkg &pkg);
+	void emit(NetPkg &pkg);
 
 	std::optional<unsigned> ref2idx(IdPoolRef) const noexcept;
 };
@@ -180,6 +242,18 @@ class Server final : public ServerSocketController {
 	World w;
 	std::map<std::string, std::vector<std::string>> civs;
 	std::vector<std::string> civnames;
+	std::mutex m_stats;
+	NetStatsLog stats_log;
+	std::mutex m_deflate;
+	std::set<SOCKET> deflate_peers; // peers that have agreed to receive compressed packets
+	size_t raw_peers; // number of peers that have not
+	std::atomic<uint16_t> fragment_id;
+	std::map<uint64_t, ClientSeat> seats; // peers that have been dropped from the running game by resume token
+	std::mutex m_spectate;
+	SpectatorTape tape; // everything that has been broadcasted and not all spectators have received yet
+	std::map<SOCKET, Spectator> spectators;
+	std::chrono::steady_clock::duration spectate_delay;
+	static constexpr int spectate_flush_ms = 50;
 
 	friend Debug;
 	friend World;
@@ -192,7 +266,24 @@ public:
 
 	bool active() const noexcept { return m_active; }
 
+	/** Periodically write network counters for all peers to \a path in CSV format. */
+	void set_stats_log(const std::string &path, double interval=1.0);
+	void close_stats_log();
+	bool has_stats_log();
+	/** Write network counters if the log interval has passed. Called from the game loop. */
+	void log_stats();
+
+	/** Delay the stream for spectators by \a seconds, so they cannot give away anything to the players. Defaults to 5 seconds. */
+	void set_spectate_delay(double seconds);
+	/** Close the current frame and pass all frames that are old enough to spectators. Called from the game loop. Returns true if some frames still have to be sent. */
+	bool spectate_step();
+
+	/** Send state updates to peers \a hz times per second, no matter how fast the game runs. Defaults to DEFAULT_TICKS_PER_SECOND. */
+	void set_snapshot_rate(double hz);
+
 	int mainloop(uint16_t port, uint16_t protocol, bool testing=false);
+	/** Run server for a single host in this process. See also Client::start(std::shared_ptr<LocalChannel>, bool) */
+	int mainloop(std::shared_ptr<LocalChannel> ch, uint16_t protocol, bool testing=false);
 
 	bool process(const Peer &p, NetPkg &pkg, std::deque<uint8_t> &out);
 
@@ -204,8 +295,14 @@ public:
 	int proper_packet(ServerSocket &s, const std::deque<uint8_t> &q) override;
 	bool process_packet(ServerSocket &s, const Peer &p, std::deque<uint8_t> &in, std::deque<uint8_t> &out, int processed) override;
 private:
+	void init(uint16_t port, uint16_t protocol, bool testing);
+
 	bool chk_protocol(const Peer &p, std::deque<uint8_t> &out, NetPkg &pkg);
 	bool chk_username(const Peer &p, std::deque<uint8_t> &out, const std::string &name);
+	bool chk_resuming(const Peer &p, NetPkgType type);
+	bool resume(const Peer &p, uint64_t token);
+	bool spectate(const Peer &p);
+	bool spectating(const Peer &p);
 
 	void change_username(const Peer &p, std::deque<uint8_t> &out, const std::string &name);
 	bool set_scn_vars(const Peer &p, ScenarioSettings &scn);
@@ -213,6 +310,7 @@ private:
 	bool process_clientinfo(const Peer &p, NetPkg &pkg);
 	bool process_playermod(const Peer &p, NetPlayerControl &ctl, std::deque<uint8_t> &out);
 	bool process_entity_mod(const Peer &p, NetEntityMod &em, std::deque<uint8_t> &out);
+	bool process_entity_group(const Peer &p, NetEntityGroup &g);
 
 	bool cam_set(const Peer &p, NetCamSet &cam);
 
@@ -225,7 +323,24 @@ private:
 
 	void broadcast(NetPkg &pkg, bool include_host=true);
 	void broadcast(NetPkg &pkg, const Peer &exclude);
+	/**
+	 * Send \a pkg to \a p only. This is not recorded for spectators: the only state that is sent this way
+	 * are the resources of a single player, which do not say whose they are.
+	 */
 	void send(const Peer &p, NetPkg &pkg);
+	void send_bulk(const Peer &p, const std::vector<BulkChunk> &chunks);
+	/** Send part of a snapshot to \a p ahead of anything that is kept aside for it. See ServerSocket::hold. */
+	void send_resync(const Peer &p, NetPkg &pkg);
+	bool can_deflate(const Peer &p);
+	bool can_deflate_all();
+	/** Add broadcasted data to the spectator stream. */
+	void record(const void *ptr, size_t size);
+	void record(const std::vector<BulkChunk> &chunks);
+	/** Append \a pkg to \a v the way every spectator can read it. */
+	void encode_spectate(std::vector<uint8_t> &v, NetPkg &pkg);
+	/** Add snapshot \a v for spectator \a ref to the stream. If \a ref is invalid_ref, all spectators receive it. */
+	void spectate_snapshot(IdPoolRef ref, std::vector<uint8_t> &&v);
+	void reply(const Peer &p, std::deque<uint8_t> &out, NetPkg &pkg);
 
 	IdPoolRef peer2ref(const Peer&);
 };
@@ -238,8 +353,39 @@ enum class ClientModFlags {
 	terrain = 1 << 2,
 };
 
+/** Reassembly buffer for a fragmented packet. */
+class FragmentBuffer final {
+public:
+	uint16_t type;
+	std::vector<uint8_t> data; // sized to the whole payload when the first fragment arrives
+	std::vector<bool> chunks; // which fragments have arrived, so duplicates are not counted twice
+	size_t missing;
+
+	FragmentBuffer() : type(0), data(), chunks(), missing(0) {}
+};
+
+/** Splits the byte stream from the server into packets and reassembles fragmented ones. */
+class PkgReceiver final {
+	std::vector<uint8_t> rbuf; // socket reads end up here. pending data is in [rpos, rend)
+	size_t rpos, rend;
+	std::map<uint16_t, FragmentBuffer> fragments;
+public:
+	PkgReceiver() : rbuf(2 * tcp4_max_size), rpos(0), rend(0), fragments() {}
+
+	/** Drop everything that has been received so far. Call this before connecting again. */
+	void reset() noexcept;
+	/** Decode next buffered packet into \a pkg without reading from the socket. Returns false if no complete packet is buffered yet. */
+	bool try_recv(NetPkg &pkg, NetStats &stats);
+	/** Read as much data as \a t has available into the receive buffer. Blocks until at least one byte has been read. */
+	void fill(Transport &t, NetStats &stats);
+private:
+	bool add_fragment(const uint8_t *ptr, size_t size, NetPkg &pkg);
+};
+
 class Client final {
 	TcpSocket s;
+	LocalSocket ls;
+	Transport *t; // either s or ls
 	std::string host;
 	uint16_t port;
 	std::atomic<bool> m_connected, starting;
@@ -252,18 +398,39 @@ class Client final {
 	unsigned playerindex, team_me;
 	bool victory;
 	std::atomic<bool> gameover;
+	PkgReceiver rx;
+	NetStats stats;
+	std::atomic<bool> deflate; // server accepts compressed packets
+	std::unique_ptr<World> sim; // local simulation in lockstep mode
+	std::atomic<uint64_t> token; // to take our seat again if we get dropped. see NetPkg::set_resume
+	std::atomic<bool> spectator; // only watch the game
+	NetTerrainMod terrain; // reused for every terrain packet, so its buffers only grow
 	friend Debug;
 	friend ClientView;
 public:
 	Game g;
 
+	static constexpr unsigned checksum_interval = 16; // turns between checksums in lockstep mode
+
 	Client();
 	~Client();
 
 	void start(const char *host, uint16_t port, bool run=true);
+	/** Connect to server running in this process. */
+	void start(std::shared_ptr<LocalChannel> ch, bool run=true);
 	void stop();
+
+	/** Take the seat we have been dropped from in a running game. Call this before start. */
+	void resume(uint64_t token) noexcept { this->token = token; }
+	/** Token to take our seat again if we have been dropped from the game on \a host and \a port. 0 if there is none. */
+	uint64_t resume_token(const std::string &host, uint16_t port) const;
+	/** Watch the game instead of playing. Works for game servers and relays. Call this before start. */
+	void spectate(bool v=true) noexcept { spectator = v; }
+	/** Copy of all network counters of this client. */
+	NetStatsSnapshot net_stats() const noexcept { return stats.snapshot(); }
 private:
 	void mainloop();
+	void dispatch(NetPkg&);
 
 	void add_chat_text(IdPoolRef, const std::string &s);
 	void start_game();
@@ -271,31 +438,36 @@ private:
 	void set_username(const std::string &s);
 	void playermod(const NetPlayerControl&);
 	void peermod(const NetPeerControl&);
-	void terrainmod(const NetTerrainMod&);
-	void entitymod(const NetEntityMod&);
+	void terrainmod(NetPkg&);
+	void entitymod(NetPkg&);
 	void particlemod(NetPkg&);
 	void resource_ctl(NetPkg&);
 	void gameticks(unsigned n);
 	void gamespeed_control(const NetGamespeedControl&);
+	void start_lockstep();
+	void lockstep_turn(const NetTurn&);
+
+	void entity_group(const std::vector<IdPoolRef>&, const EntityTask&);
 
 	void set_me(IdPoolRef);
 public:
 	bool connected() const noexcept { return m_connected; }
 
-	template<typename T> void send(T *ptr, int len=1) {
-		s.send_fully(ptr, len);
-	}
-
-	template<typename T> void recv(T *ptr, int len=1) {
-		s.recv_fully(ptr, len);
+	/** Send \a len objects at \a ptr. Returns the number of low level writes that it took. */
+	template<typename T> unsigned send(T *ptr, int len=1) {
+		return t->send_fully((const void*)ptr, len * sizeof *ptr);
 	}
 
 	void send(NetPkg&);
 	NetPkg recv();
+	/** Decode next buffered packet into \a pkg without reading from the socket. Returns false if no complete packet is buffered yet. */
+	bool try_recv(NetPkg &pkg) { return rx.try_recv(pkg, stats); }
+	/** Read as much data as the socket has available into the receive buffer. Blocks until at least one byte has been read. */
+	void recv_fill() { rx.fill(*t, stats); }
 
 	// protocol api functions
 
-	void send_protocol(uint16_t version);
+	void send_protocol(uint16_t version, uint16_t flags=0);
 	uint16_t recv_protocol();
 
 	void send_chat_text(const std::string&);
@@ -318,6 +490,9 @@ public:
 	void entity_move(IdPoolRef, float x, float y);
 	void entity_infer(IdPoolRef, IdPoolRef);
 	void entity_train(IdPoolRef, EntityType);
+	/** Order all \a refs at once. Much cheaper than ordering each entity separately. */
+	void entity_move(const std::vector<IdPoolRef>&, float x, float y);
+	void entity_infer(const std::vector<IdPoolRef>&, IdPoolRef);
 
 	/** Try to destroy entity. */
 	void entity_kill(IdPoolRef);
@@ -353,4 +528,49 @@ public:
 	}
 };
 
+/**
+ * Read fields from a payload in order. Unlike NetPkg::read, nothing is
+ * copied or allocated, so this is used for packets that arrive all the time.
+ * Throws if the payload is too small.
+ */
+class PkgReader final {
+	const uint8_t *ptr;
+	size_t size, pos;
+public:
+	PkgReader(const NetPkg &pkg, size_t pos=0) : ptr(pkg.data.data()), size(pkg.data.size()), pos(pos) {}
+
+	size_t left() const noexcept { return size - pos; }
+
+	uint8_t u8() {
+		need(1);
+		return ptr[pos++];
+	}
+
+	int8_t i8() { return (int8_t)u8(); }
+
+	uint16_t u16() {
+		need(2);
+		uint16_t v = (uint16_t)ptr[pos] << 8 | ptr[pos + 1];
+		pos += 2;
+		return v;
+	}
+
+	uint32_t u32() {
+		need(4);
+		uint32_t v = (uint32_t)ptr[pos] << 24 | (uint32_t)ptr[pos + 1] << 16 | (uint32_t)ptr[pos + 2] << 8 | ptr[pos + 3];
+		pos += 4;
+		return v;
+	}
+
+	IdPoolRef ref() {
+		uint32_t first = u32();
+		return IdPoolRef(first, u32());
+	}
+private:
+	void need(size_t n) const {
+		if (size - pos < n)
+			throw std::runtime_error("corrupt data");
+	}
+};
+
 }
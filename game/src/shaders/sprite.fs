@@ -0,0 +1,24 @@
+R""(
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+flat in float Player;
+
+uniform sampler2D texture1;
+// player color plane of texture1: 0 for normal pixels, 1 + color for player colored ones
+uniform sampler2D players;
+// player colors with one row per player
+uniform sampler2D palette;
+
+void main()
+{
+	vec4 col = texture(texture1, TexCoord);
+	int c = int(texture(players, TexCoord).r * 255.0 + 0.5);
+
+	if (c > 0)
+		col.rgb = texelFetch(palette, ivec2(c - 1, int(Player + 0.5)), 0).rgb;
+
+	FragColor = col;
+}
+)""
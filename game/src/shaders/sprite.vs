@@ -0,0 +1,25 @@
+R""(
+#version 330 core
+// unit quad corner, the rest is per instance
+layout (location = 0) in vec2 aCorner;
+layout (location = 1) in vec4 aRect;
+layout (location = 2) in vec4 aTexRect;
+layout (location = 3) in vec2 aFlags;
+
+// 2 / display size
+uniform vec2 scale;
+
+out vec2 TexCoord;
+flat out float Player;
+
+void main()
+{
+	vec2 p = (aRect.xy + aCorner * aRect.zw) * scale;
+	gl_Position = vec4(p.x - 1.0, 1.0 - p.y, 0.0, 1.0);
+
+	// mirrored sprites sample the image from right to left
+	float u = aFlags.y > 0.5 ? 1.0 - aCorner.x : aCorner.x;
+	TexCoord = mix(aTexRect.xy, aTexRect.zw, vec2(u, aCorner.y));
+	Player = aFlags.x;
+}
+)""
@@ -0,0 +1,21 @@
+R""(
+#version 330 core
+layout (location = 0) in vec2 aPos;
+layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in vec4 aColor;
+
+// camera position and 2 / display size
+uniform vec2 offset;
+uniform vec2 scale;
+
+out vec4 ourColor;
+out vec2 TexCoord;
+
+void main()
+{
+	vec2 p = (aPos + offset) * scale;
+	gl_Position = vec4(p.x - 1.0, 1.0 - p.y, 0.0, 1.0);
+	ourColor = aColor;
+	TexCoord = aTexCoord;
+}
+)""
@@ -444,7 +444,7 @@ void Engine::show_multiplayer_diplomacy() {
 			float w = std::min<float>(rbkg.bnds.w, br.x - x);
 			float s1 = rbkg.s0 + (rbkg.s1 - rbkg.s0) * w / rbkg.bnds.w;
 
-			lst->AddImage(tex1, ImVec2(x, y), ImVec2(x + w, y + h), ImVec2(rbkg.s0, rbkg.t0), ImVec2(s1, t1));
+			lst->AddImage(tex(rbkg), ImVec2(x, y), ImVec2(x + w, y + h), ImVec2(rbkg.s0, rbkg.t0), ImVec2(s1, t1));
 		}
 	}
 
@@ -645,6 +645,10 @@ void UICache::load() {
 	t_imgs.emplace_back(a.anim_at(io::DrsId::trn_desert_overlay));
 	t_imgs.emplace_back(a.anim_at(io::DrsId::trn_water_desert));
 	t_imgs.emplace_back(a.anim_at(io::DrsId::trn_water_overlay));
+
+	// tile images may have moved around in the texture
+	if (terrain)
+		terrain->invalidate();
 }
 
 void UICache::str2(const ImVec2 &pos, const char *text, bool invert) {
@@ -879,19 +883,12 @@ void UICache::show_entities() {
 
 	game_mouse_process();
 
-	std::sort(entities_deceased.begin(), entities_deceased.end(), [](const VisualEntity &lhs, const VisualEntity &rhs){ return lhs.z < rhs.z; });
-	std::sort(entities.begin(), entities.end(), [](const VisualEntity &lhs, const VisualEntity &rhs){ return lhs.z < rhs.z; });
-	
-	ImDrawList *lst = ImGui::GetBackgroundDrawList();
-
-	// push deceased entities first to make sure they are always below any other entities
-	for (VisualEntity &v : entities_deceased) {
-		lst->AddImage(e->tex1, ImVec2((int)v.x, (int)v.y), ImVec2(int(v.x + v.w), int(v.y + v.h)), ImVec2(v.s0, v.t0), ImVec2(v.s1, v.t1));
-	}
+	// the sprite batch sorts on depth, and deceased entities have their own layer so they are always below any other entities
+	for (const VisualEntity &v : entities_deceased)
+		add_sprite(SpriteLayer::deceased, v);
 
-	for (VisualEntity &v : entities) {
-		lst->AddImage(e->tex1, ImVec2((int)v.x, (int)v.y), ImVec2(int(v.x + v.w), int(v.y + v.h)), ImVec2(v.s0, v.t0), ImVec2(v.s1, v.t1));
-	}
+	for (const VisualEntity &v : entities)
+		add_sprite(SpriteLayer::entities, v);
 }
 
 void Engine::show_mph_cfg(ui::Frame &f) {
@@ -909,6 +906,7 @@ void Engine::show_mph_cfg(ui::Frame &f) {
 		f.chkbox("Reveal map", scn.explored);
 		f.chkbox("Full Tech Tree", scn.all_technologies);
 		f.chkbox("Enable cheating", scn.cheating);
+		f.chkbox("Lockstep", scn.lockstep);
 		ImGui::EndDisabled();
 
 		f.fmt("Age: %u", scn.age);
@@ -943,6 +941,7 @@ void Engine::show_mph_cfg(ui::Frame &f) {
 		changed |= f.chkbox("Reveal map", scn.explored);
 		changed |= f.chkbox("Full Tech Tree", scn.all_technologies);
 		changed |= f.chkbox("Enable cheating", scn.cheating);
+		changed |= f.chkbox("Lockstep", scn.lockstep);
 		//if (scn.hosting)
 		//	changed |= f.chkbox("Host makes settings", scn.restricted);
 
@@ -1132,7 +1131,7 @@ void Engine::show_init() {
 	ImGui::TextWrapped("%s", "Copyright Age of Empires by Microsoft. Trademark reserved by Microsoft. Remake by Folkert van Verseveld");
 }
 
-static const char *connection_modes[] = { "host game", "join game" };
+static const char *connection_modes[] = { "host game", "join game", "local game" };
 
 void Engine::multiplayer_set_localhost() {
 	strncpy0(connection_host, "127.0.0.1", sizeof(connection_host));
@@ -1270,7 +1269,8 @@ void Engine::show_multiplayer_menu() {
 	}
 
 	ImGui::RadioButton(connection_modes[0], &connection_mode, 0); ImGui::SameLine();
-	ImGui::RadioButton(connection_modes[1], &connection_mode, 1);
+	ImGui::RadioButton(connection_modes[1], &connection_mode, 1); ImGui::SameLine();
+	ImGui::RadioButton(connection_modes[2], &connection_mode, 2);
 
 	if (connection_mode == 1) {
 		ImGui::InputText("host", connection_host, sizeof(connection_host));
@@ -1279,7 +1279,9 @@ void Engine::show_multiplayer_menu() {
 			multiplayer_set_localhost();
 	}
 
-	ImGui::InputScalar("port", ImGuiDataType_U16, &connection_port);
+	// local games do not listen for other players
+	if (connection_mode != 2)
+		ImGui::InputScalar("port", ImGuiDataType_U16, &connection_port);
 
 	if (f.btn("start")) {
 		sfx.play_sfx(SfxId::sfx_ui_click);
@@ -1293,6 +1295,9 @@ void Engine::show_multiplayer_menu() {
 
 				start_client(connection_host, connection_port);
 				break;
+			case 2:
+				start_server(connection_port, true);
+				break;
 		}
 	}
 
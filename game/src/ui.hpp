@@ -9,6 +9,8 @@
 #include "legacy/strings.hpp"
 #include "legacy/scenario.hpp"
 #include "engine/assets.hpp"
+#include "engine/sprite_batch.hpp"
+#include "engine/terrain_mesh.hpp"
 
 #include "external/imgui_memory_editor.h"
 
@@ -192,14 +194,23 @@ struct VisualEntity final {
 	float x, y;
 	int w, h;
 	float s0, t0, s1, t1;
+	unsigned page; // Tileset page of the image
 	float z; // used for drawing priority
 	bool xflip;
+	unsigned player; // whose colors to use for remapped images
 
-	VisualEntity(IdPoolRef ref, IdPoolRef imgref, float x, float y, int w, int h, float s0, float t0, float s1, float t1, float z, bool xflip) : ref(ref), imgref(imgref), x(x), y(y), w(w), h(h), s0(s0), t0(t0), s1(s1), t1(t1), z(z), xflip(xflip) {}
+	VisualEntity(IdPoolRef ref, IdPoolRef imgref, float x, float y, int w, int h, float s0, float t0, float s1, float t1, unsigned page, float z, bool xflip, unsigned player) : ref(ref), imgref(imgref), x(x), y(y), w(w), h(h), s0(s0), t0(t0), s1(s1), t1(t1), page(page), z(z), xflip(xflip), player(player) {}
 };
 
 #undef small
 
+/** Sprites in lower layers are always drawn first, regardless of their depth. */
+enum class SpriteLayer {
+	deceased,
+	entities,
+	particles,
+};
+
 struct VisualTile final {
 	int tx, ty;
 	SDL_Rect bnds;
@@ -216,7 +227,9 @@ class UICache final {
 	std::vector<VisualEntity> entities, entities_deceased;
 	std::vector<VisualEntity> particles; // recycle for 'visual particle'
 	std::vector<IdPoolRef> selected;
-	std::vector<VisualTile> display_area;
+	std::vector<VisualTile> display_area; // tiles near the mouse, only filled when needed
+	std::unique_ptr<gfx::TerrainMesh> terrain; // created once the map is first shown
+	std::unique_ptr<gfx::SpriteBatch> sprites; // same as terrain
 	float left, top, scale;
 	ImDrawList *bkg;
 	std::string btnsel;
@@ -245,6 +258,10 @@ public:
 	void user_interact_entities();
 
 	void show_world();
+	/** Draw terrain and sprites with OpenGL if they have been shown in this frame. Must be done before imgui renders. */
+	void draw_world(float width, float height);
+	/** Free everything that lives on the GPU. Must be called before the OpenGL context goes away. */
+	void gl_free();
 
 	void show_mph_tbl(Frame&);
 	void show_editor_menu();
@@ -261,12 +278,15 @@ public:
 
 	void set_scn(io::Scenario&);
 private:
-	void draw_tile(uint8_t id, uint8_t h, int x, int y, const ImVec2 &size, ImU32 col);
+	void add_tile(uint8_t id, uint8_t h, int x, int y, const SDL_Rect &area);
+	/** Find all tile images that overlap with \a area and put them in display_area. */
+	void collect_tiles(const SDL_Rect &area);
 	void show_terrain();
 	/** Show user selected entities. */
 	void show_selections();
 	void show_entities();
 	void show_particles();
+	void add_sprite(SpriteLayer layer, const VisualEntity &v);
 
 	void load_entities();
 
@@ -274,7 +294,7 @@ private:
 	void mouse_left_process();
 	void mouse_right_process();
 
-	bool menu_btn(ImTextureID tex, const Assets &a, const char *lbl, float x, float scale, bool small);
+	bool menu_btn(const Assets &a, const char *lbl, float x, float scale, bool small);
 	bool frame_btn(const BackgroundColors &col, const char *lbl, float x, float y, float w, float h, float scale, bool invert=false);
 
 	void collect(std::vector<IdPoolRef> &refs, const SDL_Rect &area, bool filter=true);
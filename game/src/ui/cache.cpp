@@ -8,7 +8,7 @@ namespace aoe {
 namespace ui {
 
 UICache::UICache()
-	: civs(), e(nullptr), entities(), entities_deceased(), particles(), selected(), display_area()
+	: civs(), e(nullptr), entities(), entities_deceased(), particles(), selected(), display_area(), terrain(), sprites()
 	, left(0), top(0), scale(1)
 	, bkg(nullptr), btnsel()
 	, t_imgs()
@@ -196,16 +196,15 @@ void UICache::mouse_right_process() {
 		if (!targets.empty()) {
 			IdPoolRef t = targets.front();
 
-			for (IdPoolRef r : selected) {
-				Entity &ent = e->gv.get(r);
-				e->client->entity_infer(ent.ref, t);
-			}
-
+			// one order for the whole selection
+			e->client->entity_infer(selected, t);
 			return;
 		}
 	}
 
 	// no entities found to interact with, search tiles
+	collect_tiles(SDL_Rect{ (int)mx, (int)my, 1, 1 });
+
 	for (VisualTile &vt : display_area) {
 		if (mx >= vt.bnds.x && mx < vt.bnds.x + vt.bnds.w && my >= vt.bnds.y && my < vt.bnds.y + vt.bnds.h) {
 			// get actual image
@@ -237,13 +236,14 @@ void UICache::mouse_right_process() {
 			// TODO determine precise value, now we always use tile's center
 			//printf("clicked on %d,%d\n", vt.tx, vt.ty);
 
-			for (IdPoolRef ref : selected) {
-				Entity *ent = e->gv.try_get(ref);
-				if (!ent)
-					continue;
+			std::vector<IdPoolRef> refs;
 
-				e->client->entity_move(ent->ref, vt.tx, vt.ty);
-			}
+			for (IdPoolRef ref : selected)
+				if (e->gv.try_get(ref))
+					refs.emplace_back(ref);
+
+			if (!refs.empty())
+				e->client->entity_move(refs, vt.tx, vt.ty);
 			return;
 		}
 	}
@@ -32,7 +32,7 @@ void UICache::load_entities() {
 			x0 = tpos.x - tcp.hotspot_x;
 			y0 = tpos.y - tcp.hotspot_y;
 
-			entities_deceased.emplace_back(ent.ref, tcp.ref, x0, y0, tcp.bnds.w, tcp.bnds.h, tcp.s0, tcp.t0, tcp.s1, tcp.t1, tpos.y + 0.1f, ent.xflip);
+			entities_deceased.emplace_back(ent.ref, tcp.ref, x0, y0, tcp.bnds.w, tcp.bnds.h, tcp.s0, tcp.t0, tcp.s1, tcp.t1, tcp.page, tpos.y + 0.1f, ent.xflip, ent.playerid);
 		} else if (ent.state != EntityState::decaying) {
 			continue;
 		} else if (is_resource(ent.type)) {
@@ -51,7 +51,7 @@ void UICache::load_entities() {
 			io::DrsId gif = info.slp_decay;
 
 			const ImageSet &s_tc = a.anim_at(gif);
-			IdPoolRef imgref = s_tc.try_at(ent.playerid, ent.subimage);
+			IdPoolRef imgref = s_tc.try_at(ent.playerid, ent.frame(e->gv.ticks));
 			const gfx::ImageRef &tc = a.at(imgref);
 
 			float x0 = tpos.x - tc.hotspot_x;
@@ -59,9 +59,9 @@ void UICache::load_entities() {
 
 			if (ent.xflip) {
 				x0 = tpos.x - tc.bnds.w + tc.hotspot_x;
-				entities_deceased.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tpos.y, ent.xflip);
+				entities_deceased.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 			} else {
-				entities_deceased.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, ent.xflip);
+				entities_deceased.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 			}
 		}
 	}
@@ -87,17 +87,17 @@ void UICache::load_entities() {
 				x0 = tpos.x - tc.hotspot_x;
 				y0 = tpos.y - tc.hotspot_y;
 
-				entities.emplace_back(ent.ref, imgref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, ent.xflip);
+				entities.emplace_back(ent.ref, imgref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 			}
 
 			const ImageSet &s_tcp = a.anim_at(info.slp_player);
-			IdPoolRef imgref = s_tcp.at(ent.playerid, 0);
+			IdPoolRef imgref = s_tcp.try_at(ent.playerid, 0);
 			const gfx::ImageRef &tcp = a.at(imgref);
 
 			x0 = tpos.x - tcp.hotspot_x;
 			y0 = tpos.y - tcp.hotspot_y;
 
-			entities.emplace_back(ent.ref, imgref, x0, y0, tcp.bnds.w, tcp.bnds.h, tcp.s0, tcp.t0, tcp.s1, tcp.t1, tpos.y + 0.1f, ent.xflip);
+			entities.emplace_back(ent.ref, imgref, x0, y0, tcp.bnds.w, tcp.bnds.h, tcp.s0, tcp.t0, tcp.s1, tcp.t1, tcp.page, tpos.y + 0.1f, ent.xflip, ent.playerid);
 
 			// if building is damaged, add fire
 			float hper = (float)ent.stats.hp / ent.stats.maxhp;
@@ -111,12 +111,12 @@ void UICache::load_entities() {
 					fid = io::DrsId::gif_bld_fire2;
 
 				const ImageSet &s_fire = a.anim_at(fid);
-				const gfx::ImageRef &fimg = a.at(s_fire.try_at(ent.subimage));
+				const gfx::ImageRef &fimg = a.at(s_fire.try_at(ent.frame(e->gv.ticks)));
 
 				x0 = tpos.x - fimg.hotspot_x;
 				y0 = tpos.y - fimg.hotspot_y;
 
-				entities.emplace_back(ent.ref, fimg.ref, x0, y0, fimg.bnds.w, fimg.bnds.h, fimg.s0, fimg.t0, fimg.s1, fimg.t1, tpos.y + 0.2f, false);
+				entities.emplace_back(ent.ref, fimg.ref, x0, y0, fimg.bnds.w, fimg.bnds.h, fimg.s0, fimg.t0, fimg.s1, fimg.t1, fimg.page, tpos.y + 0.2f, false, ent.playerid);
 			}
 		} else if (is_resource(ent.type)) {
 			float x = ent.x, y = ent.y;
@@ -164,7 +164,7 @@ void UICache::load_entities() {
 				case EntityType::stone: {
 					io::DrsId gif = ent.type == EntityType::gold ? io::DrsId::gif_gold : io::DrsId::gif_stone;
 					const ImageSet &s_tc = a.anim_at(gif);
-					IdPoolRef imgref = s_tc.try_at(ent.subimage);
+					IdPoolRef imgref = s_tc.try_at(ent.frame(e->gv.ticks));
 					const gfx::ImageRef &tc = a.at(imgref);
 
 					float x0 = tpos.x - tc.hotspot_x;
@@ -172,9 +172,9 @@ void UICache::load_entities() {
 
 					if (ent.xflip) {
 						x0 = tpos.x - tc.bnds.w + tc.hotspot_x;
-						entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tpos.y, ent.xflip);
+						entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 					} else {
-						entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, ent.xflip);
+						entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 					}
 
 					continue;
@@ -186,7 +186,7 @@ void UICache::load_entities() {
 			float x0 = tpos.x - tc.hotspot_x;
 			float y0 = tpos.y - tc.hotspot_y;
 
-			entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, ent.xflip);
+			entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 		} else {
 			// figure out orientation and animation
 			float x = ent.x, y = ent.y;
@@ -207,7 +207,7 @@ void UICache::load_entities() {
 			}
 
 			const ImageSet &s_tc = a.anim_at(gif);
-			IdPoolRef imgref = s_tc.try_at(ent.playerid, ent.subimage);
+			IdPoolRef imgref = s_tc.try_at(ent.playerid, ent.frame(e->gv.ticks));
 			const gfx::ImageRef &tc = a.at(imgref);
 
 			float x0 = tpos.x - tc.hotspot_x;
@@ -215,9 +215,9 @@ void UICache::load_entities() {
 
 			if (ent.xflip) {
 				x0 = tpos.x - tc.bnds.w + tc.hotspot_x;
-				entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tpos.y, ent.xflip);
+				entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s1, tc.t0, tc.s0, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 			} else {
-				entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, ent.xflip);
+				entities.emplace_back(ent.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, ent.xflip, ent.playerid);
 			}
 		}
 	}
@@ -4,47 +4,46 @@ namespace aoe {
 
 using namespace ui;
 
-void UICache::draw_tile(uint8_t id, uint8_t h, int x, int y, const ImVec2 &size, ImU32 col) {
+void UICache::add_tile(uint8_t id, uint8_t h, int x, int y, const SDL_Rect &area) {
 	const gfx::ImageRef &img = imgtile(id);
 
 	ImVec2 tpos(e->tilepos(x, y, left, top, h));
 
-	float x0 = tpos.x - img.hotspot_x;
-	float y0 = tpos.y - img.hotspot_y;
+	SDL_Rect bnds{ (int)(tpos.x - img.hotspot_x), (int)(tpos.y - img.hotspot_y), (int)img.bnds.w + 1, (int)img.bnds.h + 1 };
 
-	float x1 = x0 + img.bnds.w;
-	float y1 = y0 + img.bnds.h;
-
-	if (x1 >= 0 && x0 < size.x && y1 >= 0 && y0 < size.y) {
-		if (x == 0 && y == 0)
-			--tpos.x;
-
-		display_area.emplace_back(x, y, SDL_Rect{ (int)x0, (int)y0, (int)img.bnds.w + 1, (int)img.bnds.h + 1 });
-
-		bkg->AddImage(e->tex1, ImVec2(x0, y0), ImVec2(x1, y1), ImVec2(img.s0, img.t0), ImVec2(img.s1, img.t1), col);
-	}
+	if (bnds.x < area.x + area.w && area.x < bnds.x + bnds.w && bnds.y < area.y + area.h && area.y < bnds.y + bnds.h)
+		display_area.emplace_back(x, y, bnds);
 }
 
-void UICache::show_terrain() {
+void UICache::collect_tiles(const SDL_Rect &area) {
 	ZoneScoped;
 
-	Assets &a = *e->assets.get();
-	ImGuiIO &io = ImGui::GetIO();
-
 	GameView &gv = e->gv;
 
 	display_area.clear();
 
-	for (int y = 0; y < gv.t.h; ++y) {
-		for (int x = 0; x < gv.t.w; ++x) {
-			ImU32 col = IM_COL32_WHITE;
+	if (!gv.t.w || !gv.t.h)
+		return;
+
+	// project the area back onto the map, so we only visit tiles that may be in there.
+	// screen pos is (left + hw * (x + y), top + hh * (x - y - h)), so use u = x + y and v = x - y
+	float hw = e->tw / 2.0f, hh = e->th / 2.0f;
+
+	// tile images stick out a bit, so add a tile on each side
+	float u0 = (area.x - e->tw - left) / hw, u1 = (area.x + area.w + e->tw - left) / hw;
+	// raised tiles show up higher on the screen
+	float v0 = (area.y - e->th - top) / hh, v1 = (area.y + area.h + e->th - top) / hh + gv.hmax;
+
+	int y0 = std::max(0, (int)floor((u0 - v1) / 2));
+	int y1 = std::min((int)gv.t.h - 1, (int)ceil((u1 - v0) / 2));
 
+	for (int y = y0; y <= y1; ++y) {
+		int x0 = std::max(0, (int)floor(std::max(u0 - y, v0 + y)));
+		int x1 = std::min((int)gv.t.w - 1, (int)ceil(std::min(u1 - y, v1 + y)));
+
+		for (int x = x0; x <= x1; ++x) {
 			uint16_t id = gv.t.tile_at(x, y);
 			uint8_t h = gv.t.h_at(x, y);
-			if (!id) {
-				// draw black tile
-				col = IM_COL32_BLACK;
-			}
 
 			if (Terrain::tile_hasoverlay(id)) {
 				TileType base = Terrain::tile_base(id);
@@ -52,28 +51,83 @@ void UICache::show_terrain() {
 				unsigned bits = meta >> (12 - 3);
 				unsigned img = meta & ~0x1e00;
 
-				unsigned base_id = Terrain::tile_id(base, img);
-				draw_tile(base_id, h, x, y, io.DisplaySize, col);
+				add_tile(Terrain::tile_id(base, img), h, x, y, area);
 
 				TileType t = Terrain::tile_type(id);
 
-				assert(bits);
-
-				if (bits & 1)
-					draw_tile(Terrain::tile_id(t, 0), h, x, y, io.DisplaySize, col);
-				if (bits & 2)
-					draw_tile(Terrain::tile_id(t, 1), h, x, y, io.DisplaySize, col);
-				if (bits & 4)
-					draw_tile(Terrain::tile_id(t, 2), h, x, y, io.DisplaySize, col);
-				if (bits & 8)
-					draw_tile(Terrain::tile_id(t, 3), h, x, y, io.DisplaySize, col);
+				for (unsigned i = 0; i < 4; ++i)
+					if (bits & (1 << i))
+						add_tile(Terrain::tile_id(t, i), h, x, y, area);
 			} else {
-				draw_tile(id, h, x, y, io.DisplaySize, col);
+				add_tile(id, h, x, y, area);
 			}
 		}
 	}
 }
 
+void UICache::show_terrain() {
+	ZoneScoped;
+
+	GameView &gv = e->gv;
+
+	if (!gv.t.w || !gv.t.h)
+		return;
+
+	if (!terrain)
+		terrain.reset(new gfx::TerrainMesh());
+
+	if (gv.terrain_reset)
+		terrain->invalidate();
+	else
+		for (const TileArea &a : gv.terrain_dirty)
+			terrain->invalidate(a.x, a.y, a.w, a.h);
+
+	gv.terrain_dirty.clear();
+	gv.terrain_reset = false;
+
+	terrain->update(gv.t, e->tw, e->th, [this](uint8_t id) -> const gfx::ImageRef& { return imgtile(id); });
+	terrain->show(left, top);
+}
+
+void UICache::draw_world(float width, float height) {
+	if (terrain)
+		terrain->draw(e->textures, width, height);
+
+	if (sprites)
+		sprites->draw(e->textures, e->tex_players, e->tex_palette, width, height);
+}
+
+void UICache::gl_free() {
+	sprites.reset();
+	terrain.reset();
+}
+
+void UICache::add_sprite(SpriteLayer layer, const VisualEntity &v) {
+	if (!sprites)
+		sprites.reset(new gfx::SpriteBatch());
+
+	gfx::SpriteBatch::Sprite s;
+
+	// snap to pixels like imgui did
+	s.x = (int)v.x;
+	s.y = (int)v.y;
+	s.w = int(v.x + v.w) - s.x;
+	s.h = int(v.y + v.h) - s.y;
+
+	// mirrored images have their texture coordinates swapped, but the shader wants them in order
+	s.xflip = v.s0 > v.s1;
+	s.s0 = s.xflip ? v.s1 : v.s0;
+	s.s1 = s.xflip ? v.s0 : v.s1;
+	s.t0 = v.t0;
+	s.t1 = v.t1;
+
+	s.player = v.player % MAX_PLAYERS;
+	s.page = v.page;
+	s.pad = 0;
+
+	sprites->add((unsigned)layer, v.z, s);
+}
+
 void UICache::show_world() {
 	ZoneScoped;
 
@@ -115,25 +169,20 @@ void UICache::show_particles() {
 		}
 
 		const ImageSet &s_gif = a.anim_at(gif);
-		IdPoolRef imgref = s_gif.try_at(p.subimage);
+		IdPoolRef imgref = s_gif.try_at(p.frame(e->gv.ticks));
 		const gfx::ImageRef &tc = a.at(imgref);
 
 		float x0 = tpos.x - tc.hotspot_x;
 		float y0 = tpos.y - tc.hotspot_y;
 
-		particles.emplace_back(p.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tpos.y, false);
+		particles.emplace_back(p.ref, tc.ref, x0, y0, tc.bnds.w, tc.bnds.h, tc.s0, tc.t0, tc.s1, tc.t1, tc.page, tpos.y, false, 0);
 	}
 
-	std::sort(particles.begin(), particles.end(), [](const VisualEntity &lhs, const VisualEntity &rhs) { return lhs.z < rhs.z; });
-
-	ImDrawList *lst = ImGui::GetBackgroundDrawList();
-
-	for (VisualEntity &v : particles) {
-		lst->AddImage(e->tex1, ImVec2((int)v.x, (int)v.y), ImVec2(int(v.x + v.w), int(v.y + v.h)), ImVec2(v.s0, v.t0), ImVec2(v.s1, v.t1));
-	}
+	for (const VisualEntity &v : particles)
+		add_sprite(SpriteLayer::particles, v);
 }
 
-bool UICache::menu_btn(ImTextureID tex, const Assets &a, const char *lbl, float x, float scale, bool small) {
+bool UICache::menu_btn(const Assets &a, const char *lbl, float x, float scale, bool small) {
 	ZoneScoped;
 	const ImageSet &btns_s = a.anim_at(small ? io::DrsId::gif_menu_btn_small0 : io::DrsId::gif_menu_btn_medium0);
 
@@ -157,7 +206,7 @@ bool UICache::menu_btn(ImTextureID tex, const Assets &a, const char *lbl, float
 		held = true;
 	}
 
-	lst->AddImage(tex, ImVec2(x, vp->WorkPos.y), ImVec2(x + btn_w, vp->WorkPos.y + btn_h), ImVec2(s0, t0), ImVec2(s1, t1));
+	lst->AddImage(e->tex(rbtns), ImVec2(x, vp->WorkPos.y), ImVec2(x + btn_w, vp->WorkPos.y + btn_h), ImVec2(s0, t0), ImVec2(s1, t1));
 
 	ImVec2 sz(ImGui::CalcTextSize(lbl));
 	if (snd) { ++x; ++y; }
@@ -295,7 +344,7 @@ void UICache::show_multiplayer_game() {
 	// TODO use p.res.age
 	std::string age(e->txt(StrId::age_stone));
 
-	lst->AddImage(e->tex1, ImVec2(menubar_left, vp->WorkPos.y), ImVec2(menubar_left + menubar_w, vp->WorkPos.y + menubar_h), ImVec2(rtop.s0, rtop.t0), ImVec2(rtop.s1, rtop.t1));
+	lst->AddImage(e->tex(rtop), ImVec2(menubar_left, vp->WorkPos.y), ImVec2(menubar_left + menubar_w, vp->WorkPos.y + menubar_h), ImVec2(rtop.s0, rtop.t0), ImVec2(rtop.s1, rtop.t1));
 
 	gmb_top.x = menubar_left;
 	gmb_top.w = menubar_w;
@@ -338,19 +387,19 @@ void UICache::show_multiplayer_game() {
 		ImGui::EndPopup();
 	}
 
-	if (menu_btn(e->tex1, a, "Menu", btn_left, scale, true)) {
+	if (menu_btn(a, "Menu", btn_left, scale, true)) {
 		e->sfx.play_sfx(SfxId::sfx_ui_click);
 		ImGui::OpenPopup("MenuPopup");
 	}
 
 	btn_left -= rbtnm.bnds.w * scale;
-	if (menu_btn(e->tex1, a, "Diplomacy", btn_left, scale, false)) {
+	if (menu_btn(a, "Diplomacy", btn_left, scale, false)) {
 		e->sfx.play_sfx(SfxId::sfx_ui_click);
 		e->show_diplomacy = !e->show_diplomacy;
 	}
 
 	btn_left -= rbtns.bnds.w * scale;
-	if (menu_btn(e->tex1, a, "Chat", btn_left, scale, true)) {
+	if (menu_btn(a, "Chat", btn_left, scale, true)) {
 		e->sfx.play_sfx(SfxId::sfx_ui_click);
 		e->show_chat = !e->show_chat;
 	}
@@ -386,7 +435,7 @@ void UICache::show_multiplayer_game() {
 
 	float top = vp->WorkPos.y + vp->WorkSize.y - menubar_h;
 
-	lst->AddImage(e->tex1, ImVec2(menubar_left, top), ImVec2(menubar_left + menubar_w, top + menubar_h), ImVec2(rbottom.s0, rbottom.t0), ImVec2(rbottom.s1, rbottom.t1));
+	lst->AddImage(e->tex(rbottom), ImVec2(menubar_left, top), ImVec2(menubar_left + menubar_w, top + menubar_h), ImVec2(rbottom.s0, rbottom.t0), ImVec2(rbottom.s1, rbottom.t1));
 
 	gmb_bottom.x = menubar_left;
 	gmb_bottom.w = menubar_w;
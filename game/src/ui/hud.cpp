@@ -56,8 +56,8 @@ void UICache::idle_game() {
 	auto &spawned = e->gv.entities_spawned;
 
 	for (IdPoolRef ref : spawned) {
-		auto it = e->gv.entities.find(ref);
-		if (it == e->gv.entities.end())
+		const Entity *it = e->gv.try_get(ref);
+		if (!it)
 			continue;
 
 		const Entity &ent = *it;
@@ -112,7 +112,7 @@ void UICache::user_interact_entities() {
 }
 
 void UICache::image(const gfx::ImageRef &ref, float x, float y, float scale) {
-	bkg->AddImage(e->tex1, ImVec2(x, y), ImVec2(x + ref.bnds.w * scale, y + ref.bnds.h * scale), ImVec2(ref.s0, ref.t0), ImVec2(ref.s1, ref.t1));
+	bkg->AddImage(e->tex(ref), ImVec2(x, y), ImVec2(x + ref.bnds.w * scale, y + ref.bnds.h * scale), ImVec2(ref.s0, ref.t0), ImVec2(ref.s1, ref.t1));
 }
 
 void UICache::show_hud_selection(float menubar_left, float top, float menubar_h) {
@@ -145,7 +145,7 @@ void UICache::show_hud_selection(float menubar_left, float top, float menubar_h)
 
 	// 8,679 -> 8,37
 	float x0 = menubar_left + 10 * scale, y0 = top + 37 * scale;
-	bkg->AddImage(e->tex1, ImVec2(x0, y0), ImVec2(x0 + img.bnds.w * scale, y0 + img.bnds.h * scale), ImVec2(img.s0, img.t0), ImVec2(img.s1, img.t1));
+	bkg->AddImage(e->tex(img), ImVec2(x0, y0), ImVec2(x0 + img.bnds.w * scale, y0 + img.bnds.h * scale), ImVec2(img.s0, img.t0), ImVec2(img.s1, img.t1));
 
 	// HP
 	// 8, 733 -> 8,91
@@ -156,7 +156,7 @@ void UICache::show_hud_selection(float menubar_left, float top, float menubar_h)
 	const gfx::ImageRef &hpimg = a.at(s_hpbar.try_at(subimage));
 
 	x0 = menubar_left + 10 * scale, y0 = top + 91 * scale;
-	bkg->AddImage(e->tex1, ImVec2(x0, y0), ImVec2(x0 + hpimg.bnds.w * scale, y0 + hpimg.bnds.h * scale), ImVec2(hpimg.s0, hpimg.t0), ImVec2(hpimg.s1, hpimg.t1));
+	bkg->AddImage(e->tex(hpimg), ImVec2(x0, y0), ImVec2(x0 + hpimg.bnds.w * scale, y0 + hpimg.bnds.h * scale), ImVec2(hpimg.s0, hpimg.t0), ImVec2(hpimg.s1, hpimg.t1));
 
 	// 8, 744 -> 8,102
 	char buf[32];
@@ -66,7 +66,7 @@ void UICache::show_editor_scenario() {
 
 	t1 = bkg.t0 + (bkg.t1 - bkg.t0) * h / bkg.bnds.h;
 
-	lst->AddImage(e->tex1, ImVec2(menubar_left, vp->WorkPos.y), ImVec2(menubar_right, vp->WorkPos.y + h * scale), ImVec2(bkg.s0, bkg.t0), ImVec2(bkg.s1, t1));
+	lst->AddImage(e->tex(bkg), ImVec2(menubar_left, vp->WorkPos.y), ImVec2(menubar_right, vp->WorkPos.y + h * scale), ImVec2(bkg.s0, bkg.t0), ImVec2(bkg.s1, t1));
 
 	h = 143.0f;
 	float t0 = bkg.t0 + (bkg.t1 - bkg.t0) * (bkg.bnds.h - h) / bkg.bnds.h;
@@ -74,7 +74,7 @@ void UICache::show_editor_scenario() {
 	float menubar2_top = vp->WorkPos.y + vp->WorkSize.y - h * scale;
 	float menubar2_bottom = vp->WorkPos.y + vp->WorkSize.y;
 
-	lst->AddImage(e->tex1, ImVec2(menubar_left, menubar2_top), ImVec2(menubar_right, menubar2_bottom), ImVec2(bkg.s0, t0), ImVec2(bkg.s1, bkg.t1));
+	lst->AddImage(e->tex(bkg), ImVec2(menubar_left, menubar2_top), ImVec2(menubar_right, menubar2_bottom), ImVec2(bkg.s0, t0), ImVec2(bkg.s1, bkg.t1));
 
 	// draw buttons
 	BackgroundColors col;
@@ -20,7 +20,7 @@ bool Engine::show_achievements(Frame &f, bool bkg) {
 	float w = 1, sx = 1, sy = 1;
 
 	if (bkg) {
-		lst->AddImage(tex1, tl, br, ImVec2(ref.s0, ref.t0), ImVec2(ref.s1, ref.t1));
+		lst->AddImage(tex(ref), tl, br, ImVec2(ref.s0, ref.t0), ImVec2(ref.s1, ref.t1));
 		w = br.x - tl.x;
 	} else {
 		//w = ImGui::GetMainViewport()->Size.x;
@@ -15,13 +15,15 @@ EntityView::EntityView() : ref(invalid_ref), type(EntityType::town_center), play
 
 EntityView::EntityView(const Entity &e) : ref(e.ref), type(e.type), playerid(e.playerid), x(e.x), y(e.y), angle(e.angle), subimage(e.subimage), state(e.state), xflip(e.xflip), stats(e.stats) {}
 
-Entity::Entity(IdPoolRef ref) : ref(ref), type(EntityType::town_center), playerid(0), x(0), y(0), angle(0), target_ref(invalid_ref), target_x(0), target_y(0), subimage(0), state(EntityState::alive), xflip(false), autotask(false), stats(entity_info.at((unsigned)type)) {}
+Entity::Entity(IdPoolRef ref) : ref(ref), type(EntityType::town_center), playerid(0), x(0), y(0), angle(0), target_ref(invalid_ref), target_x(0), target_y(0), subimage(0), state(EntityState::alive), xflip(false), autotask(false), anim_reset(true), stats(entity_info.at((unsigned)type)), anim_start(0) {}
 
-Entity::Entity(IdPoolRef ref, EntityType type, unsigned playerid, float x, float y, float angle, EntityState state) : ref(ref), type(type), playerid(playerid), x(x), y(y), angle(angle), target_ref(invalid_ref), target_x(0), target_y(0), subimage(0), state(state), xflip(false), autotask(false), stats(entity_info.at((unsigned)type)) {}
+Entity::Entity(IdPoolRef ref, EntityType type, unsigned playerid, float x, float y, float angle, EntityState state) : ref(ref), type(type), playerid(playerid), x(x), y(y), angle(angle), target_ref(invalid_ref), target_x(0), target_y(0), subimage(0), state(state), xflip(false), autotask(false), anim_reset(true), stats(entity_info.at((unsigned)type)), anim_start(0) {
+	turn();
+}
 
-Entity::Entity(IdPoolRef ref, EntityType type, float x, float y, unsigned subimage) : ref(ref), type(type), playerid(0), x(x), y(y), angle(0), target_ref(invalid_ref), target_x(0), target_y(0), subimage(subimage), state(EntityState::alive), xflip(false), autotask(false), stats(entity_info.at((unsigned)type)) {}
+Entity::Entity(IdPoolRef ref, EntityType type, float x, float y, unsigned subimage) : ref(ref), type(type), playerid(0), x(x), y(y), angle(0), target_ref(invalid_ref), target_x(0), target_y(0), subimage(subimage), state(EntityState::alive), xflip(false), autotask(false), anim_reset(true), stats(entity_info.at((unsigned)type)), anim_start(0) {}
 
-Entity::Entity(const EntityView &ev) : ref(ev.ref), type(ev.type), playerid(ev.playerid), x(ev.x), y(ev.y), angle(ev.angle), target_ref(invalid_ref), target_x(0), target_y(0), subimage(ev.subimage), state(ev.state), xflip(ev.xflip), autotask(false), stats(ev.stats) {}
+Entity::Entity(const EntityView &ev) : ref(ev.ref), type(ev.type), playerid(ev.playerid), x(ev.x), y(ev.y), angle(ev.angle), target_ref(invalid_ref), target_x(0), target_y(0), subimage(ev.subimage), state(ev.state), xflip(ev.xflip), autotask(false), anim_reset(true), stats(ev.stats), anim_start(0) {}
 
 bool Entity::die() noexcept {
 	if (!is_alive())
@@ -40,7 +42,8 @@ void Entity::decay() noexcept {
 
 void Entity::reset_anim() noexcept {
 	subimage = 0;
-	imgtick(0); // fix face depending on angle
+	anim_reset = true;
+	turn();
 }
 
 bool Entity::set_state(EntityState s) noexcept {
@@ -70,13 +73,14 @@ float Entity::lookat(float x, float y) noexcept {
 	float dx = x - this->x, dy = y - this->y;
 	// compute angle and make sure it's always positive
 	angle = fmodf(atan2(dy, dx) + 2 * M_PI, 2 * M_PI);
+	turn();
 	return sqrt(dx * dx + dy * dy);
 }
 
 bool Entity::move() noexcept {
 	float distance = lookat(target_x, target_y);
 
-	float speed = 0.04f; // TODO determine from entity stats
+	float speed = move_speed;
 	if (distance < speed) {
 		x = target_x;
 		y = target_y;
@@ -401,82 +405,96 @@ bool Entity::in_range(const Entity &e) const noexcept {
 	return distance < size1 + size2 + 0.05f;// +stats.range;
 }
 
-bool Entity::imgtick(unsigned n) noexcept {
-	bool more = true;
-	unsigned mult;
-
+unsigned Entity::face(bool &xflip) const noexcept {
 	const std::array<unsigned, 8> faces{ 1, 2, 3, 4, 3, 2, 1, 0 };
 
 	// note that we have 8 faces, so (2pi)/8 = pi/4. then we need (2pi)/(2*8) to correct for [-a,+a) range.
 	float normface = fmodf(angle + M_PI / 8, 2 * M_PI) / (M_PI / 4);
 	unsigned uface = (unsigned)normface % 8u;
 
-	unsigned face = faces[uface];
 	xflip = uface < 3;
+	return faces[uface];
+}
+
+void Entity::turn() noexcept {
+	face(xflip);
+}
+
+void Entity::start_anim(uint64_t now) noexcept {
+	anim_start = now;
+	anim_reset = false;
+}
+
+float Entity::frame(uint64_t now) const noexcept {
+	// not started yet, so it will start right away
+	float t = anim_reset || now < anim_start ? 0.0f : (float)(now - anim_start);
+	bool flip;
 
 	if (type >= entity_img_info[0].type && type <= entity_img_info.back().type) {
 		const EntityImgInfo &img = img_info();
+		unsigned face = this->face(flip), mult;
 
 		switch (state) {
 		case EntityState::alive:
 			mult = img.alive;
-			subimage = fmodf(subimage + n * 0.1, mult) + face * mult;
-			break;
+			return mult ? fmodf(t * 0.1f, mult) + face * mult : subimage;
 		case EntityState::dying:
 			mult = img.dying;
-			more = (unsigned)fmodf(subimage, mult) != img.ii_dying;
-			subimage = std::min<float>(fmodf(subimage, mult) + n, mult - 1) + face * mult;
-			break;
+			return mult ? std::min<float>(t, mult - 1) + face * mult : subimage;
 		case EntityState::decaying:
 			mult = img.decaying;
-			more = fmodf(subimage, mult) < mult - 0.5;
-			subimage = std::min<float>(fmodf(subimage, mult) + n * 0.002, mult - 1) + face * mult;
-			break;
+			return mult ? std::min<float>(t * 0.002f, mult - 1) + face * mult : subimage;
 		case EntityState::attack:
 			mult = img.attack;
-			more = (unsigned)fmodf(subimage, mult) != img.ii_attack;
-			subimage = fmodf(subimage + n, mult) + face * mult;
 			break;
 		case EntityState::attack_follow:
 			mult = img.attack_follow;
-			subimage = fmodf(subimage + n, mult) + face * mult;
 			break;
 		case EntityState::moving:
 			mult = img.moving;
-			subimage = fmodf(subimage + n, mult) + face * mult;
 			break;
+		default:
+			return subimage;
 		}
+
+		return mult ? fmodf(t, mult) + face * mult : subimage;
 	} else if (is_building(type) && is_alive()) {
-		mult = 20;
-		more = true;
-		float hper = (float)stats.hp / stats.maxhp;
-		if (hper <= 0.75f)
-			subimage = fmodf(subimage + n, mult);
+		// fire, if damaged
+		return fmodf(t, 20);
 	}
 
-#if 0
-	switch (type) {
-	case EntityType::bird1: {
-		// TODO birds have more angles
-		// TODO still buggy
-		const std::array<unsigned, 16> faces{ 1, 2, 3, 4, 5, 6, 5, 4, 3, 2, 1, 0 };
-		const std::array<bool, 16> xflips{ true, true, true, true, true, true, true, false, false, false, false, false, false, false, false, false };
+	return subimage;
+}
 
-		// note that we have 16 faces, so (2pi)/16 = pi/8. then we need (2pi)/(2*16) to correct for [-a,+a) range.
-		float normface = fmodf(angle + M_PI / 16, 2 * M_PI) / (M_PI / 8);
-		unsigned uface = (unsigned)normface % 16u;
+std::optional<uint64_t> Entity::anim_event(uint64_t after) const noexcept {
+	if (anim_reset || type < entity_img_info[0].type || type > entity_img_info.back().type)
+		return std::nullopt;
 
-		unsigned face = faces[uface];
-		xflip = xflips[uface];
+	const EntityImgInfo &img = img_info();
 
-		mult = 12;
-		subimage = (subimage + n) % mult + face * mult;
-		break;
-	}
+	// the image of impact has been shown for one tick when the event fires
+	switch (state) {
+	case EntityState::dying: {
+		if (img.ii_dying >= img.dying)
+			return std::nullopt;
+
+		uint64_t t = anim_start + img.ii_dying + 1;
+		return t > after ? std::optional<uint64_t>(t) : std::nullopt;
 	}
-#endif
+	case EntityState::attack: {
+		if (img.ii_attack >= img.attack)
+			return std::nullopt;
 
-	return more;
+		uint64_t t = anim_start + img.ii_attack + 1;
+
+		if (t <= after)
+			t += ((after - t) / img.attack + 1) * img.attack;
+
+		return t;
+	}
+	default:
+		return std::nullopt;
+	}
 }
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <idpool.hpp>
+#include <cstdint>
 #include <optional>
 
 #include "../engine/audio.hpp"
@@ -73,12 +74,17 @@ public:
 	IdPoolRef target_ref; // if == invalid_ref, use target_x,target_y
 	float target_x, target_y;
 
-	float subimage;
+	float subimage; // only used by entities without animation
 	EntityState state;
 	bool xflip, autotask;
+	bool anim_reset; // animation has changed, but has not been started yet
 
 	EntityStats stats;
 
+	uint64_t anim_start; // tick at which the current animation has started
+
+	static constexpr float move_speed = 0.04f; // tiles per tick. TODO determine from entity stats
+
 	Entity(IdPoolRef ref);
 	Entity(IdPoolRef ref, EntityType type, unsigned playerid, float x, float y, float angle=0.0f, EntityState state=EntityState::alive);
 	// resource only
@@ -117,9 +123,17 @@ public:
 	const EntityBldInfo &bld_info() const;
 	const EntityImgInfo &img_info() const;
 
-	bool imgtick(unsigned n) noexcept;
+	/** Play the current animation from tick \a now. */
+	void start_anim(uint64_t now) noexcept;
+	/** Compute image to show at tick \a now. Nothing is stored, so idle entities cost nothing until they are drawn. */
+	float frame(uint64_t now) const noexcept;
+	/** First tick after \a after at which the animation shows its image of impact, if it has any. */
+	std::optional<uint64_t> anim_event(uint64_t after) const noexcept;
+	/** Update xflip after angle has changed. */
+	void turn() noexcept;
 private:
 	void reset_anim() noexcept;
+	unsigned face(bool &xflip) const noexcept;
 	bool set_state(EntityState) noexcept;
 	bool try_state(EntityState) noexcept;
 	bool move() noexcept;
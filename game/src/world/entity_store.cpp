@@ -0,0 +1,102 @@
+#include "entity_store.hpp"
+
+#include <stdexcept>
+
+namespace aoe {
+
+/** Return where the position of \a ref is stored or nullptr if it is not in use. */
+uint32_t *EntityStore::find(IdPoolRef ref) noexcept {
+	RefCounter id = ref.first;
+
+	if (id < slots.size() && slots[id] && dense[slots[id] - 1].ref == ref)
+		return &slots[id];
+
+	if (spill.empty())
+		return nullptr;
+
+	auto it = spill.find(ref);
+	return it == spill.end() ? nullptr : &it->second;
+}
+
+void EntityStore::link(IdPoolRef ref, uint32_t pos) {
+	RefCounter id = ref.first;
+
+	if (id < max_slots) {
+		if (id >= slots.size())
+			slots.resize(id + 1);
+
+		if (!slots[id]) {
+			slots[id] = pos + 1;
+			return;
+		}
+	}
+
+	spill[ref] = pos + 1;
+}
+
+Entity *EntityStore::try_get(IdPoolRef ref) noexcept {
+	uint32_t *pos = find(ref);
+	return pos ? &dense[*pos - 1] : nullptr;
+}
+
+const Entity *EntityStore::try_get(IdPoolRef ref) const noexcept {
+	return const_cast<EntityStore*>(this)->try_get(ref);
+}
+
+Entity &EntityStore::at(IdPoolRef ref) {
+	Entity *ent = try_get(ref);
+	if (!ent)
+		throw std::out_of_range("entity store: bad ref");
+
+	return *ent;
+}
+
+Entity &EntityStore::emplace(const Entity &ent) {
+	uint32_t *pos = find(ent.ref);
+	if (pos)
+		return dense[*pos - 1];
+
+	link(ent.ref, (uint32_t)dense.size());
+	return dense.emplace_back(ent);
+}
+
+Entity &EntityStore::put(const Entity &ent) {
+	uint32_t *pos = find(ent.ref);
+	if (!pos)
+		return emplace(ent);
+
+	Entity &dst = dense[*pos - 1];
+	dst = ent;
+	return dst;
+}
+
+bool EntityStore::erase(IdPoolRef ref) {
+	uint32_t *pos = find(ref);
+	if (!pos)
+		return false;
+
+	uint32_t idx = *pos - 1;
+
+	if (ref.first < slots.size() && pos == &slots[ref.first])
+		*pos = 0;
+	else
+		spill.erase(ref);
+
+	uint32_t last = (uint32_t)dense.size() - 1;
+
+	if (idx != last) {
+		*find(dense[last].ref) = idx + 1;
+		dense[idx] = std::move(dense[last]);
+	}
+
+	dense.pop_back();
+	return true;
+}
+
+void EntityStore::clear() noexcept {
+	dense.clear();
+	slots.clear();
+	spill.clear();
+}
+
+}
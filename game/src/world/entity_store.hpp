@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+#include <map>
+#include <vector>
+
+#include <idpool.hpp>
+
+#include "entity.hpp"
+
+namespace aoe {
+
+/**
+ * Client side entity storage. Entities are kept in one contiguous array in no
+ * particular order, so drawing them is a linear walk. Refs are looked up by
+ * their id through a slot table and the full ref is compared to catch stale
+ * ones. The server may hand out the same id for two live entities, so those
+ * and ids that are too big for the slot table end up in a small map instead.
+ */
+class EntityStore final {
+	std::vector<Entity> dense;
+	std::vector<uint32_t> slots; // id -> position in dense + 1. zero if not in use
+	std::map<IdPoolRef, uint32_t> spill; // same as slots, for refs that do not fit in there
+public:
+	static constexpr RefCounter max_slots = 1 << 20;
+
+	EntityStore() : dense(), slots(), spill() {}
+
+	Entity *try_get(IdPoolRef ref) noexcept;
+	const Entity *try_get(IdPoolRef ref) const noexcept;
+	Entity &at(IdPoolRef ref);
+
+	/** Add \a ent if its ref is not in use. Returns whatever is stored for the ref afterwards. */
+	Entity &emplace(const Entity &ent);
+	/** Add \a ent or overwrite the entity with the same ref in place. */
+	Entity &put(const Entity &ent);
+	/** Remove entity. The last entity is moved into the hole, so pointers to it become invalid. */
+	bool erase(IdPoolRef ref);
+
+	void clear() noexcept;
+
+	auto begin() noexcept { return dense.begin(); }
+	auto begin() const noexcept { return dense.begin(); }
+	auto end() noexcept { return dense.end(); }
+	auto end() const noexcept { return dense.end(); }
+
+	size_t size() const noexcept { return dense.size(); }
+	bool empty() const noexcept { return dense.empty(); }
+private:
+	uint32_t *find(IdPoolRef ref) noexcept;
+	void link(IdPoolRef ref, uint32_t pos);
+};
+
+}
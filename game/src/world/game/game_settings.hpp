@@ -48,6 +48,7 @@ public:
 	bool wrap;
 	bool restricted; // allow other players to also change settings
 	bool reorder; // allow to move players up and down in the list
+	bool lockstep; // clients run the simulation themselves and only commands are sent around
 	unsigned width, height;
 	unsigned popcap;
 	int age;
@@ -0,0 +1,45 @@
+#include "../server.hpp"
+
+#include <algorithm>
+
+namespace aoe {
+
+void LockstepRelay::reset() {
+	pending.clear();
+	checksums.clear();
+	turn = 0;
+}
+
+NetTurn LockstepRelay::next(uint16_t ticks) {
+	ZoneScoped;
+	NetTurn t(turn++, ticks);
+
+	// NOTE stable sort to keep the order of arrival within each player
+	std::stable_sort(pending.begin(), pending.end(), [](const NetTurnCommand &lhs, const NetTurnCommand &rhs) {
+		return lhs.player < rhs.player;
+	});
+
+	size_t n = std::min(pending.size(), NetTurn::max_cmds);
+
+	t.cmds.assign(pending.begin(), pending.begin() + n);
+	pending.erase(pending.begin(), pending.begin() + n);
+
+	return t;
+}
+
+void LockstepRelay::commit(uint32_t turn, uint32_t hash) {
+	checksums[turn] = hash;
+
+	while (checksums.size() > history)
+		checksums.erase(checksums.begin());
+}
+
+std::optional<bool> LockstepRelay::verify(uint32_t turn, uint32_t hash) const {
+	auto it = checksums.find(turn);
+	if (it == checksums.end())
+		return std::nullopt;
+
+	return it->second == hash;
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "../net/protocol.hpp"
+
+namespace aoe {
+
+/**
+ * Collect commands for lockstep mode and group them in turns. Commands
+ * within a turn are ordered by player and then by arrival, so a peer that
+ * spams commands cannot push back everyone else within the same turn.
+ */
+class LockstepRelay final {
+	std::vector<NetTurnCommand> pending;
+	std::map<uint32_t, uint32_t> checksums; // server state hash per turn
+	uint32_t turn;
+public:
+	static constexpr unsigned history = 256; // number of turns to keep checksums for
+
+	LockstepRelay() : pending(), checksums(), turn(0) {}
+
+	void reset();
+
+	void add(const NetTurnCommand &cmd) { pending.emplace_back(cmd); }
+
+	size_t queued() const noexcept { return pending.size(); }
+	uint32_t current() const noexcept { return turn; }
+
+	/** Close the current turn that spans \a ticks game ticks. Commands that do not fit are deferred to the next turn. */
+	NetTurn next(uint16_t ticks);
+
+	/** Remember the state hash after running all ticks of \a turn. */
+	void commit(uint32_t turn, uint32_t hash);
+
+	/** Compare a peer's hash to ours. Returns nothing if we do not know the hash for \a turn (anymore). */
+	std::optional<bool> verify(uint32_t turn, uint32_t hash) const;
+};
+
+}
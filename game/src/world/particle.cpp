@@ -4,27 +4,41 @@
 
 namespace aoe {
 
-Particle::Particle(IdPoolRef ref, ParticleType type, float x, float y, unsigned subimage) : ref(ref), type(type), x(x), y(y), subimage(subimage) {}
-
-bool Particle::imgtick(unsigned n) noexcept {
-	bool more = false;
-	unsigned end;
+Particle::Particle(IdPoolRef ref, ParticleType type, float x, float y, unsigned subimage, uint64_t start) : ref(ref), type(type), x(x), y(y), subimage(subimage), start(start) {}
 
+/** Get last image and images per tick. */
+void Particle::anim(unsigned &end, float &speed) const noexcept {
 	switch (type) {
 	case ParticleType::explode1:
 	case ParticleType::explode2:
 		end = 10u - 1u;
-		more = subimage < end;
-		subimage = std::clamp<float>(subimage + n, 0u, end);
+		speed = 1;
 		break;
 	default:
 		end = 8u - 1u;
-		more = subimage < end;
-		subimage = std::clamp<float>(subimage + n * 0.25, 0u, end);
+		speed = 0.25f;
 		break;
 	}
+}
+
+float Particle::frame(uint64_t now) const noexcept {
+	unsigned end;
+	float speed;
+
+	anim(end, speed);
+
+	float t = now < start ? 0.0f : (float)(now - start);
+	return std::clamp<float>(subimage + t * speed, 0u, end);
+}
+
+bool Particle::done(uint64_t now) const noexcept {
+	unsigned end;
+	float speed;
+
+	anim(end, speed);
 
-	return more;
+	// the last image is shown for one tick
+	return now > start && subimage + (now - start - 1) * speed >= end;
 }
 
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 namespace aoe {
 
 enum class ParticleType {
@@ -16,15 +18,20 @@ public:
 	float x, y;
 
 	float subimage;
+	uint64_t start; // tick at which it has been spawned
 
-	Particle(IdPoolRef ref, ParticleType type, float x, float y, unsigned subimage);
+	Particle(IdPoolRef ref, ParticleType type, float x, float y, unsigned subimage, uint64_t start=0);
 
-	/* Animate and return whether there's more images. Returning false means the animation has ended and the particle shall be destroyed. */
-	bool imgtick(unsigned n) noexcept;
+	/* Compute image to show at tick \a now. */
+	float frame(uint64_t now) const noexcept;
+	/* Return whether the animation has ended at tick \a now and the particle shall be destroyed. */
+	bool done(uint64_t now) const noexcept;
 
 	friend bool operator<(const Particle &lhs, const Particle &rhs) noexcept {
 		return lhs.ref < rhs.ref;
 	}
+private:
+	void anim(unsigned &end, float &speed) const noexcept;
 };
 
 }
@@ -1,6 +1,7 @@
 #include "../terrain.hpp"
 
 #include <perlin_noise.hpp>
+#include <rng.hpp>
 
 namespace aoe {
 
@@ -10,6 +11,7 @@ void Terrain::tgen_normal() {
 	double octaves = 5;
 
 	const siv::PerlinNoise perlin{ seed };
+	Rng rng(seed);
 	const double fx = frequency / this->w;
 	const double fy = frequency / this->h;
 
@@ -20,9 +22,9 @@ void Terrain::tgen_normal() {
 			size_t i = y * w + x;
 
 			if (v > 0.5)
-				tiles[i] = Terrain::tile_id(TileType::grass, rand() % 9);
+				tiles[i] = Terrain::tile_id(TileType::grass, rng.below(9));
 			else if (v > 0.2)
-				tiles[i] = Terrain::tile_id(TileType::desert, rand() % 9);
+				tiles[i] = Terrain::tile_id(TileType::desert, rng.below(9));
 			else
 				tiles[i] = Terrain::tile_id(TileType::water, 0);
 
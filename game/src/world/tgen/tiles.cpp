@@ -5,6 +5,8 @@
 #include <array>
 #include <set>
 
+#include <rng.hpp>
+
 #include "../engine/grid.hpp"
 
 namespace aoe {
@@ -25,9 +27,10 @@ const std::array<std::pair<int, int>, 8> neighs_dir{{
 void Terrain::tgen_desert() {
 	// TODO use real generator like perlin noise
 	TileType types[] = { TileType::desert, TileType::grass, TileType::grass_desert };
+	Rng rng(seed);
 
 	for (size_t i = 0, n = tiles.size(); i < n; ++i) {
-		tiles[i] = Terrain::tile_id(TileType::desert, rand() % 9);
+		tiles[i] = Terrain::tile_id(TileType::desert, rng.below(9));
 		hmap[i] = 0;
 	}
 }
@@ -0,0 +1,61 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+
+namespace aoe {
+
+static_assert((TimerWheel::size & (TimerWheel::size - 1)) == 0);
+
+TimerWheel::TimerWheel() : slots(size), due(), now(0), count(0) {}
+
+void TimerWheel::reset(uint64_t now) {
+	for (std::vector<Timer> &s : slots)
+		s.clear();
+
+	due.clear();
+	this->now = now;
+	count = 0;
+}
+
+void TimerWheel::schedule(uint64_t when, IdPoolRef ref, uint64_t token) {
+	when = std::max(when, now + 1);
+
+	slots[when & (size - 1)].emplace_back(Timer{ when, ref, token });
+	++count;
+}
+
+const std::vector<TimerWheel::Timer> &TimerWheel::advance(uint64_t now) {
+	due.clear();
+
+	if (now <= this->now)
+		return due;
+
+	uint64_t from = this->now;
+	// every slot is visited at most once, no matter how far we go
+	uint64_t end = std::min(now, from + size);
+
+	for (uint64_t t = from + 1; t <= end && count; ++t) {
+		std::vector<Timer> &s = slots[t & (size - 1)];
+		size_t keep = 0;
+
+		for (size_t i = 0; i < s.size(); ++i) {
+			if (s[i].when <= now)
+				due.emplace_back(s[i]);
+			else
+				s[keep++] = s[i];
+		}
+
+		count -= s.size() - keep;
+		s.resize(keep);
+	}
+
+	this->now = now;
+
+	// timers from later rounds may show up in earlier slots
+	if (now - from > 1)
+		std::stable_sort(due.begin(), due.end(), [](const Timer &lhs, const Timer &rhs) { return lhs.when < rhs.when; });
+
+	return due;
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+#include <vector>
+
+#include <idpool.hpp>
+
+namespace aoe {
+
+/**
+ * Hashed timer wheel for animation events, such as the image of impact while
+ * attacking. Timers are never cancelled. Instead, each one has a token that
+ * whoever pops it compares to the entity, so stale timers can be skipped.
+ */
+class TimerWheel final {
+public:
+	struct Timer final {
+		uint64_t when;
+		IdPoolRef ref;
+		uint64_t token;
+	};
+private:
+	std::vector<std::vector<Timer>> slots;
+	std::vector<Timer> due;
+	uint64_t now;
+	size_t count;
+public:
+	static constexpr unsigned size = 256; // must be a power of two
+
+	TimerWheel();
+
+	void reset(uint64_t now=0);
+
+	/** Fire timer for \a ref at tick \a when. Timers that are already due fire on the next tick. */
+	void schedule(uint64_t when, IdPoolRef ref, uint64_t token);
+
+	/** Move to tick \a now and return all timers that have expired, in order of expiration. */
+	const std::vector<Timer> &advance(uint64_t now);
+
+	size_t pending() const noexcept { return count; }
+};
+
+}
@@ -4,7 +4,7 @@
 
 #include <array>
 #include <chrono>
-#include <random>
+#include <cstring>
 
 #include <tracy/Tracy.hpp>
 
@@ -62,7 +62,8 @@ World::World()
 	: m(), m_events(), t(), entities(), dirty_entities(), spawned_entities()
 	, particles(), spawned_particles()
 	, players(), player_achievements(), events_in(), events_out(), views()
-	, resources_out(), s(nullptr), gameover(false), scn(), logic_gamespeed(1.0), running(false) {}
+	, resources_out(), s(nullptr), gameover(false), rng(), relay(), desynced(), sink(), local_player(0), resyncs(), ticks(0), ticks_out(0), simticks(0), anims()
+	, scn(), logic_gamespeed(1.0), snapshot_rate(DEFAULT_TICKS_PER_SECOND), running(false) {}
 
 void World::load_scn(const ScenarioSettings &scn) {
 	ZoneScoped;
@@ -83,6 +84,7 @@ void World::load_scn(const ScenarioSettings &scn) {
 	this->scn.cheating = scn.cheating;
 	this->scn.square = scn.square;
 	this->scn.wrap = scn.wrap;
+	this->scn.lockstep = scn.lockstep;
 	this->scn.type = scn.type;
 
 	t.resize(this->scn.width, this->scn.height, this->scn.seed, this->scn.players.size(), this->scn.wrap, this->scn.type);
@@ -134,69 +136,27 @@ void World::tick_entities() {
 	for (auto &kv : entities) {
 		Entity &ent = kv.second;
 
-		if (is_building(ent.type))
+		if (is_building(ent.type)) {
+			if (ent.anim_reset)
+				start_anim(ent);
 			continue;
+		}
 
 		bool alive = ent.is_alive();
-		bool dirty = ent.tick(wv), tdirty = false;
-		bool more = ent.imgtick(1);
+		bool dirty = ent.tick(wv);
+
+		if (ent.anim_reset)
+			start_anim(ent);
 
 		if (alive && !ent.is_alive())
 			died_entities.emplace(ent.ref);
 
-		switch (ent.state) {
-			case EntityState::dying:
-				if (!more) {
-					ent.decay();
-					dirty = true;
-				}
-				break;
-			case EntityState::attack: {
-				Entity *t = entities.try_get(ent.target_ref);
-
-				if (!t || !t->is_alive()) {
-					ent.task_cancel();
-					dirty = true;
-					break;
-				}
+		if (ent.state == EntityState::attack) {
+			Entity *t = entities.try_get(ent.target_ref);
 
-				if (!more) {
-					// prevent killing the entity twice. yes i've debug tested this can happen
-					bool was_alive = t->is_alive();
-					//printf("TODO attack (%u,%u) to (%u,%u)\n", ent.ref.first, ent.ref.second, ent.target_ref.first, ent.target_ref.second);
-					if (was_alive) {
-						dirty |= t->hit(wv, ent);
-						dirty_entities.emplace(t->ref);
-					}
-
-					auto it = died_entities.find(t->ref);
-					// if t died just now
-					if (!t->is_alive()) {
-						if (is_building(t->type))
-							spawn_particle(ParticleType::explode2, t->x, t->y);
-
-						died_entities.emplace(t->ref);
-						ent.task_cancel();
-						dirty = true;
-					}
-
-					// if t died just now, remove from player
-					if (!t->is_alive() && was_alive) {
-						if (is_resource(t->type)) {
-							killed_entities.emplace(t->ref);
-							ent.task_cancel();
-							dirty = true;
-						} else if (t->playerid != Player::gaia) { // update score but ensure entity isn't owned by gaia
-							if (is_building(t->type))
-								players[ent.playerid].killed_building();
-							else
-								players[ent.playerid].killed_unit();
-						}
-					}
-
-					// TODO conversion is not detected!
-				}
-				break;
+			if (!t || !t->is_alive()) {
+				ent.task_cancel();
+				dirty = true;
 			}
 		}
 
@@ -204,6 +164,23 @@ void World::tick_entities() {
 			dirty_entities.emplace(ent.ref);
 	}
 
+	// only entities that are dying or attacking have something to do now
+	for (const TimerWheel::Timer &tm : anims.advance(simticks)) {
+		Entity *ent = entities.try_get(tm.ref);
+
+		// skip if the animation has changed in the meantime
+		if (!ent || ent->anim_reset || ent->anim_start != tm.token)
+			continue;
+
+		if (anim_event(wv, *ent))
+			dirty_entities.emplace(ent->ref);
+
+		std::optional<uint64_t> next;
+
+		if (!ent->anim_reset && (next = ent->anim_event(tm.when)).has_value())
+			anims.schedule(next.value(), ent->ref, ent->anim_start);
+	}
+
 	// now iterate all died entities
 	for (IdPoolRef ref : died_entities) {
 		Entity &ent = entities.at(ref);
@@ -215,13 +192,81 @@ void World::tick_entities() {
 		nuke_ref(ref);
 }
 
+/** Play animation of \a ent from the current tick and schedule its image of impact. */
+void World::start_anim(Entity &ent) {
+	// the animation has already advanced once if it changes while ticking, just like all other entities this tick
+	ent.start_anim(simticks - 1);
+
+	std::optional<uint64_t> t(ent.anim_event(simticks - 1));
+	if (t)
+		anims.schedule(t.value(), ent.ref, ent.anim_start);
+}
+
+/** Handle image of impact of \a ent. Returns true if \a ent has changed. */
+bool World::anim_event(WorldView &wv, Entity &ent) {
+	bool dirty = false;
+
+	switch (ent.state) {
+		case EntityState::dying:
+			ent.decay();
+			dirty = true;
+			break;
+		case EntityState::attack: {
+			Entity *t = entities.try_get(ent.target_ref);
+
+			if (!t || !t->is_alive()) {
+				ent.task_cancel();
+				dirty = true;
+				break;
+			}
+
+			// prevent killing the entity twice. yes i've debug tested this can happen
+			bool was_alive = t->is_alive();
+			//printf("TODO attack (%u,%u) to (%u,%u)\n", ent.ref.first, ent.ref.second, ent.target_ref.first, ent.target_ref.second);
+			if (was_alive) {
+				dirty |= t->hit(wv, ent);
+				dirty_entities.emplace(t->ref);
+			}
+
+			// if t died just now
+			if (!t->is_alive()) {
+				if (is_building(t->type))
+					spawn_particle(ParticleType::explode2, t->x, t->y);
+
+				died_entities.emplace(t->ref);
+				ent.task_cancel();
+				dirty = true;
+			}
+
+			// if t died just now, remove from player
+			if (!t->is_alive() && was_alive) {
+				if (is_resource(t->type)) {
+					killed_entities.emplace(t->ref);
+					ent.task_cancel();
+					dirty = true;
+				} else if (t->playerid != Player::gaia) { // update score but ensure entity isn't owned by gaia
+					if (is_building(t->type))
+						players[ent.playerid].killed_building();
+					else
+						players[ent.playerid].killed_unit();
+				}
+			}
+
+			// TODO conversion is not detected!
+			break;
+		}
+	}
+
+	return dirty;
+}
+
 /** Iterate all particles and remove those whose animation has ended. */
 void World::tick_particles() {
 	ZoneScoped;
 
 	for (auto it = particles.begin(); it != particles.end();) {
 		Particle &p = it->second;
-		if (!p.imgtick(1))
+		if (p.done(simticks))
 			// no need to tell clients as they should already be able to detect this
 			it = particles.erase(it);
 		else
@@ -241,9 +286,12 @@ void World::tick_players() {
 			continue;
 
 		p.alive = false;
-		NetPkg pkg;
-		pkg.set_player_died(i);
-		s->broadcast(pkg);
+
+		if (s) {
+			NetPkg pkg;
+			pkg.set_player_died(i);
+			s->broadcast(pkg);
+		}
 	}
 
 	if (players.size() <= 2)
@@ -277,6 +325,10 @@ void World::stop(unsigned team) {
 	else
 		puts("gameover. no winner");
 
+	// lockstep peers wait for the server to confirm the outcome
+	if (!s)
+		return;
+
 	NetPkg pkg;
 	pkg.set_gameover(team);
 	s->broadcast(pkg);
@@ -287,6 +339,7 @@ void World::stop(unsigned team) {
 void World::tick() {
 	ZoneScoped;
 	std::lock_guard<std::mutex> lk(m);
+	++simticks;
 	tick_entities();
 	tick_particles();
 	tick_players();
@@ -319,9 +372,25 @@ void World::pump_events() {
 				if (running)
 					entity_task(ev);
 				break;
+			case WorldEventType::entity_group:
+				if (running)
+					entity_group(ev);
+				break;
 			case WorldEventType::gamespeed_control:
 				gamespeed_control(ev);
 				break;
+			case WorldEventType::checksum:
+				verify_checksum(ev);
+				break;
+			case WorldEventType::peer_resync:
+				resync(ev);
+				break;
+			case WorldEventType::peer_drop:
+				scn.remove(ev.src);
+				break;
+			case WorldEventType::peer_spectate:
+				spectate(ev);
+				break;
 			default:
 				printf("%s: todo: process event: %u\n", __func__, (unsigned)ev.type);
 				break;
@@ -334,7 +403,17 @@ void World::pump_events() {
 	events_in.clear();
 }
 
-/** Send any new changes back to the peers. */
+/** Send everything that has changed since the last snapshot. */
+void World::push_snapshot() {
+	ZoneScoped;
+
+	// all ticks go first, so entities do not run ahead of the clock
+	send_gameticks(ticks_out);
+	ticks_out = 0;
+
+	push_events();
+}
+
 void World::push_events() {
 	ZoneScoped;
 	std::lock_guard<std::mutex> lk(m);
@@ -354,7 +433,9 @@ void World::push_events() {
 
 	events_out.clear();
 
-	push_scores();
+	if (s)
+		push_scores();
+
 	push_resources();
 }
 
@@ -368,7 +449,7 @@ void World::push_entities() {
 			continue;
 
 		pkg.set_entity_update(*ent);
-		s->broadcast(pkg);
+		emit(pkg);
 	}
 
 	dirty_entities.clear();
@@ -379,7 +460,7 @@ void World::push_entities() {
 			continue;
 
 		pkg.set_entity_spawn(*ent);
-		s->broadcast(pkg);
+		emit(pkg);
 	}
 
 	spawned_entities.clear();
@@ -395,7 +476,7 @@ void World::push_particles() {
 			continue;
 
 		pkg.particle_spawn(*p);
-		s->broadcast(pkg);
+		emit(pkg);
 	}
 
 	spawned_particles.clear();
@@ -506,15 +587,29 @@ void World::gamespeed_control(WorldEvent &ev) {
 
 void World::entity_kill(WorldEvent &ev) {
 	ZoneScoped;
-	std::lock_guard<std::mutex> lk(m);
 	IdPoolRef ref = std::get<IdPoolRef>(ev.data);
+	std::optional<unsigned> player;
+
+	if (!src2player(ev.src, player))
+		return;
+
+	if (scn.lockstep)
+		relay.add(NetTurnCommand(player.has_value() ? player.value() : NetTurnCommand::any, ref));
+	else
+		entity_kill(ref, player);
+}
+
+/** Kill entity \a ref if it belongs to \a player or if no player is specified. */
+void World::entity_kill(IdPoolRef ref, std::optional<unsigned> player) {
+	ZoneScoped;
+	std::lock_guard<std::mutex> lk(m);
 
 	// TODO move this to an entity_die function
 	// entity_die is like it does its proper dying animation (opt. with particles)
 	// entity_kill is like when it has to be removed completely (e.g. decaying ended, resource depleted)
 	Entity *ent = entities.try_get(ref);
 	// verify entity and check permissions
-	if (!ent || !controls_player(ev.src, ent->playerid))
+	if (!ent || (player.has_value() && ent->playerid != player.value()))
 		return;
 
 	if (is_resource(ent->type)) {
@@ -540,43 +635,95 @@ void World::nuke_ref(IdPoolRef ref) {
 	// TODO add client info that sent kill command?
 	NetPkg pkg;
 	pkg.set_entity_kill(ref);
-	s->broadcast(pkg);
+	emit(pkg);
 }
 
-bool World::controls_player(IdPoolRef src, unsigned pid) {
+/**
+ * Determine which player \a src is allowed to control. Events from the server
+ * itself may control any player, in which case \a player is left empty.
+ * Returns false if \a src may not control anything.
+ */
+bool World::src2player(IdPoolRef src, std::optional<unsigned> &player) {
+	player = ref2idx(src);
+	return player.has_value() || src == invalid_ref;
+}
+
+void World::entity_task(WorldEvent &ev) {
 	ZoneScoped;
-	// check if the event has been created by a peer. if true, check permissions
-	auto idx = ref2idx(src);
-	if (idx.has_value()) {
-		// check permissions
-		unsigned playerid = idx.value();
+	EntityTask task = std::get<EntityTask>(ev.data);
+	std::optional<unsigned> player;
 
-		if (pid != playerid)
-			return false; // permission denied
-	} else if (src != invalid_ref) {
-		// peer is not the host, permission denied
-		return false;
+	if (!src2player(ev.src, player))
+		return;
+
+	if (scn.lockstep)
+		relay.add(NetTurnCommand(player.has_value() ? player.value() : NetTurnCommand::any, task));
+	else
+		entity_task(task, player);
+}
+
+void World::entity_group(WorldEvent &ev) {
+	ZoneScoped;
+	const NetEntityGroup &g = std::get<NetEntityGroup>(ev.data);
+	std::optional<unsigned> player;
+
+	if (!src2player(ev.src, player))
+		return;
+
+	if (!scn.lockstep) {
+		entity_group(g, player);
+		return;
 	}
 
-	return true;
+	// turns carry single commands, so lockstep peers get the same tasks as if they were ordered one by one
+	EntityTask task(g.task);
+
+	for (IdPoolRef ref : g.refs) {
+		task.ref1 = ref;
+		relay.add(NetTurnCommand(player.has_value() ? player.value() : NetTurnCommand::any, task));
+	}
 }
 
-void World::entity_task(WorldEvent &ev) {
+/** Perform \a task if its entity belongs to \a player or if no player is specified. */
+void World::entity_task(const EntityTask &task, std::optional<unsigned> player) {
+	ZoneScoped;
+	std::lock_guard<std::mutex> lk(m);
+
+	// TODO keep track which player initiated this so we know which peers to send it to
+	if (run_task(task, player) && task.type == EntityTaskType::move)
+		spawn_particle(ParticleType::moveto, task.x, task.y);
+}
+
+/** Perform the task of \a g for all entities in the group that belong to \a player. */
+void World::entity_group(const NetEntityGroup &g, std::optional<unsigned> player) {
 	ZoneScoped;
 	std::lock_guard<std::mutex> lk(m);
-	EntityTask task = std::get<EntityTask>(ev.data);
 
+	EntityTask task(g.task);
+	bool moved = false;
+
+	for (IdPoolRef ref : g.refs) {
+		task.ref1 = ref;
+		moved |= run_task(task, player);
+	}
+
+	// one marker for the whole group
+	if (moved && task.type == EntityTaskType::move)
+		spawn_particle(ParticleType::moveto, task.x, task.y);
+}
+
+/** Same as entity_task, but \a m must be locked already. Returns true if the entity has accepted the task. */
+bool World::run_task(const EntityTask &task, std::optional<unsigned> player) {
 	Entity *ent = entities.try_get(task.ref1);
 	// verify entity and check permissions
-	if (!ent || !controls_player(ev.src, ent->playerid))
-		return;
+	if (!ent || (player.has_value() && ent->playerid != player.value()))
+		return false;
 
 	switch (task.type) {
 		case EntityTaskType::move:
 			if (ent->task_move(task.x, task.y)) {
 				dirty_entities.emplace(ent->ref);
-				// TODO keep track which player initiated this so we know which peers to send it to
-				spawn_particle(ParticleType::moveto, task.x, task.y);
+				return true;
 			}
 			break;
 		case EntityTaskType::infer: {
@@ -585,8 +732,10 @@ void World::entity_task(WorldEvent &ev) {
 			if (!target)
 				break;
 
-			if (ent->task_attack(*target))
+			if (ent->task_attack(*target)) {
 				dirty_entities.emplace(ent->ref);
+				return true;
+			}
 			break;
 		}
 		case EntityTaskType::train_unit: {
@@ -595,10 +744,9 @@ void World::entity_task(WorldEvent &ev) {
 
 			Resources cost = entity_info.at((unsigned)train).cost;
 			bool can_train = false;
-			auto idx = ref2idx(ev.src);
 
-			if (idx.has_value()) {
-				unsigned playerid = idx.value();
+			if (player.has_value()) {
+				unsigned playerid = player.value();
 				Player &p = players.at(playerid);
 				can_train = p.res.can_afford(cost) && ent->task_train_unit(train);
 				if (can_train) {
@@ -612,6 +760,7 @@ void World::entity_task(WorldEvent &ev) {
 			if (can_train) {
 				// TODO add to build queue stuff
 				spawn_unit(train, ent->playerid, ent->x + 2, ent->y + 2);
+				return true;
 			}
 			break;
 		}
@@ -619,6 +768,8 @@ void World::entity_task(WorldEvent &ev) {
 			fprintf(stderr, "%s: unknown entity task type %u\n", __func__, (unsigned)task.type);
 			break;
 	}
+
+	return false;
 }
 
 bool World::single_team() const noexcept {
@@ -635,6 +786,17 @@ bool World::single_team() const noexcept {
 void World::send_player(unsigned i, NetPkg &pkg) {
 	ZoneScoped;
 
+	if (!s) {
+		if (sink && i == local_player)
+			sink(pkg);
+
+		return;
+	}
+
+	// lockstep peers keep track of their resources themselves
+	if (scn.lockstep)
+		return;
+
 	for (auto kv : scn.owners) {
 		if (kv.second != i)
 			continue;
@@ -645,6 +807,16 @@ void World::send_player(unsigned i, NetPkg &pkg) {
 	}
 }
 
+/** Send simulation state to peers. In lockstep mode, peers simulate everything themselves, so only the local sink gets it. */
+void World::emit(NetPkg &pkg) {
+	if (!s) {
+		if (sink)
+			sink(pkg);
+	} else if (!scn.lockstep) {
+		s->broadcast(pkg);
+	}
+}
+
 void World::create_players() {
 	ZoneScoped;
 
@@ -655,6 +827,7 @@ void World::create_players() {
 	gaia.team = 0;
 
 	bool one_team = single_team();
+	Rng names_rng(scn.seed); // keep simulation rng untouched as lockstep peers do not pick names
 
 	// sanitize players: change team if one_team and check civ and name
 	for (unsigned i = 0; i < scn.players.size(); ++i) {
@@ -666,6 +839,10 @@ void World::create_players() {
 
 		p.res = scn.res;
 
+		// lockstep peers have already received the name and everything else from the server
+		if (!s)
+			continue;
+
 		// if player has no name, try find an owner that has one
 		if (p.name.empty()) {
 			unsigned owners = 0;
@@ -687,7 +864,7 @@ void World::create_players() {
 
 				if (p.civ >= 0 && p.civ < s->civs.size()) {
 					auto &names = s->civs[s->civnames[p.civ]];
-					p.name = names[rand() % names.size()];
+					p.name = names[names_rng.below(names.size())];
 				}
 			}
 		}
@@ -698,6 +875,11 @@ void World::create_players() {
 		s->broadcast(pkg);
 		pkg.set_player_team(i, p.team);
 		s->broadcast(pkg);
+
+		if (scn.lockstep) {
+			pkg.set_player_ai(i, p.ai);
+			s->broadcast(pkg);
+		}
 	}
 
 	size_t size = (size_t)scn.width * scn.height;
@@ -705,6 +887,9 @@ void World::create_players() {
 	for (const PlayerSetting &ps : scn.players)
 		players.emplace_back(ps, size);
 
+	if (!s)
+		return;
+
 	// create player views
 	for (auto kv : s->peers)
 		views.emplace(kv.second.ref, NetCamSet());
@@ -724,7 +909,7 @@ void World::add_building(EntityType t, unsigned player, int x, int y) {
 }
 
 void World::add_unit(EntityType t, unsigned player, float x, float y) {
-	add_unit(t, player, x, y, fmodf(rand(), 360));
+	add_unit(t, player, x, y, (float)rng.below(360));
 }
 
 void World::add_unit(EntityType t, unsigned player, float x, float y, float angle, EntityState state) {
@@ -749,15 +934,15 @@ void World::add_berries(float x, float y) {
 }
 
 void World::add_gold(float x, float y) {
-	add_resource(EntityType::gold, x, y, rand() % 7);
+	add_resource(EntityType::gold, x, y, rng.below(7));
 }
 
 void World::add_stone(float x, float y) {
-	add_resource(EntityType::stone, x, y, rand() % 7);
+	add_resource(EntityType::stone, x, y, rng.below(7));
 }
 
 void World::spawn_unit(EntityType t, unsigned player, float x, float y) {
-	spawn_unit(t, player, x, y, fmodf(rand(), 360));
+	spawn_unit(t, player, x, y, (float)rng.below(360));
 }
 
 void World::spawn_unit(EntityType t, unsigned player, float x, float y, float angle) {
@@ -776,7 +961,7 @@ void World::spawn_particle(ParticleType t, float x, float y)
 {
 	ZoneScoped;
 
-	auto p = particles.emplace(t, x, y, 0);
+	auto p = particles.emplace(t, x, y, 0, simticks);
 	assert(p.second);
 
 	IdPoolRef ref = p.first->first;
@@ -798,29 +983,28 @@ void World::create_entities() {
 	double eps_x = t.w * 0.5, eps_y = t.h * 0.5;
 	long eps_hw = (long)(scale * t.w / 2), eps_hh = (long)(scale * t.h / 2);
 
-	std::uniform_real_distribution<double> unif(0.0, 2.0 * M_PI);
-	std::default_random_engine re;
+	auto unif = [this]() { return rng.real(0.0, 2.0 * M_PI); };
 
 	scale = 0.1;
 	double angle_step = 2 * M_PI / std::max(1, non_gaia_players());
 	double angle_jitter = angle_step * scale;
-	double angle_offset = unif(re);
+	double angle_offset = unif();
 
 	scale = 0.1; // NOTE: this + ellipsoid position scale must be less than 1
 	double x_jitter = scale * t.w, y_jitter = scale * t.h;
 
-	std::uniform_real_distribution<double> unif_ang(-angle_jitter * 0.5, angle_jitter * 0.5);
-	std::uniform_real_distribution<double> unif_jx(-x_jitter * 0.5, x_jitter * 0.5);
-	std::uniform_real_distribution<double> unif_jy(-y_jitter * 0.5, y_jitter * 0.5);
+	auto unif_ang = [&]() { return rng.real(-angle_jitter * 0.5, angle_jitter * 0.5); };
+	auto unif_jx = [&]() { return rng.real(-x_jitter * 0.5, x_jitter * 0.5); };
+	auto unif_jy = [&]() { return rng.real(-y_jitter * 0.5, y_jitter * 0.5); };
 
 	const double villager_radius = 4.0;
 
 	// create player stuff
 	for (unsigned pid = 1; pid < this->players.size(); ++pid) {
-		double angle = angle_offset + pid * angle_step + unif_ang(re);
+		double angle = angle_offset + pid * angle_step + unif_ang();
 
-		int t_x = (int)(eps_x + eps_hw * cos(angle) + unif_jx(re));
-		int t_y = (int)(eps_y + eps_hh * sin(angle) + unif_jy(re));
+		int t_x = (int)(eps_x + eps_hw * cos(angle) + unif_jx());
+		int t_y = (int)(eps_y + eps_hh * sin(angle) + unif_jy());
 
 		add_building(EntityType::town_center, pid, t_x, t_y);
 
@@ -830,24 +1014,24 @@ void World::create_entities() {
 
 		unsigned villagers = this->scn.villagers;
 		double angle_villagers = 2 * M_PI / villagers;
-		double angle_vilagers_offset = unif(re);
+		double angle_vilagers_offset = unif();
 
 		double r = villager_radius;
 
 		// place villagers around town center facing random directions
 		for (unsigned j = 0; j < villagers; ++j) {
-			angle = unif(re);
+			angle = unif();
 
 			add_unit(
 				EntityType::villager, pid,
 				t_x + r * cos(angle), t_y + r * sin(angle),
-				unif(re)
+				unif()
 			);
 		}
 
 		// add some resources near the player
 		r = 6;
-		angle = unif(re);
+		angle = unif();
 
 		int b_x = t_x + r * cos(angle), b_y = t_y + r * sin(angle);
 
@@ -859,7 +1043,7 @@ void World::create_entities() {
 		add_berries(b_x + 1, b_y);
 
 		r = 7;
-		angle = unif(re);
+		angle = unif();
 		int g_x = t_x + r * cos(angle), g_y = t_y + r * sin(angle);
 
 		add_gold(g_x + 0, g_y + 0);
@@ -867,7 +1051,7 @@ void World::create_entities() {
 		add_gold(g_x + 0, g_y + 1);
 		add_gold(g_x + 1, g_y + 1);
 
-		angle = unif(re);
+		angle = unif();
 		int s_x = t_x + r * cos(angle), s_y = t_y + r * sin(angle);
 
 		add_stone(s_x + 0, s_y + 0);
@@ -887,12 +1071,22 @@ void World::create_entities() {
 	};
 
 	for (unsigned x = 0; x < players.size() * 3; ++x) {
-		add_resource(trees[rand() % 4], x, 0, 0);
-		add_resource(trees[rand() % 4], x, 1, 0);
-		add_resource(trees[rand() % 4], x, 2, 0);
+		add_resource(trees[rng.below(4)], x, 0, 0);
+		add_resource(trees[rng.below(4)], x, 1, 0);
+		add_resource(trees[rng.below(4)], x, 2, 0);
 	}
 }
 
+/** Create terrain, players and entities. This must only depend on scn, as lockstep peers do the same to get the same world. */
+void World::create_world() {
+	rng.seed(scn.seed);
+	simticks = 0;
+	anims.reset();
+	create_terrain();
+	create_players();
+	create_entities();
+}
+
 void World::startup() {
 	ZoneScoped;
 
@@ -905,30 +1099,35 @@ void World::startup() {
 	pkg.set_scn_vars(scn);
 	s->broadcast(pkg);
 
-	create_terrain();
-	create_players();
-	create_entities();
-
-	// now send all entities to each client
-	for (auto &kv : entities) {
-		pkg.set_entity_add(kv.second);
-		// TODO only send to clients that can see this entity
-		s->broadcast(pkg);
-	}
-
-	// send initial terrain chunk
-	// TODO this is buggy if the map is too small...
+	// spectators have not seen the lobby
+	std::vector<uint8_t> v;
+	push_players([this, &v](NetPkg &pkg) { s->encode_spectate(v, pkg); });
+	s->spectate_snapshot(invalid_ref, std::move(v));
 
-	for (unsigned y = 0; y < 48; y += 16) {
-		for (unsigned x = 0; x < 48; x += 16) {
-			unsigned w = 16, h = 16;
-			NetTerrainMod tm(fetch_terrain(x, y, w, h));
+	create_world();
 
-			pkg.set_terrain_mod(tm);
+	// lockstep peers create the same entities and terrain from the scenario settings
+	if (!scn.lockstep) {
+		// now send all entities to each client
+		for (auto &kv : entities) {
+			pkg.set_entity_add(kv.second);
+			// TODO only send to clients that can see this entity
 			s->broadcast(pkg);
 		}
+
+		// send whole map at once. this is too big for a single packet, so it is fragmented and interleaved with everything else
+		unsigned w = scn.width, h = scn.height;
+		NetTerrainMod tm(fetch_terrain(0, 0, w, h));
+
+		pkg.set_terrain_mod(tm);
+		s->broadcast(pkg);
 	}
 
+	relay.reset();
+	desynced.clear();
+	resyncs.clear();
+	ticks = 0;
+	ticks_out = 0;
 	this->running = true;
 
 	// start!
@@ -947,6 +1146,348 @@ void World::send_gameticks(unsigned n) {
 	NetPkg pkg;
 	pkg.set_gameticks(n);
 	s->broadcast(pkg);
+
+	ticks += n;
+}
+
+/** Close the current turn, send it to all peers and apply its commands. */
+void World::send_turn(unsigned n) {
+	ZoneScoped;
+
+	NetTurn t(relay.next((uint16_t)std::min<unsigned>(n, UINT16_MAX)));
+	NetPkg pkg;
+
+	pkg.set_turn(t);
+	s->broadcast(pkg);
+
+	apply(t);
+}
+
+void World::apply(const NetTurn &t) {
+	ZoneScoped;
+
+	for (const NetTurnCommand &c : t.cmds) {
+		std::optional<unsigned> player;
+
+		if (c.player != NetTurnCommand::any)
+			player = c.player;
+
+		if (std::holds_alternative<IdPoolRef>(c.data))
+			entity_kill(std::get<IdPoolRef>(c.data), player);
+		else
+			entity_task(std::get<EntityTask>(c.data), player);
+	}
+}
+
+void World::start_lockstep(const ScenarioSettings &scn, unsigned player, std::function<void(NetPkg&)> out) {
+	ZoneScoped;
+
+	this->s = nullptr;
+	this->scn = scn;
+	this->sink = out;
+	this->local_player = player;
+	gameover = false;
+
+	create_world();
+
+	NetPkg pkg;
+
+	for (auto &kv : entities) {
+		pkg.set_entity_add(kv.second);
+		sink(pkg);
+	}
+
+	unsigned w = scn.width, h = scn.height;
+	pkg.set_terrain_mod(fetch_terrain(0, 0, w, h));
+	sink(pkg);
+
+	send_resources();
+
+	this->running = true;
+}
+
+bool World::step(const NetTurn &t) {
+	ZoneScoped;
+
+	if (gameover)
+		return false;
+
+	apply(t);
+
+	for (unsigned i = 0; i < t.ticks && !gameover; ++i)
+		tick();
+
+	push_events();
+	return !gameover;
+}
+
+uint32_t World::checksum() {
+	ZoneScoped;
+	std::lock_guard<std::mutex> lk(m);
+
+	// FNV-1a
+	uint32_t h = 2166136261u;
+
+	auto mix = [&h](uint32_t v) {
+		for (unsigned i = 0; i < 4; ++i, v >>= 8) {
+			h ^= v & 0xff;
+			h *= 16777619u;
+		}
+	};
+
+	auto mixf = [&mix](float f) {
+		uint32_t v;
+		static_assert(sizeof v == sizeof f);
+		memcpy(&v, &f, sizeof v);
+		mix(v);
+	};
+
+	for (auto &kv : entities) {
+		const Entity &e = kv.second;
+
+		mix(e.ref.first);
+		mix(e.ref.second);
+		mix((uint32_t)e.type);
+		mix(e.playerid);
+		mixf(e.x);
+		mixf(e.y);
+		mix((uint32_t)e.state);
+		mix(e.target_ref.first);
+		mix(e.target_ref.second);
+		mix(e.stats.hp);
+	}
+
+	for (const Player &p : players) {
+		mix(p.res.wood);
+		mix(p.res.food);
+		mix(p.res.gold);
+		mix(p.res.stone);
+		mix(p.alive);
+	}
+
+	return h;
+}
+
+void World::verify_checksum(WorldEvent &ev) {
+	ZoneScoped;
+	NetChecksum c(std::get<NetChecksum>(ev.data));
+	auto ok = relay.verify(c.turn, c.hash);
+
+	// only report the first mismatch for each peer
+	if (!ok.has_value() || ok.value() || !desynced.emplace(ev.src).second)
+		return;
+
+	fprintf(stderr, "%s: peer (%u,%u) out of sync at turn %u\n", __func__, ev.src.first, ev.src.second, c.turn);
+
+	NetPkg pkg;
+	pkg.set_chat_text(invalid_ref, "desync detected at turn " + std::to_string(c.turn));
+	s->broadcast(pkg);
+}
+
+/**
+ * Take a snapshot for a peer that has joined the running game. Everything
+ * else is kept aside for this peer until it has received the whole snapshot,
+ * so it sees all changes since then in the right order.
+ */
+void World::resync(WorldEvent &ev) {
+	ZoneScoped;
+
+	// claim seat even if the peer has left already, so its peer_drop event cleans it up
+	scn.owners[ev.src] = std::get<EventPeerSeat>(ev.data).player;
+
+	const Peer *p = s->try_peer(ev.src);
+	if (!p)
+		return;
+
+	s->s.hold(*p);
+	views.emplace(ev.src, NetCamSet());
+
+	WorldResync &r = resyncs.emplace_back(ev.src);
+	r.entities.reserve(entities.size());
+
+	for (auto &kv : entities)
+		r.entities.emplace_back(kv.second);
+
+	// the rest of the snapshot is small, so send it right away
+	push_setup([this, p](NetPkg &pkg) { s->send_resync(*p, pkg); });
+
+	std::optional<unsigned> idx(ref2idx(ev.src));
+
+	if (idx.has_value() && idx.value() < players.size()) {
+		NetPkg pkg;
+		pkg.set_resources(players[idx.value()].res);
+		s->send_resync(*p, pkg);
+	}
+}
+
+/** Pass everything but the entities and terrain of a snapshot to \a out. */
+void World::push_setup(const std::function<void(NetPkg&)> &out) {
+	NetPkg pkg;
+
+	pkg.set_start_game();
+	out(pkg);
+
+	pkg.set_scn_vars(scn);
+	out(pkg);
+
+	push_players(out);
+
+	// send the time before any entities, so they do not run all animations at once
+	for (uint64_t n = ticks; n;) {
+		unsigned step = (unsigned)std::min<uint64_t>(n, UINT16_MAX);
+
+		pkg.set_gameticks(step);
+		out(pkg);
+		n -= step;
+	}
+
+	if (!running) {
+		pkg.set_gamespeed(NetGamespeedType::pause);
+		out(pkg);
+	}
+
+	for (unsigned i = 1; i < players.size(); ++i) {
+		pkg.set_player_score(i, players[i].get_score());
+		out(pkg);
+	}
+}
+
+/** Pass the players, who controls them and the names of their peers to \a out. */
+void World::push_players(const std::function<void(NetPkg&)> &out) {
+	NetPkg pkg;
+
+	pkg.set_player_resize(scn.players.size());
+	out(pkg);
+
+	for (unsigned i = 0; i < scn.players.size(); ++i) {
+		const PlayerSetting &ps = scn.players[i];
+
+		pkg.set_player_name(i, ps.name);
+		out(pkg);
+		pkg.set_player_civ(i, ps.civ);
+		out(pkg);
+		pkg.set_player_team(i, ps.team);
+		out(pkg);
+	}
+
+	for (auto kv : scn.owners) {
+		pkg.set_claim_player(kv.first, kv.second);
+		out(pkg);
+	}
+
+	std::vector<std::pair<IdPoolRef, std::string>> names;
+	{
+		std::lock_guard<std::mutex> lk(s->m_peers);
+
+		for (auto &kv : s->peers)
+			if (!(kv.second.flags & (unsigned)ClientInfoFlags::spectator))
+				names.emplace_back(kv.second.ref, kv.second.username);
+	}
+
+	for (auto &kv : names) {
+		pkg.set_ref_username(kv.first, kv.second);
+		out(pkg);
+	}
+}
+
+/**
+ * Take a snapshot for a spectator that has joined the running game. It is
+ * added to the spectator stream, so it is just as delayed as everything else
+ * and the spectator sees all changes since then in the right order.
+ */
+void World::spectate(WorldEvent &ev) {
+	ZoneScoped;
+
+	std::vector<uint8_t> v;
+	std::function<void(NetPkg&)> out([this, &v](NetPkg &pkg) { s->encode_spectate(v, pkg); });
+	NetPkg pkg;
+
+	// relays pass on everything from here until the second start_game to their new observers
+	pkg.set_spectate();
+	out(pkg);
+
+	push_setup(out);
+
+	for (auto &kv : entities) {
+		pkg.set_entity_add(kv.second);
+		out(pkg);
+	}
+
+	for (unsigned row = 0; row < scn.height;) {
+		unsigned w = scn.width, h = std::min(resync_rows, scn.height - row);
+		NetTerrainMod tm(fetch_terrain(0, row, w, h));
+
+		row += h;
+		pkg.set_terrain_mod(tm);
+		out(pkg);
+	}
+
+	pkg.set_start_game();
+	out(pkg);
+
+	s->spectate_snapshot(ev.src, std::move(v));
+}
+
+/** Send the next part of each pending snapshot and let peers that have received everything catch up. */
+void World::push_resyncs() {
+	ZoneScoped;
+
+	for (auto it = resyncs.begin(); it != resyncs.end();) {
+		const Peer *p = s->try_peer(it->ref);
+
+		// peer has left in the mean time
+		if (!p) {
+			it = resyncs.erase(it);
+			continue;
+		}
+
+		if (resync_step(*p, *it) && s->s.release(*p)) {
+			printf("%s: peer (%u,%u) has caught up\n", __func__, it->ref.first, it->ref.second);
+			it = resyncs.erase(it);
+			continue;
+		}
+
+		++it;
+	}
+}
+
+/**
+ * Queue as much of \a r as fits in the resync window for \a p. Entities are
+ * sent as updates, so they replace anything that the peer may have received
+ * before the snapshot was taken. Returns true once the snapshot has been queued.
+ */
+bool World::resync_step(const Peer &p, WorldResync &r) {
+	ZoneScoped;
+
+	if (r.done)
+		return true;
+
+	NetPkg pkg;
+
+	for (size_t queued = s->s.pending(p); queued < resync_window; queued += pkg.size()) {
+		if (r.pos < r.entities.size()) {
+			pkg.set_entity_update(r.entities[r.pos++]);
+		} else if (r.row < scn.height) {
+			unsigned w = scn.width, h = std::min(resync_rows, scn.height - r.row);
+			NetTerrainMod tm(fetch_terrain(0, r.row, w, h));
+
+			r.row += h;
+			pkg.set_terrain_mod(tm);
+		} else {
+			break;
+		}
+
+		s->send_resync(p, pkg);
+	}
+
+	if (r.pos < r.entities.size() || r.row < scn.height)
+		return false;
+
+	pkg.set_start_game();
+	s->send_resync(p, pkg);
+
+	r.done = true;
+	return true;
 }
 
 std::optional<unsigned> World::ref2idx(IdPoolRef ref) const noexcept {
@@ -964,6 +1505,7 @@ void World::eventloop(Server &s) {
 	startup();
 
 	auto last = std::chrono::steady_clock::now();
+	auto next_snapshot = last;
 	double dt = 0;
 
 	while (s.m_running.load() && !gameover) {
@@ -981,17 +1523,47 @@ void World::eventloop(Server &s) {
 		pump_events();
 
 		if (running) {
-			if (!gameover)
-				send_gameticks(steps);
-
 			save_scores();
 
-			// do steps
-			for (; steps && !gameover; --steps)
-				tick();
+			if (scn.lockstep) {
+				steps = std::min<size_t>(steps, UINT16_MAX);
+
+				// peers only advance when they receive a turn, so the turn tells them how many ticks to run
+				if (steps && !gameover) {
+					uint32_t turn = relay.current();
+					send_turn(steps);
+
+					for (; steps && !gameover; --steps)
+						tick();
+
+					relay.commit(turn, checksum());
+				}
+			} else {
+				// peers get all ticks at once with the next snapshot
+				if (!gameover)
+					ticks_out += (unsigned)steps;
+
+				// do steps
+				for (; steps && !gameover; --steps)
+					tick();
+			}
 		}
 
-		push_events();
+		// state changes pile up between snapshots, so bandwidth does not depend on logic_gamespeed
+		if (now >= next_snapshot || gameover) {
+			push_snapshot();
+
+			auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / std::max(snapshot_rate_min, snapshot_rate.load())));
+			next_snapshot += period;
+
+			// do not try to catch up after a hiccup
+			if (next_snapshot < now)
+				next_snapshot = now + period;
+		}
+
+		push_resyncs();
+		s.spectate_step();
+		s.log_stats();
 
 		dt = fmod(dt, interval);
 
@@ -1003,6 +1575,10 @@ void World::eventloop(Server &s) {
 		if (us > 500)
 			std::this_thread::sleep_for(std::chrono::microseconds(us));
 	}
+
+	// spectators are behind, so let them see the end of the game as well
+	while (s.m_active.load() && s.spectate_step())
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
 }
 
 }
@@ -11,10 +11,15 @@ enum class WorldEventType {
 	entity_spawn,
 	entity_kill,
 	entity_task,
+	entity_group,
 	player_kill,
 	peer_cam_move,
 	gameover,
 	gamespeed_control,
+	checksum,
+	peer_resync,
+	peer_drop,
+	peer_spectate,
 };
 
 class EventCameraMove final {
@@ -25,4 +30,12 @@ public:
 	EventCameraMove(IdPoolRef ref, const NetCamSet &cam) : ref(ref), cam(cam) {}
 };
 
+/** Player that a peer controls again after it has rejoined the running game. */
+class EventPeerSeat final {
+public:
+	unsigned player;
+
+	EventPeerSeat(unsigned player) : player(player) {}
+};
+
 }
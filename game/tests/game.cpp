@@ -0,0 +1,580 @@
+#include "../src/server.hpp"
+#include "../src/engine/asset_cache.hpp"
+#include "../src/engine/depth_sort.hpp"
+#include "../src/engine/gfx.hpp"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace aoe {
+
+using namespace std::chrono_literals;
+
+TEST(EntityTrack, Interpolate) {
+	EntityTrack tr;
+	auto t0 = std::chrono::steady_clock::now();
+	float x, y;
+
+	tr.add(EntityTrack::Sample{ t0, 0, 0, 0, EntityState::moving });
+	tr.add(EntityTrack::Sample{ t0 + 100ms, 10, 20, 0, EntityState::moving });
+
+	ASSERT_TRUE(tr.at(t0 - 50ms, 1, 0ms, x, y));
+	ASSERT_FLOAT_EQ(0, x);
+
+	ASSERT_TRUE(tr.at(t0 + 25ms, 1, 0ms, x, y));
+	ASSERT_NEAR(2.5f, x, 1e-3f);
+	ASSERT_NEAR(5.0f, y, 1e-3f);
+}
+
+TEST(EntityTrack, Extrapolate) {
+	EntityTrack tr;
+	auto t0 = std::chrono::steady_clock::now();
+	float x, y;
+
+	tr.add(EntityTrack::Sample{ t0, 1, 1, 0, EntityState::moving });
+
+	// moving along x at 2 tiles per second
+	ASSERT_TRUE(tr.at(t0 + 500ms, 2, 1s, x, y));
+	ASSERT_NEAR(2.0f, x, 1e-3f);
+	ASSERT_NEAR(1.0f, y, 1e-3f);
+
+	// but not too far
+	ASSERT_TRUE(tr.at(t0 + 5s, 2, 1s, x, y));
+	ASSERT_NEAR(3.0f, x, 1e-3f);
+
+	tr.add(EntityTrack::Sample{ t0 + 1s, 4, 1, 0, EntityState::alive });
+
+	// stopped: track is done once past the last sample
+	ASSERT_FALSE(tr.at(t0 + 2s, 2, 1s, x, y));
+	ASSERT_FLOAT_EQ(4, x);
+}
+
+TEST(EntityTrack, Capacity) {
+	EntityTrack tr;
+	auto t0 = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < EntityTrack::capacity + 2; ++i)
+		tr.add(EntityTrack::Sample{ t0 + i * 10ms, (float)i, 0, 0, EntityState::moving });
+
+	ASSERT_EQ(EntityTrack::capacity, tr.count);
+	ASSERT_FLOAT_EQ(2, tr.samples[0].x);
+}
+
+TEST(EntityTrack, InterpolateAtDelay) {
+	auto t0 = std::chrono::steady_clock::now();
+
+	for (double hz : { World::snapshot_rate_min, 20.0, (double)DEFAULT_TICKS_PER_SECOND, World::snapshot_rate_max }) {
+		EntityTrack tr;
+		EntityTrack::time_point last;
+
+		// moving one tile per update
+		for (unsigned i = 0; i <= 2 * hz; ++i) {
+			last = t0 + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(i / hz));
+			tr.add(EntityTrack::Sample{ last, (float)i, 0, 0, EntityState::moving });
+		}
+
+		auto t = last - GameView::interp_delay;
+		float x, y;
+
+		ASSERT_TRUE(tr.at(t, 1, 0ms, x, y));
+		ASSERT_NEAR(std::chrono::duration<double>(t - t0).count() * hz, x, 1e-2) << hz << " Hz";
+	}
+}
+
+TEST(TimerWheel, Order) {
+	TimerWheel w;
+	IdPoolRef a(1, 0), b(2, 1), c(3, 2);
+
+	w.schedule(5, a, 0);
+	w.schedule(3, b, 0);
+	w.schedule(TimerWheel::size + 44, c, 0);
+	w.schedule(3, c, 1);
+
+	ASSERT_EQ(4u, w.pending());
+	ASSERT_TRUE(w.advance(2).empty());
+
+	auto due = w.advance(3);
+	ASSERT_EQ(2u, due.size());
+	ASSERT_EQ(b, due[0].ref);
+	ASSERT_EQ(1u, due[1].token);
+
+	// more than one round at once
+	due = w.advance(TimerWheel::size * 2);
+	ASSERT_EQ(2u, due.size());
+	ASSERT_EQ(a, due[0].ref);
+	ASSERT_EQ(c, due[1].ref);
+	ASSERT_EQ(0u, w.pending());
+}
+
+TEST(Entity, AnimEvent) {
+	Entity e(IdPoolRef(1, 0), EntityType::villager, 1, 0.0f, 0.0f, 0.0f, EntityState::attack);
+	const EntityImgInfo &img = e.img_info();
+
+	ASSERT_LT(img.ii_attack, img.attack);
+	// not started yet
+	ASSERT_FALSE(e.anim_event(0).has_value());
+
+	e.start_anim(10);
+
+	uint64_t first = 10 + img.ii_attack + 1;
+	ASSERT_EQ(std::optional<uint64_t>(first), e.anim_event(10));
+	ASSERT_EQ(std::optional<uint64_t>(first + img.attack), e.anim_event(first));
+
+	// images only depend on how long it has been playing
+	ASSERT_FLOAT_EQ(e.frame(first), e.frame(first + img.attack));
+}
+
+TEST(EntityStore, Refs) {
+	EntityStore st;
+	IdPoolRef a(1, 0), b(1, 1), c(2, 2);
+
+	st.emplace(Entity(a, EntityType::villager, 1, 1.0f, 1.0f));
+	// same id, different ref
+	st.emplace(Entity(b, EntityType::villager, 1, 2.0f, 1.0f));
+	st.emplace(Entity(c, EntityType::villager, 1, 3.0f, 1.0f));
+
+	ASSERT_EQ(3u, st.size());
+	ASSERT_FLOAT_EQ(2.0f, st.at(b).x);
+	ASSERT_FALSE(st.try_get(IdPoolRef(2, 5)));
+
+	st.put(Entity(b, EntityType::villager, 1, 5.0f, 1.0f));
+	ASSERT_EQ(3u, st.size());
+	ASSERT_FLOAT_EQ(5.0f, st.at(b).x);
+
+	ASSERT_TRUE(st.erase(a));
+	ASSERT_FALSE(st.erase(a));
+	ASSERT_FALSE(st.try_get(a));
+	ASSERT_FLOAT_EQ(5.0f, st.at(b).x);
+	ASSERT_FLOAT_EQ(3.0f, st.at(c).x);
+
+	ASSERT_TRUE(st.erase(c));
+	ASSERT_EQ(1u, st.size());
+	ASSERT_EQ(b, st.begin()->ref);
+}
+
+TEST(GameView, Journal) {
+	Game g;
+	GameView gv;
+	ScenarioSettings scn;
+	IdPoolRef ref(1, 0);
+
+	g.resize(scn);
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_TRUE(gv.entities.empty());
+
+	g.entity_spawn(EntityView(Entity(ref, EntityType::villager, 1, 2.0f, 3.0f)));
+	g.tick(1);
+
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_EQ(1u, gv.entities.size());
+	ASSERT_EQ(1u, gv.entities_spawned.count(ref));
+
+	Entity moved(ref, EntityType::villager, 1, 4.0f, 3.0f);
+	g.entity_update(EntityView(moved));
+
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_TRUE(gv.try_get(ref));
+
+	g.entity_kill(ref);
+
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_FALSE(gv.try_get(ref));
+
+	// another game has nothing to do with the journal of the previous one
+	Game g2;
+	g2.resize(scn);
+	g2.entity_add(EntityView(Entity(IdPoolRef(2, 0), EntityType::berries, 5.0f, 5.0f, 0)));
+
+	ASSERT_TRUE(gv.try_read(g2));
+	ASSERT_EQ(1u, gv.entities.size());
+	ASSERT_TRUE(gv.try_get(IdPoolRef(2, 0)));
+}
+
+TEST(GameView, TwoReaders) {
+	Game g;
+	GameView a, b;
+	ScenarioSettings scn;
+	IdPoolRef ref(1, 0);
+
+	g.resize(scn);
+	g.entity_add(EntityView(Entity(ref, EntityType::villager, 1, 2.0f, 3.0f)));
+
+	ASSERT_TRUE(a.try_read(g));
+	ASSERT_TRUE(b.try_read(g));
+
+	// b has taken the journal, so a must not miss this
+	g.entity_update(EntityView(Entity(ref, EntityType::villager, 1, 4.0f, 3.0f)));
+
+	ASSERT_TRUE(a.try_read(g));
+	ASSERT_TRUE(b.try_read(g));
+	ASSERT_FLOAT_EQ(4.0f, a.get(ref).x);
+	ASSERT_FLOAT_EQ(4.0f, b.get(ref).x);
+}
+
+TEST(GameView, Gamespeed) {
+	Game g;
+	GameView gv;
+	ScenarioSettings scn;
+
+	g.resize(scn);
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_DOUBLE_EQ(1.0, gv.logic_gamespeed);
+
+	// twice as many ticks as normal
+	auto t0 = std::chrono::steady_clock::now();
+	unsigned n = 2 * DEFAULT_TICKS_PER_SECOND / 20;
+
+	while (std::chrono::steady_clock::now() - t0 < 2 * GameView::gamespeed_window) {
+		g.tick(n);
+		ASSERT_TRUE(gv.try_read(g));
+		std::this_thread::sleep_for(50ms);
+	}
+
+	ASSERT_NEAR(2.0, gv.logic_gamespeed, 0.5);
+}
+
+TEST(GameView, TerrainDirty) {
+	Game g;
+	GameView gv;
+	ScenarioSettings scn;
+
+	g.resize(scn);
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_TRUE(gv.terrain_reset);
+
+	gv.terrain_reset = false;
+
+	std::vector<uint16_t> tiles(4, 1);
+	std::vector<uint8_t> hmap(4, 2);
+	g.terrain_set(tiles, hmap, 3, 5, 2, 2);
+
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_FALSE(gv.terrain_reset);
+	ASSERT_EQ(1u, gv.terrain_dirty.size());
+	ASSERT_EQ(3u, gv.terrain_dirty[0].x);
+	ASSERT_EQ(5u, gv.terrain_dirty[0].y);
+	ASSERT_EQ(2u, gv.hmax);
+}
+
+TEST(GameView, TerrainBuffersReused) {
+	Game g;
+	GameView gv;
+	ScenarioSettings scn;
+
+	g.resize(scn);
+	ASSERT_TRUE(gv.try_read(g));
+
+	NetTerrainMod tm;
+	tm.w = tm.h = 2;
+	tm.tiles.assign(4, 1);
+	tm.hmap.assign(4, 2);
+
+	const uint16_t *tiles = tm.tiles.data();
+
+	// buffers are moved into the journal
+	g.terrain_set(tm);
+	ASSERT_TRUE(tm.tiles.empty());
+
+	// and handed back once they have been applied
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_TRUE(gv.try_read(g));
+
+	tm.tiles.assign(4, 3);
+	tm.hmap.assign(4, 4);
+	g.terrain_set(tm);
+
+	ASSERT_EQ(tiles, tm.tiles.data());
+	ASSERT_EQ(4u, tm.tiles.capacity());
+
+	ASSERT_TRUE(gv.try_read(g));
+	ASSERT_EQ(3u, gv.t.tile_at(0, 0));
+}
+
+TEST(DepthSort, LayersAndDepth) {
+	gfx::DepthSort s;
+
+	s.add(1, 2.0f);
+	s.add(0, 5.0f);
+	s.add(1, -3.0f);
+	s.add(1, 2.0f);
+	s.add(0, -1.5f);
+
+	s.sort();
+
+	const uint32_t exp[] = { 4, 1, 2, 0, 3 };
+
+	ASSERT_EQ(5u, s.size());
+	for (size_t i = 0; i < s.size(); ++i)
+		ASSERT_EQ(exp[i], s[i]);
+
+	// reuse
+	s.clear();
+	s.add(0, 1.0f);
+	s.add(0, 0.5f);
+	s.sort();
+
+	ASSERT_EQ(1u, s[0]);
+	ASSERT_EQ(0u, s[1]);
+}
+
+static std::vector<IdPoolRef> add_imgs(gfx::ImagePacker &p, std::vector<gfx::Surface> &surfs, unsigned n, int w, int h) {
+	std::vector<IdPoolRef> refs;
+
+	for (unsigned i = 0; i < n; ++i) {
+		surfs.emplace_back(SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA32), SDL_FreeSurface);
+		refs.emplace_back(p.add_img(0, 0, surfs.back().get()));
+	}
+
+	return refs;
+}
+
+static unsigned page_of(const gfx::Tileset &ts, IdPoolRef ref) {
+	return ts.imgs.find(gfx::ImageRef(ref, SDL_Rect{ 0, 0, 0, 0 }, nullptr, 0, 0))->page;
+}
+
+TEST(ImagePacker, Groups) {
+	gfx::ImagePacker p;
+	std::vector<gfx::Surface> surfs;
+
+	std::vector<IdPoolRef> a = add_imgs(p, surfs, 3, 32, 32);
+	p.group();
+	std::vector<IdPoolRef> b = add_imgs(p, surfs, 3, 32, 32);
+	p.group();
+	std::vector<IdPoolRef> c = add_imgs(p, surfs, 1, 32, 32);
+
+	// b does not fit after a, but c does
+	gfx::Tileset ts(p.collect(64, 64));
+
+	ASSERT_EQ(2u, ts.pages.size());
+
+	for (IdPoolRef r : a)
+		ASSERT_EQ(0u, page_of(ts, r));
+	for (IdPoolRef r : b)
+		ASSERT_EQ(1u, page_of(ts, r));
+
+	ASSERT_EQ(0u, page_of(ts, c[0]));
+	ASSERT_EQ(64, ts.pages[0].w);
+	ASSERT_EQ(64, ts.pages[1].w);
+}
+
+TEST(ImagePacker, SplitBigGroup) {
+	gfx::ImagePacker p;
+	std::vector<gfx::Surface> surfs;
+
+	std::vector<IdPoolRef> a = add_imgs(p, surfs, 6, 32, 32);
+	gfx::Tileset ts(p.collect(64, 64));
+
+	ASSERT_EQ(2u, ts.pages.size());
+
+	unsigned count[2] = { 0 };
+	for (IdPoolRef r : a)
+		++count[page_of(ts, r)];
+
+	ASSERT_EQ(4u, count[0]);
+	ASSERT_EQ(2u, count[1]);
+	// minimal size for what is left
+	ASSERT_EQ(32, ts.pages[1].h);
+
+	gfx::ImagePacker p2;
+	add_imgs(p2, surfs, 1, 65, 1);
+	ASSERT_THROW(p2.collect(64, 64), std::runtime_error);
+}
+
+/** Removes \a path when going out of scope, so failed tests do not leave it behind. */
+class TempFile final {
+public:
+	const char *path;
+
+	TempFile(const char *path) : path(path) {}
+	~TempFile() { remove(path); }
+};
+
+TEST(AssetCache, RoundTrip) {
+	gfx::ImagePacker p;
+	std::vector<gfx::Surface> surfs;
+
+	std::vector<IdPoolRef> a = add_imgs(p, surfs, 2, 4, 3);
+	std::vector<std::pair<int, int>> mask{ { 0, 3 }, { 1, 2 } };
+	surfs.emplace_back(SDL_CreateRGBSurfaceWithFormat(0, 2, 2, 32, SDL_PIXELFORMAT_RGBA32), SDL_FreeSurface);
+	IdPoolRef b = p.add_img(1, 2, surfs.back().get(), mask);
+
+	for (unsigned i = 0; i < surfs.size(); ++i)
+		memset(surfs[i]->pixels, 0x10 + i, (size_t)surfs[i]->pitch * surfs[i]->h);
+
+	gfx::Tileset ts(p.collect(16, 16));
+	std::map<io::DrsId, IdPoolRef> ids{ { io::DrsId::img_editor, b } };
+	std::map<io::DrsId, ImageSet> gifs;
+	std::map<io::DrsId, BackgroundColors> bkg_cols;
+	std::vector<SDL_Color> cols(MAX_PLAYERS * gfx::player_ramp, SDL_Color{ 5, 6, 7, 255 });
+
+	gifs[io::DrsId::gif_cursors].imgs = a;
+	gifs[io::DrsId::gif_cursors].dynamic = false;
+	bkg_cols[io::DrsId::bkg_main_menu].border[2] = SDL_Color{ 1, 2, 3, 4 };
+
+	TempFile tmp("asset_cache_test.bin");
+	const char *path = tmp.path;
+	ASSERT_TRUE(AssetCache(ts, ids, gifs, bkg_cols, cols).save(path, 42));
+
+	gfx::Tileset ts2;
+	std::map<io::DrsId, IdPoolRef> ids2;
+	std::map<io::DrsId, ImageSet> gifs2;
+	std::map<io::DrsId, BackgroundColors> bkg_cols2;
+	std::vector<SDL_Color> cols2;
+	AssetCache c(ts2, ids2, gifs2, bkg_cols2, cols2);
+
+	// different game data
+	ASSERT_FALSE(c.load(path, 43));
+	ASSERT_TRUE(ts2.pages.empty());
+
+	ASSERT_TRUE(c.load(path, 42));
+
+	ASSERT_EQ(ts.pages.size(), ts2.pages.size());
+	ASSERT_EQ(ts.pages[0].w, ts2.pages[0].w);
+	ASSERT_EQ(ts.pages[0].h, ts2.pages[0].h);
+
+	const SDL_Surface *s0 = ts.pages[0].surf.get(), *s1 = ts2.pages[0].surf.get();
+	for (int y = 0; y < s0->h; ++y)
+		ASSERT_EQ(0, memcmp((const uint8_t*)s0->pixels + y * s0->pitch, (const uint8_t*)s1->pixels + y * s1->pitch, 4 * s0->w));
+
+	ASSERT_EQ(ts.imgs.size(), ts2.imgs.size());
+	for (auto it = ts.imgs.begin(), it2 = ts2.imgs.begin(); it != ts.imgs.end(); ++it, ++it2) {
+		ASSERT_EQ(it->ref, it2->ref);
+		ASSERT_EQ(it->bnds.x, it2->bnds.x);
+		ASSERT_EQ(it->bnds.h, it2->bnds.h);
+		ASSERT_EQ(it->hotspot_y, it2->hotspot_y);
+		ASSERT_FLOAT_EQ(it->t1, it2->t1);
+		ASSERT_EQ(it->mask, it2->mask);
+	}
+
+	ASSERT_EQ(b, ids2.at(io::DrsId::img_editor));
+	ASSERT_EQ(a, gifs2.at(io::DrsId::gif_cursors).imgs);
+	ASSERT_EQ(2, bkg_cols2.at(io::DrsId::bkg_main_menu).border[2].g);
+	ASSERT_EQ(MAX_PLAYERS * gfx::player_ramp, cols2.size());
+
+	// player colors from another palette layout
+	std::vector<SDL_Color> cols3(3);
+	ASSERT_TRUE(AssetCache(ts, ids, gifs, bkg_cols, cols3).save(path, 42));
+	ASSERT_FALSE(c.load(path, 42));
+}
+
+TEST(Rng, Deterministic) {
+	Rng a(1234), b(1234), c(1235);
+	bool differs = false;
+
+	for (unsigned i = 0; i < 100; ++i) {
+		uint32_t v = a.next();
+		ASSERT_EQ(v, b.next());
+		differs |= v != c.next();
+	}
+
+	ASSERT_TRUE(differs);
+
+	for (unsigned i = 0; i < 100; ++i) {
+		ASSERT_LT(a.below(7), 7u);
+
+		double d = a.real(-1.0, 1.0);
+		ASSERT_GE(d, -1.0);
+		ASSERT_LT(d, 1.0);
+	}
+
+	ASSERT_EQ(0u, a.below(0));
+}
+
+TEST(LockstepRelay, Order) {
+	LockstepRelay r;
+
+	r.add(NetTurnCommand(2, IdPoolRef(1, 1)));
+	r.add(NetTurnCommand(1, IdPoolRef(2, 1)));
+	r.add(NetTurnCommand(2, IdPoolRef(3, 1)));
+	r.add(NetTurnCommand(1, IdPoolRef(4, 1)));
+
+	NetTurn t(r.next(2));
+
+	ASSERT_EQ(0u, t.turn);
+	ASSERT_EQ(2u, t.ticks);
+	ASSERT_EQ(4u, t.cmds.size());
+	ASSERT_EQ(0u, r.queued());
+
+	// by player, then by arrival
+	unsigned exp[] = { 2, 4, 1, 3 };
+	for (unsigned i = 0; i < 4; ++i)
+		ASSERT_EQ(exp[i], std::get<IdPoolRef>(t.cmds[i].data).first);
+
+	ASSERT_EQ(1u, r.next(1).turn);
+}
+
+TEST(LockstepRelay, Defer) {
+	LockstepRelay r;
+
+	for (unsigned i = 0; i < NetTurn::max_cmds + 3; ++i)
+		r.add(NetTurnCommand(1, IdPoolRef(i + 1, 1)));
+
+	ASSERT_EQ(NetTurn::max_cmds, r.next(1).cmds.size());
+	ASSERT_EQ(3u, r.next(1).cmds.size());
+}
+
+TEST(LockstepRelay, Verify) {
+	LockstepRelay r;
+
+	r.commit(5, 1234);
+	ASSERT_EQ(std::optional<bool>(true), r.verify(5, 1234));
+	ASSERT_EQ(std::optional<bool>(false), r.verify(5, 4321));
+	ASSERT_FALSE(r.verify(6, 1234).has_value());
+
+	for (unsigned i = 0; i < LockstepRelay::history; ++i)
+		r.commit(6 + i, i);
+
+	// too old
+	ASSERT_FALSE(r.verify(5, 1234).has_value());
+}
+
+TEST(Lockstep, SameTurnsSameWorld) {
+	ScenarioSettings scn;
+	scn.lockstep = true;
+	scn.seed = 1234;
+	scn.players.emplace_back("a", 0, 1, scn.res);
+	scn.players.emplace_back("b", 0, 2, scn.res);
+
+	std::map<unsigned, std::vector<IdPoolRef>> units;
+	World w1, w2;
+
+	w1.start_lockstep(scn, 1, [&units](NetPkg &pkg) {
+		EntityView ev;
+
+		if (pkg.type() == NetPkgType::entity_mod && pkg.get_entity_mod(ev) == NetEntityControlType::add && ev.playerid && !is_building(ev.type))
+			units[ev.playerid].emplace_back(ev.ref);
+	});
+	w2.start_lockstep(scn, 2, [](NetPkg&) {});
+
+	ASSERT_FALSE(units[1].empty());
+	ASSERT_FALSE(units[2].empty());
+	ASSERT_EQ(w1.checksum(), w2.checksum());
+
+	Rng rng(42);
+
+	for (uint32_t turn = 1; turn <= 300; ++turn) {
+		NetTurn t(turn, 3);
+
+		// keep sending units around and at each other, so they also fight
+		if (turn % 10 == 1) {
+			for (auto &kv : units) {
+				const std::vector<IdPoolRef> &enemies = units[3 - kv.first];
+
+				for (IdPoolRef ref : kv.second) {
+					if (rng.below(2))
+						t.cmds.emplace_back(kv.first, EntityTask(ref, rng.below(scn.width), rng.below(scn.height)));
+					else
+						t.cmds.emplace_back(kv.first, EntityTask(EntityTaskType::infer, ref, enemies[rng.below(enemies.size())]));
+				}
+			}
+		}
+
+		w1.step(t);
+		w2.step(t);
+
+		ASSERT_EQ(w1.checksum(), w2.checksum()) << "turn " << turn;
+	}
+}
+
+}
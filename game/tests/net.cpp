@@ -18,6 +18,8 @@
 
 #include "util.hpp"
 
+#include "../src/net/impair.hpp"
+
 namespace aoe {
 
 static const char *default_host = "127.0.0.1";
@@ -701,4 +703,665 @@ TEST(Ssock, mainloopEcho) {
 }
 #endif
 
+TEST(Local, RingWrap) {
+	SpscRing r(8);
+	uint8_t in[6] = { 1, 2, 3, 4, 5, 6 }, out[6];
+
+	ASSERT_EQ(8u, r.capacity());
+
+	// move head and tail near the end so the next write wraps around
+	ASSERT_EQ(6u, r.write(in, 6));
+	ASSERT_EQ(6u, r.read(out, 6));
+
+	ASSERT_EQ(6u, r.write(in, 6));
+	ASSERT_EQ(2u, r.write(in, 6)); // full
+	ASSERT_EQ(0u, r.space());
+
+	ASSERT_EQ(6u, r.read(out, 6));
+	if (memcmp(in, out, sizeof in))
+		FAIL() << "bogus data after wrap around";
+
+	ASSERT_EQ(2u, r.read(out, 6));
+	ASSERT_EQ(0u, r.size());
+}
+
+TEST(Local, RecvAfterClose) {
+	auto ch = std::make_shared<LocalChannel>(16);
+	LocalSocket s;
+	char buf[4];
+
+	s.open(ch);
+
+	ch->write(LocalSide::server, "hi", 2);
+	ch->close();
+
+	// pending data must still be received before we report the channel is closed
+	ASSERT_EQ(2, s.recv(buf, sizeof buf));
+	ASSERT_EQ(0, s.recv(buf, sizeof buf));
+
+	try {
+		s.send_fully("x", 1);
+		FAIL() << "should not be able to send over closed channel";
+	} catch (SocketClosedError&) {}
+}
+
+TEST(Local, SendCalls) {
+	auto ch = std::make_shared<LocalChannel>(8);
+	LocalSocket s;
+	uint8_t in[12] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 }, out[12];
+
+	s.open(ch);
+
+	ASSERT_EQ(1u, s.send_fully(in, 4));
+	ASSERT_EQ(4u, ch->read(LocalSide::server, out, sizeof out));
+
+	// does not fit at once, so it has to wait for the reader
+	unsigned calls = 0;
+	std::thread t([&] { calls = s.send_fully(in, sizeof in); });
+
+	for (size_t got = 0; got < sizeof in;) {
+		ch->wait(LocalSide::server, [&ch]{ return ch->available(LocalSide::server) > 0; });
+		got += ch->read(LocalSide::server, out + got, sizeof out - got);
+	}
+
+	t.join();
+
+	ASSERT_LE(2u, calls);
+	ASSERT_EQ(0, memcmp(in, out, sizeof in));
+}
+
+TEST(Ssock, mainloopLocalEcho) {
+	std::vector<std::string> bt;
+	auto ch = std::make_shared<LocalChannel>(64);
+
+	std::thread t1([&] {
+		SsockCtlEcho echo;
+		ServerSocket s;
+		int err = s.mainloop(ch, echo);
+		if (err)
+			bt.emplace_back("mainloop failed");
+	});
+
+	LocalSocket dummy;
+	dummy.open(ch);
+
+	// larger than the channel to make sure both sides have to wait for each other
+	std::vector<char> msg(1000), buf(msg.size());
+	for (size_t i = 0; i < msg.size(); ++i)
+		msg[i] = (char)i;
+
+	std::thread t2([&] { dummy.send_fully(msg.data(), (int)msg.size()); });
+
+	for (int pos = 0, in; pos < (int)buf.size(); pos += in) {
+		if ((in = dummy.recv(buf.data() + pos, (int)buf.size() - pos)) <= 0) {
+			ADD_FAILURE() << "channel closed prematurely";
+			break;
+		}
+	}
+
+	if (msg != buf)
+		ADD_FAILURE() << "bogus echo";
+
+	t2.join();
+	dummy.close();
+	t1.join();
+
+	dump_errors(bt);
+}
+
+class SsockCtlBulk final : public ServerSocketController {
+public:
+	bool incoming(ServerSocket &s, const Peer &p) override {
+		std::vector<BulkChunk> chunks;
+
+		for (char ch : { 'A', 'B', 'C' })
+			chunks.emplace_back(std::make_shared<std::vector<uint8_t>>(4, (uint8_t)ch));
+
+		s.send_bulk(p, chunks);
+		s.send(p, "x", 1);
+		return true;
+	}
+
+	void dropped(ServerSocket&, const Peer&) override {}
+	void stopped() override {}
+
+	int proper_packet(ServerSocket&, const std::deque<uint8_t> &q) override { return (int)(-(long long)q.size()); }
+	bool process_packet(ServerSocket&, const Peer&, std::deque<uint8_t>&, std::deque<uint8_t>&, int) override { return true; }
+};
+
+TEST(Ssock, localBulkInterleave) {
+	std::vector<std::string> bt;
+	auto ch = std::make_shared<LocalChannel>(64);
+
+	std::thread t1([&] {
+		SsockCtlBulk bulk;
+		ServerSocket s;
+		int err = s.mainloop(ch, bulk);
+		if (err)
+			bt.emplace_back("mainloop failed");
+	});
+
+	LocalSocket dummy;
+	dummy.open(ch);
+
+	std::string got;
+	char buf[16];
+
+	while (got.size() < 13) {
+		int in = dummy.recv(buf, sizeof buf);
+		if (in <= 0) {
+			ADD_FAILURE() << "channel closed prematurely";
+			break;
+		}
+		got.append(buf, in);
+	}
+
+	// regular data must not wait for all bulk data to be sent
+	ASSERT_EQ("xAAAABBBBCCCC", got);
+
+	dummy.close();
+	t1.join();
+
+	dump_errors(bt);
+}
+
+class SsockCtlHold final : public ServerSocketController {
+public:
+	std::atomic<bool> ready;
+	std::optional<Peer> peer;
+
+	SsockCtlHold() : ready(false), peer() {}
+
+	bool incoming(ServerSocket &s, const Peer &p) override {
+		s.hold(p);
+		s.send(p, "x", 1);
+		s.broadcast("y", 1);
+		s.send_bulk(p, { std::make_shared<std::vector<uint8_t>>(4, (uint8_t)'A') });
+
+		peer.emplace(p);
+		ready = true;
+		return true;
+	}
+
+	void dropped(ServerSocket&, const Peer&) override {}
+	void stopped() override {}
+
+	int proper_packet(ServerSocket&, const std::deque<uint8_t> &q) override { return (int)(-(long long)q.size()); }
+	bool process_packet(ServerSocket&, const Peer&, std::deque<uint8_t>&, std::deque<uint8_t>&, int) override { return true; }
+};
+
+TEST(Ssock, localHold) {
+	std::vector<std::string> bt;
+	auto ch = std::make_shared<LocalChannel>(64);
+	SsockCtlHold hold;
+	ServerSocket s;
+
+	std::thread t1([&] {
+		int err = s.mainloop(ch, hold);
+		if (err)
+			bt.emplace_back("mainloop failed");
+	});
+
+	LocalSocket dummy;
+	dummy.open(ch);
+
+	std::string got;
+	char buf[16];
+
+	auto recv = [&](size_t n) {
+		while (got.size() < n) {
+			int in = dummy.recv(buf, sizeof buf);
+			if (in <= 0) {
+				ADD_FAILURE() << "channel closed prematurely";
+				break;
+			}
+			got.append(buf, in);
+		}
+	};
+
+	// bulk data skips the line
+	recv(4);
+	ASSERT_EQ("AAAA", got);
+
+	while (!hold.ready)
+		std::this_thread::yield();
+
+	// everything has been sent now, so the rest can follow
+	while (!s.release(*hold.peer))
+		std::this_thread::yield();
+
+	// nothing is held anymore
+	ASSERT_TRUE(s.release(*hold.peer));
+
+	recv(6);
+	ASSERT_EQ("AAAAxy", got);
+
+	dummy.close();
+	t1.join();
+
+	dump_errors(bt);
+}
+
+static BulkChunk mkchunk(size_t n, char ch) {
+	return std::make_shared<std::vector<uint8_t>>(n, (uint8_t)ch);
+}
+
+TEST(SendQueue, Lanes) {
+	SendQueue q;
+	std::deque<uint8_t> out;
+
+	q.push(SendLane::bulk, mkchunk(4, 'B'));
+	q.push(SendLane::state, mkchunk(2, 'S'));
+	q.push(SendLane::control, mkchunk(1, 'c'));
+	q.push(SendLane::control, mkchunk(1, 'd'));
+
+	ASSERT_EQ(8u, q.bytes);
+	ASSERT_EQ(4u, q.lane_bytes[(unsigned)SendLane::bulk]);
+
+	// budget is checked before each packet, so at least one packet is moved
+	ASSERT_EQ(1u, q.pop(SendLane::control, out, 1));
+	ASSERT_EQ(1u, q.pop(SendLane::control, out, 1));
+	ASSERT_EQ(0u, q.pop(SendLane::command, out, 1));
+	ASSERT_EQ(2u, q.pop(SendLane::state, out, 1));
+	ASSERT_EQ(4u, q.pop(SendLane::bulk, out, 16));
+
+	ASSERT_TRUE(q.empty());
+	ASSERT_EQ(0u, q.bytes);
+	ASSERT_EQ("cdSSBBBB", std::string(out.begin(), out.end()));
+}
+
+TEST(SendQueue, Coalesce) {
+	SendQueue q;
+	std::deque<uint8_t> out;
+
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(2, 'a'), 1, true));
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(2, 'x'), SendQueue::no_key, true));
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(2, 'b'), 2, true));
+	// not under pressure: keep everything
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(2, 'c'), 2, false));
+	// newest update for key 1 takes the place of the old one
+	ASSERT_TRUE(q.push(SendLane::state, mkchunk(3, 'A'), 1, true));
+
+	ASSERT_EQ(9u, q.bytes);
+
+	q.pop(SendLane::state, out, 3);
+	ASSERT_EQ("AAA", std::string(out.begin(), out.end()));
+
+	// key 1 is gone, so this must not touch anything that is still queued
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(1, 'd'), 1, true));
+	ASSERT_TRUE(q.push(SendLane::state, mkchunk(1, 'C'), 2, true));
+
+	out.clear();
+	q.pop(SendLane::state, out, 100);
+	ASSERT_EQ("xxbbCd", std::string(out.begin(), out.end()));
+	ASSERT_TRUE(q.empty());
+}
+
+TEST(SendQueue, Barrier) {
+	SendQueue q;
+	std::deque<uint8_t> out;
+
+	q.push(SendLane::bulk, mkchunk(2, 'B'));
+	q.push(SendLane::state, mkchunk(1, 'a'), 1, true);
+	q.push(SendLane::control, mkchunk(1, 'c'));
+	q.push(SendLane::control, mkchunk(1, '|'), SendQueue::barrier);
+	q.push(SendLane::control, mkchunk(1, 'd'));
+	// must not take the place of the update in front of the barrier
+	ASSERT_FALSE(q.push(SendLane::state, mkchunk(1, 'A'), 1, true));
+	q.push(SendLane::bulk, mkchunk(1, 'E'));
+
+	// everything before the barrier goes first in the order it has been queued, no matter the budget
+	ASSERT_EQ(5u, q.pop(SendLane::control, out, 2));
+	ASSERT_EQ("cBBa|", std::string(out.begin(), out.end()));
+
+	for (unsigned i = 0; i < send_lanes; ++i)
+		q.pop((SendLane)i, out, 16);
+
+	ASSERT_TRUE(q.empty());
+	ASSERT_EQ(0u, q.bytes);
+	ASSERT_EQ("cBBa|dAE", std::string(out.begin(), out.end()));
+}
+
+TEST(SendQueue, BarrierHoldsBackNewer) {
+	SendQueue q;
+	std::deque<uint8_t> out;
+
+	q.push(SendLane::control, mkchunk(1, 'c'));
+	q.push(SendLane::control, mkchunk(1, 'd'));
+	q.push(SendLane::control, mkchunk(1, '|'), SendQueue::barrier);
+	q.push(SendLane::state, mkchunk(1, 'a'), 1, true);
+
+	// the control budget runs out before the barrier, but the state queued after it must still wait
+	ASSERT_EQ(1u, q.pop(SendLane::control, out, 1));
+	ASSERT_EQ(2u, q.pop(SendLane::state, out, 1));
+	ASSERT_EQ("cd|", std::string(out.begin(), out.end()));
+
+	ASSERT_EQ(1u, q.pop(SendLane::state, out, 1));
+	ASSERT_EQ("cd|a", std::string(out.begin(), out.end()));
+	ASSERT_TRUE(q.empty());
+}
+
+TEST(NetStats, Counters) {
+	NetStats st;
+
+	st.add(NetDir::in, 1, 10);
+	st.add(NetDir::in, 1, 20);
+	st.add(NetDir::out, 2, 4);
+	st.add(NetDir::out, 1000, 8); // unknown types share the last slot
+	st.add_recv_call();
+
+	NetStatsSnapshot s(st.snapshot());
+
+	ASSERT_EQ(2u, s.packets[0][1]);
+	ASSERT_EQ(30u, s.bytes[0][1]);
+	ASSERT_EQ(1u, s.packets[1][NetStats::types - 1]);
+	ASSERT_EQ(2u, s.total_packets(NetDir::out));
+	ASSERT_EQ(12u, s.total_bytes(NetDir::out));
+	ASSERT_EQ(1u, s.recv_calls);
+	ASSERT_EQ(0u, s.send_calls);
+}
+
+TEST(NetStats, Rate) {
+	NetStatsSnapshot s0, s1;
+	NetRate r;
+
+	s1.time = s0.time + std::chrono::seconds(2);
+	s1.packets[1][3] = 10;
+	s1.bytes[1][3] = 1000;
+	s1.send_calls = 4;
+	s1.queued = 7;
+
+	ASSERT_FALSE(r.update(s0));
+	ASSERT_TRUE(r.update(s1));
+
+	ASSERT_DOUBLE_EQ(5.0, r.packets[1][3]);
+	ASSERT_DOUBLE_EQ(500.0, r.total_bytes(NetDir::out));
+	ASSERT_DOUBLE_EQ(2.0, r.send_calls);
+	ASSERT_DOUBLE_EQ(0.0, r.total_packets(NetDir::in));
+	ASSERT_EQ(7u, r.queued);
+
+	// too soon
+	ASSERT_FALSE(r.update(s1));
+}
+
+TEST(SpectatorTape, Delay) {
+	SpectatorTape tape;
+	auto t0 = std::chrono::steady_clock::now();
+	const uint8_t a[] = { 1, 2, 3 }, b[] = { 4, 5 };
+
+	// nothing recorded: no frame
+	tape.cut(t0);
+	ASSERT_EQ(0u, tape.end());
+
+	tape.add(a, sizeof a);
+	tape.add(b, sizeof b);
+	tape.cut(t0);
+
+	tape.add(std::vector<BulkChunk>{ std::make_shared<const std::vector<uint8_t>>(3, 7) });
+	tape.cut(t0 + std::chrono::seconds(1));
+
+	ASSERT_EQ(2u, tape.end());
+	ASSERT_EQ(8u, tape.total());
+	ASSERT_EQ(5u, tape.at(0)->size());
+	ASSERT_EQ(4, (*tape.at(0))[3]);
+
+	ASSERT_EQ(0u, tape.ready(t0, std::chrono::seconds(5)));
+	ASSERT_EQ(1u, tape.ready(t0 + std::chrono::seconds(5), std::chrono::seconds(5)));
+	ASSERT_EQ(2u, tape.ready(t0 + std::chrono::seconds(6), std::chrono::seconds(5)));
+	ASSERT_EQ(2u, tape.ready(t0 + std::chrono::seconds(1), std::chrono::seconds(0)));
+
+	tape.clear();
+	ASSERT_EQ(0u, tape.end());
+	ASSERT_EQ(0u, tape.total());
+}
+
+TEST(SpectatorTape, Trim) {
+	SpectatorTape tape;
+	auto t0 = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < 4; ++i) {
+		tape.add(std::vector<BulkChunk>{ std::make_shared<const std::vector<uint8_t>>(i + 1, (uint8_t)i) });
+		tape.cut(t0 + std::chrono::seconds(i));
+	}
+
+	ASSERT_EQ(10u, tape.total());
+
+	tape.trim(2);
+	ASSERT_EQ(2u, tape.begin());
+	ASSERT_EQ(4u, tape.end());
+	ASSERT_EQ(7u, tape.total());
+	// indices stay the same
+	ASSERT_EQ(3u, tape.at(2)->size());
+	ASSERT_EQ(3, (*tape.at(3))[0]);
+	ASSERT_ANY_THROW(tape.at(1));
+
+	ASSERT_EQ(3u, tape.ready(t0 + std::chrono::seconds(2), std::chrono::seconds(0)));
+	ASSERT_EQ(2u, tape.ready(t0, std::chrono::seconds(5)));
+
+	// trimming backwards does nothing
+	tape.trim(1);
+	ASSERT_EQ(2u, tape.begin());
+
+	tape.trim(10);
+	ASSERT_EQ(4u, tape.begin());
+	ASSERT_EQ(4u, tape.end());
+	ASSERT_EQ(0u, tape.total());
+}
+
+TEST(SpectatorTape, Private) {
+	SpectatorTape tape;
+	auto t0 = std::chrono::steady_clock::now();
+	const uint8_t a[] = { 1, 2, 3 };
+	SOCKET s1 = 5, s2 = 6;
+
+	tape.add(a, sizeof a);
+
+	// frame that is being recorded goes first
+	size_t i = tape.add_private(s1, std::make_shared<const std::vector<uint8_t>>(4, 9), t0);
+	ASSERT_EQ(1u, i);
+	ASSERT_EQ(2u, tape.end());
+	ASSERT_EQ(7u, tape.total());
+
+	tape.add(a, sizeof a);
+	tape.cut(t0);
+
+	ASSERT_TRUE(tape.sends_to(0, s1));
+	ASSERT_TRUE(tape.sends_to(0, s2));
+	ASSERT_TRUE(tape.sends_to(1, s1));
+	ASSERT_FALSE(tape.sends_to(1, s2));
+	ASSERT_TRUE(tape.sends_to(2, s2));
+}
+
+TEST(Impair, Deterministic) {
+	ImpairConfig cfg;
+	cfg.seed = 42;
+	cfg.latency_us = 1000;
+	cfg.jitter_us = 500;
+	cfg.stall_chance = 0.1;
+	cfg.stall_us = 20000;
+
+	ImpairModel m1(cfg), m2(cfg);
+	uint64_t last = 0;
+
+	for (uint64_t i = 0, now = 0; i < 1000; ++i, now += 100) {
+		uint64_t due = m1.schedule(now, 64);
+
+		ASSERT_EQ(due, m2.schedule(now, 64));
+
+		if (due < last)
+			FAIL() << "packet " << i << " overtakes previous packet";
+
+		last = due;
+	}
+}
+
+TEST(Impair, Bandwidth) {
+	ImpairConfig cfg;
+	cfg.latency_us = 50;
+	cfg.bandwidth = 1000;
+
+	ImpairModel m(cfg);
+
+	// second packet has to wait till the first one has been sent
+	ASSERT_EQ(100050u, m.schedule(0, 100));
+	ASSERT_EQ(200050u, m.schedule(0, 100));
+	ASSERT_EQ(500050u, m.schedule(400000, 100));
+}
+
+TEST(Impair, Histogram) {
+	LatencyHistogram h;
+
+	for (unsigned i = 1; i <= 100; ++i)
+		h.add(i * 10);
+
+	ASSERT_EQ(100u, h.total);
+	ASSERT_EQ(10u, h.min);
+	ASSERT_EQ(1000u, h.max);
+
+	uint64_t p50 = h.percentile(0.5);
+	if (p50 < 500 || p50 > 1023)
+		FAIL() << "bad median: " << p50;
+}
+
+TEST(Impair, HistogramMerge) {
+	LatencyHistogram a, b;
+
+	a.add(10);
+	a.add(20);
+	b.add(5);
+	b.add(5000);
+
+	a.merge(b);
+
+	ASSERT_EQ(4u, a.total);
+	ASSERT_EQ(5u, a.min);
+	ASSERT_EQ(5000u, a.max);
+
+	// merging an empty histogram must not touch min
+	a.merge(LatencyHistogram());
+	ASSERT_EQ(5u, a.min);
+}
+
+TEST(Impair, Echo) {
+	std::vector<std::string> bt;
+	auto cch = std::make_shared<LocalChannel>(), sch = std::make_shared<LocalChannel>();
+
+	ImpairConfig cfg;
+	cfg.seed = 1;
+	cfg.latency_us = 2000;
+	cfg.jitter_us = 500;
+
+	ImpairProxy proxy(cch, sch, cfg);
+	proxy.start();
+
+	std::thread t1([&] {
+		SsockCtlEcho echo;
+		ServerSocket s;
+		if (s.mainloop(sch, echo))
+			bt.emplace_back("mainloop failed");
+	});
+
+	LocalSocket c;
+	c.open(cch);
+
+	// packet type 7 with 4 byte payload
+	const uint8_t pkg[] = { 0, 7, 0, 4, 'p', 'i', 'n', 'g' };
+	uint8_t buf[sizeof pkg];
+	const unsigned count = 20;
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < count; ++i) {
+		c.send_fully(pkg, sizeof pkg);
+
+		for (int pos = 0, in; pos < (int)sizeof buf; pos += in)
+			if ((in = c.recv(buf + pos, (int)sizeof buf - pos)) <= 0)
+				FAIL() << "channel closed prematurely";
+
+		if (memcmp(pkg, buf, sizeof pkg))
+			FAIL() << "bogus echo";
+	}
+
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	c.close();
+	t1.join();
+	proxy.stop();
+
+	if (us < 2 * count * cfg.latency_us)
+		ADD_FAILURE() << "round trips took " << us << "us, expected at least " << 2 * count * cfg.latency_us << "us";
+
+	auto up = proxy.histograms(true);
+	if (up[7].total != count)
+		ADD_FAILURE() << "expected " << count << " packets upstream, got " << up[7].total;
+
+	dump_errors(bt);
+}
+
+TEST(Impair, Throughput) {
+	std::vector<std::string> bt;
+	auto cch = std::make_shared<LocalChannel>(), sch = std::make_shared<LocalChannel>();
+
+	ImpairConfig cfg;
+	cfg.bandwidth = 4 * 1024 * 1024;
+
+	ImpairProxy proxy(cch, sch, cfg);
+	proxy.start();
+
+	std::thread t1([&] {
+		SsockCtlEcho echo;
+		ServerSocket s;
+		if (s.mainloop(sch, echo))
+			bt.emplace_back("mainloop failed");
+	});
+
+	LocalSocket c;
+	c.open(cch);
+
+	// packet type 7 that fills up a KiB, both ways
+	std::vector<uint8_t> pkg(1024, 'x'), buf(64 * 1024);
+	const unsigned count = 1024;
+	const size_t total = count * pkg.size();
+
+	pkg[0] = 0;
+	pkg[1] = 7;
+	pkg[2] = (uint8_t)((pkg.size() - 4) >> 8);
+	pkg[3] = (uint8_t)(pkg.size() - 4);
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::thread t2([&] {
+		for (unsigned i = 0; i < count; ++i)
+			c.send_fully(pkg.data(), (int)pkg.size());
+	});
+
+	size_t got = 0;
+	for (int in; got < total; got += in) {
+		if ((in = c.recv(buf.data(), (int)std::min(buf.size(), total - got))) <= 0) {
+			ADD_FAILURE() << "channel closed prematurely";
+			break;
+		}
+	}
+
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	t2.join();
+	c.close();
+	t1.join();
+	proxy.stop();
+
+	RecordProperty("bytes_per_second", std::to_string(us ? total * 1000000 / us : 0));
+
+	// both links are limited, but they run in parallel
+	uint64_t min_us = total * 1000000 / cfg.bandwidth;
+	if ((uint64_t)us < min_us)
+		ADD_FAILURE() << total << " bytes took " << us << "us, expected at least " << min_us << "us";
+
+	auto down = proxy.histograms(false);
+	if (down[7].total != count)
+		ADD_FAILURE() << "expected " << count << " packets downstream, got " << down[7].total;
+
+	dump_errors(bt);
+}
+
 }
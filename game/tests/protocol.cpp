@@ -1,9 +1,45 @@
 #include "../src/server.hpp"
+#include "../src/net/local.hpp"
 
 #include <gtest/gtest.h>
 
+#include <cstdlib>
+#include <new>
+
+// count heap allocations, so we can verify hot paths do not allocate.
+// the replacement is global, but it only counts on a thread that has an AllocCounter
+static thread_local bool count_allocs = false;
+static thread_local size_t allocs = 0;
+
+void *operator new(size_t n) {
+	if (count_allocs)
+		++allocs;
+
+	if (void *p = malloc(n ? n : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
 namespace aoe {
 
+/** Count heap allocations made by this thread for as long as it lives. */
+class AllocCounter final {
+public:
+	AllocCounter() { allocs = 0; count_allocs = true; }
+	~AllocCounter() { count_allocs = false; }
+
+	size_t count() const noexcept { return allocs; }
+};
+
 TEST(Pkg, Init1_512) {
 	unsigned exp_type = 1, exp_payload = 512;
 	NetPkgHdr h(exp_type, exp_payload);
@@ -35,4 +71,403 @@ TEST(Pkg, ProtocolVersion) {
 		FAIL() << "bad protocol version, expected 0x" << std::hex << exp_prot << ", got " << pkg.protocol_version() << std::dec;
 }
 
+TEST(Pkg, ProtocolFlags) {
+	NetPkg pkg;
+	pkg.set_protocol(1, (uint16_t)NetProtocolFlags::compress);
+	pkg.hton();
+	pkg.ntoh();
+
+	ASSERT_EQ(1u, pkg.protocol_version());
+	ASSERT_EQ((uint16_t)NetProtocolFlags::compress, pkg.protocol_flags());
+}
+
+TEST(Pkg, Lane) {
+	NetPkg pkg;
+	EntityView ev;
+	ev.ref = IdPoolRef(3, 5);
+
+	pkg.set_chat_text(invalid_ref, "hi");
+	ASSERT_EQ(SendLane::control, pkg.lane());
+	ASSERT_EQ(SendQueue::no_key, pkg.state_key());
+
+	// ticks refer to the entities queued before them
+	pkg.set_gameticks(1);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+
+	pkg.set_player_resize(3);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+
+	pkg.cam_set(1, 2, 3, 4);
+	ASSERT_EQ(SendLane::command, pkg.lane());
+
+	// must not overtake the snapshot in front of it
+	pkg.set_start_game();
+	ASSERT_EQ(SendLane::control, pkg.lane());
+	ASSERT_EQ(SendQueue::barrier, pkg.state_key());
+
+	pkg.set_entity_spawn(ev);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+	ASSERT_EQ(SendQueue::no_key, pkg.state_key());
+
+	pkg.set_entity_update(ev);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+	ASSERT_EQ(3ull << 32 | 5, pkg.state_key());
+
+	pkg.set_entity_kill(ev.ref);
+	ASSERT_EQ(SendQueue::no_key, pkg.state_key());
+}
+
+/** Queue \a pkg the same way Server::send does. */
+static void queue_pkg(SendQueue &q, NetPkg &pkg) {
+	SendLane lane = pkg.lane();
+	uint64_t key = pkg.state_key();
+
+	std::vector<uint8_t> v;
+	pkg.write(v);
+	q.push(lane, std::make_shared<const std::vector<uint8_t>>(std::move(v)), key, true);
+}
+
+TEST(Pkg, LaneOrder) {
+	SendQueue q;
+	NetPkg pkg;
+	EntityView a, b;
+	a.ref = IdPoolRef(1, 0);
+	b.ref = IdPoolRef(2, 0);
+
+	pkg.set_chat_text(invalid_ref, "hi"); queue_pkg(q, pkg);
+	pkg.set_entity_update(a); queue_pkg(q, pkg);
+	pkg.set_gameticks(3); queue_pkg(q, pkg);
+	pkg.set_player_resize(3); queue_pkg(q, pkg);
+	pkg.cam_set(1, 2, 3, 4); queue_pkg(q, pkg);
+	pkg.set_entity_spawn(b); queue_pkg(q, pkg);
+	pkg.set_start_game(); queue_pkg(q, pkg);
+	pkg.set_entity_update(a); queue_pkg(q, pkg);
+	pkg.set_gameticks(2); queue_pkg(q, pkg);
+	pkg.set_chat_text(invalid_ref, "bye"); queue_pkg(q, pkg);
+
+	// flush with a tiny budget, so every round only moves a packet or so from each lane
+	std::deque<uint8_t> out;
+
+	while (!q.empty())
+		for (unsigned i = 0; i < send_lanes; ++i)
+			q.pop((SendLane)i, out, 1);
+
+	std::vector<NetPkgType> types;
+
+	for (size_t pos = 0; pos + NetPkgHdr::size <= out.size();) {
+		types.emplace_back((NetPkgType)(out[pos] << 8 | out[pos + 1]));
+		pos += NetPkgHdr::size + (out[pos + 2] << 8 | out[pos + 3]);
+	}
+
+	// chat and camera may go first, but ticks and player changes stay behind the state they refer to
+	// and nothing crosses start_game in either direction
+	std::vector<NetPkgType> exp{
+		NetPkgType::chat_text, NetPkgType::cam_set, NetPkgType::entity_mod, NetPkgType::gameticks, NetPkgType::playermod,
+		NetPkgType::entity_mod, NetPkgType::start_game, NetPkgType::entity_mod, NetPkgType::chat_text, NetPkgType::gameticks,
+	};
+
+	ASSERT_EQ(exp, types);
+}
+
+TEST(Pkg, Deflate) {
+	NetTerrainMod tm;
+	tm.w = tm.h = 32;
+	tm.tiles.resize(tm.w * tm.h, 3);
+	tm.hmap.resize(tm.w * tm.h, 1);
+
+	NetPkg pkg;
+	pkg.set_terrain_mod(tm);
+
+	size_t raw = pkg.size();
+	std::vector<uint8_t> v;
+	NetStats stats;
+
+	pkg.write(v, true, &stats);
+	ASSERT_LT(v.size(), raw);
+	ASSERT_EQ(raw - NetPkgHdr::size, stats.deflate_in.load());
+
+	std::deque<uint8_t> q(v.begin(), v.end());
+	NetPkg in(q);
+
+	ASSERT_TRUE(in.hdr.type & NetPkgHdr::compressed);
+	in.inflate(&stats);
+
+	ASSERT_EQ(raw, in.size());
+	ASSERT_EQ(NetPkgType::terrainmod, in.type());
+
+	NetTerrainMod tm2(in.get_terrain_mod());
+	ASSERT_EQ(tm.tiles, tm2.tiles);
+	ASSERT_EQ(tm.hmap, tm2.hmap);
+}
+
+TEST(Pkg, DeflateSmall) {
+	NetPkg pkg;
+	pkg.set_chat_text(invalid_ref, "hi");
+
+	std::vector<uint8_t> v;
+	pkg.write(v, true);
+
+	// too small to be worth compressing
+	ASSERT_EQ(pkg.size(), v.size());
+}
+
+TEST(Pkg, Fragment) {
+	NetTerrainMod tm;
+	tm.w = tm.h = 256;
+	tm.tiles.resize(tm.w * tm.h);
+	tm.hmap.resize(tm.w * tm.h);
+
+	for (size_t i = 0; i < tm.tiles.size(); ++i)
+		tm.tiles[i] = (uint16_t)i;
+
+	NetPkg pkg;
+	pkg.set_terrain_mod(tm);
+	ASSERT_TRUE(pkg.large());
+
+	std::vector<uint8_t> v;
+	ASSERT_THROW(pkg.write(v), std::runtime_error);
+
+	auto chunks(pkg.fragment(7, false));
+	size_t total = 0;
+
+	ASSERT_EQ((pkg.data.size() + NetPkg::fragment_size - 1) / NetPkg::fragment_size, chunks.size());
+
+	for (const BulkChunk &c : chunks) {
+		std::deque<uint8_t> q(c->begin(), c->end());
+		NetPkg frag(q);
+
+		ASSERT_TRUE(q.empty());
+		ASSERT_EQ(NetPkgType::fragment, frag.type());
+		total += frag.data.size() - NetPkg::fragment_hdr;
+	}
+
+	ASSERT_EQ(pkg.data.size(), total);
+}
+
+TEST(Pkg, FragmentTwice) {
+	NetTerrainMod tm;
+	tm.w = tm.h = 128;
+	tm.tiles.resize(tm.w * tm.h);
+	tm.hmap.resize(tm.w * tm.h);
+
+	for (size_t i = 0; i < tm.tiles.size(); ++i)
+		tm.tiles[i] = (uint16_t)i;
+
+	NetPkg pkg;
+	pkg.set_terrain_mod(tm);
+
+	auto chunks(pkg.fragment(7, false));
+	ASSERT_LE(2u, chunks.size());
+
+	auto ch = std::make_shared<LocalChannel>();
+	LocalSocket s;
+	PkgReceiver rx;
+	NetStats stats;
+	NetPkg got;
+	bool done = false;
+
+	s.open(ch);
+
+	// a duplicate must not make up for the missing last fragment
+	ch->write(LocalSide::server, chunks[0]->data(), chunks[0]->size());
+
+	for (size_t i = 0; i + 1 < chunks.size(); ++i)
+		ch->write(LocalSide::server, chunks[i]->data(), chunks[i]->size());
+
+	while (!(done = rx.try_recv(got, stats)) && ch->available(LocalSide::client))
+		rx.fill(s, stats);
+
+	ASSERT_FALSE(done);
+
+	ch->write(LocalSide::server, chunks.back()->data(), chunks.back()->size());
+
+	while (!rx.try_recv(got, stats))
+		rx.fill(s, stats);
+
+	ASSERT_EQ(NetPkgType::terrainmod, got.type());
+	ASSERT_EQ(pkg.data, got.data);
+}
+
+TEST(Pkg, Turn) {
+	NetTurn t(42, 3);
+	t.cmds.emplace_back(NetTurnCommand::any, IdPoolRef(1, 2));
+	t.cmds.emplace_back(4, EntityTask(IdPoolRef(5, 6), EntityType::villager));
+
+	NetPkg pkg;
+	pkg.set_turn(t);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+	ASSERT_EQ(NetTurn::hdrsize + 2 * NetTurnCommand::size, pkg.data.size());
+
+	std::deque<uint8_t> q;
+	pkg.write(q);
+	NetPkg in(q);
+	NetTurn got(in.get_turn());
+
+	ASSERT_EQ(42u, got.turn);
+	ASSERT_EQ(3u, got.ticks);
+	ASSERT_EQ(2u, got.cmds.size());
+
+	ASSERT_EQ(NetTurnCommand::any, got.cmds[0].player);
+	ASSERT_EQ(IdPoolRef(1, 2), std::get<IdPoolRef>(got.cmds[0].data));
+
+	const EntityTask &task = std::get<EntityTask>(got.cmds[1].data);
+	ASSERT_EQ(4u, got.cmds[1].player);
+	ASSERT_EQ(EntityTaskType::train_unit, task.type);
+	ASSERT_EQ(IdPoolRef(5, 6), task.ref1);
+	ASSERT_EQ((unsigned)EntityType::villager, task.info_value);
+
+	pkg.set_checksum(42, 0xdeadbeef);
+	NetChecksum c(pkg.get_checksum());
+	ASSERT_EQ(42u, c.turn);
+	ASSERT_EQ(0xdeadbeefu, c.hash);
+}
+
+TEST(Pkg, Resume) {
+	NetPkg pkg;
+	pkg.set_resume(0x0123456789abcdefull);
+	ASSERT_EQ(SendLane::control, pkg.lane());
+
+	std::deque<uint8_t> q;
+	pkg.write(q);
+	NetPkg in(q);
+
+	ASSERT_EQ(NetPkgType::resume, in.type());
+	ASSERT_EQ(0x0123456789abcdefull, in.get_resume());
+}
+
+TEST(Pkg, EntityGroup) {
+	NetPkg pkg;
+	NetEntityGroup g(EntityTask(EntityTaskType::infer, invalid_ref, IdPoolRef(7, 8)));
+
+	for (unsigned i = 0; i < 100; ++i)
+		g.refs.emplace_back(i + 1, 1);
+
+	pkg.set_entity_group(g);
+	ASSERT_EQ(SendLane::state, pkg.lane());
+	ASSERT_EQ(NetEntityGroup::hdrsize + 100 * refsize, pkg.data.size());
+
+	std::deque<uint8_t> q;
+	pkg.write(q);
+	NetPkg in(q);
+
+	NetEntityGroup out(in.get_entity_group());
+	ASSERT_EQ(EntityTaskType::infer, out.task.type);
+	ASSERT_EQ(IdPoolRef(7, 8), out.task.ref2);
+	ASSERT_EQ(g.refs, out.refs);
+
+	g.task = EntityTask(invalid_ref, 12, 34);
+	g.refs.resize(2);
+	pkg.set_entity_group(g);
+
+	out = pkg.get_entity_group();
+	ASSERT_EQ(EntityTaskType::move, out.task.type);
+	ASSERT_EQ(12u, out.task.x);
+	ASSERT_EQ(34u, out.task.y);
+	ASSERT_EQ(2u, out.refs.size());
+
+	// the world cannot run these, so they must not get that far
+	g.task = EntityTask(EntityTaskType::attack, invalid_ref, IdPoolRef(7, 8));
+	pkg.set_entity_group(g);
+	ASSERT_THROW(pkg.get_entity_group(), std::runtime_error);
+
+	pkg.entity_task(IdPoolRef(1, 1), IdPoolRef(7, 8), EntityTaskType::attack);
+	ASSERT_THROW(pkg.get_entity_mod(), std::runtime_error);
+
+	pkg.entity_task(IdPoolRef(1, 1), IdPoolRef(7, 8));
+	ASSERT_EQ(EntityTaskType::infer, std::get<EntityTask>(pkg.get_entity_mod().data).type);
+
+	g.refs.resize(NetEntityGroup::max_refs + 1, IdPoolRef(1, 1));
+	ASSERT_THROW(pkg.set_entity_group(g), std::runtime_error);
+}
+
+TEST(Pkg, DecodeNoAlloc) {
+	EntityView ev;
+	ev.ref = IdPoolRef(3, 4);
+	ev.x = 10.5f;
+	ev.y = 20.25f;
+	ev.state = EntityState::moving;
+
+	Resources res;
+	res.wood = 100;
+	res.gold = 5;
+
+	NetTerrainMod tm;
+	tm.w = tm.h = 4;
+	tm.tiles.assign(16, 2);
+	tm.hmap.assign(16, 1);
+
+	NetPkg ent, part, rpkg, tpkg;
+	ent.set_entity_update(ev);
+	part.particle_spawn(Particle(IdPoolRef(5, 6), ParticleType::moveto, 1.5f, 2.0f, 0));
+	rpkg.set_resources(res);
+	tpkg.set_terrain_mod(tm);
+
+	EntityView out;
+	NetTerrainMod tout;
+
+	// the terrain buffers grow once
+	tpkg.get_terrain_mod(tout);
+
+	// and so do the journal, the buffer it is swapped with and the track of the entity
+	Game g;
+	GameView gv;
+	ScenarioSettings scn;
+
+	g.resize(scn);
+	g.entity_add(EntityView(Entity(ev.ref, EntityType::villager, 1, 0.0f, 0.0f)));
+	ASSERT_TRUE(gv.try_read(g));
+
+	for (unsigned i = 0; i < 2; ++i) {
+		ent.get_entity_mod(out);
+		g.entity_update(out);
+		ASSERT_TRUE(gv.try_read(g));
+	}
+
+	AllocCounter counter;
+
+	for (unsigned i = 0; i < 100; ++i) {
+		ASSERT_EQ(NetEntityControlType::update, ent.get_entity_mod(out));
+		g.entity_update(out);
+		ASSERT_TRUE(gv.try_read(g));
+
+		Particle p(part.get_particle());
+		Resources r(rpkg.get_resources());
+		tpkg.get_terrain_mod(tout);
+
+		ASSERT_EQ(5u, p.ref.first);
+		ASSERT_EQ(100u, r.wood);
+	}
+
+	ASSERT_EQ(0u, counter.count());
+
+	ASSERT_EQ(ev.ref, out.ref);
+	ASSERT_NEAR(ev.x, out.x, 0.01f);
+	ASSERT_NEAR(ev.y, out.y, 0.01f);
+	ASSERT_EQ(EntityState::moving, out.state);
+	ASSERT_EQ(tm.tiles, tout.tiles);
+	ASSERT_EQ(tm.hmap, tout.hmap);
+
+	// truncated payloads are rejected
+	ent.data.resize(ent.data.size() - 1);
+	ASSERT_THROW(ent.get_entity_mod(out), std::runtime_error);
+}
+
+TEST(Pkg, Spectate) {
+	NetPkg pkg;
+	pkg.set_spectate();
+	ASSERT_EQ(SendLane::control, pkg.lane());
+
+	std::deque<uint8_t> q;
+	pkg.write(q);
+	ASSERT_TRUE(NetPkg::complete(q));
+
+	// partial packets are not complete
+	std::deque<uint8_t> part(q.begin(), q.begin() + NetPkgHdr::size - 1);
+	ASSERT_FALSE(NetPkg::complete(part));
+
+	NetPkg in(q);
+	ASSERT_EQ(NetPkgType::spectate, in.type());
+	ASSERT_EQ(0u, in.data.size());
+}
+
 }
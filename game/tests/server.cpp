@@ -1,11 +1,15 @@
 #include "../src/server.hpp"
 
+#include <chrono>
+#include <cmath>
 #include <stdexcept>
 
 #include <gtest/gtest.h>
 
 #include "util.hpp"
 
+#include "../src/net/impair.hpp"
+
 namespace aoe {
 
 static const char *default_host = "127.0.0.1";
@@ -63,7 +67,7 @@ TEST_F(ServerFixture, clientStopEarly) {
 
 static void connect_test(bool close) {
 	Server s;
-	std::thread t1([&] { s.mainloop(1, default_port, 0, true); if (close) s.close(); });
+	std::thread t1([&] { s.mainloop(default_port, 0, true); if (close) s.close(); });
 
 	Client c;
 	c.start(default_host, default_port, false);
@@ -153,12 +157,13 @@ static void echo_test(std::vector<std::string> &bt, bool close) {
 #if BUILD_TESTS_HEADLESS
 	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
 #endif
-	Net net;
+	// in-process hosts do not go through TCP
+	auto ch = std::make_shared<LocalChannel>();
 	Server s;
-	std::thread t1([&] { s.mainloop(1, default_port, 1, true); if (close) s.close(); });
+	std::thread t1([&] { s.mainloop(ch, 1, true); if (close) s.close(); });
 
 	Client c;
-	c.start(default_host, default_port, false);
+	c.start(ch, false);
 
 	handshake(c);
 
@@ -180,13 +185,14 @@ TEST_F(ServerFixture, protocol) {
 	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
 #endif
 	std::vector<std::string> bt;
+	auto ch = std::make_shared<LocalChannel>();
 	Server s;
-	std::thread t1([&] { s.mainloop(1, default_port, 1, true); s.close(); });
+	std::thread t1([&] { s.mainloop(ch, 1, true); s.close(); });
 
 	Client c;
 	uint16_t prot;
 
-	c.start(default_host, default_port, false);
+	c.start(ch, false);
 
 	handshake(c);
 
@@ -232,4 +238,455 @@ TEST_F(ServerFixture, dataExchange) {
 	dump_errors(bt);
 }
 
+/** Poll \a cond until it holds. Returns false if it still does not hold after 10 seconds. */
+template<typename F> static bool wait_until(F cond) {
+	auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+	while (!cond()) {
+		if (std::chrono::steady_clock::now() > end)
+			return false;
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	return true;
+}
+
+/** Count entities of \a player that \a c knows about. */
+static size_t owned_entities(Client &c, GameView &gv, unsigned player) {
+	gv.try_read(c.g);
+
+	size_t n = 0;
+
+	for (const Entity &ent : gv.entities)
+		if (ent.playerid == player && ent.is_alive())
+			++n;
+
+	return n;
+}
+
+/** Let \a host and \a guest claim player 1 and 2 respectively and start the game. */
+static void start_duel(std::vector<std::string> &bt, Client &host, Client &guest) {
+	ClientView hv, gv;
+
+	host.start(default_host, default_port);
+
+	// the first peer from localhost becomes the host
+	if (!wait_until([&] { hv.try_read(host); return hv.me != invalid_ref; })) {
+		bt.emplace_back("host has not joined");
+		return;
+	}
+
+	host.send_players_resize(3);
+	host.claim_player(1);
+	host.send_ready(true);
+
+	guest.start(default_host, default_port);
+
+	if (!wait_until([&] { gv.try_read(guest); return gv.me != invalid_ref && gv.scn.players.size() == 3; })) {
+		bt.emplace_back("guest has not joined");
+		return;
+	}
+
+	guest.claim_player(2);
+	guest.send_ready(true);
+
+	// the server ignores start_game until everyone is ready
+	if (!wait_until([&] { host.send_start_game(); return guest.resume_token(default_host, default_port) != 0; }))
+		bt.emplace_back("game has not started");
+}
+
+TEST_F(ServerFixture, resume) {
+#if BUILD_TESTS_HEADLESS
+	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
+#endif
+	std::vector<std::string> bt;
+	Server s;
+	std::thread t1([&] { s.mainloop(default_port, 1, true); });
+
+	// give the server some time to start listening
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	Client host, guest, back;
+	start_duel(bt, host, guest);
+
+	GameView gv;
+
+	if (bt.empty() && !wait_until([&] { return owned_entities(guest, gv, 2) > 0; }))
+		bt.emplace_back("guest has not received its units");
+
+	if (bt.empty()) {
+		uint64_t token = guest.resume_token(default_host, default_port);
+		guest.stop();
+
+		// the seat is only kept once the server has noticed that the guest is gone
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		back.resume(token);
+		back.start(default_host, default_port);
+
+		ClientView cv;
+		GameView bv;
+
+		if (!wait_until([&] { cv.try_read(back); return cv.playerindex == 2; }))
+			bt.emplace_back("seat has not been given back");
+		else if (!wait_until([&] { return owned_entities(back, bv, 2) > 0; }))
+			bt.emplace_back("units have not been given back");
+	}
+
+	back.stop();
+	host.stop();
+	s.close();
+	t1.join();
+
+	// the world thread checks every tick whether the server is still running
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	dump_errors(bt);
+}
+
+/** Check if \a a and \a b show the same entities and terrain. */
+static bool same_world(GameView &a, GameView &b) {
+	if (!a.entities.size() || a.entities.size() != b.entities.size() || a.t.w != b.t.w || a.t.h != b.t.h)
+		return false;
+
+	for (const Entity &ent : a.entities) {
+		const Entity *other = b.try_get(ent.ref);
+
+		if (!other || other->type != ent.type || other->playerid != ent.playerid || other->state != ent.state)
+			return false;
+
+		if (std::fabs(other->x - ent.x) > 0.01f || std::fabs(other->y - ent.y) > 0.01f)
+			return false;
+	}
+
+	for (unsigned y = 0; y < a.t.h; ++y)
+		for (unsigned x = 0; x < a.t.w; ++x)
+			if (a.t.tile_at(x, y) != b.t.tile_at(x, y) || a.t.h_at(x, y) != b.t.h_at(x, y))
+				return false;
+
+	return true;
+}
+
+TEST_F(ServerFixture, spectateRunning) {
+#if BUILD_TESTS_HEADLESS
+	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
+#endif
+	std::vector<std::string> bt;
+	Server s;
+	std::thread t1([&] { s.mainloop(default_port, 1, true); });
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	Client host, guest, spec, observer;
+	SpectatorRelay relay;
+	std::thread t2;
+	start_duel(bt, host, guest);
+
+	GameView hv, sv, ov;
+
+	if (bt.empty() && !wait_until([&] { return owned_entities(host, hv, 1) > 0; }))
+		bt.emplace_back("host has not received its units");
+
+	if (bt.empty()) {
+		s.set_spectate_delay(0);
+
+		// nothing changes while the game is paused, so everyone has to end up with the same world
+		host.send_gamespeed_control(NetGamespeedType::pause);
+
+		spec.spectate();
+		spec.start(default_host, default_port);
+
+		if (!wait_until([&] { hv.try_read(host.g); sv.try_read(spec.g); return same_world(hv, sv); }))
+			bt.emplace_back("spectator has not rebuilt the world");
+
+		// the relay joins late as well and asks for another snapshot for its observer
+		t2 = std::thread([&] { relay.mainloop(default_host, default_port, default_port + 1); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		observer.spectate();
+		observer.start(default_host, default_port + 1);
+
+		if (!wait_until([&] { hv.try_read(host.g); ov.try_read(observer.g); return same_world(hv, ov); }))
+			bt.emplace_back("observer has not rebuilt the world");
+	}
+
+	observer.stop();
+	relay.stop();
+	if (t2.joinable())
+		t2.join();
+
+	spec.stop();
+	guest.stop();
+	host.stop();
+	s.close();
+	t1.join();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	dump_errors(bt);
+}
+
+/** Count gameticks packets and game ticks that \a c receives in one second. */
+static void measure_gameticks(Client &c, uint64_t &packets, uint64_t &ticks) {
+	GameView gv;
+	gv.try_read(c.g);
+
+	uint64_t p0 = c.net_stats().packets[(unsigned)NetDir::in][(unsigned)NetPkgType::gameticks], t0 = gv.ticks;
+
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+
+	gv.try_read(c.g);
+
+	packets = c.net_stats().packets[(unsigned)NetDir::in][(unsigned)NetPkgType::gameticks] - p0;
+	ticks = gv.ticks - t0;
+}
+
+TEST_F(ServerFixture, snapshotRateGamespeed) {
+#if BUILD_TESTS_HEADLESS
+	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
+#endif
+	std::vector<std::string> bt;
+	Server s;
+	std::thread t1([&] { s.mainloop(default_port, 1, true); });
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	Client host, guest;
+	start_duel(bt, host, guest);
+
+	GameView hv;
+
+	if (bt.empty() && !wait_until([&] { return owned_entities(host, hv, 1) > 0; }))
+		bt.emplace_back("host has not received its units");
+
+	if (bt.empty()) {
+		s.set_snapshot_rate(10);
+
+		uint64_t slow_packets, slow_ticks, fast_packets, fast_ticks;
+		measure_gameticks(host, slow_packets, slow_ticks);
+
+		// from normal speed to the maximum
+		for (double speed = 1.0; speed < World::gamespeed_max; speed += World::gamespeed_step)
+			host.send_gamespeed_control(NetGamespeedType::increase);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		measure_gameticks(host, fast_packets, fast_ticks);
+
+		if (slow_packets < 5 || slow_packets > 15)
+			bt.emplace_back("expected about 10 snapshots per second, got " + std::to_string(slow_packets));
+
+		if (fast_packets + 3 < slow_packets || fast_packets > slow_packets + 3)
+			bt.emplace_back("snapshot rate changed with gamespeed: " + std::to_string(slow_packets) + " -> " + std::to_string(fast_packets));
+
+		if (fast_ticks < 2 * slow_ticks)
+			bt.emplace_back("gamespeed has not changed: " + std::to_string(slow_ticks) + " -> " + std::to_string(fast_ticks) + " ticks");
+	}
+
+	guest.stop();
+	host.stop();
+	s.close();
+	t1.join();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	dump_errors(bt);
+}
+
+TEST_F(ServerFixture, resumeBadToken) {
+#if BUILD_TESTS_HEADLESS
+	GTEST_SKIP() << "todo figure out why this segfaults when running headless on github actions";
+#endif
+	std::vector<std::string> bt;
+	Server s;
+	std::thread t1([&] { s.mainloop(default_port, 1, true); });
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	Client host, guest, bad;
+	start_duel(bt, host, guest);
+
+	if (bt.empty()) {
+		bad.start(default_host, default_port, false);
+
+		NetPkg pkg;
+		pkg.set_resume(guest.resume_token(default_host, default_port) ^ 1);
+		bad.send(pkg);
+
+		// this is only echoed if the server has let us in
+		bad.send_chat_text("let me in");
+
+		try {
+			while (1) {
+				pkg = bad.recv();
+
+				if (pkg.type() == NetPkgType::chat_text && pkg.chat_text().second == "let me in") {
+					bt.emplace_back("peer with unknown token has not been kicked");
+					break;
+				}
+			}
+		} catch (std::runtime_error&) {}
+	}
+
+	bad.stop();
+	guest.stop();
+	host.stop();
+	s.close();
+	t1.join();
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+	dump_errors(bt);
+}
+
+static void local_protocol_test(std::vector<std::string> &bt, const ImpairConfig *cfg) {
+	auto ch = std::make_shared<LocalChannel>(), sch = ch;
+	std::unique_ptr<ImpairProxy> proxy;
+
+	if (cfg) {
+		sch = std::make_shared<LocalChannel>();
+		proxy.reset(new ImpairProxy(ch, sch, *cfg));
+		proxy->start();
+	}
+
+	Server s;
+	std::thread t1([&] { s.mainloop(sch, 1, true); s.close(); });
+
+	Client c;
+	c.start(ch, false);
+
+	handshake(c);
+
+	c.send_protocol(2);
+
+	uint16_t prot;
+	if ((prot = c.recv_protocol()) != 1u) {
+		char buf[64];
+		snprintf(buf, sizeof buf, "bad protocol: expected %u, got %u", 1u, prot);
+		bt.emplace_back(buf);
+	}
+
+	c.stop();
+	t1.join();
+
+	if (s.active())
+		bt.emplace_back("server should have stopped after host left");
+
+	if (proxy)
+		proxy->stop();
+}
+
+TEST_F(ServerFixture, localProtocol) {
+	std::vector<std::string> bt;
+	local_protocol_test(bt, nullptr);
+	dump_errors(bt);
+}
+
+TEST_F(ServerFixture, localProtocolImpaired) {
+	std::vector<std::string> bt;
+
+	ImpairConfig cfg;
+	cfg.seed = 1234;
+	cfg.latency_us = 5000;
+	cfg.jitter_us = 2000;
+	cfg.bandwidth = 64 * 1024;
+	cfg.stall_chance = 0.2;
+	cfg.stall_us = 10000;
+
+	local_protocol_test(bt, &cfg);
+	dump_errors(bt);
+}
+
+static uint64_t proxy_packets(const std::map<uint16_t, LatencyHistogram> &h, NetPkgType type) {
+	auto it = h.find((uint16_t)type);
+	return it == h.end() ? 0 : it->second.total;
+}
+
+TEST_F(ServerFixture, localGameImpaired) {
+	std::vector<std::string> bt;
+
+	ImpairConfig cfg;
+	cfg.seed = 1234;
+	cfg.latency_us = 5000;
+	cfg.jitter_us = 2000;
+	cfg.bandwidth = 256 * 1024;
+	cfg.stall_chance = 0.05;
+	cfg.stall_us = 10000;
+
+	auto ch = std::make_shared<LocalChannel>(), sch = std::make_shared<LocalChannel>();
+	ImpairProxy proxy(ch, sch, cfg);
+	proxy.start();
+
+	Server s;
+	std::thread t1([&] { s.mainloop(sch, 1, true); s.close(); });
+
+	Client c;
+	c.start(ch);
+
+	ClientView cv;
+	GameView gv;
+
+	if (!wait_until([&] { cv.try_read(c); return cv.me != invalid_ref; })) {
+		bt.emplace_back("host has not joined");
+	} else {
+		c.send_players_resize(2);
+		c.claim_player(1);
+		c.send_ready(true);
+
+		// keep asking as the server ignores start_game until we are ready
+		if (!wait_until([&] { c.send_start_game(); return owned_entities(c, gv, 1) > 0; }))
+			bt.emplace_back("host has not received its units");
+	}
+
+	if (bt.empty()) {
+		IdPoolRef unit = invalid_ref;
+		float x = 0, y = 0;
+
+		for (const Entity &ent : gv.entities)
+			if (ent.playerid == 1 && ent.is_alive() && !is_building(ent.type)) {
+				unit = ent.ref;
+				x = ent.x;
+				y = ent.y;
+				break;
+			}
+
+		if (unit == invalid_ref) {
+			bt.emplace_back("host has no units");
+		} else {
+			c.entity_move(unit, x + 3, y + 3);
+
+			// the command goes up and the entity updates come back through the impaired link
+			if (!wait_until([&] {
+				gv.try_read(c.g);
+				const Entity *ent = gv.try_get(unit);
+				return ent && (std::fabs(ent->x - x) > 0.5f || std::fabs(ent->y - y) > 0.5f);
+			}))
+				bt.emplace_back("unit has not moved");
+		}
+	}
+
+	c.stop();
+	t1.join();
+	proxy.stop();
+
+	NetStatsSnapshot st(c.net_stats());
+	auto up = proxy.histograms(true), down = proxy.histograms(false);
+
+	uint64_t ent_in = st.packets[(unsigned)NetDir::in][(unsigned)NetPkgType::entity_mod];
+	uint64_t ticks_in = st.packets[(unsigned)NetDir::in][(unsigned)NetPkgType::gameticks];
+	uint64_t ent_out = st.packets[(unsigned)NetDir::out][(unsigned)NetPkgType::entity_mod];
+
+	if (!ent_in || !ticks_in)
+		bt.emplace_back("expected entity updates and game ticks, got " + std::to_string(ent_in) + " and " + std::to_string(ticks_in));
+
+	// the proxy has seen everything the client has read, but it may have delivered more after we stopped reading
+	if (proxy_packets(down, NetPkgType::entity_mod) < ent_in || proxy_packets(down, NetPkgType::gameticks) < ticks_in)
+		bt.emplace_back("client has received more packets than the proxy has forwarded");
+
+	if (!ent_out || proxy_packets(up, NetPkgType::entity_mod) != ent_out)
+		bt.emplace_back("expected " + std::to_string(ent_out) + " commands upstream, got " + std::to_string(proxy_packets(up, NetPkgType::entity_mod)));
+
+	dump_errors(bt);
+}
+
 }